@@ -1,18 +1,39 @@
 ﻿// Integrated JMA Nowcast and GSI Map Viewer
 // - Combines GSI map rendering (fractional zoom, Japan bounds)
-// - With JMA Nowcast overlay (time step, animation, async download/cache)
+// - With JMA Nowcast overlay (time step, motion-interpolated animation ('M'), async download/cache)
+// - Thunder ('T') and tornado ('O') nowcast layers sharing the timeline, fetch queue and per-layer cache budgets
+// - Switchable GSI base styles std/pale/blank/seamlessphoto ('G', --style) with a cache partition per style,
+//   per-layer request/memory accounting ('L')
+// - Headless command-line modes (--snapshot, --export, --prefetch, --bench-*)
+// - Archive playback with timeline scrubbing (--playback file.ame)
+// - Threshold alert daemon for watched points/areas (--watch)
+// - Local HTTP query service for rainfall intensity (--serve)
+// - Caching tile proxy for a LAN of viewers (--proxy; clients use --upstream host:port)
+// - Rainfall analysis on palette planes: cursor intensity, point series, area stats, 1h/3h accumulation ('A'),
+//   10/30/50 mm/h contours ('C', --contours out.geojson), storm cell tracks ('S', --storms cells.csv),
+//   advection extrapolation up to 60 min past the latest observation ('E')
+// - Forecast verification of archived N2 frames against later observations (--verify: POD/FAR/CSI)
+// - Japan-wide single-raster mosaics per frame, mercator or lat/lon grid (--mosaic outdir [--equirect])
+// - Georeferenced intensity grids as GeoTIFF or float32 + .hdr/.prj (--export-grid out.tif)
+// - Rain exposure along timed routes using N1 for the past and N2 ahead (--route-exposure routes.txt)
+// - Prefecture/municipality boundary overlay from a compact per-zoom LOD file ('B', --boundaries, --boundary-build)
+// - Streaming rainfall annotation of live vehicle positions from a pipe or socket (--geofence [--listen port])
+// - On-disk tile cache (%LOCALAPPDATA%\ame\cache) and single-file tile archive (--archive-*, --delta)
 //
 // Build: /DUNICODE /D_UNICODE
-// Link : d2d1.lib windowscodecs.lib winhttp.lib ole32.lib user32.lib gdi32.lib dwrite.lib
+// Link : d2d1.lib windowscodecs.lib winhttp.lib ole32.lib user32.lib gdi32.lib dwrite.lib shell32.lib ws2_32.lib
 
 #define WIN32_LEAN_AND_MEAN
 #define NOMINMAX
 #include <windows.h>
 #include <windowsx.h>
+#include <shellapi.h>
 #include <d2d1.h>
 #include <dwrite.h>
 #include <wincodec.h>
 #include <winhttp.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
 #include <stdint.h>
 #include <vector>
 #include <unordered_map>
@@ -29,13 +50,24 @@
 #include <queue>
 #include <memory>
 #include <sstream>
+#include <list>
+#include <future>
 #include <iomanip>
+#include <random>
+#include <bit>
+#include <ctime>
+#include <climits>
+#include <cfloat>
+#include <charconv>
+#include <emmintrin.h>
 
 #pragma comment(lib, "d2d1.lib")
 #pragma comment(lib, "windowscodecs.lib")
 #pragma comment(lib, "winhttp.lib")
 #pragma comment(lib, "ole32.lib")
 #pragma comment(lib, "dwrite.lib")
+#pragma comment(lib, "shell32.lib")
+#pragma comment(lib, "ws2_32.lib")
 
 #ifndef SAFE_RELEASE
 #define SAFE_RELEASE(p) do{ if(p){ (p)->Release(); (p)=nullptr; } }while(0)
@@ -71,7 +103,106 @@ static const double JAPAN_MAX_LAT = 46.0;
 static const float kOverlayAlpha = 0.90f;
 static const float kAnimDurationSec = 0.65f;
 static const float kAnimStepInterval = 0.70f;
-static const size_t kCacheLimit = 256;
+
+// -------------------- Tile Layers --------------------
+// タイルの層。時刻一覧・取得キュー (gPool)・タイルキャッシュ (gCache) は全層で共有し、
+// URL・ズーム・キャッシュ枠・不透明度は層ごとに持つ。JMA の層は gTimes の時刻で引く
+// GSI の地図はスタイルごとに別の層にして、写真のような大きいタイルが標準地図を追い出さないようにする。
+// 枠は枚数で持つが、タイルは PNG も JPEG もデコード後は 256x256 32bpp (256 KB) で、圧縮データはデコードまでしか
+// 持たないので、枚数がそのまま容量の上限になる (写真の 96 枚で約 24 MB)
+enum TileLayer : uint8_t {
+	kTileGsiStd = 0, kTileGsiPale, kTileGsiBlank, kTileGsiPhoto,
+	kTileRain, kTileThunder, kTileTornado,
+	kTileMotion,	// 途中フレーム (Motion Interpolation)。取得はせず、キャッシュの枠だけを持つ
+	kTileLayerCount
+};
+static inline bool IsGsiLayer(TileLayer l) { return l < kTileRain; }
+struct TileLayerDef {
+	const wchar_t* name;
+	const wchar_t* key;		// URL 中の名前 (GSI は /xyz/<key>/、JMA は /surf/<key>/)。--style でも使う
+	const wchar_t* host;
+	const wchar_t* tileFmt;	// GSI は z, x, y。JMA は basetime, validtime, z, x, y。手元で作る層は nullptr
+	int minZoom, maxZoom;	// タイルがあるズーム。外れる表示ズームでは端のズームのタイルを拡大・縮小して使う
+	size_t cacheTiles;		// gCache 内の上限枚数 (層ごとに古いものから捨てる。全体の上限 kTileCacheTotal も別にある)
+	float alpha;
+	bool classes;			// 降水強度のパレット面を作るか (hrpns のみ)
+};
+static const TileLayerDef kTileLayers[kTileLayerCount] = {
+	{ L"標準地図", L"std", K_GSI_HOST, K_GSI_TILE_FMT, MIN_MAP_ZOOM, MAX_MAP_ZOOM, 192, 1.0f, false },
+	{ L"淡色地図", L"pale", K_GSI_HOST, L"/xyz/pale/%d/%d/%d.png", MIN_MAP_ZOOM, MAX_MAP_ZOOM, 128, 1.0f, false },
+	{ L"白地図", L"blank", K_GSI_HOST, L"/xyz/blank/%d/%d/%d.png", 5, 14, 128, 1.0f, false },
+	{ L"写真", L"seamlessphoto", K_GSI_HOST, L"/xyz/seamlessphoto/%d/%d/%d.jpg", MIN_MAP_ZOOM, MAX_MAP_ZOOM, 96, 1.0f, false },
+	{ L"降水", L"hrpns", K_JMA_HOST, K_JMA_TILE_FMT, MIN_JMA_ZOOM, 10, 256, kOverlayAlpha, true },
+	// 雷・竜巻は格子が粗いので z8 までで足りる
+	{ L"雷", L"thns", K_JMA_HOST, L"/bosai/jmatile/data/nowc/%s/none/%s/surf/thns/%d/%d/%d.png", MIN_JMA_ZOOM, 8, 64, 0.80f, false },
+	{ L"竜巻", L"trns", K_JMA_HOST, L"/bosai/jmatile/data/nowc/%s/none/%s/surf/trns/%d/%d/%d.png", MIN_JMA_ZOOM, 8, 64, 0.80f, false },
+	// 3 組 x 3 ステップ x 1280x800 の画面のタイル程度。降水の枠とは別にして、本来のフレームを追い出さない
+	{ L"途中フレーム", L"motion", K_JMA_HOST, nullptr, MIN_JMA_ZOOM, 10, 320, kOverlayAlpha, false },
+};
+// 層ごとの枠の合計 (1248 枚) は全部がそろうことはない (使わない地図のスタイルは古くなって先に捨てられる) ので、
+// 全体でも枚数を抑える。デコード後は 1 枚 256 KB なので 640 枚で約 160 MB
+static const size_t kTileCacheTotal = 640;
+static const int kTileRetryMinSec = 10, kTileRetryMaxSec = 300;	// 取得に失敗したタイルを取り直す間隔 (失敗ごとに倍)
+// 表示する JMA の層 ('T' で雷、'O' で竜巻を切り替え。降水は常に表示)
+static bool gTileLayerOn[kTileLayerCount] = { false, false, false, false, true, false, false, false };
+// 表示中の地図のスタイル ('G' で順に切り替え、--style で指定)。切り替え直後は未取得のタイルの下に前のスタイルを敷く
+static TileLayer gGsiStyle = kTileGsiStd, gGsiUnderlay = kTileGsiStd;
+static bool gShowLayerStats = false;	// 'L' で層ごとの取得・キャッシュの集計を情報表示に出す
+
+// 層ごとの要求・取得の回数 (どのスレッドからも加算する)。キャッシュ内の枚数・容量は TileLayerUsage で数える
+struct TileLayerCounters {
+	std::atomic<size_t> requests{ 0 }, httpFetches{ 0 }, failures{ 0 };
+	std::atomic<uint64_t> fetchedBytes{ 0 };
+};
+static TileLayerCounters gTileLayerCounters[kTileLayerCount];
+
+// パスが kTileLayers のどれかの書式どおりのタイル (余計な文字なし、範囲内の z/x/y) なら層と位置を返す。
+// 外から受け取るパス (プロキシ) はこれを通ったものだけを取得・ディスクキャッシュに書く
+struct TilePathParts {
+	TileLayer layer{};
+	int z{}, x{}, y{};
+	std::wstring base, valid;	// JMA のみ
+};
+static bool ParseTileLayerPath(const std::wstring& path, TilePathParts& out)
+{
+	for (int l = 0; l < kTileLayerCount; ++l) {
+		const TileLayerDef& d = kTileLayers[l];
+		if (!d.tileFmt) continue;
+		int z = -1, x = -1, y = -1;
+		wchar_t base[16] = {}, valid[16] = {}, buf[512];
+		if (IsGsiLayer((TileLayer)l)) {
+			if (swscanf_s(path.c_str(), d.tileFmt, &z, &x, &y) != 3) continue;
+			swprintf_s(buf, d.tileFmt, z, x, y);
+		}
+		else {
+			std::wstring fmt = d.tileFmt;
+			for (size_t p; (p = fmt.find(L"%s")) != std::wstring::npos;) fmt.replace(p, 2, L"%15[0-9]");
+			if (swscanf_s(path.c_str(), fmt.c_str(), base, (unsigned)_countof(base), valid, (unsigned)_countof(valid), &z, &x, &y) != 5) continue;
+			swprintf_s(buf, d.tileFmt, base, valid, z, x, y);
+		}
+		if (path != buf || z < 0 || z > 24 || x < 0 || y < 0 || x >= (1 << z) || y >= (1 << z)) continue;
+		out.layer = (TileLayer)l;
+		out.z = z; out.x = x; out.y = y;
+		out.base = base; out.valid = valid;
+		return true;
+	}
+	return false;
+}
+static bool ParseTileLayerPath(const std::wstring& path, TileLayer& out)
+{
+	TilePathParts t;
+	if (!ParseTileLayerPath(path, t)) return false;
+	out = t.layer;
+	return true;
+}
+
+// --style の名前 (kTileLayers[].key) から地図のスタイルを引く
+static bool GsiStyleFromKey(const std::wstring& key, TileLayer& out)
+{
+	for (int l = 0; l < kTileRain; ++l)
+		if (key == kTileLayers[l].key) { out = (TileLayer)l; return true; }
+	return false;
+}
 
 #define WM_TILE_READY (WM_APP+1)
 
@@ -96,14 +227,27 @@ static App g;
 // -------------------- Types (JMA Overlay & Cache) --------------------
 struct Img {
 	std::vector<BYTE> bytes;
+	IWICBitmap* decoded{ nullptr };	// バックグラウンドでデコード済み (D2D 化のみメインスレッド)
 	ID2D1Bitmap* bmp{ nullptr };
+	std::vector<BYTE> classes;		// JMA タイルのパレット面 (強度の問い合わせ用)
 	std::chrono::steady_clock::time_point lastUsed{};
+	TileLayer layer{ kTileRain };	// 積算など降水から作るタイルも降水の枠で数える (途中フレームは kTileMotion)
+	std::chrono::steady_clock::time_point retryAt{};	// 取得に失敗したタイルはこの時刻まで取り直さない
+	uint8_t fails{};
+};
+struct NowcTime {
+	std::wstring basetime, validtime;
+	uint32_t layers{};	// 一覧の elements にある層 (1 << TileLayer)。0 は不明 (アーカイブ・外挿) で、全層がある扱い
 };
-struct NowcTime { std::wstring basetime, validtime; };
+// 外挿フレーム (Extrapolation) は basetime が "extrap/<元にした観測の validtime>"
+static inline bool IsExtrapolated(const NowcTime& T) { return T.basetime.compare(0, 7, L"extrap/") == 0; }
+// 観測 (N1) は basetime == validtime
+static inline bool IsObservation(const NowcTime& T) { return T.basetime == T.validtime; }
 
 static std::mutex gCacheMtx;
 static std::unordered_map<std::wstring, Img> gCache;
 static std::vector<NowcTime> gTimes;
+static std::vector<NowcTime> gObsTimes;	// 予測 (N2) 表示中に積算や雷・竜巻の時刻に使う観測 (N1) の一覧
 static bool gUseForecast = false;
 static int gTimeIndex = 0;
 
@@ -112,6 +256,23 @@ static std::chrono::steady_clock::time_point gAnimStart{};
 static int gAnimFrom = 0, gAnimTo = 0;
 static float gAnimT = 0.0f;
 
+// アーカイブ再生 (--playback)
+static const int kScrubSettleMs = 200;
+static const size_t kSeekStatCount = 100;
+static const UINT_PTR kSettleTimerId = 2;
+struct PlaybackState {
+	bool active{};
+	bool dragging{};	// タイムラインをドラッグ中
+	int lastDir{ -1 };	// 直前のシーク方向 (-1: 新しい時刻へ)
+	std::chrono::steady_clock::time_point lastSeek{};
+	// シーク遅延: シーク開始から低ズーム/表示ズームのタイルが全て揃うまで (ms)
+	int pendingIndex{ -1 };
+	bool coarseDone{};
+	std::chrono::steady_clock::time_point seekStart{};
+	std::deque<double> coarseMs, fullMs;
+};
+static PlaybackState gPlayback;
+
 // -------------------- Thread Pool (JMA) --------------------
 class ThreadPool {
 public:
@@ -164,6 +325,79 @@ private:
 };
 static std::unique_ptr<ThreadPool> gPool;
 
+// [0, n) を threads 本で分割実行し、全件完了まで待つ (バッチ処理用)
+static void ParallelFor(size_t n, size_t threads, const std::function<void(size_t)>& fn)
+{
+	threads = std::max<size_t>(1, std::min(threads, n));
+	std::atomic<size_t> next(0);
+	auto run = [&]() {
+		for (size_t i; (i = next.fetch_add(1)) < n;) fn(i);
+		};
+	std::vector<std::thread> ts;
+	for (size_t t = 1; t < threads; ++t) ts.emplace_back(run);
+	run();
+	for (auto& t : ts) t.join();
+}
+
+// LRU の共有キャッシュ。同じキーの取得が重なったときは先着の 1 回だけ load を呼び、残りはその結果を待つ
+template <class V>
+class SingleFlightCache {
+public:
+	using Ptr = std::shared_ptr<const V>;
+	explicit SingleFlightCache(size_t capacity) : capacity(capacity) {}
+
+	struct Stats { size_t hits, coalesced, loads; };
+
+	// load(V&) が false なら nullptr を返す (失敗はキャッシュしない)
+	template <class Load>
+	Ptr Get(const std::wstring& key, Load&& load) {
+		std::shared_future<Ptr> wait;
+		std::promise<Ptr> mine;
+		{
+			std::lock_guard<std::mutex> lk(mtx);
+			auto it = map.find(key);
+			if (it != map.end()) {
+				lru.splice(lru.begin(), lru, it->second.second);
+				++hits;
+				return it->second.first;
+			}
+			auto f = inflight.find(key);
+			if (f != inflight.end()) { wait = f->second; ++coalesced; }
+			else inflight.emplace(key, mine.get_future().share());
+		}
+		if (wait.valid()) return wait.get();
+
+		// この呼び出しが取得を受け持つ
+		auto v = std::make_shared<V>();
+		Ptr p = load(*v) ? Ptr(std::move(v)) : Ptr();
+		{
+			std::lock_guard<std::mutex> lk(mtx);
+			++loads;
+			if (p) {
+				lru.push_front(key);
+				map.emplace(key, std::make_pair(p, lru.begin()));
+				while (map.size() > capacity) { map.erase(lru.back()); lru.pop_back(); }
+			}
+			inflight.erase(key);
+		}
+		mine.set_value(p);
+		return p;
+	}
+
+	Stats statistics() const {
+		std::lock_guard<std::mutex> lk(mtx);
+		return { hits, coalesced, loads };
+	}
+
+private:
+	size_t capacity;
+	mutable std::mutex mtx;
+	std::list<std::wstring> lru;
+	std::unordered_map<std::wstring, std::pair<Ptr, std::list<std::wstring>::iterator>> map;
+	std::unordered_map<std::wstring, std::shared_future<Ptr>> inflight;
+	size_t hits{}, coalesced{}, loads{};
+};
+
 
 // -------------------- Math helpers (GSI) --------------------
 static inline double LonLatToWorldX(double lon, int z) { return TILE_SIZE * (1 << z) * ((lon + 180.0) / 360.0); }
@@ -183,6 +417,802 @@ static inline double WorldYToLat(double wy, int z) {
 static inline double Clamp(double v, double lo, double hi) {
 	return std::min(std::max(v, lo), hi);
 }
+static double Percentile(std::vector<double> v, double p) {
+	if (v.empty()) return 0.0;
+	size_t k = std::min(v.size() - 1, (size_t)std::floor(p / 100.0 * v.size()));
+	std::nth_element(v.begin(), v.begin() + k, v.end());
+	return v[k];
+}
+static double SecondsSince(std::chrono::steady_clock::time_point t0)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// validtime (YYYYMMDDhhmmss) を 1970 年からの分に
+static int64_t ValidTimeMinutes(const std::wstring& t)
+{
+	int Y, M, D, h, mi;
+	if (swscanf_s(t.c_str(), L"%4d%2d%2d%2d%2d", &Y, &M, &D, &h, &mi) != 5) return 0;
+	// 暦日から通日 (Howard Hinnant の days_from_civil)
+	Y -= M <= 2;
+	const int era = (Y >= 0 ? Y : Y - 399) / 400;
+	const unsigned yoe = (unsigned)(Y - era * 400);
+	const unsigned doy = (153 * (M + (M > 2 ? -3 : 9)) + 2) / 5 + D - 1;
+	const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	const int64_t days = (int64_t)era * 146097 + doe - 719468;
+	return days * 1440 + h * 60 + mi;
+}
+
+static std::wstring MinutesToValidTime(int64_t minutes)
+{
+	// 通日から暦日 (civil_from_days)
+	const int64_t days = (minutes >= 0 ? minutes : minutes - 1439) / 1440, m = minutes - days * 1440;
+	const int64_t z = days + 719468, era = (z >= 0 ? z : z - 146096) / 146097;
+	const unsigned doe = (unsigned)(z - era * 146097);
+	const unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	const unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100), mp = (5 * doy + 2) / 153;
+	const unsigned D = doy - (153 * mp + 2) / 5 + 1, M = mp < 10 ? mp + 3 : mp - 9;
+	const int Y = (int)(yoe + era * 400 + (M <= 2));
+	wchar_t buf[32];
+	swprintf_s(buf, L"%04d%02u%02u%02d%02d00", Y, M, D, (int)(m / 60), (int)(m % 60));
+	return buf;
+}
+
+struct GeoBox { double minLon, minLat, maxLon, maxLat; };
+static const GeoBox kJapanBox{ JAPAN_MIN_LON, JAPAN_MIN_LAT, JAPAN_MAX_LON, JAPAN_MAX_LAT };
+
+// 範囲に掛かるタイル番号 (両端含む)
+static void TileRangeForBox(const GeoBox& b, int z, int& tx0, int& ty0, int& tx1, int& ty1)
+{
+	const int maxT = 1 << z;
+	tx0 = std::clamp((int)std::floor(LonLatToWorldX(b.minLon, z) / TILE_SIZE), 0, maxT - 1);
+	tx1 = std::clamp((int)std::floor(LonLatToWorldX(b.maxLon, z) / TILE_SIZE), 0, maxT - 1);
+	ty0 = std::clamp((int)std::floor(LonLatToWorldY(b.maxLat, z) / TILE_SIZE), 0, maxT - 1);
+	ty1 = std::clamp((int)std::floor(LonLatToWorldY(b.minLat, z) / TILE_SIZE), 0, maxT - 1);
+}
+
+// -------------------- Disk Cache --------------------
+// ダウンロード済みタイルを %LOCALAPPDATA%\ame\cache\<host>\<path> に保存する (オフライン利用・事前取得用)
+static std::wstring gDiskCacheDir;	// 空なら既定の場所
+
+static const std::wstring& DiskCacheRoot()
+{
+	static std::once_flag once;
+	std::call_once(once, []() {
+		if (!gDiskCacheDir.empty()) return;
+		wchar_t buf[MAX_PATH];
+		DWORD n = GetEnvironmentVariableW(L"LOCALAPPDATA", buf, MAX_PATH);
+		gDiskCacheDir = (n > 0 && n < MAX_PATH) ? std::wstring(buf) + L"\\ame\\cache" : L"ame_cache";
+		});
+	return gDiskCacheDir;
+}
+
+static std::wstring DiskCachePath(const wchar_t* host, const std::wstring& path)
+{
+	std::wstring file = DiskCacheRoot() + L"\\" + host + path;
+	std::replace(file.begin(), file.end(), L'/', L'\\');
+	return file;
+}
+
+static bool DiskCacheHas(const std::wstring& file, uint64_t* size = nullptr)
+{
+	WIN32_FILE_ATTRIBUTE_DATA fa;
+	if (!GetFileAttributesExW(file.c_str(), GetFileExInfoStandard, &fa) || (fa.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) return false;
+	if (size) *size = ((uint64_t)fa.nFileSizeHigh << 32) | fa.nFileSizeLow;
+	return true;
+}
+
+static bool DiskCacheRead(const std::wstring& file, std::vector<BYTE>& out)
+{
+	HANDLE h = CreateFileW(file.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (h == INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER sz{};
+	bool ok = GetFileSizeEx(h, &sz) && sz.QuadPart > 0 && sz.QuadPart < (64ll << 20);
+	if (ok) {
+		out.resize((size_t)sz.QuadPart);
+		DWORD got = 0;
+		ok = ReadFile(h, out.data(), (DWORD)out.size(), &got, nullptr) && got == out.size();
+		if (!ok) out.clear();
+	}
+	CloseHandle(h);
+	return ok;
+}
+
+// CSV や GeoJSON など利用者が与える入力ファイルを丸ごと読む (タイル用の DiskCacheRead と違い大きさの上限なし)。
+// 失敗したら理由を stderr に出す
+static bool ReadInputFile(const std::wstring& file, std::string& text)
+{
+	FILE* f = nullptr;
+	if (_wfopen_s(&f, file.c_str(), L"rb") != 0 || !f) { fwprintf(stderr, L"error: cannot open %ls\n", file.c_str()); return false; }
+	text.clear();
+	std::vector<char> buf(1 << 20);
+	for (size_t n; (n = fread(buf.data(), 1, buf.size(), f)) > 0;) text.append(buf.data(), n);
+	bool ok = !ferror(f);
+	fclose(f);
+	if (!ok) fwprintf(stderr, L"error: read failed: %ls\n", file.c_str());
+	return ok;
+}
+
+static void CreateParentDirectories(const std::wstring& file)
+{
+	for (size_t pos = file.find(L'\\', 3); pos != std::wstring::npos; pos = file.find(L'\\', pos + 1))
+		CreateDirectoryW(file.substr(0, pos).c_str(), nullptr);
+}
+
+// 一時ファイルに書いてから置き換えるので、中断しても壊れたタイルは残らない
+static bool DiskCacheWrite(const std::wstring& file, const std::vector<BYTE>& data)
+{
+	std::wstring part = file + L".part";
+	HANDLE h = CreateFileW(part.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (h == INVALID_HANDLE_VALUE) {
+		CreateParentDirectories(file);
+		h = CreateFileW(part.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (h == INVALID_HANDLE_VALUE) return false;
+	}
+	DWORD put = 0;
+	bool ok = WriteFile(h, data.data(), (DWORD)data.size(), &put, nullptr) && put == data.size();
+	CloseHandle(h);
+	ok = ok && MoveFileExW(part.c_str(), file.c_str(), MOVEFILE_REPLACE_EXISTING);
+	if (!ok) DeleteFileW(part.c_str());
+	return ok;
+}
+
+// キャッシュ内のタイルを列挙する (ホスト以下の相対パスを URL パスに戻して渡す)
+static void ForEachCachedTile(const std::function<void(const wchar_t* host, const std::wstring& file, const std::wstring& urlPath)>& fn)
+{
+	for (const wchar_t* host : { K_GSI_HOST, K_JMA_HOST }) {
+		std::wstring root = DiskCacheRoot() + L"\\" + host;
+		std::vector<std::wstring> stack{ L"" };
+		while (!stack.empty()) {
+			std::wstring rel = stack.back();
+			stack.pop_back();
+			WIN32_FIND_DATAW fd;
+			HANDLE h = FindFirstFileW((root + rel + L"\\*").c_str(), &fd);
+			if (h == INVALID_HANDLE_VALUE) continue;
+			do {
+				std::wstring name = fd.cFileName;
+				if (name == L"." || name == L"..") continue;
+				std::wstring child = rel + L"\\" + name;
+				if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+					stack.push_back(child);
+				}
+				else if (name.size() > 4 && (name.compare(name.size() - 4, 4, L".png") == 0 || name.compare(name.size() - 4, 4, L".jpg") == 0)) {
+					std::wstring url = child;
+					std::replace(url.begin(), url.end(), L'\\', L'/');
+					fn(host, root + child, url);
+				}
+			} while (FindNextFileW(h, &fd));
+			FindClose(h);
+		}
+	}
+}
+
+// -------------------- Tile Archive --------------------
+// 履歴保存用の単一ファイル形式 (リトルエンディアン)
+//   [ヘッダ 64B][blob データ ...][blob 表 ArchiveBlob x blobCount][索引 ArchiveEntry x entryCount (キー順)]
+// 同一内容のタイルは blob を共有する。読み出しはファイル全体をマップし、blob へのポインタをそのままデコーダへ渡す。
+static uint32_t Crc32(const BYTE* p, size_t n, uint32_t crc = 0)
+{
+	static const auto table = []() {
+		std::vector<uint32_t> t(256);
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			t[i] = c;
+		}
+		return t;
+		}();
+	crc = ~crc;
+	for (size_t i = 0; i < n; ++i) crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+static const char kArchiveMagic[8] = { 'A', 'M', 'E', 'T', 'I', 'L', 'E', '1' };
+static const uint32_t kArchiveVersion = 1;
+
+// kLayerJmaDelta は hrpns をパレット面の差分で持つ層 (Palette Planes 参照)。3 以降は地図のスタイルと雷・竜巻 (後から追加)
+enum ArchiveLayer : uint16_t {
+	kLayerGsiStd = 0, kLayerJmaHrpns = 1, kLayerJmaDelta = 2,
+	kLayerGsiPale = 3, kLayerGsiBlank = 4, kLayerGsiPhoto = 5, kLayerJmaThns = 6, kLayerJmaTrns = 7
+};
+// タイルの層 → アーカイブの層 (手元で作る層は入れない)
+static const uint16_t kArchiveLayerOf[kTileLayerCount] = {
+	kLayerGsiStd, kLayerGsiPale, kLayerGsiBlank, kLayerGsiPhoto, kLayerJmaHrpns, kLayerJmaThns, kLayerJmaTrns, UINT16_MAX
+};
+static bool TileLayerOfArchive(uint16_t a, TileLayer& out)
+{
+	if (a == kLayerJmaDelta) a = kLayerJmaHrpns;
+	for (int l = 0; l < kTileLayerCount; ++l)
+		if (kArchiveLayerOf[l] == a) { out = (TileLayer)l; return true; }
+	return false;
+}
+
+struct ArchiveHeader {
+	char magic[8];
+	uint32_t version, headerSize;
+	uint64_t entryCount, indexOffset;
+	uint64_t blobCount, blobTableOffset;
+	uint64_t fileSize;
+	uint32_t tableCrc;		// blob 表 + 索引の CRC32
+	uint32_t headerCrc;		// この直前までの CRC32
+};
+static_assert(sizeof(ArchiveHeader) == 64, "archive header layout");
+
+struct ArchiveBlob {
+	uint64_t offset;
+	uint32_t size, crc;
+};
+static_assert(sizeof(ArchiveBlob) == 16, "archive blob layout");
+
+// 時刻は UTC の yyyymmddhhmmss を整数にしたもの (GSI は 0)
+#pragma pack(push, 4)
+struct ArchiveKey {
+	uint64_t time{}, base{};
+	uint32_t x{}, y{};
+	uint16_t layer{};
+	uint8_t z{}, flags{};
+};
+struct ArchiveEntry {
+	ArchiveKey key;
+	uint32_t blob;
+};
+#pragma pack(pop)
+static_assert(sizeof(ArchiveEntry) == 32, "archive entry layout");
+
+// 索引の並び: layer → validtime → basetime → z → x → y
+static inline bool ArchiveKeyLess(const ArchiveKey& a, const ArchiveKey& b)
+{
+	if (a.layer != b.layer) return a.layer < b.layer;
+	if (a.time != b.time) return a.time < b.time;
+	if (a.base != b.base) return a.base < b.base;
+	if (a.z != b.z) return a.z < b.z;
+	if (a.x != b.x) return a.x < b.x;
+	return a.y < b.y;
+}
+static inline bool ArchiveKeyEqual(const ArchiveKey& a, const ArchiveKey& b)
+{
+	return a.layer == b.layer && a.time == b.time && a.base == b.base && a.z == b.z && a.x == b.x && a.y == b.y;
+}
+
+static uint64_t TimeKey(const std::wstring& t)
+{
+	uint64_t v = 0;
+	for (wchar_t c : t) { if (c < L'0' || c > L'9') return 0; v = v * 10 + (c - L'0'); }
+	return v;
+}
+static std::wstring TimeString(uint64_t v)
+{
+	wchar_t buf[32];
+	swprintf_s(buf, L"%014llu", (unsigned long long)v);
+	return buf;
+}
+
+// URL パス (kTileLayers[].tileFmt) ⇔ キー
+static bool ArchiveKeyFromPath(const std::wstring& path, ArchiveKey& k)
+{
+	k = ArchiveKey();
+	TilePathParts t;
+	if (!ParseTileLayerPath(path, t) || kArchiveLayerOf[t.layer] == UINT16_MAX) return false;
+	k.layer = kArchiveLayerOf[t.layer];
+	if (!IsGsiLayer(t.layer)) {
+		k.base = TimeKey(t.base);
+		k.time = TimeKey(t.valid);
+	}
+	k.z = (uint8_t)t.z; k.x = (uint32_t)t.x; k.y = (uint32_t)t.y;
+	return true;
+}
+
+static std::wstring ArchivePath(const ArchiveKey& k)
+{
+	wchar_t buf[512];
+	TileLayer l = kTileRain;
+	TileLayerOfArchive(k.layer, l);
+	if (!IsGsiLayer(l))
+		swprintf_s(buf, kTileLayers[l].tileFmt, TimeString(k.base).c_str(), TimeString(k.time).c_str(), (int)k.z, (int)k.x, (int)k.y);
+	else
+		swprintf_s(buf, kTileLayers[l].tileFmt, (int)k.z, (int)k.x, (int)k.y);
+	return buf;
+}
+
+static uint64_t Fnv1a64(const BYTE* p, size_t n)
+{
+	uint64_t h = 14695981039346656037ull;
+	for (size_t i = 0; i < n; ++i) { h ^= p[i]; h *= 1099511628211ull; }
+	return h;
+}
+
+// 一括書き込み。Add は blob を逐次追記し、Finish で索引を並べ替えて末尾に書く
+class ArchiveWriter {
+public:
+	~ArchiveWriter() { if (f) fclose(f); }
+
+	bool Open(const std::wstring& file) {
+		if (_wfopen_s(&f, file.c_str(), L"wb") != 0 || !f) return false;
+		ArchiveHeader h{};
+		return fwrite(&h, sizeof(h), 1, f) == 1;
+	}
+
+	bool Add(const ArchiveKey& key, const BYTE* data, size_t size) {
+		if (!f || size == 0 || size > 0xFFFFFFFFu) return false;
+		bytesIn += size;
+		uint64_t hash = Fnv1a64(data, size);
+		uint32_t crc = Crc32(data, size);
+		uint32_t id = UINT32_MAX;
+		auto range = byHash.equal_range(hash);
+		for (auto it = range.first; it != range.second; ++it)
+			if (blobs[it->second].size == size && blobs[it->second].crc == crc) { id = it->second; ++dedupHits; break; }
+		if (id == UINT32_MAX) {
+			ArchiveBlob b{ offset, (uint32_t)size, crc };
+			if (fwrite(data, 1, size, f) != size) return false;
+			offset += size;
+			id = (uint32_t)blobs.size();
+			blobs.push_back(b);
+			byHash.emplace(hash, id);
+		}
+		entries.push_back({ key, id });
+		return true;
+	}
+
+	bool Finish() {
+		if (!f) return false;
+		std::sort(entries.begin(), entries.end(), [](const ArchiveEntry& a, const ArchiveEntry& b) { return ArchiveKeyLess(a.key, b.key); });
+		// 同じキーが重複した場合は後から追加したものを残す
+		std::vector<ArchiveEntry> uniq;
+		uniq.reserve(entries.size());
+		for (auto& e : entries) {
+			if (!uniq.empty() && ArchiveKeyEqual(uniq.back().key, e.key)) uniq.back() = e;
+			else uniq.push_back(e);
+		}
+		entries.swap(uniq);
+
+		// 表は 16 バイト境界から置く
+		static const BYTE zeros[16] = {};
+		size_t pad = (size_t)((16 - offset % 16) % 16);
+		if (pad && fwrite(zeros, 1, pad, f) != pad) return false;
+		offset += pad;
+
+		ArchiveHeader h{};
+		memcpy(h.magic, kArchiveMagic, 8);
+		h.version = kArchiveVersion;
+		h.headerSize = sizeof(ArchiveHeader);
+		h.blobCount = blobs.size();
+		h.blobTableOffset = offset;
+		h.entryCount = entries.size();
+		h.indexOffset = offset + blobs.size() * sizeof(ArchiveBlob);
+		h.fileSize = h.indexOffset + entries.size() * sizeof(ArchiveEntry);
+		h.tableCrc = Crc32((const BYTE*)blobs.data(), blobs.size() * sizeof(ArchiveBlob));
+		h.tableCrc = Crc32((const BYTE*)entries.data(), entries.size() * sizeof(ArchiveEntry), h.tableCrc);
+		h.headerCrc = Crc32((const BYTE*)&h, offsetof(ArchiveHeader, headerCrc));
+
+		bool ok = fwrite(blobs.data(), sizeof(ArchiveBlob), blobs.size(), f) == blobs.size();
+		ok = ok && fwrite(entries.data(), sizeof(ArchiveEntry), entries.size(), f) == entries.size();
+		ok = ok && _fseeki64(f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, f) == 1;
+		ok = (fclose(f) == 0) && ok;
+		f = nullptr;
+		return ok;
+	}
+
+	size_t entryCount() const { return entries.size(); }
+	size_t blobCount() const { return blobs.size(); }
+	size_t dedupCount() const { return dedupHits; }
+	uint64_t inputBytes() const { return bytesIn; }
+	uint64_t blobBytes() const { return offset - sizeof(ArchiveHeader); }
+
+private:
+	FILE* f{};
+	uint64_t offset{ sizeof(ArchiveHeader) };
+	uint64_t bytesIn{};
+	size_t dedupHits{};
+	std::vector<ArchiveBlob> blobs;
+	std::vector<ArchiveEntry> entries;
+	std::unordered_multimap<uint64_t, uint32_t> byHash;
+};
+
+// 読み出し側。ファイル全体を読み取り専用でマップする
+class TileArchive {
+public:
+	~TileArchive() { Close(); }
+
+	bool Open(const std::wstring& file) {
+		Close();
+		hFile = CreateFileW(file.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+		if (hFile == INVALID_HANDLE_VALUE) { hFile = nullptr; return false; }
+		LARGE_INTEGER sz{};
+		if (!GetFileSizeEx(hFile, &sz) || sz.QuadPart < (LONGLONG)sizeof(ArchiveHeader)) { Close(); return false; }
+		size = (uint64_t)sz.QuadPart;
+		hMap = CreateFileMappingW(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!hMap) { Close(); return false; }
+		base = (const BYTE*)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+		if (!base) { Close(); return false; }
+
+		// 表の大きさは掛け算が桁あふれしないよう割り算で先に確かめる
+		const ArchiveHeader* h = header();
+		bool ok = memcmp(h->magic, kArchiveMagic, 8) == 0 && h->version == kArchiveVersion &&
+			h->headerCrc == Crc32(base, offsetof(ArchiveHeader, headerCrc)) && h->fileSize == size &&
+			h->blobTableOffset >= sizeof(ArchiveHeader) && h->blobTableOffset <= h->indexOffset && h->indexOffset <= size &&
+			h->blobCount <= (h->indexOffset - h->blobTableOffset) / sizeof(ArchiveBlob) &&
+			h->entryCount <= (size - h->indexOffset) / sizeof(ArchiveEntry) &&
+			h->blobTableOffset + h->blobCount * sizeof(ArchiveBlob) == h->indexOffset &&
+			h->indexOffset + h->entryCount * sizeof(ArchiveEntry) == size &&
+			h->blobCount <= UINT32_MAX && (h->blobTableOffset % alignof(ArchiveBlob)) == 0;
+		if (!ok) { Close(); return false; }
+		return true;
+	}
+
+	void Close() {
+		if (base) UnmapViewOfFile(base);
+		if (hMap) CloseHandle(hMap);
+		if (hFile) CloseHandle(hFile);
+		base = nullptr; hMap = nullptr; hFile = nullptr; size = 0;
+	}
+
+	bool isOpen() const { return base != nullptr; }
+	uint64_t fileSize() const { return size; }
+	const ArchiveHeader* header() const { return (const ArchiveHeader*)base; }
+	const ArchiveBlob* blobs() const { return (const ArchiveBlob*)(base + header()->blobTableOffset); }
+	const ArchiveEntry* entries() const { return (const ArchiveEntry*)(base + header()->indexOffset); }
+	size_t entryCount() const { return (size_t)header()->entryCount; }
+
+	// 二分探索。data はマップ領域を直接指す (コピーなし)
+	bool Find(const ArchiveKey& key, const BYTE** data, size_t* len) const {
+		if (!base) return false;
+		const ArchiveEntry* b = entries();
+		const ArchiveEntry* e = b + entryCount();
+		const ArchiveEntry* it = std::lower_bound(b, e, key, [](const ArchiveEntry& a, const ArchiveKey& k) { return ArchiveKeyLess(a.key, k); });
+		if (it == e || !ArchiveKeyEqual(it->key, key)) return false;
+		return Blob(*it, data, len);
+	}
+	// 壊れた索引でマップ外を読まないよう、blob 番号と範囲はここで毎回確かめる (CRC は Verify のみ)
+	bool Blob(const ArchiveEntry& e, const BYTE** data, size_t* len) const {
+		const ArchiveHeader* h = header();
+		if (e.blob >= h->blobCount) return false;
+		const ArchiveBlob& bl = blobs()[e.blob];
+		if (bl.offset < sizeof(ArchiveHeader) || bl.offset > h->blobTableOffset || bl.size > h->blobTableOffset - bl.offset) return false;
+		*data = base + bl.offset;
+		*len = bl.size;
+		return true;
+	}
+	// layer の [first, last) 範囲
+	std::pair<const ArchiveEntry*, const ArchiveEntry*> LayerRange(uint16_t layer) const {
+		ArchiveKey lo; lo.layer = layer;
+		ArchiveKey hi; hi.layer = (uint16_t)(layer + 1);
+		auto cmp = [](const ArchiveEntry& a, const ArchiveKey& k) { return ArchiveKeyLess(a.key, k); };
+		const ArchiveEntry* b = entries();
+		const ArchiveEntry* e = b + entryCount();
+		return { std::lower_bound(b, e, lo, cmp), layer == UINT16_MAX ? e : std::lower_bound(b, e, hi, cmp) };
+	}
+	// layer に含まれる (validtime, basetime) の組を時刻順に返す
+	std::vector<std::pair<uint64_t, uint64_t>> Times(uint16_t layer) const {
+		std::vector<std::pair<uint64_t, uint64_t>> out;
+		auto r = LayerRange(layer);
+		for (auto* it = r.first; it != r.second; ++it)
+			if (out.empty() || out.back().first != it->key.time || out.back().second != it->key.base)
+				out.emplace_back(it->key.time, it->key.base);
+		return out;
+	}
+
+	// 整合性検査: 表の CRC、索引の並び、blob の範囲と CRC
+	bool Verify(size_t& badBlobs, size_t& badEntries, std::wstring& message) const {
+		badBlobs = badEntries = 0;
+		const ArchiveHeader* h = header();
+		uint32_t crc = Crc32((const BYTE*)blobs(), (size_t)h->blobCount * sizeof(ArchiveBlob));
+		crc = Crc32((const BYTE*)entries(), entryCount() * sizeof(ArchiveEntry), crc);
+		if (crc != h->tableCrc) message += L"index/blob table CRC mismatch\n";
+		for (uint64_t i = 0; i < h->blobCount; ++i) {
+			const ArchiveBlob& b = blobs()[i];
+			bool inRange = b.offset >= sizeof(ArchiveHeader) && b.offset <= h->blobTableOffset && b.size <= h->blobTableOffset - b.offset;
+			if (!inRange || Crc32(base + b.offset, b.size) != b.crc) ++badBlobs;
+		}
+		const ArchiveEntry* e = entries();
+		for (size_t i = 0; i < entryCount(); ++i) {
+			bool sorted = i == 0 || ArchiveKeyLess(e[i - 1].key, e[i].key);
+			if (!sorted || e[i].blob >= h->blobCount) ++badEntries;
+		}
+		return crc == h->tableCrc && badBlobs == 0 && badEntries == 0;
+	}
+
+private:
+	HANDLE hFile{}, hMap{};
+	const BYTE* base{};
+	uint64_t size{};
+};
+
+// 再生モードで開いているアーカイブ (起動時に開き、終了まで変更しない)
+static std::unique_ptr<TileArchive> gArchive;
+
+// -------------------- Palette Planes (JMA) --------------------
+// JMA のナウキャストタイルは降水強度の階級ごとの固定色だけで塗られている。
+// 1 画素 1 バイトの階級番号 (0 = 降水なし) に落とした「パレット面」で扱うと、差分や集計が軽くなる。
+static const int kTilePixels = TILE_SIZE * TILE_SIZE;
+
+struct JmaClass {
+	BYTE r, g, b;
+	float lo, hi;		// mm/h (hi は次の階級の下限。最上位は表示用の目安)
+};
+// 階級 1..8 (index 0 は降水なし)
+static const JmaClass kJmaScale[] = {
+	{   0,   0,   0,  0.0f,   0.0f },
+	{ 242, 242, 255,  0.0f,   1.0f },
+	{ 160, 210, 255,  1.0f,   5.0f },
+	{  33, 140, 255,  5.0f,  10.0f },
+	{   0,  65, 255, 10.0f,  20.0f },
+	{ 250, 245,   0, 20.0f,  30.0f },
+	{ 255, 153,   0, 30.0f,  50.0f },
+	{ 255,  40,   0, 50.0f,  80.0f },
+	{ 180,   0, 104, 80.0f, 120.0f },
+};
+static const int kJmaClassCount = (int)(sizeof(kJmaScale) / sizeof(kJmaScale[0]));
+
+// 最も近い階級色。半透明の境界画素は乗算済みアルファを戻してから比べる
+static BYTE ClassifyJmaPixel(BYTE b, BYTE g, BYTE r, BYTE a)
+{
+	if (a < 128) return 0;
+	if (a < 255) { b = (BYTE)(b * 255 / a); g = (BYTE)(g * 255 / a); r = (BYTE)(r * 255 / a); }
+	int best = 1, bestD = 1 << 30;
+	for (int c = 1; c < kJmaClassCount; ++c) {
+		int dr = r - kJmaScale[c].r, dg = g - kJmaScale[c].g, db = b - kJmaScale[c].b;
+		int d = dr * dr + dg * dg + db * db;
+		if (d < bestD) { bestD = d; best = c; }
+	}
+	return (BYTE)best;
+}
+
+// 32bppPBGRA → パレット面。階級色と完全一致しなかった画素数を返す
+static size_t ClassifyBgra(const BYTE* bgra, UINT stride, BYTE* plane)
+{
+	size_t inexact = 0;
+	uint32_t lastPx = 0; BYTE lastCls = 0;	// 同色の連続が多いので直前の結果を使い回す
+	for (int y = 0; y < TILE_SIZE; ++y) {
+		const uint32_t* row = (const uint32_t*)(bgra + (size_t)y * stride);
+		BYTE* out = plane + (size_t)y * TILE_SIZE;
+		for (int x = 0; x < TILE_SIZE; ++x) {
+			uint32_t px = row[x];
+			if (px == lastPx) { out[x] = lastCls; continue; }
+			BYTE b = px & 0xFF, g = (px >> 8) & 0xFF, r = (px >> 16) & 0xFF, a = px >> 24;
+			BYTE c = ClassifyJmaPixel(b, g, r, a);
+			if (a != 0 && (a != 255 || kJmaScale[c].r != r || kJmaScale[c].g != g || kJmaScale[c].b != b)) ++inexact;
+			lastPx = px; lastCls = c;
+			out[x] = c;
+		}
+	}
+	return inexact;
+}
+
+// パレット面 → 32bppPBGRA (不透明の階級色)
+static void ExpandClassPlane(const BYTE* plane, uint32_t* bgra)
+{
+	static const auto lut = []() {
+		std::vector<uint32_t> t(256, 0);
+		for (int c = 1; c < kJmaClassCount; ++c)
+			t[c] = 0xFF000000u | ((uint32_t)kJmaScale[c].r << 16) | ((uint32_t)kJmaScale[c].g << 8) | kJmaScale[c].b;
+		return t;
+		}();
+	for (int i = 0; i < kTilePixels; ++i) bgra[i] = lut[plane[i]];
+}
+
+// ---- 連続フレームの差分格納 ----
+// 1 タイル位置の時系列を、キーフレーム (パレット面そのもの) と直前フレームとの XOR 差分で持つ。
+// どちらもバイト単位の RLE で圧縮する。雨域の動いた所以外は 0 の長い連続になる。
+//   blob = [DeltaBlobHeader][RLE]
+//   RLE  : t < 0x80 → 続く t+1 バイトをそのまま / t >= 0x80 → 次の 1 バイトを (t & 0x7F)+1 回
+//          (t == 0xFF のときは長さ 128 + LEB128 の追加長、その後に値)
+static const char kDeltaMagic[4] = { 'A', 'M', 'D', '1' };
+static const int kDeltaKeyInterval = 12;		// 1 時間 (5 分間隔) ごとにキーフレーム
+static const int kDeltaMaxChain = 288;			// 復元時にたどる差分の上限 (1 日分)
+
+struct DeltaBlobHeader {
+	char magic[4];
+	uint32_t planeSize;
+	uint64_t prevTime, prevBase;	// 差分の基準フレーム (キーフレームは 0)
+};
+static_assert(sizeof(DeltaBlobHeader) == 24, "delta blob layout");
+
+static void RleEncode(const BYTE* p, size_t n, std::vector<BYTE>& out)
+{
+	size_t i = 0, litStart = 0;
+	auto flushLiteral = [&](size_t end) {
+		while (litStart < end) {
+			size_t c = std::min<size_t>(128, end - litStart);
+			out.push_back((BYTE)(c - 1));
+			out.insert(out.end(), p + litStart, p + litStart + c);
+			litStart += c;
+		}
+		};
+	while (i < n) {
+		size_t j = i + 1;
+		while (j < n && p[j] == p[i]) ++j;
+		size_t run = j - i;
+		if (run >= 3) {
+			flushLiteral(i);
+			if (run <= 127) {
+				out.push_back((BYTE)(0x80 | (run - 1)));
+			}
+			else {
+				out.push_back(0xFF);
+				for (size_t extra = run - 128; ; extra >>= 7) {
+					if (extra < 0x80) { out.push_back((BYTE)extra); break; }
+					out.push_back((BYTE)(0x80 | (extra & 0x7F)));
+				}
+			}
+			out.push_back(p[i]);
+			litStart = j;
+		}
+		i = j;
+	}
+	flushLiteral(n);
+}
+
+// RLE を展開しながら dst へ適用する。xorInto なら XOR (差分)、そうでなければ上書き (キーフレーム)。
+// 0 の連続は XOR では何もしないので読み飛ばし、それ以外は 16 バイト単位の SSE2 で処理する
+static bool RleApply(const BYTE* src, size_t len, BYTE* dst, size_t n, bool xorInto)
+{
+	const BYTE* end = src + len;
+	size_t o = 0;
+	while (src < end) {
+		BYTE t = *src++;
+		if (t < 0x80) {
+			size_t c = (size_t)t + 1;
+			if ((size_t)(end - src) < c || n - o < c) return false;
+			if (!xorInto) {
+				memcpy(dst + o, src, c);
+			}
+			else {
+				size_t k = 0;
+				for (; k + 16 <= c; k += 16) {
+					__m128i a = _mm_loadu_si128((const __m128i*)(dst + o + k));
+					__m128i b = _mm_loadu_si128((const __m128i*)(src + k));
+					_mm_storeu_si128((__m128i*)(dst + o + k), _mm_xor_si128(a, b));
+				}
+				for (; k < c; ++k) dst[o + k] ^= src[k];
+			}
+			src += c; o += c;
+		}
+		else {
+			size_t c = (size_t)(t & 0x7F) + 1;
+			if (t == 0xFF) {
+				size_t extra = 0;
+				for (int shift = 0; ; shift += 7) {
+					if (src >= end || shift > 28) return false;
+					BYTE v = *src++;
+					extra |= (size_t)(v & 0x7F) << shift;
+					if (!(v & 0x80)) break;
+				}
+				c = 128 + extra;
+			}
+			if (src >= end || n - o < c) return false;
+			BYTE v = *src++;
+			if (!xorInto) {
+				memset(dst + o, v, c);
+			}
+			else if (v != 0) {
+				const __m128i vv = _mm_set1_epi8((char)v);
+				size_t k = 0;
+				for (; k + 16 <= c; k += 16) {
+					__m128i a = _mm_loadu_si128((const __m128i*)(dst + o + k));
+					_mm_storeu_si128((__m128i*)(dst + o + k), _mm_xor_si128(a, vv));
+				}
+				for (; k < c; ++k) dst[o + k] ^= v;
+			}
+			o += c;
+		}
+	}
+	return o == n;
+}
+
+// 差分をつなぐ系列。実況 (basetime == validtime) は 1 本、予報は basetime ごとに 1 本。
+// 実況と予報を交互に並べると差分が大きくなるので混ぜない
+static inline uint64_t DeltaStream(const ArchiveKey& k)
+{
+	return k.base == k.time ? 0 : k.base;
+}
+
+// 1 タイル位置・1 系列の時系列を時刻順に与えると、キーフレームか差分の blob を作る
+class DeltaSeriesEncoder {
+public:
+	// 次のタイル位置に移るときに呼ぶ
+	void Reset() { count = 0; }
+
+	// 戻り値: キーフレームなら true
+	bool Encode(const ArchiveKey& key, const BYTE* plane, std::vector<BYTE>& out) {
+		std::vector<BYTE> keyRle, deltaRle;
+		RleEncode(plane, kTilePixels, keyRle);
+		bool isKey = count % kDeltaKeyInterval == 0;
+		if (!isKey) {
+			xorBuf.resize(kTilePixels);
+			for (int i = 0; i < kTilePixels; ++i) xorBuf[i] = plane[i] ^ prev[i];
+			RleEncode(xorBuf.data(), kTilePixels, deltaRle);
+			// 差分の方が大きければ (雨域が大きく変わった) キーフレームにする
+			isKey = deltaRle.size() >= keyRle.size();
+		}
+		DeltaBlobHeader h{};
+		memcpy(h.magic, kDeltaMagic, 4);
+		h.planeSize = kTilePixels;
+		if (!isKey) { h.prevTime = prevKey.time; h.prevBase = prevKey.base; }
+		const std::vector<BYTE>& body = isKey ? keyRle : deltaRle;
+		out.resize(sizeof(h) + body.size());
+		memcpy(out.data(), &h, sizeof(h));
+		memcpy(out.data() + sizeof(h), body.data(), body.size());
+
+		prev.assign(plane, plane + kTilePixels);
+		prevKey = key;
+		count = isKey ? 1 : count + 1;
+		return isKey;
+	}
+
+private:
+	std::vector<BYTE> prev, xorBuf;
+	ArchiveKey prevKey;
+	int count{};
+};
+
+static bool ParseDeltaBlob(const BYTE* p, size_t n, DeltaBlobHeader& h)
+{
+	if (n < sizeof(h)) return false;
+	memcpy(&h, p, sizeof(h));
+	return memcmp(h.magic, kDeltaMagic, 4) == 0 && h.planeSize == (uint32_t)kTilePixels;
+}
+
+// blob を plane に適用する (キーフレームは上書き、差分は直前フレームの plane へ XOR)
+static bool ApplyDeltaBlob(const BYTE* p, size_t n, BYTE* plane)
+{
+	DeltaBlobHeader h;
+	if (!ParseDeltaBlob(p, n, h)) return false;
+	return RleApply(p + sizeof(h), n - sizeof(h), plane, kTilePixels, h.prevTime != 0);
+}
+
+// アーカイブの差分層からパレット面を復元する。
+// タイル位置ごとに最後に復元した面を覚えておき、順再生では差分 1 つの適用で済ませる
+class DeltaPlaneReader {
+public:
+	explicit DeltaPlaneReader(const TileArchive& a) : archive(a) {}
+
+	bool Read(const ArchiveKey& key, BYTE* plane) {
+		const uint64_t tile = ((uint64_t)key.z << 56) | ((uint64_t)key.x << 28) | key.y;
+		std::vector<std::pair<const BYTE*, size_t>> chain;
+		ArchiveKey k = key;
+		for (;;) {
+			const BYTE* p; size_t n;
+			DeltaBlobHeader h;
+			if (!archive.Find(k, &p, &n) || !ParseDeltaBlob(p, n, h)) return false;
+			chain.emplace_back(p, n);
+			if (h.prevTime == 0) break;
+			if (chain.size() > (size_t)kDeltaMaxChain) return false;
+			k.time = h.prevTime; k.base = h.prevBase;
+			std::lock_guard<std::mutex> lk(mtx);
+			auto it = cache.find(tile);
+			if (it != cache.end() && it->second.time == k.time && it->second.base == k.base) {
+				memcpy(plane, it->second.plane.data(), kTilePixels);
+				break;
+			}
+		}
+		for (size_t i = chain.size(); i-- > 0; )
+			if (!ApplyDeltaBlob(chain[i].first, chain[i].second, plane)) return false;
+
+		std::lock_guard<std::mutex> lk(mtx);
+		if (cache.size() >= kCacheTiles && !cache.count(tile)) {
+			auto oldest = std::min_element(cache.begin(), cache.end(), [](auto& a, auto& b) { return a.second.tick < b.second.tick; });
+			cache.erase(oldest);
+		}
+		Cached& c = cache[tile];
+		c.time = key.time; c.base = key.base; c.tick = ++tick;
+		c.plane.assign(plane, plane + kTilePixels);
+		return true;
+	}
+
+private:
+	struct Cached {
+		uint64_t time{}, base{}, tick{};
+		std::vector<BYTE> plane;
+	};
+	static const size_t kCacheTiles = 256;
+	const TileArchive& archive;
+	std::mutex mtx;
+	std::unordered_map<uint64_t, Cached> cache;
+	uint64_t tick{};
+};
+
+// 再生用アーカイブの差分層 (gArchive と同時に作る)
+static std::unique_ptr<DeltaPlaneReader> gDeltaReader;
 
 // -------------------- Network (JMA) --------------------
 static bool HttpGet(const wchar_t* host, INTERNET_PORT port, bool https, const std::wstring& path, std::vector<BYTE>& out)
@@ -222,12 +1252,42 @@ static bool HttpGet(const wchar_t* host, INTERNET_PORT port, bool https, const s
 	return ok && !out.empty();
 }
 
+// 接続先の差し替え (--upstream host:port)。指定すると JMA/GSI とも同じパスでそのサーバーへ HTTP で取りに行く
+// (LAN 内の中継サーバーや負荷試験用の模擬サーバー向け)
+struct Upstream {
+	std::wstring host;		// 空なら本来の JMA/GSI へ HTTPS
+	INTERNET_PORT port{};
+};
+static Upstream gUpstream;
+static bool gDiskCacheEnabled = true;	// --no-disk-cache で無効
+
+static bool ParseHostPort(const std::wstring& s, std::wstring& host, INTERNET_PORT& port)
+{
+	size_t colon = s.rfind(L':');
+	if (colon == std::wstring::npos || colon == 0) return false;
+	int p = _wtoi(s.c_str() + colon + 1);
+	if (p <= 0 || p > 65535) return false;
+	host = s.substr(0, colon);
+	port = (INTERNET_PORT)p;
+	return true;
+}
+
+static bool UpstreamGet(const wchar_t* host, const std::wstring& path, std::vector<BYTE>& out)
+{
+	if (!gUpstream.host.empty()) return HttpGet(gUpstream.host.c_str(), gUpstream.port, false, path, out);
+	return HttpGet(host, INTERNET_DEFAULT_HTTPS_PORT, true, path, out);
+}
+
 static bool FetchTimes(bool forecast, std::vector<NowcTime>& out)
 {
 	std::vector<BYTE> buf;
 	const wchar_t* path = forecast ? K_TIMES_URL_N2 : K_TIMES_URL_N1;
+	// 取得できない場合は前回保存した一覧を使う (オフライン時)
+	std::wstring file = DiskCachePath(K_JMA_HOST, path);
+	if (UpstreamGet(K_JMA_HOST, path, buf)) { if (gDiskCacheEnabled) DiskCacheWrite(file, buf); }
+	else if (!gDiskCacheEnabled || !DiskCacheRead(file, buf)) return false;
+
 	// JSON簡易パース
-	if (!HttpGet(K_JMA_HOST, INTERNET_DEFAULT_HTTPS_PORT, true, path, buf)) return false;
 
 	out.clear();
 	std::string js(buf.begin(), buf.end());
@@ -242,6 +1302,19 @@ static bool FetchTimes(bool forecast, std::vector<NowcTime>& out)
 		std::string bs = js.substr(bq1 + 1, bq2 - bq1 - 1);
 		std::string vs = js.substr(vq1 + 1, vq2 - vq1 - 1);
 		NowcTime t; t.basetime.assign(bs.begin(), bs.end()); t.validtime.assign(vs.begin(), vs.end());
+		// "elements": ["hrpns", "thns", ...] (同じオブジェクト内)。雷・竜巻は降水より更新間隔が長く、ない時刻がある
+		size_t o0 = js.rfind('{', b), o1 = js.find('}', b), e = js.find("\"elements\"", o0 == std::string::npos ? 0 : o0);
+		if (o1 != std::string::npos && e < o1) {
+			size_t a0 = js.find('[', e), a1 = js.find(']', e);
+			for (size_t q1 = js.find('"', a0); a0 < a1 && q1 < a1; q1 = js.find('"', q1 + 1)) {
+				size_t q2 = js.find('"', q1 + 1);
+				if (q2 == std::string::npos || q2 > a1) break;
+				std::wstring name(js.begin() + q1 + 1, js.begin() + q2);
+				for (int l = kTileRain; l < kTileLayerCount; ++l)
+					if (kTileLayers[l].tileFmt && name == kTileLayers[l].key) t.layers |= 1u << l;
+				q1 = q2;
+			}
+		}
 		out.push_back(std::move(t));
 		pos = vq2 + 1;
 		if (out.size() > 120) break;
@@ -249,89 +1322,287 @@ static bool FetchTimes(bool forecast, std::vector<NowcTime>& out)
 	return !out.empty();
 }
 
-// -------------------- Cache & Decode (JMA) --------------------
-static ID2D1Bitmap* LoadPngToD2D(const std::vector<BYTE>& png)
+// タイル取得の回数 (監視・プロキシの統計用)
+static std::atomic<size_t> gTileDiskHits{ 0 }, gTileHttpFetches{ 0 };
+
+// タイル取得 (ホストは層で決まる)。ディスクキャッシュを優先する
+static bool FetchTileBytes(const std::wstring& path, TileLayer layer, std::vector<BYTE>& out)
+{
+	const wchar_t* host = kTileLayers[layer].host;
+	TileLayerCounters& c = gTileLayerCounters[layer];
+	std::wstring file = DiskCachePath(host, path);
+	if (gDiskCacheEnabled && DiskCacheRead(file, out)) { ++gTileDiskHits; return true; }
+	++gTileHttpFetches;
+	++c.httpFetches;
+	if (!UpstreamGet(host, path, out)) { ++c.failures; return false; }
+	c.fetchedBytes += out.size();
+	if (gDiskCacheEnabled) DiskCacheWrite(file, out);
+	return true;
+}
+
+// -------------------- Cache & Decode (JMA) --------------------
+static ID2D1Bitmap* LoadPngToD2D(ID2D1RenderTarget* rt, const BYTE* png, size_t size)
 {
 	IWICStream* s = nullptr; IWICBitmapDecoder* dec = nullptr;
 	IWICBitmapFrameDecode* fr = nullptr; IWICFormatConverter* cvt = nullptr; ID2D1Bitmap* bmp = nullptr;
 	if (FAILED(g.wic->CreateStream(&s))) goto done;
-	if (FAILED(s->InitializeFromMemory((WICInProcPointer)png.data(), (DWORD)png.size()))) goto done;
+	if (FAILED(s->InitializeFromMemory((WICInProcPointer)png, (DWORD)size))) goto done;
 	if (FAILED(g.wic->CreateDecoderFromStream(s, nullptr, WICDecodeMetadataCacheOnLoad, &dec))) goto done;
 	if (FAILED(dec->GetFrame(0, &fr))) goto done;
 	if (FAILED(g.wic->CreateFormatConverter(&cvt))) goto done;
 	if (FAILED(cvt->Initialize(fr, GUID_WICPixelFormat32bppPBGRA, WICBitmapDitherTypeNone, nullptr, 0, WICBitmapPaletteTypeCustom))) goto done;
-	if (FAILED(g.rt->CreateBitmapFromWicBitmap(cvt, nullptr, &bmp))) goto done;
+	if (FAILED(rt->CreateBitmapFromWicBitmap(cvt, nullptr, &bmp))) goto done;
 done:
 	SAFE_RELEASE(cvt); SAFE_RELEASE(fr); SAFE_RELEASE(dec); SAFE_RELEASE(s);
 	return bmp;
 }
 
-static void PurgeOldTiles()
+// ワーカースレッド用の WIC ファクトリ (スレッドごとに MTA で初期化して保持する)
+static IWICImagingFactory* ThreadWic()
 {
-	if (gCache.size() <= kCacheLimit) return;
-	std::vector<std::pair<std::wstring, std::chrono::steady_clock::time_point>> v;
-	for (auto& kv : gCache) v.emplace_back(kv.first, kv.second.lastUsed);
-	std::sort(v.begin(), v.end(), [](auto& a, auto& b) { return a.second < b.second; });
-	size_t removeCount = v.size() - kCacheLimit;
-	for (size_t i = 0; i < removeCount; ++i) {
-		auto it = gCache.find(v[i].first);
-		if (it != gCache.end()) {
-			SAFE_RELEASE(it->second.bmp);
-			it->second.bytes.clear();
-			gCache.erase(it);
+	struct Holder {
+		IWICImagingFactory* wic{};
+		bool com{}, borrowed{};
+		Holder() {
+			HRESULT hr = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+			if (hr == RPC_E_CHANGED_MODE) { wic = g.wic; borrowed = true; return; } // メインスレッド (STA)
+			com = SUCCEEDED(hr);
+			CoCreateInstance(CLSID_WICImagingFactory, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&wic));
+		}
+		~Holder() {
+			if (!borrowed) SAFE_RELEASE(wic);
+			if (com) CoUninitialize();
 		}
+	};
+	thread_local Holder h;
+	return h.wic;
+}
+
+// PNG を CPU 上の 32bppPBGRA ビットマップへデコード (描画先に依存しないので複数スレッドで共有できる)
+static IWICBitmap* DecodePngToWic(IWICImagingFactory* wic, const BYTE* png, size_t size)
+{
+	IWICStream* s = nullptr; IWICBitmapDecoder* dec = nullptr;
+	IWICBitmapFrameDecode* fr = nullptr; IWICFormatConverter* cvt = nullptr; IWICBitmap* bmp = nullptr;
+	if (FAILED(wic->CreateStream(&s))) goto done;
+	if (FAILED(s->InitializeFromMemory((WICInProcPointer)png, (DWORD)size))) goto done;
+	if (FAILED(wic->CreateDecoderFromStream(s, nullptr, WICDecodeMetadataCacheOnLoad, &dec))) goto done;
+	if (FAILED(dec->GetFrame(0, &fr))) goto done;
+	if (FAILED(wic->CreateFormatConverter(&cvt))) goto done;
+	if (FAILED(cvt->Initialize(fr, GUID_WICPixelFormat32bppPBGRA, WICBitmapDitherTypeNone, nullptr, 0, WICBitmapPaletteTypeCustom))) goto done;
+	if (FAILED(wic->CreateBitmapFromSource(cvt, WICBitmapCacheOnLoad, &bmp))) bmp = nullptr;
+done:
+	SAFE_RELEASE(cvt); SAFE_RELEASE(fr); SAFE_RELEASE(dec); SAFE_RELEASE(s);
+	return bmp;
+}
+
+// WIC ビットマップ (32bppPBGRA, 256x256) → パレット面
+static bool ClassifyWicBitmap(IWICBitmap* bmp, BYTE* plane, size_t* inexact = nullptr)
+{
+	UINT w = 0, h = 0;
+	if (!bmp || FAILED(bmp->GetSize(&w, &h)) || w != (UINT)TILE_SIZE || h != (UINT)TILE_SIZE) return false;
+	WICRect rc{ 0, 0, (INT)w, (INT)h };
+	IWICBitmapLock* lock = nullptr;
+	if (FAILED(bmp->Lock(&rc, WICBitmapLockRead, &lock))) return false;
+	UINT stride = 0, cb = 0; BYTE* px = nullptr;
+	bool ok = SUCCEEDED(lock->GetStride(&stride)) && SUCCEEDED(lock->GetDataPointer(&cb, &px));
+	if (ok) {
+		size_t n = ClassifyBgra(px, stride, plane);
+		if (inexact) *inexact = n;
+	}
+	SAFE_RELEASE(lock);
+	return ok;
+}
+
+static bool DecodeJmaClasses(IWICImagingFactory* wic, const BYTE* png, size_t size, BYTE* plane, size_t* inexact = nullptr)
+{
+	IWICBitmap* bmp = DecodePngToWic(wic, png, size);
+	bool ok = ClassifyWicBitmap(bmp, plane, inexact);
+	SAFE_RELEASE(bmp);
+	return ok;
+}
+
+// パレット面 → 描画用の 32bppPBGRA ビットマップ
+static IWICBitmap* ClassPlaneToWic(IWICImagingFactory* wic, const BYTE* plane)
+{
+	std::vector<uint32_t> bgra(kTilePixels);
+	ExpandClassPlane(plane, bgra.data());
+	IWICBitmap* bmp = nullptr;
+	if (FAILED(wic->CreateBitmapFromMemory(TILE_SIZE, TILE_SIZE, GUID_WICPixelFormat32bppPBGRA, TILE_SIZE * 4,
+		(UINT)(bgra.size() * 4), (BYTE*)bgra.data(), &bmp))) return nullptr;
+	return bmp;
+}
+
+// 再生用アーカイブにあればマップ領域から直接デコードする (ワーカースレッドから呼ばれる)
+// PNG のない JMA タイルは差分層からパレット面を復元する
+static IWICBitmap* DecodeArchiveTile(const std::wstring& path)
+{
+	ArchiveKey k;
+	const BYTE* p = nullptr; size_t n = 0;
+	if (!gArchive || !ArchiveKeyFromPath(path, k)) return nullptr;
+	if (gArchive->Find(k, &p, &n)) return DecodePngToWic(ThreadWic(), p, n);
+	if (k.layer != kLayerJmaHrpns || !gDeltaReader) return nullptr;
+	k.layer = kLayerJmaDelta;
+	std::vector<BYTE> plane(kTilePixels);
+	if (!gDeltaReader->Read(k, plane.data())) return nullptr;
+	return ClassPlaneToWic(ThreadWic(), plane.data());
+}
+
+// 取得ではなく計算で作る JMA タイル (外挿フレーム "extrap/...")。生成関数は Extrapolation の節で設定する
+static std::function<bool(const std::wstring& path, BYTE* plane)> gSyntheticTileClasses;
+static bool IsSyntheticTilePath(const std::wstring& path) { return path.compare(0, 7, L"extrap/") == 0; }
+static IWICBitmap* DecodeSyntheticTile(const std::wstring& path)
+{
+	std::vector<BYTE> plane(kTilePixels);
+	if (!gSyntheticTileClasses || !gSyntheticTileClasses(path, plane.data())) return nullptr;
+	return ClassPlaneToWic(ThreadWic(), plane.data());
+}
+
+// 層ごとの枠 (kTileLayers[].cacheTiles) と全体の枠 (kTileCacheTotal) を超えた分を古いものから捨てる。gCacheMtx を保持して呼ぶ
+static void PurgeOldTiles()
+{
+	size_t count[kTileLayerCount] = {}, total = gCache.size();
+	for (auto& kv : gCache) ++count[kv.second.layer];
+	bool over = total > kTileCacheTotal;
+	for (int l = 0; l < kTileLayerCount; ++l) over |= count[l] > kTileLayers[l].cacheTiles;
+	if (!over) return;
+
+	std::vector<std::pair<std::chrono::steady_clock::time_point, std::wstring>> v;
+	for (auto& kv : gCache)
+		if (total > kTileCacheTotal || count[kv.second.layer] > kTileLayers[kv.second.layer].cacheTiles) v.emplace_back(kv.second.lastUsed, kv.first);
+	std::sort(v.begin(), v.end(), [](auto& a, auto& b) { return a.first < b.first; });
+	for (auto& e : v) {
+		auto it = gCache.find(e.second);
+		if (it == gCache.end()) continue;
+		size_t& n = count[it->second.layer];
+		if (n <= kTileLayers[it->second.layer].cacheTiles && total <= kTileCacheTotal) continue;
+		--n; --total;
+		SAFE_RELEASE(it->second.bmp);
+		SAFE_RELEASE(it->second.decoded);
+		it->second.bytes.clear();
+		gCache.erase(it);
+	}
+}
+
+// 層ごとのキャッシュ使用量。画素は 32bpp として数える (PNG のままのものは圧縮後の大きさ)
+struct TileLayerUsage { size_t tiles{}, pending{}; uint64_t bytes{}; };
+static void CountTileLayerUsage(TileLayerUsage (&u)[kTileLayerCount])
+{
+	for (auto& x : u) x = TileLayerUsage();
+	std::lock_guard<std::mutex> lk(gCacheMtx);
+	for (auto& kv : gCache) {
+		const Img& im = kv.second;
+		TileLayerUsage& x = u[im.layer];
+		++x.tiles;
+		if (!im.bmp && !im.decoded && im.bytes.empty() && im.fails == 0) ++x.pending;
+		x.bytes += im.bytes.size() + im.classes.size() + ((im.bmp || im.decoded) ? (uint64_t)kTilePixels * 4 : 0);
+	}
+}
+
+// キャッシュ済みのエントリを D2D ビットマップにする (メインスレッド、gCacheMtx を保持して呼ぶ)
+static ID2D1Bitmap* CachedBitmap(Img& im)
+{
+	im.lastUsed = std::chrono::steady_clock::now();
+	if (!im.bmp && im.decoded) {
+		if (FAILED(g.rt->CreateBitmapFromWicBitmap(im.decoded, nullptr, &im.bmp))) im.bmp = nullptr;
+		SAFE_RELEASE(im.decoded);
+	}
+	if (!im.bmp && !im.bytes.empty()) {
+		// WICデコードはメインスレッドでのみ行う
+		im.bmp = LoadPngToD2D(g.rt, im.bytes.data(), im.bytes.size());
+		im.bytes.clear();
 	}
+	return im.bmp;
 }
 
-static bool GetOrFetchBitmap(const std::wstring& key, ID2D1Bitmap** outBmp, bool isOverlay)
+// 取得は始めずにキャッシュだけを見る (積算層など、バックグラウンドで作るタイル用)
+static ID2D1Bitmap* PeekCachedBitmap(const std::wstring& key)
 {
 	std::lock_guard<std::mutex> lk(gCacheMtx);
 	auto it = gCache.find(key);
+	return it == gCache.end() ? nullptr : CachedBitmap(it->second);
+}
+
+static bool GetOrFetchBitmap(const std::wstring& key, ID2D1Bitmap** outBmp, TileLayer layer)
+{
+	std::lock_guard<std::mutex> lk(gCacheMtx);
+	const auto now = std::chrono::steady_clock::now();
+	auto it = gCache.find(key);
 	if (it != gCache.end()) {
-		it->second.lastUsed = std::chrono::steady_clock::now();
-		if (!it->second.bmp && !it->second.bytes.empty()) {
-			// WICデコードはメインスレッドでのみ行う
-			it->second.bmp = LoadPngToD2D(it->second.bytes);
-			it->second.bytes.clear();
+		Img& im = it->second;
+		// 取得に失敗したタイルは取り直す時刻まで空のまま (404 の海域などを再描画のたびに要求しない)
+		if (im.fails == 0 || now < im.retryAt) {
+			*outBmp = CachedBitmap(im);
+			return (*outBmp != nullptr);
 		}
-		*outBmp = it->second.bmp;
-		return (*outBmp != nullptr);
+		// 取り直しの完了 (成功か次の retryAt) までは要求中として重ねて取りに行かない
+		im.lastUsed = now;
+		im.retryAt = std::chrono::steady_clock::time_point::max();
+	}
+	else {
+		// キャッシュにない場合はプレースホルダーを追加
+		Img im;
+		im.lastUsed = now;
+		im.layer = layer;
+		gCache.emplace(key, std::move(im));
+		PurgeOldTiles();
 	}
 	*outBmp = nullptr;
 
-	// キャッシュにない場合はプレースホルダーを追加し、非同期ダウンロードを開始
-	Img im;
-	im.lastUsed = std::chrono::steady_clock::now();
-	gCache.emplace(key, std::move(im));
-	PurgeOldTiles();
+	// 非同期ダウンロードを開始
+	++gTileLayerCounters[layer].requests;
 
 	if (gPool) {
 		if (!gPool->is_stopping()) {
 			// hwnd をキャプチャ
-			gPool->enqueue([key, isOverlay, hwnd = g.hwnd]() {
+			gPool->enqueue([key, layer, hwnd = g.hwnd]() {
 				// HttpGetは長時間ブロックするため、停止処理に入っている場合は実行しない
 				if (gPool->is_stopping()) return;
 
 				std::vector<BYTE> buf;
-				const wchar_t* host = isOverlay ? K_JMA_HOST : K_GSI_HOST;
+				// アーカイブ再生中はマップ領域から直接デコードする。外挿フレームはここで計算する
+				const bool synthetic = IsSyntheticTilePath(key);
+				IWICBitmap* decoded = synthetic ? DecodeSyntheticTile(key) : DecodeArchiveTile(key);
 				// 修正: path ではなく key を使用
-				bool ok = HttpGet(host, INTERNET_DEFAULT_HTTPS_PORT, true, key, buf);
+				bool ok = decoded || (!synthetic && FetchTileBytes(key, layer, buf));
+				// JMA タイルはここでデコードし、降水は強度の問い合わせ用にパレット面も作っておく
+				std::vector<BYTE> classes;
+				if (ok && !IsGsiLayer(layer)) {
+					if (!decoded && (decoded = DecodePngToWic(ThreadWic(), buf.data(), buf.size())) != nullptr) buf.clear();
+					if (kTileLayers[layer].classes) {
+						classes.resize(kTilePixels);
+						if (!ClassifyWicBitmap(decoded, classes.data())) classes.clear();
+					}
+				}
 
 				// 修正: HttpGet後、gPoolが破棄されていないか確認せずに、
 				// グローバル変数 g.hwnd がクリアされていないか確認し、安全を確保
-				if (!hwnd) return;
+				if (!hwnd) { SAFE_RELEASE(decoded); return; }
 
 				std::lock_guard<std::mutex> lk(gCacheMtx);
 				auto it_dl = gCache.find(key);
+				if (it_dl == gCache.end()) SAFE_RELEASE(decoded);
 				if (it_dl != gCache.end()) {
 					if (ok) {
-						it_dl->second.bytes = std::move(buf);
+						Img& im = it_dl->second;
+						// 既に D2D 化済みなら新しいデコード結果は使わない
+						if (im.bmp) SAFE_RELEASE(decoded);
+						else {
+							SAFE_RELEASE(im.decoded);
+							im.decoded = decoded;
+							im.bytes = std::move(buf);
+						}
+						im.classes = std::move(classes);
+						im.fails = 0;
+						im.retryAt = {};
 						// メインスレッドにデコードを促す (キャプチャした hwnd を使用)
 						PostMessage(hwnd, WM_TILE_READY, 0, 0);
 					}
 					else {
-						// 失敗したタイルはキャッシュから削除
-						gCache.erase(it_dl);
+						// 失敗したタイルは空のまま残し、間隔を空けてから取り直す
+						Img& im = it_dl->second;
+						const int sec = std::min(kTileRetryMaxSec, kTileRetryMinSec << std::min<int>(im.fails, 5));
+						im.retryAt = std::chrono::steady_clock::now() + std::chrono::seconds(sec);
+						if (im.fails < UINT8_MAX) ++im.fails;
 					}
 				}
 				});
@@ -381,14 +1652,18 @@ static void UpdateTitle() {
 	double lon = WorldXToLon(cx, zi);
 
 	std::wstring timeStr;
+	const wchar_t* mode = gUseForecast ? L"Forecast" : L"Observation";
 	if (!gTimes.empty() && gTimeIndex >= 0 && gTimeIndex < gTimes.size()) {
+		if (IsExtrapolated(gTimes[gTimeIndex])) mode = L"Extrapolated";
 		timeStr = L" | Time: " + gTimes[gTimeIndex].validtime.substr(4, 2) + L"/" + gTimes[gTimeIndex].validtime.substr(6, 2) +
 			L" " + gTimes[gTimeIndex].validtime.substr(8, 2) + L":" + gTimes[gTimeIndex].validtime.substr(10, 2);
 	}
 
 	wchar_t title[256];
 	swprintf(title, 256, L"JMA Nowcast & GSI Map - Lat: %.4f, Lon: %.4f, Zoom: %.2f%s (%s)",
-		lat, lon, g.zoom, timeStr.c_str(), gUseForecast ? L"Forecast" : L"Observation");
+		lat, lon, g.zoom, timeStr.c_str(), mode);
+	if (gPlayback.active) swprintf(title, 256, L"JMA Nowcast & GSI Map - Lat: %.4f, Lon: %.4f, Zoom: %.2f%s (Archive %d/%d)",
+		lat, lon, g.zoom, timeStr.c_str(), (int)gTimes.size() - gTimeIndex, (int)gTimes.size());
 	SetWindowTextW(g.hwnd, title);
 }
 
@@ -427,6 +1702,8 @@ static void SwitchTimes(bool forecast)
 		gTimeIndex = 0;
 		gAnimPlaying = false;
 	}
+	if (!gUseForecast) gObsTimes.clear();
+	else if (FetchTimes(false, t)) gObsTimes.swap(t);
 	InvalidateRect(g.hwnd, nullptr, FALSE);
 	UpdateTitle();
 }
@@ -464,354 +1741,7636 @@ static void StepTime(int delta)
 }
 
 
-// -------------------- Draw --------------------
-static void EnsureRT() {
-	if (!g.rt) {
-		RECT rc; GetClientRect(g.hwnd, &rc);
-		D2D1_SIZE_U sz = D2D1::SizeU(rc.right, rc.bottom);
-		HRESULT hr = g.factory->CreateHwndRenderTarget(D2D1::RenderTargetProperties(),
-			D2D1::HwndRenderTargetProperties(g.hwnd, sz), &g.rt);
-		if (FAILED(hr)) g.rt = nullptr;
-	}
+// -------------------- Map Layers --------------------
+// 描画先に依存しないビュー定義 (ウィンドウ描画とヘッドレス描画で共有)
+struct MapView {
+	int w{}, h{};
+	double zoom{};
+	double originWX{}, originWY{};
+};
+using TileBitmapFn = std::function<ID2D1Bitmap* (const std::wstring& path, TileLayer layer)>;
+using TileRectFn = std::function<void(const std::wstring& path, const D2D1_RECT_F& dst)>;
+
+static MapView CurrentView() {
+	MapView v;
+	v.w = g.clientW; v.h = g.clientH;
+	v.zoom = g.zoom;
+	v.originWX = g.originWX; v.originWY = g.originWY;
+	return v;
 }
 
-static void DrawScene() {
-	EnsureRT();
-	if (!g.rt) return;
+// 指定中心・ズーム・サイズのビューを作る (CenterOnLonLat と同じ計算)
+static MapView MakeView(double lon, double lat, double zoom, int w, int h) {
+	MapView v;
+	v.w = w; v.h = h;
+	v.zoom = std::clamp(zoom, (double)MIN_MAP_ZOOM, (double)MAX_MAP_ZOOM);
+	int z = (int)std::floor(v.zoom);
+	double sc = std::pow(2.0, v.zoom - z);
+	v.originWX = LonLatToWorldX(lon, z) - w / (2.0 * sc);
+	v.originWY = LonLatToWorldY(lat, z) - h / (2.0 * sc);
+	return v;
+}
 
-	g.rt->BeginDraw();
-	g.rt->Clear(D2D1::ColorF(1.0f, 1.0f, 1.0f));
+static int JmaZoomFor(double zCur) {
+	int zJMA;
+	double zCur_adjusted = zCur + 1e-9;
 
-	int zDL = (int)std::floor(g.zoom);
-	zDL = std::clamp(zDL, MIN_MAP_ZOOM, MAX_MAP_ZOOM);
+	if (zCur_adjusted < 5.0) {
+		zJMA = 4;
+	}
+	else if (zCur_adjusted < 7.0) {
+		zJMA = 6;
+	}
+	else if (zCur_adjusted < 9.0) {
+		zJMA = 8;
+	}
+	else if (zCur_adjusted < 11.0) {
+		zJMA = 10;
+	}
+	else {
+		zJMA = 10;
+	}
 
-	double current_scale = std::pow(2.0, g.zoom - zDL);
+	return std::max(zJMA, 4);
+}
 
-	double wx0 = g.originWX;
-	double wy0 = g.originWY;
-	double wx1 = g.originWX + g.clientW / current_scale;
-	double wy1 = g.originWY + g.clientH / current_scale;
+// GSIマップのタイル列挙
+// style のタイルがないズームでは、端のズームのタイルを表示ズームの大きさに合わせて使う
+static void ForEachGsiTile(const MapView& v, TileLayer style, const TileRectFn& fn) {
+	int zDL = std::clamp((int)std::floor(v.zoom), MIN_MAP_ZOOM, MAX_MAP_ZOOM);
+	double current_scale = std::pow(2.0, v.zoom - zDL);
 
-	// GSIマップの描画ロジック
-	auto drawGsiTiles = [&]() {
-		int zGSI = zDL;
-		int maxT = (1 << zGSI);
+	double wx0 = v.originWX;
+	double wy0 = v.originWY;
+	double wx1 = v.originWX + v.w / current_scale;
+	double wy1 = v.originWY + v.h / current_scale;
 
-		int tx0 = (int)std::floor(wx0 / TILE_SIZE);
-		int ty0 = (int)std::floor(wy0 / TILE_SIZE);
-		int tx1 = (int)std::floor(wx1 / TILE_SIZE);
-		int ty1 = (int)std::floor(wy1 / TILE_SIZE);
+	int zGSI = std::clamp(zDL, kTileLayers[style].minZoom, kTileLayers[style].maxZoom);
+	int maxT = (1 << zGSI);
+	double tileWorld = std::ldexp((double)TILE_SIZE, zDL - zGSI);	// zDL の世界座標でのタイルの大きさ
 
-		for (int ty = ty0; ty <= ty1; ++ty) {
-			for (int tx = tx0; tx <= tx1; ++tx) {
-				int nx = (tx % maxT + maxT) % maxT;
-				int ny_clamped = std::clamp(ty, 0, maxT - 1);
+	int tx0 = (int)std::floor(wx0 / tileWorld);
+	int ty0 = (int)std::floor(wy0 / tileWorld);
+	int tx1 = (int)std::floor(wx1 / tileWorld);
+	int ty1 = (int)std::floor(wy1 / tileWorld);
 
-				if (ny_clamped != ty) {
-					continue;
-				}
+	for (int ty = ty0; ty <= ty1; ++ty) {
+		for (int tx = tx0; tx <= tx1; ++tx) {
+			int nx = (tx % maxT + maxT) % maxT;
+			int ny_clamped = std::clamp(ty, 0, maxT - 1);
 
-				int ny = ny_clamped;
+			if (ny_clamped != ty) {
+				continue;
+			}
 
-				double wx_start = tx * TILE_SIZE;
-				double wy_start = ty * TILE_SIZE;
+			int ny = ny_clamped;
 
-				float sx = (float)((wx_start - g.originWX) * current_scale);
-				float sy = (float)((wy_start - g.originWY) * current_scale);
-				float ss = (float)(TILE_SIZE * current_scale);
+			double wx_start = tx * tileWorld;
+			double wy_start = ty * tileWorld;
 
-				D2D1_RECT_F dst = D2D1::RectF(sx, sy, sx + ss, sy + ss);
+			float sx = (float)((wx_start - v.originWX) * current_scale);
+			float sy = (float)((wy_start - v.originWY) * current_scale);
+			float ss = (float)(tileWorld * current_scale);
 
-				if (dst.right > 0 && dst.left < g.clientW && dst.bottom > 0 && dst.top < g.clientH) {
-					wchar_t buf[512];
-					swprintf_s(buf, K_GSI_TILE_FMT, zGSI, nx, ny);
-					std::wstring path = buf;
+			D2D1_RECT_F dst = D2D1::RectF(sx, sy, sx + ss, sy + ss);
 
-					ID2D1Bitmap* bmp = nullptr;
-					if (GetOrFetchBitmap(path, &bmp, false) && bmp) {
-						g.rt->DrawBitmap(bmp, dst, 1.0f, D2D1_BITMAP_INTERPOLATION_MODE_LINEAR);
-					}
-				}
+			if (dst.right > 0 && dst.left < v.w && dst.bottom > 0 && dst.top < v.h) {
+				wchar_t buf[512];
+				swprintf_s(buf, kTileLayers[style].tileFmt, zGSI, nx, ny);
+				fn(buf, dst);
 			}
 		}
-		};
+	}
+}
 
-	// JMAナウキャストの描画ロジック
-	auto drawJmaOverlay = [&](int timeIndex, float alpha) {
-		if (gTimes.empty() || timeIndex < 0 || timeIndex >= gTimes.size()) return;
+// JMA タイル格子 (ズーム zJMA) のうちビューにかかるタイルの列挙
+using TileXYRectFn = std::function<void(int x, int y, const D2D1_RECT_F& dst)>;
+static void ForEachJmaTileXY(const MapView& v, int zJMA, const TileXYRectFn& fn) {
+	int zDL = std::clamp((int)std::floor(v.zoom), MIN_MAP_ZOOM, MAX_MAP_ZOOM);
+	double current_scale = std::pow(2.0, v.zoom - zDL);
 
-		double zCur = g.zoom;
+	double wx0 = v.originWX;
+	double wy0 = v.originWY;
+	double wx1 = v.originWX + v.w / current_scale;
+	double wy1 = v.originWY + v.h / current_scale;
 
-		int zJMA;
-		double zCur_adjusted = zCur + 1e-9;
+	const int maxT_JMA = (1 << zJMA);
 
-		if (zCur_adjusted < 5.0) {
-			zJMA = 4;
-		}
-		else if (zCur_adjusted < 7.0) {
-			zJMA = 6;
-		}
-		else if (zCur_adjusted < 9.0) {
-			zJMA = 8;
-		}
-		else if (zCur_adjusted < 11.0) {
-			zJMA = 10;
-		}
-		else {
-			zJMA = 10;
-		}
+	const double JMA_TILE_WORLD_SIZE = TILE_SIZE;
+
+	double Z_JMA_to_Z_DL_factor = std::pow(2.0, zDL - zJMA);
+	double tileWorldSize_zDL_final = JMA_TILE_WORLD_SIZE * Z_JMA_to_Z_DL_factor;
 
-		zJMA = std::max(zJMA, 4);
+	double Z_DL_to_Z_JMA_scale = 1.0 / Z_JMA_to_Z_DL_factor;
 
-		const int maxT_JMA = (1 << zJMA);
-		const NowcTime T = gTimes[timeIndex];
+	double wx0_JMA = wx0 * Z_DL_to_Z_JMA_scale;
+	double wy0_JMA = wy0 * Z_DL_to_Z_JMA_scale;
+	double wx1_JMA = wx1 * Z_DL_to_Z_JMA_scale;
+	double wy1_JMA = wy1 * Z_DL_to_Z_JMA_scale;
 
-		const double JMA_TILE_WORLD_SIZE = TILE_SIZE;
+	int tx0_JMA = (int)std::floor(wx0_JMA / JMA_TILE_WORLD_SIZE - 0.001) - 1;
+	int ty0_JMA = (int)std::floor(wy0_JMA / JMA_TILE_WORLD_SIZE - 0.001) - 1;
+	int tx1_JMA = (int)std::floor(wx1_JMA / JMA_TILE_WORLD_SIZE + 0.001) + 1;
+	int ty1_JMA = (int)std::floor(wy1_JMA / JMA_TILE_WORLD_SIZE + 0.001) + 1;
 
-		double Z_JMA_to_Z_DL_factor = std::pow(2.0, zDL - zJMA);
-		double tileWorldSize_zDL_final = JMA_TILE_WORLD_SIZE * Z_JMA_to_Z_DL_factor;
+	for (int ty_JMA = ty0_JMA; ty_JMA <= ty1_JMA; ++ty_JMA) {
+		for (int tx_JMA = tx0_JMA; tx_JMA <= tx1_JMA; ++tx_JMA) {
+			int nx = (tx_JMA % maxT_JMA + maxT_JMA) % maxT_JMA;
+			int ny = std::clamp(ty_JMA, 0, maxT_JMA - 1);
 
-		double Z_DL_to_Z_JMA_scale = 1.0 / Z_JMA_to_Z_DL_factor;
+			double wx_jma_start_ZJMA = (double)tx_JMA * JMA_TILE_WORLD_SIZE;
+			double wy_jma_start_ZJMA = (double)ty_JMA * JMA_TILE_WORLD_SIZE;
 
-		double wx0_JMA = wx0 * Z_DL_to_Z_JMA_scale;
-		double wy0_JMA = wy0 * Z_DL_to_Z_JMA_scale;
-		double wx1_JMA = wx1 * Z_DL_to_Z_JMA_scale;
-		double wy1_JMA = wy1 * Z_DL_to_Z_JMA_scale;
+			double wx_jma_start = wx_jma_start_ZJMA * Z_JMA_to_Z_DL_factor;
+			double wy_jma_start = wy_jma_start_ZJMA * Z_JMA_to_Z_DL_factor;
 
-		int tx0_JMA = (int)std::floor(wx0_JMA / JMA_TILE_WORLD_SIZE - 0.001) - 1;
-		int ty0_JMA = (int)std::floor(wy0_JMA / JMA_TILE_WORLD_SIZE - 0.001) - 1;
-		int tx1_JMA = (int)std::floor(wx1_JMA / JMA_TILE_WORLD_SIZE + 0.001) + 1;
-		int ty1_JMA = (int)std::floor(wy1_JMA / JMA_TILE_WORLD_SIZE + 0.001) + 1;
+			float sx = (float)((wx_jma_start - v.originWX) * current_scale);
+			float sy = (float)((wy_jma_start - v.originWY) * current_scale);
 
-		for (int ty_JMA = ty0_JMA; ty_JMA <= ty1_JMA; ++ty_JMA) {
-			for (int tx_JMA = tx0_JMA; tx_JMA <= tx1_JMA; ++tx_JMA) {
-				int nx = (tx_JMA % maxT_JMA + maxT_JMA) % maxT_JMA;
-				int ny = std::clamp(ty_JMA, 0, maxT_JMA - 1);
+			float draw_size = (float)(tileWorldSize_zDL_final * current_scale);
 
-				double wx_jma_start_ZJMA = (double)tx_JMA * JMA_TILE_WORLD_SIZE;
-				double wy_jma_start_ZJMA = (double)ty_JMA * JMA_TILE_WORLD_SIZE;
+			D2D1_RECT_F dst = D2D1::RectF(sx, sy, sx + draw_size, sy + draw_size);
 
-				double wx_jma_start = wx_jma_start_ZJMA * Z_JMA_to_Z_DL_factor;
-				double wy_jma_start = wy_jma_start_ZJMA * Z_JMA_to_Z_DL_factor;
+			if (dst.right > 0 && dst.left < v.w && dst.bottom > 0 && dst.top < v.h) fn(nx, ny, dst);
+		}
+	}
+}
 
-				float sx = (float)((wx_jma_start - g.originWX) * current_scale);
-				float sy = (float)((wy_jma_start - g.originWY) * current_scale);
+// 外挿フレームは JMA のパスではなく "extrap/<元の観測>/<validtime>/z/x/y" (通信せず計算で作る。降水のみ)
+static std::wstring JmaTilePath(const NowcTime& T, int z, int x, int y, TileLayer layer = kTileRain)
+{
+	wchar_t buf[512];
+	if (IsExtrapolated(T)) swprintf_s(buf, L"%s/%s/%d/%d/%d", T.basetime.c_str(), T.validtime.c_str(), z, x, y);
+	else swprintf_s(buf, kTileLayers[layer].tileFmt, T.basetime.c_str(), T.validtime.c_str(), z, x, y);
+	return buf;
+}
 
-				float draw_size = (float)(tileWorldSize_zDL_final * current_scale);
+// 層が持つタイルのズーム (zJMA < 0 ならビューのズームに応じた JmaZoomFor)
+static int JmaLayerZoom(const MapView& v, TileLayer layer, int zJMA = -1) {
+	if (zJMA < 0) zJMA = JmaZoomFor(v.zoom);
+	return std::clamp(zJMA, kTileLayers[layer].minZoom, kTileLayers[layer].maxZoom);
+}
 
-				D2D1_RECT_F dst = D2D1::RectF(sx, sy, sx + draw_size, sy + draw_size);
+// JMAナウキャストのタイル列挙
+// zJMA < 0 ならビューのズームに応じた JMA ズーム (JmaZoomFor) を使う
+static void ForEachJmaTile(const MapView& v, const NowcTime& T, const TileRectFn& fn, int zJMA = -1, TileLayer layer = kTileRain) {
+	zJMA = JmaLayerZoom(v, layer, zJMA);
+	ForEachJmaTileXY(v, zJMA, [&](int x, int y, const D2D1_RECT_F& dst) { fn(JmaTilePath(T, zJMA, x, y, layer), dst); });
+}
 
-				if (dst.right > 0 && dst.left < g.clientW && dst.bottom > 0 && dst.top < g.clientH) {
-					wchar_t buf[512];
-					swprintf_s(buf, K_JMA_TILE_FMT, T.basetime.c_str(), T.validtime.c_str(), zJMA, nx, ny);
-					std::wstring path = buf;
+// 取得・デコードを待っているタイル数 (失敗して空のままのタイルは数えない)
+static int CountPendingGsiTiles(const MapView& v, TileLayer style) {
+	int pending = 0;
+	std::lock_guard<std::mutex> lk(gCacheMtx);
+	ForEachGsiTile(v, style, [&](const std::wstring& path, const D2D1_RECT_F&) {
+		auto it = gCache.find(path);
+		if (it == gCache.end() || (!it->second.bmp && !it->second.decoded && it->second.bytes.empty() && it->second.fails == 0)) ++pending;
+		});
+	return pending;
+}
 
-					ID2D1Bitmap* bmp = nullptr;
-					if (GetOrFetchBitmap(path, &bmp, true) && bmp) {
-						g.rt->DrawBitmap(bmp, dst, alpha, D2D1_BITMAP_INTERPOLATION_MODE_LINEAR);
-					}
-				}
-			}
-		}
-		};
+// 描画できなかった (未取得の) タイル数を返す
+static int DrawGsiLayer(ID2D1RenderTarget* rt, const MapView& v, const TileBitmapFn& getBmp, TileLayer style = gGsiStyle) {
+	int missing = 0;
+	ForEachGsiTile(v, style, [&](const std::wstring& path, const D2D1_RECT_F& dst) {
+		if (ID2D1Bitmap* bmp = getBmp(path, style))
+			rt->DrawBitmap(bmp, dst, kTileLayers[style].alpha, D2D1_BITMAP_INTERPOLATION_MODE_LINEAR);
+		else
+			++missing;
+		});
+	return missing;
+}
 
-	// 1. GSI Base Mapを描画
-	drawGsiTiles();
+// 層 layer で timeIndex の時刻に描く時刻。降水はそのまま、雷・竜巻は一覧の elements にその層がある
+// 直近の時刻 (表示中の時刻以前) を使う。予報の一覧にない場合は観測の一覧 (gObsTimes) から探す
+static bool JmaLayerTime(int timeIndex, TileLayer layer, NowcTime& out)
+{
+	const NowcTime& T = gTimes[timeIndex];
+	if (layer == kTileRain || T.layers == 0) { out = T; return !IsExtrapolated(T) || layer == kTileRain; }
+	const uint32_t bit = 1u << layer;
+	for (size_t i = timeIndex; i < gTimes.size(); ++i)
+		if (gTimes[i].layers & bit) { out = gTimes[i]; return true; }
+	for (const NowcTime& o : gObsTimes)
+		if (o.validtime <= T.validtime && (o.layers & bit)) { out = o; return true; }
+	return false;
+}
 
-	// 2. JMA Overlayを描画
-	if (gAnimPlaying) {
-		float t = std::chrono::duration<float>(std::chrono::steady_clock::now() - gAnimStart).count() / kAnimDurationSec;
-		gAnimT = (float)Clamp(t, 0.0, 1.0);
-		drawJmaOverlay(gAnimFrom, (1.0f - gAnimT) * kOverlayAlpha);
-		drawJmaOverlay(gAnimTo, gAnimT * kOverlayAlpha);
-		if (t >= 1.0f) { gAnimPlaying = false; gTimeIndex = gAnimTo; UpdateTitle(); }
-		InvalidateRect(g.hwnd, nullptr, FALSE);
-	}
-	else {
-		drawJmaOverlay(gTimeIndex, kOverlayAlpha);
+// 描画できなかった (未取得の) タイル数を返す
+static int DrawJmaLayer(ID2D1RenderTarget* rt, const MapView& v, const TileBitmapFn& getBmp, int timeIndex, float alpha, int zJMA = -1, TileLayer layer = kTileRain) {
+	if (gTimes.empty() || timeIndex < 0 || timeIndex >= gTimes.size()) return 0;
+	NowcTime T;
+	if (!JmaLayerTime(timeIndex, layer, T)) return 0;
+	int missing = 0;
+	ForEachJmaTile(v, T, [&](const std::wstring& path, const D2D1_RECT_F& dst) {
+		if (ID2D1Bitmap* bmp = getBmp(path, layer))
+			rt->DrawBitmap(bmp, dst, alpha, D2D1_BITMAP_INTERPOLATION_MODE_LINEAR);
+		else
+			++missing;
+		}, zJMA, layer);
+	return missing;
+}
+
+// 降水の上に重ねる層 (雷・竜巻)。時刻の送りはクロスフェードせず timeIndex の時刻だけを描く
+static void DrawExtraJmaLayers(ID2D1RenderTarget* rt, const MapView& v, const TileBitmapFn& getBmp, int timeIndex) {
+	for (int l = kTileRain + 1; l < kTileLayerCount; ++l)
+		if (gTileLayerOn[l] && kTileLayers[l].tileFmt) DrawJmaLayer(rt, v, getBmp, timeIndex, kTileLayers[l].alpha, -1, (TileLayer)l);
+}
+
+// -------------------- Intensity Query (JMA) --------------------
+// キャッシュ済み JMA タイルのパレット面から、指定地点の降水強度の階級を引く (通信はしない)
+struct IntensitySample {
+	int cls{};			// 0 = 降水なし, 1..8 = kJmaScale の階級
+	float lo{}, hi{};	// mm/h
+	int z{ -1 };		// 値を取ったタイルのズーム
+};
+
+// zMax から粗いズームへ順に探し、最初に見つかったキャッシュを使う。
+// ビューアがキャッシュするのは JmaZoomFor の返す z4/6/8/10 だけなので、それ以外は引かない
+static bool QueryIntensity(double lon, double lat, int timeIndex, IntensitySample& out, int zMax = MAX_JMA_ZOOM)
+{
+	if (timeIndex < 0 || timeIndex >= (int)gTimes.size()) return false;
+	const NowcTime& T = gTimes[timeIndex];
+	for (int z = MAX_JMA_ZOOM; z >= MIN_JMA_ZOOM; z -= 2) {
+		if (z > zMax) continue;
+		double wx = LonLatToWorldX(lon, z), wy = LonLatToWorldY(lat, z);
+		int tx = (int)std::floor(wx / TILE_SIZE), ty = (int)std::floor(wy / TILE_SIZE);
+		if (tx < 0 || ty < 0 || tx >= (1 << z) || ty >= (1 << z)) return false;
+		int px = std::clamp((int)(wx - tx * TILE_SIZE), 0, TILE_SIZE - 1);
+		int py = std::clamp((int)(wy - ty * TILE_SIZE), 0, TILE_SIZE - 1);
+		std::lock_guard<std::mutex> lk(gCacheMtx);
+		auto it = gCache.find(JmaTilePath(T, z, tx, ty));
+		if (it == gCache.end() || it->second.classes.empty()) continue;
+		out.cls = it->second.classes[(size_t)py * TILE_SIZE + px];
+		if (out.cls >= kJmaClassCount) out.cls = 0;
+		out.lo = kJmaScale[out.cls].lo;
+		out.hi = kJmaScale[out.cls].hi;
+		out.z = z;
+		return true;
 	}
+	return false;
+}
 
+static std::wstring FormatIntensity(const IntensitySample& s)
+{
+	std::wstringstream ss;
+	if (s.cls == 0) ss << L"降水なし";
+	else if (s.cls == kJmaClassCount - 1) ss << s.lo << L" mm/h 以上";
+	else ss << s.lo << L"〜" << s.hi << L" mm/h";
+	return ss.str();
+}
 
-	// 3. 情報表示オーバーレイ
-	if (!gTimes.empty()) {
-		ID2D1SolidColorBrush* bgBrush = nullptr;
-		g.rt->CreateSolidColorBrush(D2D1::ColorF(D2D1::ColorF::White, 0.7f), &bgBrush);
+// カーソル位置の強度 (WM_MOUSEMOVE で更新し、変わったときだけ再描画する)
+struct CursorIntensity {
+	bool inside{};
+	int sx{}, sy{};
+	bool valid{};
+	IntensitySample sample;
+	double queryUs{};
+};
+static CursorIntensity gCursor;
 
-		ID2D1SolidColorBrush* textBrush = nullptr;
-		g.rt->CreateSolidColorBrush(D2D1::ColorF(D2D1::ColorF::Black), &textBrush);
+static void ScreenToLonLat(int sx, int sy, double& lon, double& lat)
+{
+	int zi = (int)std::floor(g.zoom);
+	double sc = std::pow(2.0, g.zoom - zi);
+	lon = WorldXToLon(g.originWX + sx / sc, zi);
+	lat = WorldYToLat(g.originWY + sy / sc, zi);
+}
 
+// 戻り値: 表示内容が変わったら true
+static bool UpdateCursorIntensity()
+{
+	if (!gCursor.inside) return false;
+	double lon, lat;
+	ScreenToLonLat(gCursor.sx, gCursor.sy, lon, lat);
+	auto t0 = std::chrono::steady_clock::now();
+	IntensitySample s;
+	bool valid = QueryIntensity(lon, lat, gTimeIndex, s, JmaZoomFor(g.zoom));
+	gCursor.queryUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+	bool changed = valid != gCursor.valid || s.cls != gCursor.sample.cls;
+	gCursor.valid = valid;
+	gCursor.sample = s;
+	return changed;
+}
 
-		IDWriteFactory* writeFactory = nullptr;
-		IDWriteTextFormat* textFormat = nullptr;
+// -------------------- Point Time Series --------------------
+// 多数の地点 × 全時刻の強度を一括で引く。地点はタイル/画素座標へ一度だけ変換してタイルごとにまとめ、
+// (時刻, タイル) ごとに 1 回だけ取得・階級化して、そのタイルに入る地点の値をまとめて拾う。
+static const BYTE kNoSample = 0xFF;		// タイルが取れなかった/範囲外
 
-		HRESULT hr = DWriteCreateFactory(DWRITE_FACTORY_TYPE_SHARED, __uuidof(IDWriteFactory),
-			reinterpret_cast<IUnknown**>(&writeFactory));
+// 階級の代表値 (mm/h)。階級の中央、最上位は下限と表示上限の中央
+static inline float JmaClassMmh(int c)
+{
+	if (c <= 0 || c >= kJmaClassCount) return 0.0f;
+	return (kJmaScale[c].lo + kJmaScale[c].hi) * 0.5f;
+}
 
-		if (SUCCEEDED(hr) && writeFactory) {
-			hr = writeFactory->CreateTextFormat(L"Arial", nullptr, DWRITE_FONT_WEIGHT_NORMAL, DWRITE_FONT_STYLE_NORMAL,
-				DWRITE_FONT_STRETCH_NORMAL, 24.0f, L"ja-jp", &textFormat);
-		}
+// JMA タイルのパレット面 (差分層 → アーカイブの PNG → ディスクキャッシュ/HTTP の順)
+static bool LoadTileClasses(const std::wstring& path, BYTE* plane)
+{
+	if (IsSyntheticTilePath(path)) return gSyntheticTileClasses && gSyntheticTileClasses(path, plane);
+	ArchiveKey k;
+	if (gDeltaReader && ArchiveKeyFromPath(path, k) && k.layer == kLayerJmaHrpns) {
+		k.layer = kLayerJmaDelta;
+		if (gDeltaReader->Read(k, plane)) return true;
+	}
+	if (IWICBitmap* bmp = DecodeArchiveTile(path)) {
+		bool ok = ClassifyWicBitmap(bmp, plane);
+		bmp->Release();
+		return ok;
+	}
+	std::vector<BYTE> buf;
+	return FetchTileBytes(path, kTileRain, buf) && DecodeJmaClasses(ThreadWic(), buf.data(), buf.size(), plane);
+}
 
-		if (bgBrush && textBrush && textFormat) {
-			std::wstringstream ss;
-			ss << (gUseForecast ? L"予測 (N2)" : L"観測 (N1)") << L"\n";
+struct GeoPoint { double lon, lat; };
 
-			if (gTimeIndex >= 0 && gTimeIndex < gTimes.size()) {
-				const auto& t = gTimes[gTimeIndex].validtime;
+class PointSeriesQuery {
+public:
+	struct Stats {
+		size_t tiles{}, tileLoads{}, failedLoads{};
+		double mapSec{}, fetchSec{};
+	};
 
-				int year = std::stoi(t.substr(0, 4));
-				int month = std::stoi(t.substr(4, 2));
-				int day = std::stoi(t.substr(6, 2));
-				int hour = std::stoi(t.substr(8, 2));
-				int minute = std::stoi(t.substr(10, 2));
+	// 地点をズーム z のタイル/画素へ変換し、タイル順に並べる
+	PointSeriesQuery(const std::vector<GeoPoint>& pts, int z) : count(pts.size()), zoom(z) {
+		auto t0 = std::chrono::steady_clock::now();
+		const int n = 1 << z;
+		std::vector<std::pair<uint64_t, uint32_t>> keyed;
+		keyed.reserve(pts.size());
+		pixel.assign(pts.size(), 0);
+		for (uint32_t i = 0; i < (uint32_t)pts.size(); ++i) {
+			double wx = LonLatToWorldX(pts[i].lon, z), wy = LonLatToWorldY(pts[i].lat, z);
+			int tx = (int)std::floor(wx / TILE_SIZE), ty = (int)std::floor(wy / TILE_SIZE);
+			if (tx < 0 || ty < 0 || tx >= n || ty >= n) continue;
+			int px = std::clamp((int)(wx - tx * TILE_SIZE), 0, TILE_SIZE - 1);
+			int py = std::clamp((int)(wy - ty * TILE_SIZE), 0, TILE_SIZE - 1);
+			pixel[i] = (uint16_t)(py * TILE_SIZE + px);
+			keyed.emplace_back(((uint64_t)ty << 32) | (uint32_t)tx, i);
+		}
+		std::sort(keyed.begin(), keyed.end());
+		order.reserve(keyed.size());
+		for (size_t i = 0; i < keyed.size(); ++i) {
+			if (i == 0 || keyed[i].first != keyed[i - 1].first)
+				groups.push_back({ (int)(keyed[i].first & 0xFFFFFFFF), (int)(keyed[i].first >> 32), i, i });
+			groups.back().end = i + 1;
+			order.push_back(keyed[i].second);
+		}
+		stats.tiles = groups.size();
+		stats.mapSec = SecondsSince(t0);
+	}
 
-				hour += 9;
+	// out[frame * 点数 + 点] = 階級 (取れなければ kNoSample)。frames は gTimes の添字
+	void Run(const std::vector<NowcTime>& times, const std::vector<int>& frames, size_t threads, std::vector<BYTE>& out) {
+		auto t0 = std::chrono::steady_clock::now();
+		out.assign(frames.size() * count, kNoSample);
+		std::atomic<size_t> loads{ 0 }, failed{ 0 };
+		ParallelFor(frames.size() * groups.size(), threads, [&](size_t job) {
+			size_t f = job / groups.size();
+			const Group& gr = groups[job % groups.size()];
+			thread_local std::vector<BYTE> plane;
+			plane.resize(kTilePixels);
+			++loads;
+			if (!LoadTileClasses(JmaTilePath(times[frames[f]], zoom, gr.tx, gr.ty), plane.data())) { ++failed; return; }
+			BYTE* row = out.data() + f * count;
+			for (size_t i = gr.begin; i < gr.end; ++i) {
+				uint32_t p = order[i];
+				row[p] = plane[pixel[p]];
+			}
+			});
+		stats.tileLoads = loads;
+		stats.failedLoads = failed;
+		stats.fetchSec = SecondsSince(t0);
+	}
 
-				if (hour >= 24) {
-					hour -= 24;
-					day += 1;
+	const Stats& statistics() const { return stats; }
+	size_t pointCount() const { return count; }
+	size_t mappedCount() const { return order.size(); }
 
-					// 簡易的な日付繰り上げ処理
-					if (day > 31) { /* 処理省略 */ }
-				}
+private:
+	struct Group {
+		int tx, ty;
+		size_t begin, end;		// order[begin, end) がこのタイルの地点
+	};
+	size_t count;
+	int zoom;
+	std::vector<uint16_t> pixel;	// 地点ごとのタイル内画素 (py * 256 + px)
+	std::vector<uint32_t> order;	// タイル順に並べた地点番号
+	std::vector<Group> groups;
+	Stats stats;
+};
 
-				std::wstringstream time_ss;
-				time_ss << std::setw(2) << std::setfill(L'0') << month << L"/"
-					<< std::setw(2) << std::setfill(L'0') << day << L" "
-					<< std::setw(2) << std::setfill(L'0') << hour << L":"
-					<< std::setw(2) << std::setfill(L'0') << minute;
+// -------------------- Area Statistics --------------------
+// 多角形 (経緯度) を JMA タイルの画素格子へ塗りつぶし、タイルごとのマスクにしてから
+// 各時刻のパレット面と突き合わせて階級ごとの面積・最大・平均・閾値以上の面積を求める。
+// 同じタイルにかかる多角形はまとめて処理し、(時刻, タイル) ごとにタイルを 1 回だけ読む。
+struct GeoPolygon {
+	std::string name;
+	std::vector<std::vector<GeoPoint>> rings;	// 偶奇規則 (内側の輪は穴)
+};
 
-				ss << L"表示時刻: " << time_ss.str() << L" JST";
+struct TileMask {
+	int tx, ty;
+	std::vector<BYTE> mask;		// 0xFF = 内側
+	uint16_t rowMin, rowMax;	// 内側の画素がある行の範囲
+};
+
+// 画素中心が多角形の内側にあるものを塗る
+static std::vector<TileMask> RasterizePolygon(const GeoPolygon& poly, int z)
+{
+	std::vector<std::pair<double, double>> pts;
+	std::vector<std::pair<size_t, size_t>> rings;
+	double minY = 1e300, maxY = -1e300;
+	for (const auto& r : poly.rings) {
+		if (r.size() < 3) continue;
+		rings.emplace_back(pts.size(), pts.size() + r.size());
+		for (const auto& p : r) {
+			double y = LonLatToWorldY(p.lat, z);
+			pts.emplace_back(LonLatToWorldX(p.lon, z), y);
+			minY = std::min(minY, y); maxY = std::max(maxY, y);
+		}
+	}
+	std::vector<TileMask> out;
+	if (rings.empty()) return out;
+	std::unordered_map<uint64_t, size_t> index;
+	const int worldPx = TILE_SIZE << z;
+	std::vector<double> xs;
+	int y0 = std::max(0, (int)std::floor(minY)), y1 = std::min(worldPx - 1, (int)std::ceil(maxY));
+	for (int y = y0; y <= y1; ++y) {
+		double yc = y + 0.5;
+		xs.clear();
+		for (auto& r : rings) {
+			for (size_t i = r.first; i < r.second; ++i) {
+				const auto& a = pts[i];
+				const auto& b = pts[i + 1 < r.second ? i + 1 : r.first];
+				if ((a.second <= yc) == (b.second <= yc)) continue;
+				xs.push_back(a.first + (yc - a.second) * (b.first - a.first) / (b.second - a.second));
 			}
-			else {
-				ss << L"表示時刻: データなし";
+		}
+		std::sort(xs.begin(), xs.end());
+		for (size_t k = 0; k + 1 < xs.size(); k += 2) {
+			int xa = std::max(0, (int)std::ceil(xs[k] - 0.5)), xb = std::min(worldPx - 1, (int)std::floor(xs[k + 1] - 0.5));
+			while (xa <= xb) {
+				int tx = xa / TILE_SIZE, ty = y / TILE_SIZE;
+				int end = std::min(xb, tx * TILE_SIZE + TILE_SIZE - 1);
+				uint64_t id = ((uint64_t)ty << 32) | (uint32_t)tx;
+				auto it = index.find(id);
+				if (it == index.end()) {
+					it = index.emplace(id, out.size()).first;
+					out.push_back({ tx, ty, std::vector<BYTE>(kTilePixels, 0), (uint16_t)(TILE_SIZE - 1), 0 });
+				}
+				TileMask& m = out[it->second];
+				int py = y - ty * TILE_SIZE;
+				memset(m.mask.data() + (size_t)py * TILE_SIZE + (xa - tx * TILE_SIZE), 0xFF, end - xa + 1);
+				m.rowMin = std::min<uint16_t>(m.rowMin, (uint16_t)py);
+				m.rowMax = std::max<uint16_t>(m.rowMax, (uint16_t)py);
+				xa = end + 1;
 			}
+		}
+	}
+	return out;
+}
 
-			std::wstring text = ss.str();
+// 画素 1 つの面積 (km^2)。Web メルカトルなので緯度で変わる
+static double PixelAreaKm2(int z, double worldY)
+{
+	const double kEarthKm = 40075.016686;
+	double lat = WorldYToLat(worldY, z) * M_PI / 180.0;
+	double side = kEarthKm * std::cos(lat) / (TILE_SIZE << z);
+	return side * side;
+}
 
-			IDWriteTextLayout* textLayout = nullptr;
-			hr = writeFactory->CreateTextLayout(text.c_str(), (UINT32)text.length(), textFormat, (float)g.clientW - 20.0f, (float)g.clientH - 20.0f, &textLayout);
+struct AreaStats {
+	double classKm2[kJmaClassCount]{};	// 階級ごとの面積 (データのあった部分)
+	double maskKm2{};					// 多角形全体の面積
+	int maxClass{};
+	size_t tiles{}, missingTiles{};
 
-			if (SUCCEEDED(hr) && textLayout) {
-				DWRITE_TEXT_METRICS metrics;
-				textLayout->GetMetrics(&metrics);
+	double dataKm2() const { double s = 0; for (double v : classKm2) s += v; return s; }
+	double MeanMmh() const {
+		double a = dataKm2(), s = 0;
+		for (int c = 1; c < kJmaClassCount; ++c) s += classKm2[c] * JmaClassMmh(c);
+		return a > 0 ? s / a : 0.0;
+	}
+	// 階級の下限が threshold 以上の面積
+	double AboveKm2(float threshold) const {
+		double s = 0;
+		for (int c = 1; c < kJmaClassCount; ++c) if (kJmaScale[c].lo >= threshold) s += classKm2[c];
+		return s;
+	}
+	void Merge(const AreaStats& o) {
+		for (int c = 0; c < kJmaClassCount; ++c) classKm2[c] += o.classKm2[c];
+		maskKm2 += o.maskKm2;
+		maxClass = std::max(maxClass, o.maxClass);
+		tiles += o.tiles; missingTiles += o.missingTiles;
+	}
+};
 
-				float padding = 10.0f;
-				D2D1_RECT_F bgRect = D2D1::RectF(
-					10.0f, 10.0f,
-					10.0f + metrics.width + padding * 2.0f,
-					10.0f + metrics.height + padding * 2.0f
-				);
+// マスク内の階級ヒストグラムと最大値 (SSE2)。外側の画素は 0xFF にしてどの階級とも一致させない
+static void AccumulateMaskedTile(const BYTE* plane, const TileMask& m, const double* rowKm2, AreaStats& st)
+{
+	__m128i vmax = _mm_setzero_si128();
+	__m128i cls[kJmaClassCount];
+	for (int c = 0; c < kJmaClassCount; ++c) cls[c] = _mm_set1_epi8((char)c);
+	for (int y = m.rowMin; y <= m.rowMax; ++y) {
+		const BYTE* p = plane + (size_t)y * TILE_SIZE;
+		const BYTE* k = m.mask.data() + (size_t)y * TILE_SIZE;
+		int counts[kJmaClassCount] = {};
+		for (int x = 0; x < TILE_SIZE; x += 16) {
+			__m128i mk = _mm_loadu_si128((const __m128i*)(k + x));
+			__m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(p + x)), mk);
+			vmax = _mm_max_epu8(vmax, v);
+			v = _mm_or_si128(v, _mm_xor_si128(mk, _mm_set1_epi8((char)0xFF)));
+			for (int c = 0; c < kJmaClassCount; ++c)
+				counts[c] += std::popcount((unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, cls[c])));
+		}
+		for (int c = 0; c < kJmaClassCount; ++c) st.classKm2[c] += counts[c] * rowKm2[y];
+	}
+	alignas(16) BYTE mx[16];
+	_mm_store_si128((__m128i*)mx, vmax);
+	for (BYTE b : mx) if (b < kJmaClassCount) st.maxClass = std::max(st.maxClass, (int)b);
+}
 
-				D2D1_ROUNDED_RECT roundedRect = D2D1::RoundedRect(bgRect, 8.0f, 8.0f);
+// タイルのパレット面を得る関数 (false ならそのタイルは欠測)
+using TileClassesFn = std::function<bool(const std::wstring& path, BYTE* plane)>;
 
-				g.rt->FillRoundedRectangle(&roundedRect, bgBrush);
+class RegionStatsEngine {
+public:
+	explicit RegionStatsEngine(int z) : zoom(z) {}
 
-				D2D1_RECT_F textRect = D2D1::RectF(
-					10.0f + padding,
-					10.0f + padding,
-					bgRect.right,
-					bgRect.bottom
-				);
-				g.rt->DrawTextLayout(D2D1::Point2F(textRect.left, textRect.top), textLayout, textBrush);
+	void Add(const GeoPolygon& poly) {
+		size_t id = polyCount++;
+		for (auto& m : RasterizePolygon(poly, zoom)) {
+			uint64_t key = ((uint64_t)m.ty << 32) | (uint32_t)m.tx;
+			auto it = tileIndex.find(key);
+			if (it == tileIndex.end()) {
+				it = tileIndex.emplace(key, tiles.size()).first;
+				tiles.push_back({ m.tx, m.ty, {}, {} });
+				// 行ごとの画素面積はタイルで共通
+				auto& rows = tiles.back().rowKm2;
+				rows.resize(TILE_SIZE);
+				for (int y = 0; y < TILE_SIZE; ++y) rows[y] = PixelAreaKm2(zoom, (double)m.ty * TILE_SIZE + y + 0.5);
+			}
+			Tile& t = tiles[it->second];
+			double km2 = 0;
+			for (int y = m.rowMin; y <= m.rowMax; ++y)
+				km2 += std::count(m.mask.begin() + (size_t)y * TILE_SIZE, m.mask.begin() + (size_t)(y + 1) * TILE_SIZE, (BYTE)0xFF) * t.rowKm2[y];
+			t.masks.push_back({ id, std::move(m), km2 });
+		}
+	}
 
-				SAFE_RELEASE(textLayout);
+	size_t polygonCount() const { return polyCount; }
+	size_t tileCount() const { return tiles.size(); }
+
+	// out[frame][polygon]。frames は gTimes の添字
+	void Run(const std::vector<NowcTime>& times, const std::vector<int>& frames, size_t threads, const TileClassesFn& load,
+		std::vector<std::vector<AreaStats>>& out) const {
+		const size_t jobs = frames.size() * tiles.size();
+		// (時刻, タイル) ごとの部分結果を後でまとめる
+		std::vector<std::vector<AreaStats>> partial(jobs);
+		ParallelFor(jobs, threads, [&](size_t job) {
+			size_t f = job / tiles.size();
+			const Tile& t = tiles[job % tiles.size()];
+			thread_local std::vector<BYTE> plane;
+			plane.resize(kTilePixels);
+			bool ok = load(JmaTilePath(times[frames[f]], zoom, t.tx, t.ty), plane.data());
+			auto& res = partial[job];
+			res.resize(t.masks.size());
+			for (size_t i = 0; i < t.masks.size(); ++i) {
+				res[i].maskKm2 = t.masks[i].km2;
+				res[i].tiles = 1;
+				if (ok) AccumulateMaskedTile(plane.data(), t.masks[i].mask, t.rowKm2.data(), res[i]);
+				else res[i].missingTiles = 1;
 			}
+			});
+		out.assign(frames.size(), std::vector<AreaStats>(polyCount));
+		for (size_t job = 0; job < jobs; ++job) {
+			const Tile& t = tiles[job % tiles.size()];
+			for (size_t i = 0; i < t.masks.size(); ++i) out[job / tiles.size()][t.masks[i].poly].Merge(partial[job][i]);
 		}
+	}
 
-		SAFE_RELEASE(textFormat);
-		SAFE_RELEASE(writeFactory);
-		SAFE_RELEASE(textBrush);
-		SAFE_RELEASE(bgBrush);
+private:
+	struct PolyMask {
+		size_t poly;
+		TileMask mask;
+		double km2;
+	};
+	struct Tile {
+		int tx, ty;
+		std::vector<PolyMask> masks;
+		std::vector<double> rowKm2;
+	};
+	int zoom;
+	size_t polyCount{};
+	std::vector<Tile> tiles;
+	std::unordered_map<uint64_t, size_t> tileIndex;
+};
+
+// 表示範囲の統計 (キャッシュ済みのパレット面だけを使う)。時刻とビューが変わらなければ前回の結果を返す
+static bool ViewportStats(AreaStats& out)
+{
+	struct Memo {
+		int timeIndex{ -1 }, w{}, h{};
+		double zoom{}, ox{}, oy{};
+		bool complete{};
+		AreaStats st;
+	};
+	static Memo memo;
+	if (gTimeIndex < 0 || gTimeIndex >= (int)gTimes.size()) return false;
+	if (memo.complete && memo.timeIndex == gTimeIndex && memo.zoom == g.zoom && memo.ox == g.originWX && memo.oy == g.originWY &&
+		memo.w == g.clientW && memo.h == g.clientH) {
+		out = memo.st;
+		return true;
 	}
+	GeoPolygon rect;
+	double lon0, lat0, lon1, lat1;
+	ScreenToLonLat(0, 0, lon0, lat0);
+	ScreenToLonLat(g.clientW, g.clientH, lon1, lat1);
+	rect.rings.push_back({ { lon0, lat0 }, { lon1, lat0 }, { lon1, lat1 }, { lon0, lat1 } });
+	RegionStatsEngine eng(JmaZoomFor(g.zoom));
+	eng.Add(rect);
+	std::vector<std::vector<AreaStats>> res;
+	eng.Run(gTimes, { gTimeIndex }, 1, [](const std::wstring& path, BYTE* plane) {
+		std::lock_guard<std::mutex> lk(gCacheMtx);
+		auto it = gCache.find(path);
+		if (it == gCache.end() || it->second.classes.empty()) return false;
+		memcpy(plane, it->second.classes.data(), kTilePixels);
+		return true;
+		}, res);
+	memo = { gTimeIndex, g.clientW, g.clientH, g.zoom, g.originWX, g.originWY, false, res[0][0] };
+	memo.complete = memo.st.missingTiles == 0;
+	out = memo.st;
+	return true;
+}
 
-	g.rt->EndDraw();
+// -------------------- Accumulation Layer --------------------
+// 観測 5 分間隔の強度を窓 (1 時間 = 12 フレーム、3 時間 = 36 フレーム) で積算した雨量。
+// タイルごとに積算値を持ち、時刻が進んだら新しいフレームを足して窓から外れたフレームを引く。
+// 窓内のフレームは引くときのために RLE 圧縮したパレット面で覚えておく。
+// 積算値は「階級の代表値 (mm/h) x 2」の整数和 (uint16)。雨量 mm = 和 / 24
+static const int kAccumMaxZoom = 8;			// これより細かいズームでは z8 の積算を拡大して描く
+static const size_t kAccumTileLimit = 96;	// ビューア用に保持する積算タイルの上限
+static const double kAccumUnitsPerMm = 24.0;
+static int gAccumFrames = 0;				// 0 = 積算表示なし
+static bool gAccumShort = false;			// 観測が窓の長さに足りず積算を出していない
+
+static const uint16_t* AccumUnitsLut()
+{
+	static const auto lut = []() {
+		std::vector<uint16_t> t(256, 0);
+		for (int c = 1; c < kJmaClassCount; ++c) t[c] = (uint16_t)std::lround(JmaClassMmh(c) * 2.0f);
+		return t;
+		}();
+	return lut.data();
 }
 
-// -------------------- Win32 --------------------
+// 積算雨量の色 (下限 mm、1 時間/3 時間で別の段階)
+struct AccumColor { BYTE r, g, b; };
+static const AccumColor kAccumColors[] = {
+	{ 200, 240, 200 }, { 120, 210, 120 }, {  40, 160,  70 }, { 250, 230,  60 },
+	{ 250, 150,  30 }, { 240,  60,  30 }, { 190,  20, 120 }, { 110,  20, 140 },
+};
+static const float kAccumSteps1h[] = { 1, 5, 10, 20, 30, 50, 80, 100 };
+static const float kAccumSteps3h[] = { 1, 10, 20, 40, 60, 80, 100, 150 };
+
+// 積算値ごとの色 (値は 200 x 36 = 7200 まで)。1 時間用と 3 時間用を一度だけ作る
+static const size_t kAccumLutSize = 200 * 36 + 1;
+static const uint32_t* AccumColorLut(int frames)
+{
+	auto build = [](const float* steps) {
+		std::vector<uint32_t> lut(kAccumLutSize, 0);
+		for (size_t u = 0; u < lut.size(); ++u) {
+			double mm = u / kAccumUnitsPerMm;
+			for (int k = 7; k >= 0; --k)
+				if (mm >= steps[k]) { lut[u] = 0xFF000000u | (kAccumColors[k].r << 16) | (kAccumColors[k].g << 8) | kAccumColors[k].b; break; }
+		}
+		return lut;
+		};
+	static const std::vector<uint32_t> lut1h = build(kAccumSteps1h), lut3h = build(kAccumSteps3h);
+	return frames > 12 ? lut3h.data() : lut1h.data();
+}
+
+static void AccumToBgra(const uint16_t* acc, int frames, uint32_t* bgra)
+{
+	const uint32_t* lut = AccumColorLut(frames);
+	for (int i = 0; i < kTilePixels; ++i) bgra[i] = lut[std::min<size_t>(acc[i], kAccumLutSize - 1)];
+}
+
+struct AccumUpdateStats {
+	size_t added{}, removed{}, missing{}, rebuilds{};
+	double loadSec{}, applySec{};
+	void Merge(const AccumUpdateStats& o) {
+		added += o.added; removed += o.removed; missing += o.missing; rebuilds += o.rebuilds;
+		loadSec += o.loadSec; applySec += o.applySec;
+	}
+};
+
+// 1 タイル位置の積算状態
+class TileAccumulator {
+public:
+	// window: 窓に入るフレームの validtime。load(validtime, plane) でパレット面を得る
+	void Slide(const std::vector<std::wstring>& window, const std::function<bool(const std::wstring&, BYTE*)>& load, AccumUpdateStats& st) {
+		if (acc.empty()) acc.assign(kTilePixels, 0);
+		std::vector<std::wstring> toAdd, toRemove;
+		for (auto& t : window) if (!frames.count(t)) toAdd.push_back(t);
+		for (auto& kv : frames) if (std::find(window.begin(), window.end(), kv.first) == window.end()) toRemove.push_back(kv.first);
+		// 入れ替えが窓より多ければ作り直す
+		if (toAdd.size() + toRemove.size() > window.size()) {
+			std::fill(acc.begin(), acc.end(), (uint16_t)0);
+			frames.clear();
+			toAdd = window; toRemove.clear();
+			++st.rebuilds;
+		}
+		plane.resize(kTilePixels);
+		for (auto& t : toRemove) {
+			auto t0 = std::chrono::steady_clock::now();
+			const auto& rle = frames[t];
+			if (RleApply(rle.data(), rle.size(), plane.data(), kTilePixels, false)) Apply(plane.data(), false);
+			frames.erase(t);
+			st.applySec += SecondsSince(t0);
+			++st.removed;
+		}
+		for (auto& t : toAdd) {
+			auto t0 = std::chrono::steady_clock::now();
+			bool ok = load(t, plane.data());
+			auto t1 = std::chrono::steady_clock::now();
+			st.loadSec += std::chrono::duration<double>(t1 - t0).count();
+			if (!ok) { ++st.missing; continue; }	// 次の更新で再び試す
+			Apply(plane.data(), true);
+			RleEncode(plane.data(), kTilePixels, frames[t]);
+			st.applySec += SecondsSince(t1);
+			++st.added;
+		}
+		complete = frames.size() == window.size();
+	}
+
+	const uint16_t* units() const { return acc.data(); }
+	bool isComplete() const { return complete; }
+	uint64_t tick{};
+
+private:
+	// 16 画素ずつ見て、降水なしのブロックは飛ばす
+	void Apply(const BYTE* p, bool add) {
+		const uint16_t* lut = AccumUnitsLut();
+		const __m128i zero = _mm_setzero_si128();
+		for (int i = 0; i < kTilePixels; i += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) == 0xFFFF) continue;
+			if (add) for (int k = 0; k < 16; ++k) acc[i + k] += lut[p[i + k]];
+			else for (int k = 0; k < 16; ++k) acc[i + k] -= lut[p[i + k]];
+		}
+	}
+
+	std::vector<uint16_t> acc;
+	std::vector<BYTE> plane;
+	std::unordered_map<std::wstring, std::vector<BYTE>> frames;	// 窓内の validtime → RLE 圧縮したパレット面
+	bool complete{};
+};
+
+// 積算タイルのキャッシュキー (gCache に JMA タイルと並べて置く)
+static std::wstring AccumTileKey(int frames, const std::wstring& validtime, int z, int x, int y)
+{
+	wchar_t buf[128];
+	swprintf_s(buf, L"accum/%d/%s/%d/%d/%d", frames, validtime.c_str(), z, x, y);
+	return buf;
+}
+
+// times[timeIndex] の時刻までの最新の観測から古い方へ frames 個の観測 (一覧は新しい順)。
+// 予報・外挿フレームは積算に入れない。times に観測がなければ (予測表示中) gObsTimes から取る。
+// 観測が frames 個そろわなければ false (短い窓を 1 時間/3 時間の積算として出さない)
+static bool AccumWindow(const std::vector<NowcTime>& times, int timeIndex, int frames, std::vector<NowcTime>& w)
+{
+	w.clear();
+	if (timeIndex < 0 || timeIndex >= (int)times.size()) return false;
+	const std::wstring until = times[timeIndex].validtime;
+	auto collect = [&](const std::vector<NowcTime>& src) {
+		for (auto& t : src)
+			if ((int)w.size() < frames && IsObservation(t) && t.validtime <= until) w.push_back(t);
+		};
+	collect(times);
+	if (w.empty()) collect(gObsTimes);
+	return (int)w.size() == frames;
+}
+
+// ビューア用。表示中のタイルの積算をバックグラウンドで更新し、色付けしたビットマップを gCache に入れる
+class AccumulationLayer {
+public:
+	~AccumulationLayer() { Stop(); }
+	void Start() {
+		stop = false;
+		th = std::thread([this]() { Loop(); });
+	}
+	void Stop() {
+		{
+			std::lock_guard<std::mutex> lk(mtx);
+			stop = true;
+		}
+		cv.notify_all();
+		if (th.joinable()) th.join();
+	}
+	// window は AccumWindow でそろえた観測 (長さ = 積算フレーム数)
+	void Request(const MapView& v, const std::vector<NowcTime>& window) {
+		const int frames = (int)window.size();
+		std::lock_guard<std::mutex> lk(mtx);
+		if (frames == hFrames && !hWindow.empty() && window.front().validtime == hWindow.front().validtime && v.w == hView.w && v.h == hView.h &&
+			v.zoom == hView.zoom && v.originWX == hView.originWX && v.originWY == hView.originWY && !retry) return;
+		hView = v; hFrames = frames; hWindow = window; retry = false;
+		++gen;
+		cv.notify_all();
+	}
+
+private:
+	void Loop() {
+		uint64_t seen = 0;
+		for (;;) {
+			MapView v; int frames;
+			std::vector<NowcTime> window;
+			{
+				std::unique_lock<std::mutex> lk(mtx);
+				cv.wait(lk, [&]() { return stop || gen != seen; });
+				if (stop) return;
+				seen = gen; v = hView; frames = hFrames; window = hWindow;
+			}
+			const int z = std::min(JmaZoomFor(v.zoom), kAccumMaxZoom);
+			std::vector<std::wstring> times;
+			std::unordered_map<std::wstring, const NowcTime*> byValid;
+			for (auto& t : window) { times.push_back(t.validtime); byValid[t.validtime] = &t; }
+			bool incomplete = false;
+			ForEachJmaTileXY(v, z, [&](int x, int y, const D2D1_RECT_F&) {
+				if (stop || gen != seen) return;
+				std::wstring key = AccumTileKey(frames, window.front().validtime, z, x, y);
+				{
+					std::lock_guard<std::mutex> lk(gCacheMtx);
+					if (gCache.count(key)) return;
+				}
+				TileAccumulator& a = Tile(frames, z, x, y);
+				AccumUpdateStats st;
+				a.Slide(times, [&](const std::wstring& t, BYTE* plane) {
+					return LoadTileClasses(JmaTilePath(*byValid[t], z, x, y), plane);
+					}, st);
+				if (!a.isComplete()) { incomplete = true; return; }	// 欠けた積算は表示しない
+				std::vector<uint32_t> bgra(kTilePixels);
+				AccumToBgra(a.units(), frames, bgra.data());
+				IWICBitmap* bmp = nullptr;
+				if (FAILED(ThreadWic()->CreateBitmapFromMemory(TILE_SIZE, TILE_SIZE, GUID_WICPixelFormat32bppPBGRA, TILE_SIZE * 4,
+					(UINT)(bgra.size() * 4), (BYTE*)bgra.data(), &bmp))) return;
+				{
+					std::lock_guard<std::mutex> lk(gCacheMtx);
+					auto r = gCache.emplace(key, Img());
+					if (r.second) { r.first->second.decoded = bmp; r.first->second.lastUsed = std::chrono::steady_clock::now(); }
+					else SAFE_RELEASE(bmp);
+				}
+				if (g.hwnd) PostMessage(g.hwnd, WM_TILE_READY, 0, 0);
+				});
+			// 取得できなかったフレームは次の Request で取り直す
+			if (incomplete) { std::lock_guard<std::mutex> lk(mtx); retry = true; }
+		}
+	}
+
+	// 積算状態 (窓の長さとタイル位置ごと)。上限を超えたら最も古く使ったものを捨てる
+	TileAccumulator& Tile(int frames, int z, int x, int y) {
+		uint64_t id = ((uint64_t)frames << 56) | ((uint64_t)z << 48) | ((uint64_t)y << 24) | (uint32_t)x;
+		if (tiles.size() >= kAccumTileLimit && !tiles.count(id)) {
+			auto oldest = std::min_element(tiles.begin(), tiles.end(), [](auto& a, auto& b) { return a.second.tick < b.second.tick; });
+			tiles.erase(oldest);
+		}
+		TileAccumulator& a = tiles[id];
+		a.tick = ++tick;
+		return a;
+	}
+
+	std::thread th;
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::atomic<bool> stop{ false };
+	std::atomic<uint64_t> gen{ 0 };
+	bool retry{};
+	MapView hView{};
+	int hFrames{};
+	std::vector<NowcTime> hWindow;
+	std::unordered_map<uint64_t, TileAccumulator> tiles;	// ワーカースレッドのみが触る
+	uint64_t tick{};
+};
+static AccumulationLayer gAccumLayer;
+
+// 描画できなかった (未計算の) タイル数を返す。観測が窓の長さだけそろわなければ何も描かず -1
+static int DrawAccumLayer(ID2D1RenderTarget* rt, const MapView& v, int timeIndex, int frames, float alpha)
+{
+	std::vector<NowcTime> window;
+	if (!AccumWindow(gTimes, timeIndex, frames, window)) return -1;
+	const int z = std::min(JmaZoomFor(v.zoom), kAccumMaxZoom);
+	int missing = 0;
+	ForEachJmaTileXY(v, z, [&](int x, int y, const D2D1_RECT_F& dst) {
+		if (ID2D1Bitmap* bmp = PeekCachedBitmap(AccumTileKey(frames, window.front().validtime, z, x, y)))
+			rt->DrawBitmap(bmp, dst, alpha, D2D1_BITMAP_INTERPOLATION_MODE_LINEAR);
+		else
+			++missing;
+		});
+	gAccumLayer.Request(v, window);
+	return missing;
+}
+
+// -------------------- Contours --------------------
+// 降水強度の等値線。パレット面を「閾値の階級以上」で 2 値化し、マーチングスクエアで境界を引く。
+// 線分はタイルごとに並列に作り、モザイク全体で端点をつないで閉じた輪にする (タイル境界をまたいでつながる)
+static const float kContourLevels[] = { 10.0f, 30.0f, 50.0f };
+
+// 閾値 (mm/h) を下限とする階級。階級の境界にない値は上の階級に丸める
+static int ContourClassFor(float mmh)
+{
+	for (int c = 1; c < kJmaClassCount; ++c) if (kJmaScale[c].lo >= mmh) return c;
+	return kJmaClassCount;
+}
+
+// 描画・出力用の輪。座標はズーム z のワールド座標 (画素中心を結ぶ。先頭点は繰り返さない)。
+// 内側 (閾値以上) が進行方向の左 (画面座標で反時計回り) になる向き
+struct ContourRing {
+	float level;
+	std::vector<D2D1_POINT_2F> pts;
+};
+
+// モザイク: z の tx0..tx0+nx-1, ty0..ty0+ny-1 のパレット面。取得できなかったタイルは空 (降水なし扱い)
+struct ClassMosaic {
+	int z{}, tx0{}, ty0{}, nx{}, ny{};
+	std::vector<std::vector<BYTE>> planes;		// 行優先 (j * nx + i)
+};
+
+static size_t LoadClassMosaic(const NowcTime& T, int z, int tx0, int ty0, int tx1, int ty1, size_t threads, ClassMosaic& m)
+{
+	m.z = z; m.tx0 = tx0; m.ty0 = ty0; m.nx = tx1 - tx0 + 1; m.ny = ty1 - ty0 + 1;
+	m.planes.assign((size_t)m.nx * m.ny, {});
+	std::atomic<size_t> failed{ 0 };
+	ParallelFor(m.planes.size(), threads, [&](size_t k) {
+		std::vector<BYTE> p(kTilePixels);
+		if (LoadTileClasses(JmaTilePath(T, z, tx0 + (int)(k % m.nx), ty0 + (int)(k / m.nx)), p.data())) m.planes[k] = std::move(p);
+		else ++failed;
+		});
+	return failed;
+}
+
+struct ContourStats {
+	size_t segments{}, rings{}, rawPoints{}, points{};
+	double classifySec{}, marchSec{}, joinSec{}, simplifySec{};
+};
+
+// 2 値化 (SSE2)。戻り値: 0 = すべて外側, 1 = すべて内側, 2 = 混在
+enum : BYTE { kMaskEmpty = 0, kMaskFull = 1, kMaskMixed = 2 };
+static BYTE ThresholdPlane(const BYTE* plane, int cls, BYTE* mask)
+{
+	const __m128i t = _mm_set1_epi8((char)(cls - 1)), one = _mm_set1_epi8(1);
+	__m128i any = _mm_setzero_si128(), all = _mm_set1_epi8(-1);
+	for (int i = 0; i < kTilePixels; i += 16) {
+		__m128i in = _mm_cmpgt_epi8(_mm_loadu_si128((const __m128i*)(plane + i)), t);
+		any = _mm_or_si128(any, in);
+		all = _mm_and_si128(all, in);
+		_mm_storeu_si128((__m128i*)(mask + i), _mm_and_si128(in, one));
+	}
+	if (_mm_movemask_epi8(any) == 0) return kMaskEmpty;
+	return _mm_movemask_epi8(all) == 0xFFFF ? kMaskFull : kMaskMixed;
+}
+
+// 線分の端点はセルの辺の中点。モザイク画素座標 (-1 から) を 2 倍して +2 したものを 64bit に詰める
+static inline uint64_t ContourKey(int X, int Y) { return ((uint64_t)(uint32_t)Y << 32) | (uint32_t)X; }
+
+// 1 タイル分のセルを処理する。セルの左上画素がこのタイルにあるものを受け持ち、
+// モザイクの左端・上端のタイルは外側 (-1) の列・行も受け持つ
+static void MarchTile(const ClassMosaic& m, const std::vector<std::vector<BYTE>>& masks, const std::vector<BYTE>& state,
+	int ti, int tj, std::vector<std::pair<uint64_t, uint64_t>>& segs)
+{
+	// 辺の中点 (セル左上を原点に 2 倍した座標): 上, 右, 下, 左
+	static const int kEdge[4][2] = { { 1, 0 }, { 2, 1 }, { 1, 2 }, { 0, 1 } };
+	enum { T, R, B, L, N = -1 };
+	// 角のビット: 左上 8, 右上 4, 右下 2, 左下 1。鞍点 (5, 10) は角を分けて扱う
+	static const int kCase[16][4] = {
+		{ N, N, N, N }, { B, L, N, N }, { R, B, N, N }, { R, L, N, N },
+		{ T, R, N, N }, { T, R, B, L }, { T, B, N, N }, { T, L, N, N },
+		{ L, T, N, N }, { B, T, N, N }, { L, T, R, B }, { R, T, N, N },
+		{ L, R, N, N }, { B, R, N, N }, { L, B, N, N }, { N, N, N, N },
+	};
+	auto at = [&](int i, int j) -> BYTE {
+		return i < 0 || j < 0 || i >= m.nx || j >= m.ny ? (BYTE)kMaskEmpty : state[(size_t)j * m.nx + i];
+		};
+	const BYTE own = at(ti, tj);
+	const bool edge = ti == 0 || tj == 0;
+	if (own != kMaskMixed && !(own == kMaskFull && edge) && at(ti + 1, tj) == own && at(ti, tj + 1) == own && at(ti + 1, tj + 1) == own) return;
+
+	// 258 x 258 の局所格子 (モザイク画素 x0-1 .. x0+256)
+	const int G = TILE_SIZE + 2;
+	const int x0 = ti * TILE_SIZE, y0 = tj * TILE_SIZE;
+	std::vector<BYTE> grid((size_t)G * G);
+	auto pixel = [&](int gx, int gy) -> BYTE {
+		if (gx < 0 || gy < 0) return 0;
+		int i = gx / TILE_SIZE, j = gy / TILE_SIZE;
+		BYTE s = at(i, j);
+		if (s != kMaskMixed) return s;
+		return masks[(size_t)j * m.nx + i][(size_t)(gy % TILE_SIZE) * TILE_SIZE + gx % TILE_SIZE];
+		};
+	for (int ly = 0; ly < G; ++ly) {
+		BYTE* row = &grid[(size_t)ly * G];
+		const int gy = y0 - 1 + ly;
+		if (ly >= 1 && ly <= TILE_SIZE && own != kMaskMixed) memset(row + 1, own, TILE_SIZE);
+		else if (ly >= 1 && ly <= TILE_SIZE) memcpy(row + 1, &masks[(size_t)tj * m.nx + ti][(size_t)(ly - 1) * TILE_SIZE], TILE_SIZE);
+		else for (int lx = 1; lx <= TILE_SIZE; ++lx) row[lx] = pixel(x0 - 1 + lx, gy);
+		row[0] = pixel(x0 - 1, gy);
+		row[G - 1] = pixel(x0 + TILE_SIZE, gy);
+	}
+
+	const int lx0 = ti == 0 ? 0 : 1, ly0 = tj == 0 ? 0 : 1;
+	for (int ly = ly0; ly <= TILE_SIZE; ++ly) {
+		const BYTE* r0 = &grid[(size_t)ly * G];
+		const BYTE* r1 = r0 + G;
+		// 上下の行が同じで一様な区間は飛ばす
+		if (memcmp(r0, r1, G) == 0 && memchr(r0, 1 - r0[0], G) == nullptr) continue;
+		const int cy = 2 * (y0 - 1 + ly) + 2;
+		for (int lx = lx0; lx <= TILE_SIZE; ++lx) {
+			const int c = (r0[lx] << 3) | (r0[lx + 1] << 2) | (r1[lx + 1] << 1) | r1[lx];
+			if (c == 0 || c == 15) continue;
+			const int cx = 2 * (x0 - 1 + lx) + 2;
+			const int* e = kCase[c];
+			for (int k = 0; k < 4 && e[k] != N; k += 2)
+				segs.emplace_back(ContourKey(cx + kEdge[e[k]][0], cy + kEdge[e[k]][1]), ContourKey(cx + kEdge[e[k + 1]][0], cy + kEdge[e[k + 1]][1]));
+		}
+	}
+}
+
+// Douglas-Peucker (閉じた輪)。先頭と、そこから最も遠い点で 2 本に分けて単純化する
+static void SimplifyRing(std::vector<D2D1_POINT_2F>& pts, double tol)
+{
+	const size_t n = pts.size();
+	if (n < 4 || tol <= 0) return;
+	size_t far = 0;
+	double best = -1;
+	for (size_t i = 1; i < n; ++i) {
+		double dx = pts[i].x - pts[0].x, dy = pts[i].y - pts[0].y, d = dx * dx + dy * dy;
+		if (d > best) { best = d; far = i; }
+	}
+	std::vector<char> keep(n, 0);
+	keep[0] = keep[far] = 1;
+	std::vector<std::pair<size_t, size_t>> stack = { { 0, far }, { far, n } };	// n は先頭 (0) を指す
+	while (!stack.empty()) {
+		auto [a, b] = stack.back();
+		stack.pop_back();
+		const D2D1_POINT_2F pa = pts[a], pb = pts[b % n];
+		const double vx = pb.x - pa.x, vy = pb.y - pa.y, len = std::sqrt(vx * vx + vy * vy);
+		size_t idx = 0;
+		double dmax = tol;
+		for (size_t i = a + 1; i < b; ++i) {
+			double wx = pts[i].x - pa.x, wy = pts[i].y - pa.y;
+			double d = len > 0 ? std::fabs(vx * wy - vy * wx) / len : std::sqrt(wx * wx + wy * wy);
+			if (d > dmax) { dmax = d; idx = i; }
+		}
+		if (idx) { keep[idx] = 1; stack.push_back({ a, idx }); stack.push_back({ idx, b }); }
+	}
+	size_t w = 0;
+	for (size_t i = 0; i < n; ++i) if (keep[i]) pts[w++] = pts[i];
+	pts.resize(w);
+}
+
+// levels (mm/h) ごとの輪を out に追加する。tolPx はズーム z の画素単位の単純化の許容幅 (0 で単純化しない)
+static void ExtractContours(const ClassMosaic& m, const std::vector<float>& levels, double tolPx, size_t threads,
+	std::vector<ContourRing>& out, ContourStats& st)
+{
+	const size_t tiles = m.planes.size();
+	const double ox = (double)m.tx0 * TILE_SIZE - 0.5, oy = (double)m.ty0 * TILE_SIZE - 0.5;	// キー → ワールド座標
+	for (float level : levels) {
+		const int cls = ContourClassFor(level);
+		if (cls >= kJmaClassCount) continue;
+
+		auto t0 = std::chrono::steady_clock::now();
+		std::vector<std::vector<BYTE>> masks(tiles);
+		std::vector<BYTE> state(tiles, kMaskEmpty);
+		ParallelFor(tiles, threads, [&](size_t k) {
+			if (m.planes[k].empty()) return;
+			masks[k].resize(kTilePixels);
+			state[k] = ThresholdPlane(m.planes[k].data(), cls, masks[k].data());
+			});
+		st.classifySec += SecondsSince(t0);
+
+		t0 = std::chrono::steady_clock::now();
+		std::vector<std::vector<std::pair<uint64_t, uint64_t>>> segs(tiles);
+		ParallelFor(tiles, threads, [&](size_t k) { MarchTile(m, masks, state, (int)(k % m.nx), (int)(k / m.nx), segs[k]); });
+		st.marchSec += SecondsSince(t0);
+
+		// 端点をつなぐ。どの点も入る線分と出る線分が 1 本ずつなので、たどれば必ず輪になる
+		t0 = std::chrono::steady_clock::now();
+		size_t total = 0;
+		for (auto& s : segs) total += s.size();
+		std::unordered_map<uint64_t, uint64_t> next;
+		next.reserve(total);
+		for (auto& s : segs) for (auto& e : s) next.emplace(e.first, e.second);
+		const size_t first = out.size();
+		while (!next.empty()) {
+			const uint64_t start = next.begin()->first;
+			ContourRing r{ level, {} };
+			for (uint64_t cur = start;;) {
+				r.pts.push_back(D2D1::Point2F((float)(ox + (uint32_t)cur * 0.5), (float)(oy + (cur >> 32) * 0.5)));
+				auto it = next.find(cur);
+				if (it == next.end()) break;
+				cur = it->second;
+				next.erase(it);
+				if (cur == start) break;
+			}
+			st.rawPoints += r.pts.size();
+			out.push_back(std::move(r));
+		}
+		st.segments += total;
+		st.joinSec += SecondsSince(t0);
+
+		t0 = std::chrono::steady_clock::now();
+		ParallelFor(out.size() - first, threads, [&](size_t i) { SimplifyRing(out[first + i].pts, tolPx); });
+		out.erase(std::remove_if(out.begin() + first, out.end(), [](const ContourRing& r) { return r.pts.size() < 3; }), out.end());
+		st.simplifySec += SecondsSince(t0);
+	}
+	st.rings = out.size();
+	st.points = 0;
+	for (auto& r : out) st.points += r.pts.size();
+}
+
+// ビューア用。表示範囲の等値線をバックグラウンドで作り、描画はワールド座標のジオメトリを変換して行う
+static bool gShowContours = false;	// 'C' で切り替え
+
+class ContourLayer {
+public:
+	~ContourLayer() { Stop(); }
+	void Start() {
+		stop = false;
+		th = std::thread([this]() { Loop(); });
+	}
+	void Stop() {
+		{
+			std::lock_guard<std::mutex> lk(mtx);
+			stop = true;
+		}
+		cv.notify_all();
+		if (th.joinable()) th.join();
+		ReleaseGeometry();
+	}
+
+	void Draw(ID2D1RenderTarget* rt, const MapView& v, int timeIndex) {
+		if (timeIndex < 0 || timeIndex >= (int)gTimes.size()) return;
+		Key k = KeyFor(v, gTimes[timeIndex]);
+		std::shared_ptr<const Result> r;
+		{
+			std::lock_guard<std::mutex> lk(mtx);
+			if (!(k == want)) {
+				want = k; wantTime = gTimes[timeIndex];
+				wantTol = 0.75 * std::pow(2.0, k.z - v.zoom);	// 画面上で 0.75 px
+				cv.notify_all();
+			}
+			r = done;
+		}
+		// 作り終わっていなければ前の結果 (同じ時刻・ズームのもの) を出しておく
+		if (!r || r->key.validtime != k.validtime || r->key.z != k.z) return;
+		if (r != drawn) {
+			ReleaseGeometry();
+			drawn = r;
+			for (float level : kContourLevels) geoms.push_back(BuildGeometry(*r, level));
+		}
+
+		int zDL = std::clamp((int)std::floor(v.zoom), MIN_MAP_ZOOM, MAX_MAP_ZOOM);
+		double sc = std::pow(2.0, v.zoom - zDL);
+		float s = (float)(std::pow(2.0, zDL - k.z) * sc);
+		D2D1_MATRIX_3X2_F old;
+		rt->GetTransform(&old);
+		rt->SetTransform(D2D1::Matrix3x2F::Scale(s, s) * D2D1::Matrix3x2F::Translation((float)(-v.originWX * sc), (float)(-v.originWY * sc)));
+		for (size_t i = 0; i < geoms.size(); ++i) {
+			if (!geoms[i]) continue;
+			const JmaClass& c = kJmaScale[ContourClassFor(kContourLevels[i])];
+			ID2D1SolidColorBrush* br = nullptr;
+			rt->CreateSolidColorBrush(D2D1::ColorF(c.r / 255.0f, c.g / 255.0f, c.b / 255.0f), &br);
+			if (br) rt->DrawGeometry(geoms[i], br, 1.5f / s);
+			SAFE_RELEASE(br);
+		}
+		rt->SetTransform(old);
+	}
+
+private:
+	struct Key {
+		std::wstring validtime;
+		int z{ -1 }, tx0{}, ty0{}, tx1{ -1 }, ty1{ -1 };
+		bool operator==(const Key& o) const { return validtime == o.validtime && z == o.z && tx0 == o.tx0 && ty0 == o.ty0 && tx1 == o.tx1 && ty1 == o.ty1; }
+	};
+	struct Result {
+		Key key;
+		std::vector<ContourRing> rings;
+	};
+
+	static Key KeyFor(const MapView& v, const NowcTime& T) {
+		Key k{ T.validtime, JmaZoomFor(v.zoom), INT_MAX, INT_MAX, INT_MIN, INT_MIN };
+		ForEachJmaTileXY(v, k.z, [&](int x, int y, const D2D1_RECT_F&) {
+			k.tx0 = std::min(k.tx0, x); k.ty0 = std::min(k.ty0, y);
+			k.tx1 = std::max(k.tx1, x); k.ty1 = std::max(k.ty1, y);
+			});
+		return k;
+	}
+
+	void Loop() {
+		Key last;
+		for (;;) {
+			Key k; NowcTime T; double tol;
+			{
+				std::unique_lock<std::mutex> lk(mtx);
+				cv.wait(lk, [&]() { return stop || !(want == last); });
+				if (stop) return;
+				k = want; T = wantTime; tol = wantTol;
+			}
+			last = k;
+			if (k.tx1 < k.tx0) continue;
+			ClassMosaic m;
+			LoadClassMosaic(T, k.z, k.tx0, k.ty0, k.tx1, k.ty1, WORKER_THREADS, m);
+			auto r = std::make_shared<Result>();
+			r->key = k;
+			ContourStats st;
+			ExtractContours(m, std::vector<float>(std::begin(kContourLevels), std::end(kContourLevels)), tol, WORKER_THREADS, r->rings, st);
+			{
+				std::lock_guard<std::mutex> lk(mtx);
+				done = r;
+			}
+			if (g.hwnd) PostMessage(g.hwnd, WM_TILE_READY, 0, 0);
+		}
+	}
+
+	static ID2D1PathGeometry* BuildGeometry(const Result& r, float level) {
+		ID2D1PathGeometry* geo = nullptr;
+		ID2D1GeometrySink* sink = nullptr;
+		if (!g.factory || FAILED(g.factory->CreatePathGeometry(&geo))) return nullptr;
+		if (FAILED(geo->Open(&sink))) { SAFE_RELEASE(geo); return nullptr; }
+		for (auto& ring : r.rings) {
+			if (ring.level != level) continue;
+			sink->BeginFigure(ring.pts[0], D2D1_FIGURE_BEGIN_HOLLOW);
+			sink->AddLines(ring.pts.data() + 1, (UINT32)ring.pts.size() - 1);
+			sink->EndFigure(D2D1_FIGURE_END_CLOSED);
+		}
+		sink->Close();
+		SAFE_RELEASE(sink);
+		return geo;
+	}
+
+	void ReleaseGeometry() {
+		for (auto& p : geoms) SAFE_RELEASE(p);
+		geoms.clear();
+		drawn.reset();
+	}
+
+	std::thread th;
+	std::mutex mtx;
+	std::condition_variable cv;
+	bool stop{};
+	Key want;
+	NowcTime wantTime;
+	double wantTol{};
+	std::shared_ptr<const Result> done;
+	// 以下はメインスレッドのみ
+	std::shared_ptr<const Result> drawn;
+	std::vector<ID2D1PathGeometry*> geoms;		// kContourLevels の順
+};
+static ContourLayer gContourLayer;
+
+// GeoJSON (FeatureCollection)。輪ごとに LineString (閉じる) を出し、properties に閾値を入れる
+static bool WriteContoursGeoJson(const std::wstring& file, const std::vector<ContourRing>& rings, int z)
+{
+	FILE* f = nullptr;
+	if (_wfopen_s(&f, file.c_str(), L"wb") != 0 || !f) return false;
+	fputs("{\"type\":\"FeatureCollection\",\"features\":[", f);
+	for (size_t i = 0; i < rings.size(); ++i) {
+		const ContourRing& r = rings[i];
+		fprintf(f, "%s\n{\"type\":\"Feature\",\"properties\":{\"mmh\":%g},\"geometry\":{\"type\":\"LineString\",\"coordinates\":[", i ? "," : "", r.level);
+		for (size_t k = 0; k <= r.pts.size(); ++k) {
+			const D2D1_POINT_2F& p = r.pts[k % r.pts.size()];
+			fprintf(f, "%s[%.5f,%.5f]", k ? "," : "", WorldXToLon(p.x, z), WorldYToLat(p.y, z));
+		}
+		fputs("]}}", f);
+	}
+	fputs("\n]}\n", f);
+	return fclose(f) == 0;
+}
+
+// -------------------- Storm Cells --------------------
+// 強い雨域 (既定 20 mm/h 以上) を 8 近傍の連結成分として切り出し、連続するフレームの間で対応付けて移動を追う。
+// ラベル付けはタイルごとに並列に行い (union-find)、タイル境界をまたぐ成分は境界の画素を見てまとめる
+static const float kStormThresholdMmh = 20.0f;
+static const double kStormMinKm2 = 10.0;		// これより小さい成分はセルとしない
+static const double kStormMaxSpeedKmh = 120.0;	// 対応付けの上限
+static const int kStormZoom = 6;				// ビューアで追跡に使うズーム (日本全域)
+static const size_t kStormHistory = 48;			// 保持するフレーム数 (4 時間)
+
+struct StormCell {
+	double lon{}, lat{};		// 重心
+	double areaKm2{};
+	float meanMmh{}, maxMmh{};
+	int track{ -1 };
+	double vxKmh{}, vyKmh{};	// 東向き・北向き (対応が付いたときのみ)
+};
+
+struct StormFrame {
+	std::wstring validtime;
+	std::vector<StormCell> cells;
+};
+
+struct StormLabelStats {
+	size_t labelledTiles{}, components{}, cells{};
+	double labelSec{}, mergeSec{};
+};
+
+// union-find (経路半分化、小さい番号を根にする)
+template <class T>
+static T UfFind(std::vector<T>& p, T x)
+{
+	while (p[x] != x) { p[x] = p[p[x]]; x = p[x]; }
+	return x;
+}
+template <class T>
+static void UfUnion(std::vector<T>& p, T a, T b)
+{
+	a = UfFind(p, a); b = UfFind(p, b);
+	if (a == b) return;
+	if (a < b) p[b] = a; else p[a] = b;
+}
+
+// 1 タイル分のラベル (0 = 外側, 1..n) と成分ごとの集計
+struct TileLabels {
+	struct Comp { double px, sx, sy, km2, mmhKm2; float maxMmh; };
+	std::vector<uint16_t> label;
+	std::vector<Comp> comps;	// [label - 1]
+};
+
+// 2 パスのラベル付け (8 近傍)。256x256 では成分は 16384 個以下なので 16bit に収まる
+static void LabelTile(const BYTE* plane, const BYTE* mask, int z, int tileX, int tileY, TileLabels& out)
+{
+	out.label.assign(kTilePixels, 0);
+	std::vector<uint16_t> parent(1, 0);
+	for (int y = 0; y < TILE_SIZE; ++y) {
+		const BYTE* mrow = mask + y * TILE_SIZE;
+		uint16_t* lrow = &out.label[(size_t)y * TILE_SIZE];
+		const uint16_t* prev = y ? lrow - TILE_SIZE : nullptr;
+		for (int x = 0; x < TILE_SIZE; ++x) {
+			if (!mrow[x]) continue;
+			uint16_t n[4] = { x ? lrow[x - 1] : (uint16_t)0, prev && x ? prev[x - 1] : (uint16_t)0,
+				prev ? prev[x] : (uint16_t)0, prev && x + 1 < TILE_SIZE ? prev[x + 1] : (uint16_t)0 };
+			uint16_t l = 0;
+			for (uint16_t v : n) if (v && (!l || v < l)) l = v;
+			if (!l) {
+				l = (uint16_t)parent.size();
+				parent.push_back(l);
+			}
+			else for (uint16_t v : n) if (v && v != l) UfUnion<uint16_t>(parent, l, v);
+			lrow[x] = l;
+		}
+	}
+	// 根ごとに詰め直した番号を振る
+	std::vector<uint16_t> compact(parent.size(), 0);
+	out.comps.clear();
+	for (size_t i = 1; i < parent.size(); ++i) {
+		uint16_t r = UfFind<uint16_t>(parent, (uint16_t)i);
+		if (r == i) { out.comps.push_back({}); compact[i] = (uint16_t)out.comps.size(); }
+	}
+	for (int y = 0; y < TILE_SIZE; ++y) {
+		const double wy = (double)tileY * TILE_SIZE + y + 0.5;
+		const double km2 = PixelAreaKm2(z, wy);
+		uint16_t* lrow = &out.label[(size_t)y * TILE_SIZE];
+		for (int x = 0; x < TILE_SIZE; ++x) {
+			if (!lrow[x]) continue;
+			lrow[x] = compact[UfFind<uint16_t>(parent, lrow[x])];
+			TileLabels::Comp& c = out.comps[lrow[x] - 1];
+			const float mmh = JmaClassMmh(plane[y * TILE_SIZE + x]);
+			c.px += 1; c.sx += (double)tileX * TILE_SIZE + x + 0.5; c.sy += wy;
+			c.km2 += km2; c.mmhKm2 += mmh * km2;
+			c.maxMmh = std::max(c.maxMmh, mmh);
+		}
+	}
+}
+
+// モザイク全体の強雨セル (面積 minKm2 以上)
+static void LabelStormCells(const ClassMosaic& m, float thresholdMmh, double minKm2, size_t threads,
+	std::vector<StormCell>& cells, StormLabelStats& st)
+{
+	const int cls = ContourClassFor(thresholdMmh);
+	const size_t tiles = m.planes.size();
+	auto t0 = std::chrono::steady_clock::now();
+	std::vector<TileLabels> labels(tiles);
+	ParallelFor(tiles, threads, [&](size_t k) {
+		if (m.planes[k].empty() || cls >= kJmaClassCount) return;
+		std::vector<BYTE> mask(kTilePixels);
+		if (ThresholdPlane(m.planes[k].data(), cls, mask.data()) == kMaskEmpty) return;
+		LabelTile(m.planes[k].data(), mask.data(), m.z, m.tx0 + (int)(k % m.nx), m.ty0 + (int)(k / m.nx), labels[k]);
+		});
+	st.labelSec += SecondsSince(t0);
+
+	// タイルをまたぐ成分をまとめる (右・下・右下・左下の隣と、接する画素どうしを結ぶ)
+	t0 = std::chrono::steady_clock::now();
+	std::vector<uint32_t> offset(tiles + 1, 0);
+	for (size_t k = 0; k < tiles; ++k) {
+		offset[k + 1] = offset[k] + (uint32_t)labels[k].comps.size();
+		if (!labels[k].comps.empty()) ++st.labelledTiles;
+	}
+	std::vector<uint32_t> parent(offset[tiles]);
+	for (uint32_t i = 0; i < parent.size(); ++i) parent[i] = i;
+	auto lab = [&](int i, int j, int x, int y) -> uint32_t {
+		if (i < 0 || j < 0 || i >= m.nx || j >= m.ny) return 0;
+		const TileLabels& t = labels[(size_t)j * m.nx + i];
+		if (t.label.empty() || x < 0 || y < 0 || x >= TILE_SIZE || y >= TILE_SIZE) return 0;
+		uint16_t l = t.label[(size_t)y * TILE_SIZE + x];
+		return l ? offset[(size_t)j * m.nx + i] + l : 0;	// 1 始まり (0 = なし)
+		};
+	auto join = [&](uint32_t a, uint32_t b) { if (a && b) UfUnion<uint32_t>(parent, a - 1, b - 1); };
+	const int E = TILE_SIZE - 1;
+	for (int j = 0; j < m.ny; ++j)
+		for (int i = 0; i < m.nx; ++i) {
+			if (labels[(size_t)j * m.nx + i].label.empty()) continue;
+			for (int s = 0; s < TILE_SIZE; ++s) {
+				uint32_t r = lab(i, j, E, s), b = lab(i, j, s, E);
+				for (int d = -1; d <= 1; ++d) {
+					join(r, lab(i + 1, j, 0, s + d));
+					join(b, lab(i, j + 1, s + d, 0));
+				}
+			}
+			join(lab(i, j, E, E), lab(i + 1, j + 1, 0, 0));
+			join(lab(i, j, 0, E), lab(i - 1, j + 1, E, 0));
+		}
+
+	std::vector<TileLabels::Comp> agg(parent.size());
+	for (size_t k = 0; k < tiles; ++k)
+		for (size_t c = 0; c < labels[k].comps.size(); ++c) {
+			TileLabels::Comp& a = agg[UfFind<uint32_t>(parent, offset[k] + (uint32_t)c)];
+			const TileLabels::Comp& s = labels[k].comps[c];
+			a.px += s.px; a.sx += s.sx; a.sy += s.sy; a.km2 += s.km2; a.mmhKm2 += s.mmhKm2;
+			a.maxMmh = std::max(a.maxMmh, s.maxMmh);
+		}
+	for (uint32_t i = 0; i < agg.size(); ++i) {
+		if (UfFind<uint32_t>(parent, i) != i) continue;
+		++st.components;
+		const TileLabels::Comp& a = agg[i];
+		if (a.km2 < minKm2) continue;
+		StormCell c;
+		c.lon = WorldXToLon(a.sx / a.px, m.z);
+		c.lat = WorldYToLat(a.sy / a.px, m.z);
+		c.areaKm2 = a.km2;
+		c.meanMmh = (float)(a.mmhKm2 / a.km2);
+		c.maxMmh = a.maxMmh;
+		cells.push_back(c);
+	}
+	st.cells += cells.size();
+	st.mergeSec += SecondsSince(t0);
+}
+
+// 2 点間のおおよその距離 (km、東向き・北向きの成分)
+static void GeoOffsetKm(double lon0, double lat0, double lon1, double lat1, double& dx, double& dy)
+{
+	dx = (lon1 - lon0) * 111.32 * std::cos((lat0 + lat1) * 0.5 * M_PI / 180.0);
+	dy = (lat1 - lat0) * 110.57;
+}
+
+// フレームを古い順に受け取り、前のフレームのセルと対応付けて追跡番号と速度を付ける。
+// 予測位置 (前回の速度で進めた位置) に近い順に貪欲に 1 対 1 で結ぶ
+class StormTracker {
+public:
+	bool Has(const std::wstring& validtime) const {
+		for (auto& f : hist) if (f.validtime == validtime) return true;
+		return false;
+	}
+	const std::wstring& lastTime() const { static const std::wstring none; return hist.empty() ? none : hist.back().validtime; }
+	const std::deque<StormFrame>& frames() const { return hist; }
+	size_t trackCount() const { return (size_t)nextTrack; }
+	void Reset() { hist.clear(); nextTrack = 0; }
+
+	// validtime は直前のフレームより新しいこと
+	void Advance(const std::wstring& validtime, std::vector<StormCell> cells) {
+		const StormFrame* prev = hist.empty() ? nullptr : &hist.back();
+		const double dtH = prev ? (ValidTimeMinutes(validtime) - ValidTimeMinutes(prev->validtime)) / 60.0 : 0.0;
+		if (prev && dtH > 0 && dtH <= 1.0) {
+			struct Pair { double d; size_t a, b; };
+			std::vector<Pair> pairs;
+			for (size_t a = 0; a < prev->cells.size(); ++a) {
+				const StormCell& p = prev->cells[a];
+				const double gate = kStormMaxSpeedKmh * dtH + std::sqrt(p.areaKm2 / M_PI);
+				for (size_t b = 0; b < cells.size(); ++b) {
+					double dx, dy;
+					GeoOffsetKm(p.lon, p.lat, cells[b].lon, cells[b].lat, dx, dy);
+					dx -= p.vxKmh * dtH; dy -= p.vyKmh * dtH;
+					double d = std::sqrt(dx * dx + dy * dy);
+					if (d <= gate) pairs.push_back({ d, a, b });
+				}
+			}
+			std::sort(pairs.begin(), pairs.end(), [](const Pair& x, const Pair& y) { return x.d < y.d; });
+			std::vector<char> usedA(prev->cells.size(), 0);
+			for (auto& pr : pairs) {
+				if (usedA[pr.a] || cells[pr.b].track >= 0) continue;
+				usedA[pr.a] = 1;
+				const StormCell& p = prev->cells[pr.a];
+				StormCell& c = cells[pr.b];
+				double dx, dy;
+				GeoOffsetKm(p.lon, p.lat, c.lon, c.lat, dx, dy);
+				c.track = p.track;
+				// 重心は形の変化で揺れるので前回の速度と平均する
+				const bool hadSpeed = p.vxKmh != 0 || p.vyKmh != 0;
+				c.vxKmh = hadSpeed ? 0.5 * (p.vxKmh + dx / dtH) : dx / dtH;
+				c.vyKmh = hadSpeed ? 0.5 * (p.vyKmh + dy / dtH) : dy / dtH;
+			}
+		}
+		for (auto& c : cells) if (c.track < 0) c.track = nextTrack++;
+		hist.push_back({ validtime, std::move(cells) });
+		while (hist.size() > kStormHistory) hist.pop_front();
+	}
+
+private:
+	std::deque<StormFrame> hist;
+	int nextTrack{};
+};
+
+// ビューア用。N1/N2 の一覧が更新されると、まだ見ていない新しいフレームだけを処理する
+static bool gShowStorms = false;	// 'S' で切り替え
+
+class StormLayer {
+public:
+	~StormLayer() { Stop(); }
+	void Start() {
+		stop = false;
+		th = std::thread([this]() { Loop(); });
+	}
+	void Stop() {
+		{
+			std::lock_guard<std::mutex> lk(mtx);
+			stop = true;
+		}
+		cv.notify_all();
+		if (th.joinable()) th.join();
+	}
+
+	void Draw(ID2D1RenderTarget* rt, const MapView& v, int timeIndex) {
+		if (timeIndex < 0 || timeIndex >= (int)gTimes.size()) return;
+		std::shared_ptr<const std::deque<StormFrame>> snap;
+		{
+			std::lock_guard<std::mutex> lk(mtx);
+			if (gTimes.size() != wantTimes.size() || gTimes.front().validtime != wantTimes.front().validtime) {
+				wantTimes = gTimes;
+				cv.notify_all();
+			}
+			snap = frames;
+		}
+		// 外挿フレームのセルは作らない (追跡は観測だけで行う)
+		if (!snap || IsExtrapolated(gTimes[timeIndex])) return;
+		const std::wstring& vt = gTimes[timeIndex].validtime;
+		int fi = -1;
+		for (int i = 0; i < (int)snap->size(); ++i) if ((*snap)[i].validtime == vt) fi = i;
+		if (fi < 0) return;
+
+		const int zDL = std::clamp((int)std::floor(v.zoom), MIN_MAP_ZOOM, MAX_MAP_ZOOM);
+		const double sc = std::pow(2.0, v.zoom - zDL);
+		auto toScreen = [&](double lon, double lat) {
+			return D2D1::Point2F((float)((LonLatToWorldX(lon, zDL) - v.originWX) * sc), (float)((LonLatToWorldY(lat, zDL) - v.originWY) * sc));
+			};
+		const double pxPerKm = (TILE_SIZE << zDL) * sc / (40075.016686 * std::cos(35.0 * M_PI / 180.0));
+
+		ID2D1SolidColorBrush* track = nullptr, * cell = nullptr;
+		rt->CreateSolidColorBrush(D2D1::ColorF(0.2f, 0.2f, 0.2f, 0.8f), &track);
+		rt->CreateSolidColorBrush(D2D1::ColorF(0.8f, 0.0f, 0.4f), &cell);
+		if (track && cell) {
+			for (const StormCell& c : (*snap)[fi].cells) {
+				// 過去 1 時間の重心の軌跡
+				D2D1_POINT_2F p = toScreen(c.lon, c.lat);
+				for (int i = fi - 1, tr = c.track; i >= 0 && i >= fi - 12; --i) {
+					auto it = std::find_if((*snap)[i].cells.begin(), (*snap)[i].cells.end(), [&](const StormCell& o) { return o.track == tr; });
+					if (it == (*snap)[i].cells.end()) break;
+					D2D1_POINT_2F q = toScreen(it->lon, it->lat);
+					rt->DrawLine(q, p, track, 2.0f);
+					p = q;
+				}
+				// 面積相当の円と 30 分後の予想位置への矢印
+				D2D1_POINT_2F o = toScreen(c.lon, c.lat);
+				float r = (float)std::max(3.0, std::sqrt(c.areaKm2 / M_PI) * pxPerKm);
+				rt->DrawEllipse(D2D1::Ellipse(o, r, r), cell, 1.5f);
+				if (c.vxKmh != 0 || c.vyKmh != 0) {
+					D2D1_POINT_2F e = D2D1::Point2F(o.x + (float)(c.vxKmh * 0.5 * pxPerKm), o.y - (float)(c.vyKmh * 0.5 * pxPerKm));
+					rt->DrawLine(o, e, cell, 2.0f);
+				}
+			}
+		}
+		SAFE_RELEASE(track);
+		SAFE_RELEASE(cell);
+	}
+
+private:
+	void Loop() {
+		StormTracker tracker;
+		std::vector<NowcTime> seen;
+		for (;;) {
+			std::vector<NowcTime> times;
+			{
+				std::unique_lock<std::mutex> lk(mtx);
+				cv.wait(lk, [&]() { return stop || (!wantTimes.empty() && (wantTimes.size() != seen.size() || wantTimes.front().validtime != seen.front().validtime)); });
+				if (stop) return;
+				times = seen = wantTimes;
+			}
+			// 先頭の外挿フレームは観測の履歴ではないので追跡に入れない
+			times.erase(std::remove_if(times.begin(), times.end(), IsExtrapolated), times.end());
+			// 一覧に追跡済みより古い未処理のフレームがあれば (N1/N2 の切り替えなど) 作り直す
+			for (int i = (int)times.size() - 1; i >= 0; --i)
+				if (times[i].validtime < tracker.lastTime() && !tracker.Has(times[i].validtime)) { tracker.Reset(); break; }
+			int tx0, ty0, tx1, ty1;
+			TileRangeForBox(kJapanBox, kStormZoom, tx0, ty0, tx1, ty1);
+			for (int i = (int)times.size() - 1; i >= 0 && !stop; --i) {
+				if (times[i].validtime <= tracker.lastTime()) continue;
+				ClassMosaic m;
+				if (LoadClassMosaic(times[i], kStormZoom, tx0, ty0, tx1, ty1, WORKER_THREADS, m) == m.planes.size()) continue;
+				std::vector<StormCell> cells;
+				StormLabelStats st;
+				LabelStormCells(m, kStormThresholdMmh, kStormMinKm2, WORKER_THREADS, cells, st);
+				tracker.Advance(times[i].validtime, std::move(cells));
+				auto snap = std::make_shared<const std::deque<StormFrame>>(tracker.frames());
+				{
+					std::lock_guard<std::mutex> lk(mtx);
+					frames = snap;
+				}
+				if (g.hwnd) PostMessage(g.hwnd, WM_TILE_READY, 0, 0);
+			}
+		}
+	}
+
+	std::thread th;
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::atomic<bool> stop{ false };
+	std::vector<NowcTime> wantTimes;
+	std::shared_ptr<const std::deque<StormFrame>> frames;
+};
+static StormLayer gStormLayer;
+
+// -------------------- Motion Interpolation --------------------
+// 連続する 2 フレームのパレット面からブロックマッチングで動きを推定し、途中のフレームを移流 (warp) で作る。
+// 不透明度のクロスフェードでは雨域が二重に見えるが、こちらは雨域が移動して見える
+static const int kFlowBlock = 16;						// ブロックの大きさ (画素)
+static const int kFlowGrid = TILE_SIZE / kFlowBlock;	// タイルあたりのブロック数 (一辺)
+static const int kFlowSearch = 8;						// 探索範囲 (±画素)
+static const int kMotionSteps = 3;						// 途中フレームの数
+static const int kFlowApron = kFlowSearch;				// 隣のタイルから借りる縁の幅 (画素)
+static const int kApronSize = TILE_SIZE + 2 * kFlowApron;	// 縁付きの面の一辺 (= 行の長さ)
+static const int kMotionRetryMinSec = 5, kMotionRetryMaxSec = 300;	// 読めなかった組の再試行の間隔 (失敗ごとに倍)
+static bool gMotionInterp = true;	// 'M' でクロスフェードと切り替え
+
+struct FlowField {
+	float vx[kFlowGrid * kFlowGrid]{}, vy[kFlowGrid * kFlowGrid]{};	// A → B の移動量 (画素)
+	int validBlocks{};		// 雨があって探索できたブロック数
+};
+
+// 3x3 タイル (nb[4] が中央、欠けは nullptr = 降水なし) から、中央のタイルに kFlowApron 画素の縁を付けた面を作る。
+// 探索や途中フレームの標本がタイルの端で切れると継ぎ目が見えるので、AdvectTile と同じく隣のタイルから取る
+static void BuildApronPlane(const BYTE* const nb[9], BYTE* out)
+{
+	for (int y = 0; y < kApronSize; ++y) {
+		const int sy = y - kFlowApron + TILE_SIZE;
+		for (int x = 0; x < kApronSize; ++x) {
+			const int sx = x - kFlowApron + TILE_SIZE;
+			const BYTE* p = nb[(sy / TILE_SIZE) * 3 + sx / TILE_SIZE];
+			out[y * kApronSize + x] = p ? p[(sy % TILE_SIZE) * TILE_SIZE + sx % TILE_SIZE] : 0;
+		}
+	}
+}
+
+// 16x16 ブロックの差の絶対値の和 (SSE2: 1 行 16 画素を _mm_sad_epu8 でまとめて足す)。a はタイル、b は縁付きの面
+static inline uint32_t BlockSad(const BYTE* a, const BYTE* b)
+{
+	__m128i acc = _mm_setzero_si128();
+	for (int y = 0; y < kFlowBlock; ++y)
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(a + y * TILE_SIZE)), _mm_loadu_si128((const __m128i*)(b + y * kApronSize))));
+	return (uint32_t)(_mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8)));
+}
+
+// 比較用 (--bench-flow)
+static inline uint32_t BlockSadScalar(const BYTE* a, const BYTE* b)
+{
+	uint32_t s = 0;
+	for (int y = 0; y < kFlowBlock; ++y)
+		for (int x = 0; x < kFlowBlock; ++x) s += (uint32_t)std::abs(a[y * TILE_SIZE + x] - b[y * kApronSize + x]);
+	return s;
+}
+
+// a: A のタイル、b: B の縁付きの面 (BuildApronPlane)。探索は縁の中で行うのでタイルの端のブロックも全方向を見る
+template <uint32_t (*Sad)(const BYTE*, const BYTE*)>
+static void EstimateFlowT(const BYTE* a, const BYTE* b, FlowField& f)
+{
+	const __m128i zero = _mm_setzero_si128();
+	std::vector<char> valid(kFlowGrid * kFlowGrid, 0);
+	f.validBlocks = 0;
+	for (int by = 0; by < kFlowGrid; ++by)
+		for (int bx = 0; bx < kFlowGrid; ++bx) {
+			const int k = by * kFlowGrid + bx, x0 = bx * kFlowBlock, y0 = by * kFlowBlock;
+			const BYTE* src = a + y0 * TILE_SIZE + x0;
+			f.vx[k] = f.vy[k] = 0;
+			// 雨のないブロックは動きが決まらないので後で周りから埋める
+			__m128i any = zero;
+			for (int y = 0; y < kFlowBlock; ++y) any = _mm_or_si128(any, _mm_loadu_si128((const __m128i*)(src + y * TILE_SIZE)));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, zero)) == 0xFFFF) continue;
+			uint32_t best = UINT32_MAX;
+			int bestD = INT_MAX;
+			for (int dy = -kFlowSearch; dy <= kFlowSearch; ++dy) {
+				for (int dx = -kFlowSearch; dx <= kFlowSearch; ++dx) {
+					uint32_t s = Sad(src, b + (y0 + dy + kFlowApron) * kApronSize + x0 + dx + kFlowApron);
+					int d = dx * dx + dy * dy;
+					// 同点なら移動の小さい方
+					if (s < best || (s == best && d < bestD)) { best = s; bestD = d; f.vx[k] = (float)dx; f.vy[k] = (float)dy; }
+				}
+			}
+			valid[k] = 1;
+			++f.validBlocks;
+		}
+	if (f.validBlocks == 0) return;
+
+	// 外れ値を 3x3 の中央値で抑える (雨のあるブロックのみ)
+	float mx[kFlowGrid * kFlowGrid], my[kFlowGrid * kFlowGrid];
+	for (int by = 0; by < kFlowGrid; ++by)
+		for (int bx = 0; bx < kFlowGrid; ++bx) {
+			const int k = by * kFlowGrid + bx;
+			mx[k] = f.vx[k]; my[k] = f.vy[k];
+			if (!valid[k]) continue;
+			float xs[9], ys[9];
+			int n = 0;
+			for (int j = std::max(0, by - 1); j <= std::min(kFlowGrid - 1, by + 1); ++j)
+				for (int i = std::max(0, bx - 1); i <= std::min(kFlowGrid - 1, bx + 1); ++i)
+					if (valid[j * kFlowGrid + i]) { xs[n] = f.vx[j * kFlowGrid + i]; ys[n] = f.vy[j * kFlowGrid + i]; ++n; }
+			std::nth_element(xs, xs + n / 2, xs + n);
+			std::nth_element(ys, ys + n / 2, ys + n);
+			mx[k] = xs[n / 2]; my[k] = ys[n / 2];
+		}
+	memcpy(f.vx, mx, sizeof(mx));
+	memcpy(f.vy, my, sizeof(my));
+
+	// 雨のないブロックは近くの確定したブロックの平均で埋める (広がるまで繰り返す)
+	for (bool changed = true; changed;) {
+		changed = false;
+		std::vector<char> next = valid;
+		for (int by = 0; by < kFlowGrid; ++by)
+			for (int bx = 0; bx < kFlowGrid; ++bx) {
+				const int k = by * kFlowGrid + bx;
+				if (valid[k]) continue;
+				float sx = 0, sy = 0;
+				int n = 0;
+				for (int j = std::max(0, by - 1); j <= std::min(kFlowGrid - 1, by + 1); ++j)
+					for (int i = std::max(0, bx - 1); i <= std::min(kFlowGrid - 1, bx + 1); ++i)
+						if (valid[j * kFlowGrid + i]) { sx += f.vx[j * kFlowGrid + i]; sy += f.vy[j * kFlowGrid + i]; ++n; }
+				if (n) { f.vx[k] = sx / n; f.vy[k] = sy / n; next[k] = 1; changed = true; }
+			}
+		valid.swap(next);
+	}
+}
+
+static void EstimateFlow(const BYTE* a, const BYTE* b, FlowField& f) { EstimateFlowT<BlockSad>(a, b, f); }
+
+// 画素 (x, y) の移動量。ブロック中心の間で双線形補間する
+static inline void FlowAt(const FlowField& f, float x, float y, float& vx, float& vy)
+{
+	const float gx = std::clamp((x + 0.5f) / kFlowBlock - 0.5f, 0.0f, kFlowGrid - 1.0f);
+	const float gy = std::clamp((y + 0.5f) / kFlowBlock - 0.5f, 0.0f, kFlowGrid - 1.0f);
+	const int i0 = std::min((int)gx, kFlowGrid - 2), j0 = std::min((int)gy, kFlowGrid - 2);
+	const float fx = gx - i0, fy = gy - j0;
+	const int k = j0 * kFlowGrid + i0;
+	vx = (f.vx[k] * (1 - fx) + f.vx[k + 1] * fx) * (1 - fy) + (f.vx[k + kFlowGrid] * (1 - fx) + f.vx[k + kFlowGrid + 1] * fx) * fy;
+	vy = (f.vy[k] * (1 - fx) + f.vy[k + 1] * fx) * (1 - fy) + (f.vy[k + kFlowGrid] * (1 - fx) + f.vy[k + kFlowGrid + 1] * fx) * fy;
+}
+
+// t (0..1) の途中フレーム。出力画素から A へは -t v、B へは (1-t) v 戻った位置を見て、
+// 両者の強度 (mm/h) を t で混ぜてから階級に戻す。a, b は縁付きの面 (|v| <= kFlowSearch なので縁の中に収まる)
+static void InterpolateClasses(const BYTE* a, const BYTE* b, const FlowField& f, float t, BYTE* out)
+{
+	// 混ぜた結果の階級表 [A の階級][B の階級]
+	BYTE mix[kJmaClassCount][kJmaClassCount];
+	for (int ca = 0; ca < kJmaClassCount; ++ca)
+		for (int cb = 0; cb < kJmaClassCount; ++cb) {
+			const float mm = (1.0f - t) * JmaClassMmh(ca) + t * JmaClassMmh(cb);
+			int c = 0;
+			if (mm > 0) for (c = kJmaClassCount - 1; c > 1 && kJmaScale[c].lo >= mm; --c) {}
+			mix[ca][cb] = (BYTE)c;
+		}
+	auto cls = [](BYTE v) { return v < kJmaClassCount ? v : (BYTE)0; };
+	for (int y = 0; y < TILE_SIZE; ++y) {
+		for (int x = 0; x < TILE_SIZE; ++x) {
+			float vx, vy;
+			FlowAt(f, (float)x, (float)y, vx, vy);
+			const int ax = std::clamp((int)std::lround(x - t * vx) + kFlowApron, 0, kApronSize - 1), ay = std::clamp((int)std::lround(y - t * vy) + kFlowApron, 0, kApronSize - 1);
+			const int bx = std::clamp((int)std::lround(x + (1 - t) * vx) + kFlowApron, 0, kApronSize - 1), by = std::clamp((int)std::lround(y + (1 - t) * vy) + kFlowApron, 0, kApronSize - 1);
+			out[y * TILE_SIZE + x] = mix[cls(a[ay * kApronSize + ax])][cls(b[by * kApronSize + bx])];
+		}
+	}
+}
+
+// 途中フレームのキャッシュキー (gCache に JMA タイルと並べて置く)。step は 1..kMotionSteps
+static std::wstring MotionTileKey(const NowcTime& A, const NowcTime& B, int step, int z, int x, int y)
+{
+	wchar_t buf[160];
+	swprintf_s(buf, L"motion/%s/%s/%d/%d/%d/%d", A.validtime.c_str(), B.validtime.c_str(), step, z, x, y);
+	return buf;
+}
+
+// ビューア用。表示中のタイルについて、今の時刻と前後の時刻の組の途中フレームをバックグラウンドで作る
+class MotionLayer {
+public:
+	~MotionLayer() { Stop(); }
+	void Start() {
+		stop = false;
+		for (int i = 0; i < WORKER_THREADS; ++i) th.emplace_back([this]() { Loop(); });
+	}
+	void Stop() {
+		{
+			std::lock_guard<std::mutex> lk(mtx);
+			stop = true;
+		}
+		cv.notify_all();
+		for (auto& t : th) if (t.joinable()) t.join();
+		th.clear();
+	}
+	// 組 (from, to) を新しいものに差し替える。先頭の組から処理する。
+	// 読めなかった組は再試行の時刻まで外すので、再描画のたびに取り直すことはない
+	void Request(const MapView& v, const std::vector<std::pair<int, int>>& pairs) {
+		const int z = JmaZoomFor(v.zoom);
+		const auto now = std::chrono::steady_clock::now();
+		std::lock_guard<std::mutex> lk(mtx);
+		std::vector<Job> jobs;
+		std::wstring key;
+		for (auto& p : pairs) {
+			if (p.first < 0 || p.second < 0 || p.first >= (int)gTimes.size() || p.second >= (int)gTimes.size()) continue;
+			ForEachJmaTileXY(v, z, [&](int x, int y, const D2D1_RECT_F&) {
+				std::wstring k = MotionTileKey(gTimes[p.first], gTimes[p.second], 0, z, x, y);
+				auto it = retry.find(k);
+				if (it != retry.end() && now < it->second.at) return;
+				jobs.push_back({ gTimes[p.first], gTimes[p.second], z, x, y });
+				key += k;
+				});
+		}
+		if (key == queuedKey) return;
+		queuedKey = std::move(key);
+		queue.assign(jobs.begin(), jobs.end());
+		cv.notify_all();
+	}
+
+private:
+	struct Job { NowcTime a, b; int z, x, y; };
+	struct Retry { std::chrono::steady_clock::time_point at; int fails{}; };
+
+	// 表示中のタイルはキャッシュのパレット面を使い、なければ読み込む
+	static bool LoadPlane(const NowcTime& T, int z, int x, int y, BYTE* plane) {
+		if (x < 0 || y < 0 || x >= (1 << z) || y >= (1 << z)) return false;
+		const std::wstring path = JmaTilePath(T, z, x, y);
+		{
+			std::lock_guard<std::mutex> lk(gCacheMtx);
+			auto it = gCache.find(path);
+			if (it != gCache.end() && !it->second.classes.empty()) { memcpy(plane, it->second.classes.data(), kTilePixels); return true; }
+		}
+		return LoadTileClasses(path, plane);
+	}
+
+	// 3x3 タイルを読んで縁付きの面を作る。中央が読めなければ false (周りの欠けは降水なし)
+	static bool LoadApron(const NowcTime& T, int z, int x, int y, std::vector<BYTE>(&nb)[9], BYTE* center, BYTE* apron) {
+		if (!LoadPlane(T, z, x, y, center)) return false;
+		const BYTE* src[9];
+		for (int k = 0; k < 9; ++k) {
+			if (k == 4) { src[k] = center; continue; }
+			nb[k].resize(kTilePixels);
+			src[k] = LoadPlane(T, z, x + k % 3 - 1, y + k / 3 - 1, nb[k].data()) ? nb[k].data() : nullptr;
+		}
+		BuildApronPlane(src, apron);
+		return true;
+	}
+
+	void Loop() {
+		std::vector<BYTE> pa(kTilePixels), pb(kTilePixels), ea(kApronSize * kApronSize), eb(kApronSize * kApronSize), out(kTilePixels);
+		std::vector<BYTE> nb[9];
+		for (;;) {
+			Job j;
+			{
+				std::unique_lock<std::mutex> lk(mtx);
+				cv.wait(lk, [&]() { return stop || !queue.empty(); });
+				if (stop) return;
+				j = std::move(queue.front());
+				queue.pop_front();
+			}
+			{
+				std::lock_guard<std::mutex> lk(gCacheMtx);
+				if (gCache.count(MotionTileKey(j.a, j.b, kMotionSteps, j.z, j.x, j.y))) continue;
+			}
+			const std::wstring jobKey = MotionTileKey(j.a, j.b, 0, j.z, j.x, j.y);
+			if (!LoadApron(j.a, j.z, j.x, j.y, nb, pa.data(), ea.data()) || !LoadApron(j.b, j.z, j.x, j.y, nb, pb.data(), eb.data())) {
+				// 未取得・取得できないタイルは間隔を空けて取り直す (次の Request で組に戻る)
+				std::lock_guard<std::mutex> lk(mtx);
+				Retry& r = retry[jobKey];
+				const int sec = std::min(kMotionRetryMaxSec, kMotionRetryMinSec << std::min(r.fails, 6));
+				r.at = std::chrono::steady_clock::now() + std::chrono::seconds(sec);
+				++r.fails;
+				if (retry.size() > 4096) PruneRetry();
+				continue;
+			}
+			{
+				std::lock_guard<std::mutex> lk(mtx);
+				retry.erase(jobKey);
+			}
+			FlowField f;
+			EstimateFlow(pa.data(), eb.data(), f);
+			// 最後のステップを入れたら完了の印 (途中で止まっても残りは次の要求で作る)
+			for (int s = 1; s <= kMotionSteps; ++s) {
+				InterpolateClasses(ea.data(), eb.data(), f, (float)s / (kMotionSteps + 1), out.data());
+				IWICBitmap* bmp = ClassPlaneToWic(ThreadWic(), out.data());
+				if (!bmp) break;
+				std::lock_guard<std::mutex> lk(gCacheMtx);
+				auto r = gCache.emplace(MotionTileKey(j.a, j.b, s, j.z, j.x, j.y), Img());
+				if (r.second) {
+					r.first->second.decoded = bmp;
+					r.first->second.lastUsed = std::chrono::steady_clock::now();
+					r.first->second.layer = kTileMotion;
+				}
+				else SAFE_RELEASE(bmp);
+			}
+			if (g.hwnd) PostMessage(g.hwnd, WM_TILE_READY, 0, 0);
+		}
+	}
+
+	// 再試行の時刻を過ぎた記録を捨てる (mtx を保持して呼ぶ)
+	void PruneRetry() {
+		const auto now = std::chrono::steady_clock::now();
+		for (auto it = retry.begin(); it != retry.end();) it = now >= it->second.at ? retry.erase(it) : std::next(it);
+	}
+
+	std::vector<std::thread> th;
+	std::mutex mtx;
+	std::condition_variable cv;
+	bool stop{};
+	std::deque<Job> queue;
+	std::wstring queuedKey;
+	std::unordered_map<std::wstring, Retry> retry;	// 読めなかった組 (MotionTileKey の step 0) → 次に試す時刻
+};
+static MotionLayer gMotionLayer;
+
+// from → to の途中 (t = 0..1) を描く。途中フレームは隣どうしを不透明度で繋ぎ、
+// まだ作られていないタイルはクロスフェードで描く
+static void DrawMotionLayer(ID2D1RenderTarget* rt, const MapView& v, const TileBitmapFn& getBmp, int from, int to, float t, float alpha)
+{
+	const NowcTime& A = gTimes[from], & B = gTimes[to];
+	const int z = JmaZoomFor(v.zoom);
+	const float u = std::clamp(t, 0.0f, 1.0f) * (kMotionSteps + 1);
+	const int k = std::min((int)u, kMotionSteps);
+	const float fk = u - k;
+	ForEachJmaTileXY(v, z, [&](int x, int y, const D2D1_RECT_F& dst) {
+		auto frame = [&](int s) -> ID2D1Bitmap* {
+			if (s <= 0) return getBmp(JmaTilePath(A, z, x, y), kTileRain);
+			if (s > kMotionSteps) return getBmp(JmaTilePath(B, z, x, y), kTileRain);
+			return PeekCachedBitmap(MotionTileKey(A, B, s, z, x, y));
+			};
+		ID2D1Bitmap* b0 = frame(k), * b1 = frame(k + 1);
+		if (b0 && b1) {
+			rt->DrawBitmap(b0, dst, (1.0f - fk) * alpha, D2D1_BITMAP_INTERPOLATION_MODE_LINEAR);
+			rt->DrawBitmap(b1, dst, fk * alpha, D2D1_BITMAP_INTERPOLATION_MODE_LINEAR);
+			return;
+		}
+		if (ID2D1Bitmap* a = frame(0)) rt->DrawBitmap(a, dst, (1.0f - t) * alpha, D2D1_BITMAP_INTERPOLATION_MODE_LINEAR);
+		if (ID2D1Bitmap* b = frame(kMotionSteps + 1)) rt->DrawBitmap(b, dst, t * alpha, D2D1_BITMAP_INTERPOLATION_MODE_LINEAR);
+		});
+}
+
+// -------------------- Extrapolation --------------------
+// 最新の観測を移流させて 5 分刻みで先へ延ばす (N2 の予報の先、または N1 の最新より先)。
+// 直近 2 組の観測 (t-2→t-1, t-1→t) からタイルごとの動きを推定し、最新フレームを流れに沿って運ぶ。
+// 外挿フレームは時刻一覧の先頭に足し、タイルは描画や集計で要求されたときに作る
+static const int kExtrapSteps = 12;		// 60 分先まで
+static const int kExtrapZoom = 8;		// これより細かいズームは z8 の外挿を拡大する (JmaZoomFor のズームに合わせる。z10 は z8 から)
+static bool gExtrapEnabled = false;		// 'E' で切り替え (観測表示のみ)
+
+// 3x3 タイル分の最新フレーム (nb[4] が対象、欠けは nullptr = 降水なし) を steps ステップ先へ運ぶ。
+// 出力画素から流れの向きに steps 倍だけ遡った画素を取る (semi-Lagrangian)
+static void AdvectTile(const BYTE* const nb[9], const FlowField& f, float steps, BYTE* out)
+{
+	for (int y = 0; y < TILE_SIZE; ++y)
+		for (int x = 0; x < TILE_SIZE; ++x) {
+			float vx, vy;
+			FlowAt(f, (float)x, (float)y, vx, vy);
+			const int sx = (int)std::lround(x - steps * vx) + TILE_SIZE, sy = (int)std::lround(y - steps * vy) + TILE_SIZE;
+			BYTE c = 0;
+			if (sx >= 0 && sy >= 0 && sx < 3 * TILE_SIZE && sy < 3 * TILE_SIZE)
+				if (const BYTE* p = nb[(sy / TILE_SIZE) * 3 + sx / TILE_SIZE]) c = p[(sy % TILE_SIZE) * TILE_SIZE + sx % TILE_SIZE];
+			out[y * TILE_SIZE + x] = c < kJmaClassCount ? c : 0;
+		}
+}
+
+class Extrapolator {
+public:
+	using Plane = SingleFlightCache<std::vector<BYTE>>::Ptr;
+	explicit Extrapolator(size_t cacheTiles) : planes(cacheTiles), motions(cacheTiles) {}
+
+	// 観測の一覧 (新しい順) を設定し、外挿フレーム (新しい順) を返す
+	std::vector<NowcTime> SetObservations(const std::vector<NowcTime>& obs, int steps = kExtrapSteps) {
+		std::vector<NowcTime> out;
+		std::lock_guard<std::mutex> lk(mtx);
+		recent.assign(obs.begin(), obs.begin() + std::min<size_t>(3, obs.size()));
+		if (recent.size() < 2) return out;
+		const int64_t t0 = ValidTimeMinutes(recent[0].validtime);
+		for (int k = steps; k >= 1; --k) out.push_back({ L"extrap/" + recent[0].validtime, MinutesToValidTime(t0 + 5 * k) });
+		return out;
+	}
+
+	// JmaTilePath の "extrap/<観測>/<validtime>/z/x/y"
+	bool TileFromPath(const std::wstring& path, BYTE* out) {
+		std::vector<std::wstring> part;
+		for (size_t pos = 0; pos <= path.size();) {
+			size_t slash = std::min(path.find(L'/', pos), path.size());
+			part.push_back(path.substr(pos, slash - pos));
+			pos = slash + 1;
+		}
+		if (part.size() != 6) return false;
+		NowcTime T{ L"extrap/" + part[1], part[2] };
+		return Tile(T, _wtoi(part[3].c_str()), _wtoi(part[4].c_str()), _wtoi(part[5].c_str()), out);
+	}
+
+	bool Tile(const NowcTime& T, int z, int x, int y, BYTE* out) {
+		std::vector<NowcTime> obs = Recent();
+		if (obs.size() < 2 || T.basetime != L"extrap/" + obs[0].validtime) return false;	// 古い一覧のフレーム
+		const int64_t lead = ValidTimeMinutes(T.validtime) - ValidTimeMinutes(obs[0].validtime);
+		if (lead <= 0) return false;
+		const int ze = std::min(z, kExtrapZoom);
+		if (z > ze) {
+			// z8 の外挿タイルの該当部分を拡大する
+			const int d = z - ze, px = x >> d, py = y >> d;
+			const std::wstring parent = JmaTilePath(T, ze, px, py);
+			Plane p = planes.Get(parent, [&](std::vector<BYTE>& v) { v.resize(kTilePixels); return Tile(T, ze, px, py, v.data()); });
+			if (!p) return false;
+			const int span = TILE_SIZE >> d, ox = (x - (px << d)) * span, oy = (y - (py << d)) * span;
+			for (int yy = 0; yy < TILE_SIZE; ++yy)
+				for (int xx = 0; xx < TILE_SIZE; ++xx) out[yy * TILE_SIZE + xx] = (*p)[(oy + (yy >> d)) * TILE_SIZE + ox + (xx >> d)];
+			return true;
+		}
+		FlowField f;
+		if (!Motion(obs, z, x, y, f)) return false;
+		Plane nb[9];
+		const BYTE* src[9];
+		for (int k = 0; k < 9; ++k) {
+			nb[k] = ObservedTile(obs[0], z, x + k % 3 - 1, y + k / 3 - 1);
+			src[k] = nb[k] ? nb[k]->data() : nullptr;
+		}
+		if (!src[4]) return false;
+		AdvectTile(src, f, lead / 5.0f, out);
+		return true;
+	}
+
+	// タイルの動き (画素 / 5 分)。直近 2 組が取れれば平均する
+	bool Motion(const std::vector<NowcTime>& obs, int z, int x, int y, FlowField& f) {
+		wchar_t key[96];
+		swprintf_s(key, L"%s/%d/%d/%d", obs[0].validtime.c_str(), z, x, y);
+		auto m = motions.Get(key, [&](FlowField& r) {
+			Plane p1 = ObservedTile(obs[1], z, x, y);
+			Plane p2 = obs.size() > 2 ? ObservedTile(obs[2], z, x, y) : nullptr;
+			std::vector<BYTE> e0, e1;
+			if (!p1 || !ObservedApron(obs[0], z, x, y, e0)) return false;
+			EstimateFlow(p1->data(), e0.data(), r);
+			FlowField older;
+			if (p2 && r.validBlocks > 0 && ObservedApron(obs[1], z, x, y, e1) && (EstimateFlow(p2->data(), e1.data(), older), older.validBlocks > 0))
+				for (int k = 0; k < kFlowGrid * kFlowGrid; ++k) { r.vx[k] = 0.5f * (r.vx[k] + older.vx[k]); r.vy[k] = 0.5f * (r.vy[k] + older.vy[k]); }
+			return true;
+			});
+		if (!m) return false;
+		f = *m;
+		return true;
+	}
+
+	Plane ObservedTile(const NowcTime& T, int z, int x, int y) {
+		if (x < 0 || y < 0 || x >= (1 << z) || y >= (1 << z)) return nullptr;
+		const std::wstring path = JmaTilePath(T, z, x, y);
+		return planes.Get(path, [&](std::vector<BYTE>& v) { v.resize(kTilePixels); return LoadTileClasses(path, v.data()); });
+	}
+
+	// 3x3 の観測タイルから縁付きの面を作る。中央がなければ false
+	bool ObservedApron(const NowcTime& T, int z, int x, int y, std::vector<BYTE>& out) {
+		Plane nb[9];
+		const BYTE* src[9];
+		for (int k = 0; k < 9; ++k) {
+			nb[k] = ObservedTile(T, z, x + k % 3 - 1, y + k / 3 - 1);
+			src[k] = nb[k] ? nb[k]->data() : nullptr;
+		}
+		if (!src[4]) return false;
+		out.resize(kApronSize * kApronSize);
+		BuildApronPlane(src, out.data());
+		return true;
+	}
+
+	std::vector<NowcTime> Recent() {
+		std::lock_guard<std::mutex> lk(mtx);
+		return recent;
+	}
+
+private:
+	SingleFlightCache<std::vector<BYTE>> planes;	// 観測と z8 の外挿のパレット面
+	SingleFlightCache<FlowField> motions;
+	std::mutex mtx;
+	std::vector<NowcTime> recent;					// 新しい順に最大 3 つ
+};
+static Extrapolator gExtrap(2048);
+
+// gTimes の先頭の外挿フレームを付け直す (観測表示のときのみ)。表示中のフレームは変えない
+static void ApplyExtrapolation()
+{
+	int removed = 0;
+	while (!gTimes.empty() && IsExtrapolated(gTimes.front())) { gTimes.erase(gTimes.begin()); ++removed; }
+	gTimeIndex = std::max(0, gTimeIndex - removed);
+	gAnimPlaying = false;
+	if (!gExtrapEnabled || gUseForecast || gPlayback.active || gTimes.empty()) return;
+	std::vector<NowcTime> ex = gExtrap.SetObservations(gTimes);
+	gTimes.insert(gTimes.begin(), ex.begin(), ex.end());
+	gTimeIndex += (int)ex.size();
+}
+
+// 外挿の表示中は 1 分ごとに観測の一覧を取り直し、新しいフレームが来たら外挿し直す
+static const UINT_PTR kTimesTimerId = 3;
+static void RefreshObservations()
+{
+	if (!gExtrapEnabled || gUseForecast || gPlayback.active) return;
+	std::vector<NowcTime> t;
+	if (!FetchTimes(false, t)) return;
+	int latest = 0;
+	while (latest < (int)gTimes.size() && IsExtrapolated(gTimes[latest])) ++latest;
+	if (latest < (int)gTimes.size() && gTimes[latest].validtime == t[0].validtime) return;
+	// 最新の観測か外挿を見ていたら新しい最新へ、それ以外は同じ時刻のまま
+	const bool follow = gTimeIndex <= latest || gTimeIndex >= (int)gTimes.size();
+	const std::wstring shown = follow ? L"" : gTimes[gTimeIndex].validtime;
+	gTimes.swap(t);
+	gTimeIndex = 0;
+	for (int i = 0; !follow && i < (int)gTimes.size(); ++i) if (gTimes[i].validtime == shown) gTimeIndex = i;
+	ApplyExtrapolation();
+	InvalidateRect(g.hwnd, nullptr, FALSE);
+	UpdateTitle();
+}
+
+// -------------------- Forecast Verification --------------------
+// アーカイブの N2 予報 (basetime < validtime) を同じ validtime の観測と画素ごとに突き合わせ、
+// 閾値ごとの 2x2 分割表から POD (捕捉率)・FAR (空振り率)・CSI を出す
+struct Contingency {
+	uint64_t hits = 0, misses = 0, falseAlarms = 0, total = 0;
+	double POD() const { return hits + misses ? (double)hits / (hits + misses) : NAN; }
+	double FAR() const { return hits + falseAlarms ? (double)falseAlarms / (hits + falseAlarms) : NAN; }
+	double CSI() const { return hits + misses + falseAlarms ? (double)hits / (hits + misses + falseAlarms) : NAN; }
+	Contingency& operator+=(const Contingency& o) { hits += o.hits; misses += o.misses; falseAlarms += o.falseAlarms; total += o.total; return *this; }
+};
+
+// 1 タイル分を数えて out[0..n) に足す。cls[k] は閾値 k の階級 (その階級以上を「降水あり」とする)
+static void CountContingencyScalar(const BYTE* fc, const BYTE* ob, const int* cls, int n, Contingency* out)
+{
+	for (int k = 0; k < n; ++k) {
+		uint64_t h = 0, m = 0, fa = 0;
+		for (int i = 0; i < kTilePixels; ++i) {
+			const bool f = fc[i] >= cls[k], o = ob[i] >= cls[k];
+			h += f & o; m += !f & o; fa += f & !o;
+		}
+		out[k].hits += h; out[k].misses += m; out[k].falseAlarms += fa; out[k].total += kTilePixels;
+	}
+}
+
+// SSE2 版。比較結果 (-1/0) を引いてバイト単位で数え、溢れる前に _mm_sad_epu8 で 64bit に足し込む
+static void CountContingency(const BYTE* fc, const BYTE* ob, const int* cls, int n, Contingency* out)
+{
+	const __m128i zero = _mm_setzero_si128();
+	for (int k = 0; k < n; ++k) {
+		const __m128i t = _mm_set1_epi8((char)(cls[k] - 1));
+		__m128i sh = zero, sm = zero, sf = zero;
+		for (int i0 = 0; i0 < kTilePixels; i0 += 16 * 240) {
+			__m128i h = zero, m = zero, fa = zero;
+			for (int i = i0; i < std::min(i0 + 16 * 240, kTilePixels); i += 16) {
+				const __m128i f = _mm_cmpgt_epi8(_mm_loadu_si128((const __m128i*)(fc + i)), t);
+				const __m128i o = _mm_cmpgt_epi8(_mm_loadu_si128((const __m128i*)(ob + i)), t);
+				h = _mm_sub_epi8(h, _mm_and_si128(f, o));
+				m = _mm_sub_epi8(m, _mm_andnot_si128(f, o));
+				fa = _mm_sub_epi8(fa, _mm_andnot_si128(o, f));
+			}
+			sh = _mm_add_epi64(sh, _mm_sad_epu8(h, zero));
+			sm = _mm_add_epi64(sm, _mm_sad_epu8(m, zero));
+			sf = _mm_add_epi64(sf, _mm_sad_epu8(fa, zero));
+		}
+		auto sum = [](__m128i v) { return (uint64_t)(uint32_t)_mm_cvtsi128_si32(v) + (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(v, 8)); };
+		out[k].hits += sum(sh); out[k].misses += sum(sm); out[k].falseAlarms += sum(sf); out[k].total += kTilePixels;
+	}
+}
+
+// 予報と観測の組。lead は 5 分単位の予報時間
+struct VerifyPair {
+	NowcTime forecast, observed;
+	int lead;
+};
+
+// アーカイブから、観測がある validtime の予報を集める (最新の観測から hours 時間以内)
+static std::vector<VerifyPair> ArchiveVerifyPairs(double hours)
+{
+	std::vector<VerifyPair> out;
+	if (!gArchive) return out;
+	std::vector<std::pair<uint64_t, uint64_t>> times = gArchive->Times(kLayerJmaHrpns), delta = gArchive->Times(kLayerJmaDelta);
+	times.insert(times.end(), delta.begin(), delta.end());
+	std::sort(times.begin(), times.end());
+	times.erase(std::unique(times.begin(), times.end()), times.end());
+	std::vector<uint64_t> observed;
+	for (auto& t : times) if (t.first == t.second) observed.push_back(t.first);
+	if (observed.empty()) return out;
+	const int64_t latest = ValidTimeMinutes(TimeString(observed.back()));
+	for (auto& t : times) {
+		if (t.first == t.second || !std::binary_search(observed.begin(), observed.end(), t.first)) continue;
+		const std::wstring valid = TimeString(t.first), base = TimeString(t.second);
+		const int64_t v = ValidTimeMinutes(valid), lead = v - ValidTimeMinutes(base);
+		if (lead <= 0 || lead % 5 != 0 || latest - v > hours * 60) continue;
+		out.push_back({ { base, valid }, { valid, valid }, (int)(lead / 5) });
+	}
+	return out;
+}
+
+// 全タイル × 全組の分割表。タイルごとに観測を 1 回だけ読み、同じ validtime の予報をまとめて数える
+class VerificationJob {
+public:
+	VerificationJob(int z, std::vector<float> levels) : z(z), levels(std::move(levels)) {
+		TileRangeForBox(kJapanBox, z, tx0, ty0, tx1, ty1);
+		for (float l : this->levels) cls.push_back(ContourClassFor(l));
+	}
+
+	void Run(const std::vector<VerifyPair>& pairs, size_t threads) {
+		const size_t nl = levels.size(), nt = tileCount();
+		maxLead = 0;
+		for (auto& p : pairs) maxLead = std::max(maxLead, p.lead);
+		tiles.assign(nt * nl, Contingency());
+		byLead.assign(((size_t)maxLead + 1) * nl, Contingency());
+		compared = skipped = 0;
+		// pairs は validtime 順なので、同じ観測を使う組が並ぶ
+		std::mutex mtx;
+		ParallelFor(nt, threads, [&](size_t t) {
+			const int x = tx0 + (int)(t % (tx1 - tx0 + 1)), y = ty0 + (int)(t / (tx1 - tx0 + 1));
+			std::vector<BYTE> ob(kTilePixels), fc(kTilePixels);
+			std::vector<Contingency> lead(byLead.size()), c(nl);
+			std::wstring loaded;
+			bool haveOb = false;
+			size_t n = 0, miss = 0;
+			for (auto& p : pairs) {
+				if (loaded != p.observed.validtime) {
+					loaded = p.observed.validtime;
+					haveOb = LoadTileClasses(JmaTilePath(p.observed, z, x, y), ob.data());
+				}
+				if (!haveOb || !LoadTileClasses(JmaTilePath(p.forecast, z, x, y), fc.data())) { ++miss; continue; }
+				c.assign(nl, Contingency());
+				CountContingency(fc.data(), ob.data(), cls.data(), (int)nl, c.data());
+				for (size_t k = 0; k < nl; ++k) { tiles[t * nl + k] += c[k]; lead[p.lead * nl + k] += c[k]; }
+				++n;
+			}
+			std::lock_guard<std::mutex> lk(mtx);
+			for (size_t i = 0; i < lead.size(); ++i) byLead[i] += lead[i];
+			compared += n; skipped += miss;
+			});
+	}
+
+	size_t tileCount() const { return (size_t)(tx1 - tx0 + 1) * (ty1 - ty0 + 1); }
+	const Contingency& Tile(size_t t, size_t level) const { return tiles[t * levels.size() + level]; }
+	const Contingency& Lead(int lead, size_t level) const { return byLead[lead * levels.size() + level]; }
+	Contingency Overall(size_t level) const {
+		Contingency c;
+		for (int l = 0; l <= maxLead; ++l) c += Lead(l, level);
+		return c;
+	}
+
+	int z, tx0, ty0, tx1, ty1, maxLead = 0;
+	std::vector<float> levels;
+	std::vector<int> cls;
+	size_t compared = 0, skipped = 0;	// 数えたタイルの組 / 片方が読めなかった組
+
+private:
+	std::vector<Contingency> tiles, byLead;
+};
+
+// -------------------- Mosaic Raster --------------------
+// 日本全域の JMA タイルを 1 時刻 1 枚の連続したラスタ (1 画素 1 バイトの階級、255 = データなし) にまとめる。
+// 出力ファイルはタイル行の帯ごとに書き込み用にマップし、タイルは読めた順にそのまま該当位置へ写す
+// (全体を一度メモリに組み立てない。z10 は 1 枚数百 MB になり、32 ビット版ではまとめてマップできない)。
+// 正距円筒 (緯度経度格子) への再投影は列と行の対応表を先に作り、最近傍で引く (階級なので補間しない)
+static const char kMosaicMagic[8] = { 'A', 'M', 'E', 'R', 'A', 'S', 'T', '1' };
+static const BYTE kMosaicNoData = 255;
+static const size_t kMosaicDataOffset = 128;
+static const size_t kMosaicBandBytes = 64u << 20;	// 一度にマップする帯の大きさの目安
+enum : uint8_t { kMosaicMercator = 0, kMosaicEquirect = 1 };
+
+#pragma pack(push, 1)
+struct MosaicHeader {
+	char magic[8];
+	uint32_t width, height;
+	uint8_t projection, z;
+	uint16_t reserved;
+	uint32_t tx0, ty0;							// メルカトル: 左上のタイル番号
+	double minLon, minLat, maxLon, maxLat;		// 正距円筒: 画素の外縁
+	uint64_t base, time;						// TimeKey
+};
+#pragma pack(pop)
+static_assert(sizeof(MosaicHeader) <= kMosaicDataOffset, "mosaic header layout");
+
+// 書き込み用にマップしたファイル (作成時にサイズを確定する)。ビューは Map で一部分ずつ作る
+class MappedOutputFile {
+public:
+	~MappedOutputFile() { Close(); }
+
+	bool Create(const std::wstring& file, uint64_t size) {
+		Close();
+		hFile = CreateFileW(file.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (hFile == INVALID_HANDLE_VALUE) {
+			CreateParentDirectories(file);
+			hFile = CreateFileW(file.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		}
+		if (hFile == INVALID_HANDLE_VALUE) { hFile = nullptr; return false; }
+		hMap = CreateFileMappingW(hFile, nullptr, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, nullptr);
+		if (!hMap) Close();
+		return hMap != nullptr;
+	}
+
+	// [offset, offset + size) を書き込み用にマップする (前のビューは外す)。返すのは offset の位置
+	BYTE* Map(uint64_t offset, size_t size) {
+		Unmap();
+		if (!hMap) return nullptr;
+		static const DWORD gran = []() { SYSTEM_INFO si; GetSystemInfo(&si); return si.dwAllocationGranularity; }();
+		const uint64_t start = offset - offset % gran;
+		base = (BYTE*)MapViewOfFile(hMap, FILE_MAP_WRITE, (DWORD)(start >> 32), (DWORD)start, (SIZE_T)(offset - start + size));
+		return base ? base + (offset - start) : nullptr;
+	}
+
+	void Unmap() {
+		if (base) UnmapViewOfFile(base);
+		base = nullptr;
+	}
+
+	void Close() {
+		Unmap();
+		if (hMap) CloseHandle(hMap);
+		if (hFile) CloseHandle(hFile);
+		base = nullptr; hMap = nullptr; hFile = nullptr;
+	}
+
+private:
+	HANDLE hFile{}, hMap{};
+	BYTE* base{};
+};
+
+// 出力格子とタイルの対応。span はタイル列 (行) ごとの出力列 (行) の範囲、px はタイル内の画素位置
+struct MosaicGrid {
+	uint8_t projection{};
+	int z{}, tx0{}, ty0{}, nx{}, ny{}, width{}, height{};
+	GeoBox box{};
+	std::vector<std::pair<int, int>> colSpan, rowSpan;
+	std::vector<BYTE> colPx, rowPx;
+
+	size_t pixels() const { return (size_t)width * height; }
+};
+
+// gridDeg <= 0 なら赤道での z の画素間隔 (経度方向の解像度をそろえる)
+static MosaicGrid MakeMosaicGrid(const GeoBox& b, int z, bool equirect, double gridDeg)
+{
+	MosaicGrid g;
+	g.z = z; g.box = b;
+	g.projection = equirect ? kMosaicEquirect : kMosaicMercator;
+	int tx1, ty1;
+	TileRangeForBox(b, z, g.tx0, g.ty0, tx1, ty1);
+	g.nx = tx1 - g.tx0 + 1; g.ny = ty1 - g.ty0 + 1;
+	g.colSpan.assign(g.nx, { 0, 0 }); g.rowSpan.assign(g.ny, { 0, 0 });
+	if (!equirect) {
+		g.width = g.nx * TILE_SIZE; g.height = g.ny * TILE_SIZE;
+		for (int i = 0; i < g.nx; ++i) g.colSpan[i] = { i * TILE_SIZE, (i + 1) * TILE_SIZE };
+		for (int j = 0; j < g.ny; ++j) g.rowSpan[j] = { j * TILE_SIZE, (j + 1) * TILE_SIZE };
+		return g;
+	}
+	if (gridDeg <= 0) gridDeg = 360.0 / ((double)TILE_SIZE * (1 << z));
+	g.width = (int)std::ceil((b.maxLon - b.minLon) / gridDeg);
+	g.height = (int)std::ceil((b.maxLat - b.minLat) / gridDeg);
+	g.box.maxLon = b.minLon + g.width * gridDeg;
+	g.box.minLat = b.maxLat - g.height * gridDeg;
+	// 画素中心の位置。経度・緯度とも単調なので、同じタイルに落ちる列 (行) は連続する
+	auto map = [&](int n, int t0, int tiles, auto&& world, std::vector<std::pair<int, int>>& span, std::vector<BYTE>& px) {
+		px.resize(n);
+		for (int k = 0; k < n; ++k) {
+			const int w = std::clamp((int)std::floor(world(k)), t0 * TILE_SIZE, (t0 + tiles) * TILE_SIZE - 1);
+			const int t = w / TILE_SIZE - t0;
+			px[k] = (BYTE)(w % TILE_SIZE);
+			if (span[t].first == span[t].second) span[t] = { k, k + 1 };
+			else span[t].second = k + 1;
+		}
+		};
+	map(g.width, g.tx0, g.nx, [&](int c) { return LonLatToWorldX(b.minLon + (c + 0.5) * gridDeg, z); }, g.colSpan, g.colPx);
+	map(g.height, g.ty0, g.ny, [&](int r) { return LonLatToWorldY(b.maxLat - (r + 0.5) * gridDeg, z); }, g.rowSpan, g.rowPx);
+	return g;
+}
+
+// タイル (i, j) の担当範囲を書く。plane が nullptr ならデータなし。raster の先頭は出力の firstRow 行目
+static void BlitMosaicTile(const MosaicGrid& g, int i, int j, const BYTE* plane, BYTE* raster, int firstRow = 0)
+{
+	const auto [c0, c1] = g.colSpan[i];
+	const auto [r0, r1] = g.rowSpan[j];
+	for (int r = r0; r < r1; ++r) {
+		BYTE* out = raster + (size_t)(r - firstRow) * g.width;
+		if (!plane) { memset(out + c0, kMosaicNoData, c1 - c0); continue; }
+		if (g.projection == kMosaicMercator) { memcpy(out + c0, plane + (r - r0) * TILE_SIZE, TILE_SIZE); continue; }
+		const BYTE* row = plane + g.rowPx[r] * TILE_SIZE;
+		for (int c = c0; c < c1; ++c) out[c] = row[g.colPx[c]];
+	}
+}
+
+struct MosaicBuildStats {
+	size_t tiles{}, missing{};
+	double seconds{}, blitSec{};	// blitSec はスレッドの合計
+};
+
+// 1 時刻分をファイルに書く。タイル行の帯ごとにマップし、各スレッドがタイルを読み込み次第そこへ直接写す
+static bool BuildMosaicFile(const NowcTime& T, const MosaicGrid& g, const std::wstring& file, size_t threads, MosaicBuildStats& st)
+{
+	auto t0 = std::chrono::steady_clock::now();
+	MappedOutputFile out;
+	if (!out.Create(file, kMosaicDataOffset + g.pixels())) return false;
+	BYTE* base = out.Map(0, sizeof(MosaicHeader));
+	if (!base) return false;
+	MosaicHeader h{};
+	memcpy(h.magic, kMosaicMagic, 8);
+	h.width = g.width; h.height = g.height;
+	h.projection = g.projection; h.z = (uint8_t)g.z;
+	h.tx0 = g.tx0; h.ty0 = g.ty0;
+	h.minLon = g.box.minLon; h.minLat = g.box.minLat; h.maxLon = g.box.maxLon; h.maxLat = g.box.maxLat;
+	h.base = TimeKey(T.basetime); h.time = TimeKey(T.validtime);
+	memcpy(base, &h, sizeof(h));
+
+	std::atomic<size_t> missing{ 0 };
+	std::atomic<int64_t> blitUs{ 0 };
+	const int bandRows = std::max(1, (int)(kMosaicBandBytes / ((size_t)g.width * TILE_SIZE)));
+	for (int j0 = 0; j0 < g.ny; j0 += bandRows) {
+		const int j1 = std::min(g.ny, j0 + bandRows);
+		// 正距円筒では画素の中心が落ちないタイル行 (範囲が空) があるので、空でない行から帯の範囲を決める
+		int r0 = -1, r1 = -1;
+		for (int j = j0; j < j1; ++j) {
+			if (g.rowSpan[j].first == g.rowSpan[j].second) continue;
+			if (r0 < 0) r0 = g.rowSpan[j].first;
+			r1 = g.rowSpan[j].second;
+		}
+		if (r0 < 0) continue;
+		BYTE* raster = out.Map(kMosaicDataOffset + (uint64_t)r0 * g.width, (size_t)(r1 - r0) * g.width);
+		if (!raster) return false;
+		ParallelFor((size_t)g.nx * (j1 - j0), threads, [&](size_t k) {
+			const int i = (int)(k % g.nx), j = j0 + (int)(k / g.nx);
+			if (g.colSpan[i].first == g.colSpan[i].second || g.rowSpan[j].first == g.rowSpan[j].second) return;
+			std::vector<BYTE> p(kTilePixels);
+			const bool ok = LoadTileClasses(JmaTilePath(T, g.z, g.tx0 + i, g.ty0 + j), p.data());
+			if (!ok) ++missing;
+			auto t1 = std::chrono::steady_clock::now();
+			BlitMosaicTile(g, i, j, ok ? p.data() : nullptr, raster, r0);
+			blitUs += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t1).count();
+			});
+	}
+	out.Close();
+	st.tiles = (size_t)g.nx * g.ny;
+	st.missing = missing;
+	st.blitSec = blitUs / 1e6;
+	st.seconds = SecondsSince(t0);
+	return true;
+}
+
+// -------------------- Grid Export --------------------
+// 降水強度 (mm/h、階級の代表値) の float32 格子を GeoTIFF または生データ + ヘッダ (.flt/.hdr/.prj) で書く。
+// 格子は MosaicGrid (メルカトル = EPSG:3857 のタイル境界、正距円筒 = EPSG:4326) と同じ。
+// 出力はタイル 1 行分ずつ読み込んで上から順に書くので、保持するのはタイル 1 行分の階級と 1 行分の float だけ
+enum class GridFormat { GeoTiff, RawFloat };
+static const float kGridNoData = -9999.0f;
+static const double kMercatorHalf = 20037508.342789244;	// EPSG:3857 の赤道半周 (m)
+
+static const char kWebMercatorPrj[] =
+	"PROJCS[\"WGS_1984_Web_Mercator_Auxiliary_Sphere\",GEOGCS[\"GCS_WGS_1984\",DATUM[\"D_WGS_1984\",SPHEROID[\"WGS_1984\",6378137.0,298.257223563]],"
+	"PRIMEM[\"Greenwich\",0.0],UNIT[\"Degree\",0.0174532925199433]],PROJECTION[\"Mercator_Auxiliary_Sphere\"],PARAMETER[\"False_Easting\",0.0],"
+	"PARAMETER[\"False_Northing\",0.0],PARAMETER[\"Central_Meridian\",0.0],PARAMETER[\"Standard_Parallel_1\",0.0],"
+	"PARAMETER[\"Auxiliary_Sphere_Type\",0.0],UNIT[\"Meter\",1.0]]";
+static const char kWgs84Prj[] =
+	"GEOGCS[\"GCS_WGS_1984\",DATUM[\"D_WGS_1984\",SPHEROID[\"WGS_1984\",6378137.0,298.257223563]],PRIMEM[\"Greenwich\",0.0],UNIT[\"Degree\",0.0174532925199433]]";
+
+// 左上の角の座標と画素の大きさ (メルカトルは m、正距円筒は度)
+static void GridGeoTransform(const MosaicGrid& g, double& x0, double& y0, double& dx, double& dy)
+{
+	if (g.projection == kMosaicEquirect) {
+		x0 = g.box.minLon; y0 = g.box.maxLat;
+		dx = (g.box.maxLon - g.box.minLon) / g.width; dy = (g.box.maxLat - g.box.minLat) / g.height;
+		return;
+	}
+	dx = dy = 2.0 * kMercatorHalf / ((double)TILE_SIZE * (1 << g.z));
+	x0 = -kMercatorHalf + (double)g.tx0 * TILE_SIZE * dx;
+	y0 = kMercatorHalf - (double)g.ty0 * TILE_SIZE * dy;
+}
+
+// 上の行から順に WriteRow するだけの書き手。非圧縮なのでストリップ位置は先に決まり、IFD を先頭に置ける
+class GridRasterWriter {
+public:
+	~GridRasterWriter() { if (f) fclose(f); }
+
+	bool Open(const std::wstring& file, const MosaicGrid& g, GridFormat format) {
+		width = g.width; height = g.height;
+		if (format == GridFormat::RawFloat && !WriteSidecars(file, g)) return false;
+		if (_wfopen_s(&f, file.c_str(), L"wb") != 0 || !f) { f = nullptr; return false; }
+		return format == GridFormat::RawFloat || WriteTiffHeader(g);
+	}
+
+	bool WriteRow(const float* row) { return fwrite(row, sizeof(float), width, f) == (size_t)width; }
+
+	bool Finish() {
+		bool ok = f && fflush(f) == 0 && !ferror(f);
+		if (f) fclose(f);
+		f = nullptr;
+		return ok;
+	}
+
+private:
+	// 1 行 1 ストリップより大きく、1 ストリップが数 MB に収まる程度にまとめる
+	static const uint32_t kRowsPerStrip = 16;
+
+	bool WriteTiffHeader(const MosaicGrid& g) {
+		const uint64_t rowBytes = (uint64_t)width * sizeof(float);
+		const uint32_t strips = (height + kRowsPerStrip - 1) / kRowsPerStrip;
+		double x0, y0, dx, dy;
+		GridGeoTransform(g, x0, y0, dx, dy);
+		const double scale[3] = { dx, dy, 0.0 }, tie[6] = { 0.0, 0.0, 0.0, x0, y0, 0.0 };
+		const uint16_t geoKeys[16] = {
+			1, 1, 0, 3,
+			1024, 0, 1, (uint16_t)(g.projection == kMosaicEquirect ? 2 : 1),	// GTModelType: geographic / projected
+			1025, 0, 1, 1,														// GTRasterType: PixelIsArea
+			(uint16_t)(g.projection == kMosaicEquirect ? 2048 : 3072), 0, 1, (uint16_t)(g.projection == kMosaicEquirect ? 4326 : 3857),
+		};
+		char noData[16];
+		const int noDataLen = sprintf_s(noData, "%g", kGridNoData) + 1;
+
+		// IFD (15 項目) の後ろに配列を置き、画素はその後から
+		struct Tag { uint16_t id, type; uint32_t count; std::vector<BYTE> data; };
+		std::vector<Tag> tags;
+		auto add = [&](uint16_t id, uint16_t type, uint32_t count, const void* p, size_t size) {
+			tags.push_back({ id, type, count, std::vector<BYTE>((const BYTE*)p, (const BYTE*)p + size) });
+			};
+		auto addShort = [&](uint16_t id, uint16_t v) { add(id, 3, 1, &v, 2); };
+		auto addLong = [&](uint16_t id, uint32_t v) { add(id, 4, 1, &v, 4); };
+		std::vector<uint32_t> offsets(strips), counts(strips);
+		addLong(256, width);
+		addLong(257, height);
+		addShort(258, 32);
+		addShort(259, 1);							// 非圧縮
+		addShort(262, 1);							// BlackIsZero
+		add(273, 4, strips, offsets.data(), strips * 4);
+		addShort(277, 1);
+		addLong(278, kRowsPerStrip);
+		add(279, 4, strips, counts.data(), strips * 4);
+		addShort(284, 1);
+		addShort(339, 3);							// IEEE float
+		add(33550, 12, 3, scale, sizeof(scale));	// ModelPixelScale
+		add(33922, 12, 6, tie, sizeof(tie));		// ModelTiepoint
+		add(34735, 3, 16, geoKeys, sizeof(geoKeys));
+		add(42113, 2, noDataLen, noData, noDataLen);	// GDAL_NODATA
+
+		const uint32_t ifdBytes = 2 + (uint32_t)tags.size() * 12 + 4;
+		uint64_t extra = 8 + ifdBytes;
+		for (auto& t : tags) if (t.data.size() > 4) extra += (t.data.size() + 1) & ~(size_t)1;
+		const uint64_t dataStart = (extra + 15) & ~(uint64_t)15;
+		if (dataStart + rowBytes * height > 0xFFFFFFFFull) return false;	// 4 GB を超えるなら BigTIFF が要る
+		for (uint32_t s = 0; s < strips; ++s) {
+			offsets[s] = (uint32_t)(dataStart + rowBytes * s * kRowsPerStrip);
+			counts[s] = (uint32_t)(rowBytes * std::min(kRowsPerStrip, height - s * kRowsPerStrip));
+		}
+		memcpy(tags[5].data.data(), offsets.data(), strips * 4);	// StripOffsets
+		memcpy(tags[8].data.data(), counts.data(), strips * 4);		// StripByteCounts
+
+		std::vector<BYTE> head, tail;
+		auto put = [](std::vector<BYTE>& v, const void* p, size_t n) { v.insert(v.end(), (const BYTE*)p, (const BYTE*)p + n); };
+		const uint32_t ifdOffset = 8;
+		put(head, "II\x2A\0", 4);
+		put(head, &ifdOffset, 4);
+		const uint16_t n = (uint16_t)tags.size();
+		put(head, &n, 2);
+		uint32_t at = 8 + ifdBytes;
+		for (auto& t : tags) {
+			put(head, &t.id, 2); put(head, &t.type, 2); put(head, &t.count, 4);
+			uint32_t v = 0;
+			if (t.data.size() <= 4) memcpy(&v, t.data.data(), t.data.size());
+			else {
+				v = at;
+				put(tail, t.data.data(), t.data.size());
+				if (t.data.size() & 1) tail.push_back(0);
+				at += (uint32_t)((t.data.size() + 1) & ~(size_t)1);
+			}
+			put(head, &v, 4);
+		}
+		const uint32_t next = 0;
+		put(head, &next, 4);
+		head.insert(head.end(), tail.begin(), tail.end());
+		head.resize((size_t)dataStart, 0);
+		return fwrite(head.data(), 1, head.size(), f) == head.size();
+	}
+
+	// ESRI の .hdr (EHdr) と .prj。メルカトルの画素は正方形なので cellsize 1 つで足りる
+	bool WriteSidecars(const std::wstring& file, const MosaicGrid& g) {
+		const std::wstring stem = file.substr(0, file.find_last_of(L'.') == std::wstring::npos ? file.size() : file.find_last_of(L'.'));
+		double x0, y0, dx, dy;
+		GridGeoTransform(g, x0, y0, dx, dy);
+		FILE* h = nullptr;
+		if (_wfopen_s(&h, (stem + L".hdr").c_str(), L"wb") != 0 || !h) return false;
+		fprintf(h, "ncols %d\r\nnrows %d\r\nxllcorner %.10f\r\nyllcorner %.10f\r\n", width, height, x0, y0 - dy * height);
+		if (std::abs(dx - dy) <= 1e-9 * dx) fprintf(h, "cellsize %.12f\r\n", dx);
+		else fprintf(h, "xdim %.12f\r\nydim %.12f\r\n", dx, dy);
+		fprintf(h, "nodata_value %g\r\nbyteorder lsbfirst\r\nnbits 32\r\npixeltype float\r\nlayout bil\r\nnbands 1\r\n", kGridNoData);
+		fclose(h);
+		if (_wfopen_s(&h, (stem + L".prj").c_str(), L"wb") != 0 || !h) return false;
+		fputs(g.projection == kMosaicEquirect ? kWgs84Prj : kWebMercatorPrj, h);
+		fclose(h);
+		return true;
+	}
+
+	FILE* f{};
+	uint32_t width{}, height{};
+};
+
+struct GridExportStats {
+	size_t tiles{}, missing{};
+	double loadSec{}, writeSec{};
+};
+
+// 1 時刻分を書き出す。タイル行ごとに該当タイルを並列に読み、出力行に写して float に直して書く
+static bool ExportIntensityGrid(const NowcTime& T, const MosaicGrid& g, const std::wstring& file, GridFormat format, size_t threads, GridExportStats& st)
+{
+	GridRasterWriter w;
+	if (!w.Open(file, g, format)) return false;
+	static const auto lut = []() {
+		std::vector<float> t(256, kGridNoData);
+		for (int c = 0; c < kJmaClassCount; ++c) t[c] = JmaClassMmh(c);
+		return t;
+		}();
+	std::vector<BYTE> strip;
+	std::vector<float> row(g.width);
+	std::atomic<size_t> missing{ 0 };
+	for (int j = 0; j < g.ny; ++j) {
+		const auto [r0, r1] = g.rowSpan[j];
+		if (r0 == r1) continue;
+		auto t0 = std::chrono::steady_clock::now();
+		strip.assign((size_t)(r1 - r0) * g.width, kMosaicNoData);
+		ParallelFor(g.nx, threads, [&](size_t i) {
+			if (g.colSpan[i].first == g.colSpan[i].second) return;
+			std::vector<BYTE> p(kTilePixels);
+			const bool ok = LoadTileClasses(JmaTilePath(T, g.z, g.tx0 + (int)i, g.ty0 + j), p.data());
+			if (!ok) ++missing;
+			BlitMosaicTile(g, (int)i, j, ok ? p.data() : nullptr, strip.data(), r0);
+			});
+		st.loadSec += SecondsSince(t0);
+		t0 = std::chrono::steady_clock::now();
+		for (int r = 0; r < r1 - r0; ++r) {
+			const BYTE* cls = strip.data() + (size_t)r * g.width;
+			for (int c = 0; c < g.width; ++c) row[c] = lut[cls[c]];
+			if (!w.WriteRow(row.data())) return false;
+		}
+		st.writeSec += SecondsSince(t0);
+	}
+	st.tiles += (size_t)g.nx * g.ny;
+	st.missing += missing;
+	return w.Finish();
+}
+
+// -------------------- Route Exposure --------------------
+// 経路 (折れ線) を出発時刻と区間ごとの速度で走ったとき、各地点を通る時刻のフレーム (過去は N1、先は N2) で
+// 強度を引き、区間ごとの雨量を出す。全経路のサンプル点を (フレーム, タイル) でまとめ、組ごとに 1 回だけ読む
+struct RouteVertex {
+	double lon, lat;
+	float kmh;			// この頂点から次の頂点までの速度
+};
+struct Route {
+	std::string name;
+	int64_t departMin{};	// UTC の通算分 (ValidTimeMinutes)
+	std::vector<RouteVertex> pts;
+};
+
+struct RouteSegmentExposure {
+	float km{}, minutes{};
+	double startMin{};		// 区間に入る時刻
+	float meanMmh{}, maxMmh{};
+	float rainKm{};			// 閾値以上の中を走る距離
+	float exposureMm{};		// 強度を走行時間で積分した量 (mm)
+	int samples{}, missing{};
+};
+
+// 通算分 → フレーム。N1 と N2 (最新の観測より先のみ) を 5 分刻みの枠に並べ、最も近い枠を使う
+class FrameTimeline {
+public:
+	void Build(const std::vector<NowcTime>& obs, const std::vector<NowcTime>& fc) {
+		frames.clear(); slot.clear();
+		int64_t latest = INT64_MIN;
+		for (auto& T : obs) { frames.push_back(T); latest = std::max(latest, ValidTimeMinutes(T.validtime)); }
+		for (auto& T : fc) if (ValidTimeMinutes(T.validtime) > latest) frames.push_back(T);
+		if (frames.empty()) return;
+		first = INT64_MAX; last = INT64_MIN;
+		for (auto& T : frames) { first = std::min(first, ValidTimeMinutes(T.validtime)); last = std::max(last, ValidTimeMinutes(T.validtime)); }
+		slot.assign((size_t)((last - first) / 5 + 1), -1);
+		for (int i = 0; i < (int)frames.size(); ++i) slot[(size_t)((ValidTimeMinutes(frames[i].validtime) - first) / 5)] = i;
+		latestObs = latest;
+	}
+
+	// 範囲外や欠けた枠は -1
+	int FrameAt(double minute) const {
+		if (slot.empty()) return -1;
+		const double k = std::floor((minute - first) / 5.0 + 0.5);
+		return k < 0 || k >= (double)slot.size() ? -1 : slot[(size_t)k];
+	}
+
+	std::vector<NowcTime> frames;
+	int64_t first{}, last{}, latestObs{};
+
+private:
+	std::vector<int> slot;
+};
+
+class RouteExposureQuery {
+public:
+	struct Stats {
+		size_t samples{}, outOfTime{}, groups{}, failedLoads{};
+		double planSec{}, fetchSec{}, reduceSec{};
+	};
+
+	// 各区間を stepKm 以下の小区間に分け、その中点を通る時刻と位置でサンプルを置く
+	RouteExposureQuery(const std::vector<Route>& routes, const FrameTimeline& tl, int z, double stepKm) : routes(routes), zoom(z) {
+		auto t0 = std::chrono::steady_clock::now();
+		const int n = 1 << z;
+		std::vector<std::pair<uint64_t, uint32_t>> keyed;
+		for (uint32_t r = 0; r < (uint32_t)routes.size(); ++r) {
+			const Route& rt = routes[r];
+			double t = (double)rt.departMin;
+			for (uint32_t s = 0; s + 1 < (uint32_t)rt.pts.size(); ++s) {
+				const RouteVertex& a = rt.pts[s], & b = rt.pts[s + 1];
+				double dx, dy;
+				GeoOffsetKm(a.lon, a.lat, b.lon, b.lat, dx, dy);
+				const double km = std::hypot(dx, dy), minutes = km / std::max(1.0f, a.kmh) * 60.0;
+				const int parts = std::max(1, (int)std::ceil(km / stepKm));
+				for (int k = 0; k < parts; ++k) {
+					const double u = (k + 0.5) / parts;
+					const double lon = a.lon + (b.lon - a.lon) * u, lat = a.lat + (b.lat - a.lat) * u;
+					Sample smp{ r, s, (float)(km / parts), (float)(minutes / parts), 0 };
+					const int frame = tl.FrameAt(t + minutes * u);
+					const double wx = LonLatToWorldX(lon, z), wy = LonLatToWorldY(lat, z);
+					const int tx = (int)std::floor(wx / TILE_SIZE), ty = (int)std::floor(wy / TILE_SIZE);
+					if (frame >= 0 && tx >= 0 && ty >= 0 && tx < n && ty < n) {
+						smp.pixel = (uint16_t)(std::clamp((int)(wy - ty * TILE_SIZE), 0, TILE_SIZE - 1) * TILE_SIZE + std::clamp((int)(wx - tx * TILE_SIZE), 0, TILE_SIZE - 1));
+						keyed.emplace_back(((uint64_t)frame << 44) | ((uint64_t)ty << 22) | (uint64_t)tx, (uint32_t)samples.size());
+					}
+					else ++stats.outOfTime;
+					samples.push_back(smp);
+				}
+				t += minutes;
+			}
+		}
+		std::sort(keyed.begin(), keyed.end());
+		order.reserve(keyed.size());
+		for (size_t i = 0; i < keyed.size(); ++i) {
+			if (i == 0 || keyed[i].first != keyed[i - 1].first) {
+				const uint64_t k = keyed[i].first;
+				groups.push_back({ (int)(k >> 44), (int)(k & 0x3FFFFF), (int)((k >> 22) & 0x3FFFFF), i, i });
+			}
+			groups.back().end = i + 1;
+			order.push_back(keyed[i].second);
+		}
+		frames = tl.frames;
+		stats.samples = samples.size();
+		stats.groups = groups.size();
+		stats.planSec = SecondsSince(t0);
+	}
+
+	// out[経路][区間]
+	void Run(size_t threads, float thresholdMmh, std::vector<std::vector<RouteSegmentExposure>>& out) {
+		auto t0 = std::chrono::steady_clock::now();
+		std::vector<BYTE> cls(samples.size(), kNoSample);
+		std::atomic<size_t> failed{ 0 };
+		ParallelFor(groups.size(), threads, [&](size_t gi) {
+			const Group& gr = groups[gi];
+			thread_local std::vector<BYTE> plane;
+			plane.resize(kTilePixels);
+			if (!LoadTileClasses(JmaTilePath(frames[gr.frame], zoom, gr.tx, gr.ty), plane.data())) { ++failed; return; }
+			for (size_t i = gr.begin; i < gr.end; ++i) cls[order[i]] = plane[samples[order[i]].pixel];
+			});
+		stats.failedLoads = failed;
+		stats.fetchSec = SecondsSince(t0);
+
+		t0 = std::chrono::steady_clock::now();
+		out.assign(routes.size(), {});
+		for (size_t r = 0; r < routes.size(); ++r) out[r].resize(routes[r].pts.size() > 1 ? routes[r].pts.size() - 1 : 0);
+		for (size_t i = 0; i < samples.size(); ++i) {
+			const Sample& s = samples[i];
+			RouteSegmentExposure& e = out[s.route][s.seg];
+			e.km += s.km; e.minutes += s.minutes; ++e.samples;
+			if (cls[i] == kNoSample) { ++e.missing; continue; }
+			const float mmh = JmaClassMmh(cls[i]);
+			e.meanMmh += mmh;		// 区間内の小区間は同じ長さ
+			e.maxMmh = std::max(e.maxMmh, mmh);
+			if (mmh >= thresholdMmh) e.rainKm += s.km;
+			e.exposureMm += mmh * s.minutes / 60.0f;
+		}
+		for (size_t r = 0; r < routes.size(); ++r) {
+			double t = (double)routes[r].departMin;
+			for (auto& seg : out[r]) {
+				seg.startMin = t;
+				t += seg.minutes;
+				if (seg.samples > seg.missing) seg.meanMmh /= (float)(seg.samples - seg.missing);
+			}
+		}
+		stats.reduceSec = SecondsSince(t0);
+	}
+
+	const Stats& statistics() const { return stats; }
+
+private:
+	struct Sample {
+		uint32_t route, seg;
+		float km, minutes;
+		uint16_t pixel;
+	};
+	struct Group {
+		int frame, tx, ty;
+		size_t begin, end;		// order[begin, end) がこの (フレーム, タイル) のサンプル
+	};
+	const std::vector<Route>& routes;
+	int zoom;
+	std::vector<NowcTime> frames;
+	std::vector<Sample> samples;
+	std::vector<uint32_t> order;
+	std::vector<Group> groups;
+	Stats stats;
+};
+
+// -------------------- Watch & Alerts --------------------
+// 監視する地点/領域ごとに、観測 (N1 の最新) と予測 (N2) の強度を閾値と比べ、
+// 閾値を超えた/下回ったときだけ通知する。必要なタイルは監視対象にかかるものだけを読む。
+struct WatchItem {
+	std::string name;
+	GeoPolygon area;	// 頂点が 1 つなら地点
+	bool isPoint() const { return area.rings.size() == 1 && area.rings[0].size() == 1; }
+};
+
+struct AlertEvent {
+	std::string item;
+	bool forecast{};
+	bool raised{};			// true = 閾値超え、false = 解除
+	int cls{};				// 対象フレーム中の最大階級
+	std::wstring validtime;	// 最初に閾値を超えたフレーム (解除時は評価した最新フレーム)
+};
+
+static std::string UtcNowIso()
+{
+	time_t now = time(nullptr);
+	tm t{};
+	gmtime_s(&t, &now);
+	char buf[32];
+	strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &t);
+	return buf;
+}
+
+// JSON 文字列の中身として書けるようにする (名前は利用者の CSV から来る)
+static std::string JsonEscape(const std::string& s)
+{
+	std::string out;
+	out.reserve(s.size());
+	for (unsigned char c : s) {
+		if (c == '"' || c == '\\') { out += '\\'; out += (char)c; }
+		else if (c == '\n') out += "\\n";
+		else if (c == '\r') out += "\\r";
+		else if (c == '\t') out += "\\t";
+		else if (c < 0x20 || c == 0x7F) { char u[8]; sprintf_s(u, "\\u%04x", c); out += u; }
+		else out += (char)c;
+	}
+	return out;
+}
+
+// 通知先: 1 行 1 件の JSON をファイルへ追記、または UDP で送る
+class AlertSink {
+public:
+	~AlertSink() {
+		if (f) fclose(f);
+		if (sock != INVALID_SOCKET) { closesocket(sock); WSACleanup(); }
+	}
+	bool OpenFile(const std::wstring& path) {
+		return _wfopen_s(&f, path.c_str(), L"ab") == 0 && f;
+	}
+	// "host:port"
+	bool OpenUdp(const std::wstring& target) {
+		size_t colon = target.rfind(L':');
+		if (colon == std::wstring::npos) return false;
+		std::string host(target.begin(), target.begin() + colon), port(target.begin() + colon + 1, target.end());
+		WSADATA wsa;
+		if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) return false;
+		addrinfo hints{}, * res = nullptr;
+		hints.ai_family = AF_INET; hints.ai_socktype = SOCK_DGRAM; hints.ai_protocol = IPPROTO_UDP;
+		if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 || !res) { WSACleanup(); return false; }
+		memcpy(&addr, res->ai_addr, res->ai_addrlen);
+		addrLen = (int)res->ai_addrlen;
+		freeaddrinfo(res);
+		sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		if (sock == INVALID_SOCKET) { WSACleanup(); return false; }
+		return true;
+	}
+	bool isOpen() const { return f || sock != INVALID_SOCKET; }
+
+	void Emit(const AlertEvent& e) {
+		char tail[256];
+		int n = sprintf_s(tail, "\",\"kind\":\"%s\",\"state\":\"%s\",\"validtime\":\"%ls\",\"mmh_lo\":%g,\"mmh_hi\":%g}\n",
+			e.forecast ? "forecast" : "observation", e.raised ? "alert" : "clear",
+			e.validtime.c_str(), kJmaScale[e.cls].lo, kJmaScale[e.cls].hi);
+		if (n <= 0) return;
+		std::string line = "{\"time\":\"" + UtcNowIso() + "\",\"item\":\"" + JsonEscape(e.item) + tail;
+		if (f) { fwrite(line.data(), 1, line.size(), f); fflush(f); }
+		if (sock != INVALID_SOCKET) sendto(sock, line.data(), (int)line.size(), 0, (const sockaddr*)&addr, addrLen);
+	}
+
+private:
+	FILE* f{};
+	SOCKET sock{ INVALID_SOCKET };
+	sockaddr_storage addr{};
+	int addrLen{};
+};
+
+class WatchEvaluator {
+public:
+	struct Stats {
+		size_t frames{}, tileLoads{}, failedLoads{};
+		double evalMs{};
+	};
+
+	WatchEvaluator(const std::vector<WatchItem>& list, int z, float thresholdMmh, size_t threadCount)
+		: items(list), regions(z), threshold(thresholdMmh), threads(threadCount), obsState(list.size()), fcState(list.size()) {
+		std::vector<GeoPoint> pts;
+		for (size_t i = 0; i < items.size(); ++i) {
+			if (items[i].isPoint()) { pointItems.push_back(i); pts.push_back(items[i].area.rings[0][0]); }
+			else { regionItems.push_back(i); regions.Add(items[i].area); }
+		}
+		points = std::make_unique<PointSeriesQuery>(pts, z);
+	}
+
+	// frames (任意の順) を評価し、状態が変わった監視対象の通知を events に積む
+	void Evaluate(const std::vector<NowcTime>& frames, bool forecast, std::vector<AlertEvent>& events, Stats& st) {
+		if (frames.empty()) return;	// 一覧が空なら判定しない (イベントなし)
+		auto t0 = std::chrono::steady_clock::now();
+		std::vector<int> idx(frames.size());
+		for (size_t i = 0; i < idx.size(); ++i) idx[i] = (int)i;
+		// 監視対象ごとのフレーム別最大階級
+		std::vector<std::vector<int>> cls(items.size(), std::vector<int>(frames.size(), 0));
+		if (!pointItems.empty()) {
+			std::vector<BYTE> out;
+			points->Run(frames, idx, threads, out);
+			for (size_t f = 0; f < frames.size(); ++f)
+				for (size_t p = 0; p < pointItems.size(); ++p) {
+					BYTE c = out[f * pointItems.size() + p];
+					cls[pointItems[p]][f] = c == kNoSample ? 0 : c;
+				}
+			st.tileLoads += points->statistics().tileLoads;
+			st.failedLoads += points->statistics().failedLoads;
+		}
+		if (!regionItems.empty()) {
+			// 読んだ回数は実際の呼び出しで数える (missingTiles は多角形ごとなので、タイルを共有すると重複する)
+			std::atomic<size_t> loads{ 0 }, failed{ 0 };
+			std::vector<std::vector<AreaStats>> res;
+			regions.Run(frames, idx, threads, [&](const std::wstring& path, BYTE* plane) {
+				++loads;
+				bool ok = LoadTileClasses(path, plane);
+				if (!ok) ++failed;
+				return ok;
+				}, res);
+			for (size_t f = 0; f < frames.size(); ++f)
+				for (size_t r = 0; r < regionItems.size(); ++r) cls[regionItems[r]][f] = res[f][r].maxClass;
+			st.tileLoads += loads;
+			st.failedLoads += failed;
+		}
+		// 閾値判定 (フレームは時刻順に見て、最初に超えたものを報告する)
+		std::vector<size_t> order(frames.size());
+		for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+		std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return frames[a].validtime < frames[b].validtime; });
+		auto& state = forecast ? fcState : obsState;
+		for (size_t i = 0; i < items.size(); ++i) {
+			int maxCls = 0;
+			const NowcTime* first = nullptr;
+			for (size_t f : order) {
+				int c = cls[i][f];
+				maxCls = std::max(maxCls, c);
+				if (!first && c > 0 && kJmaScale[c].lo >= threshold) first = &frames[f];
+			}
+			bool raised = first != nullptr;
+			if (raised == state[i]) continue;
+			state[i] = raised;
+			events.push_back({ items[i].name, forecast, raised, maxCls, raised ? first->validtime : frames[order.back()].validtime });
+		}
+		st.frames += frames.size();
+		st.evalMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+	}
+
+private:
+	std::vector<WatchItem> items;
+	std::vector<size_t> pointItems, regionItems;
+	std::unique_ptr<PointSeriesQuery> points;
+	RegionStatsEngine regions;
+	float threshold;
+	size_t threads;
+	std::vector<bool> obsState, fcState;	// 現在閾値を超えているか
+};
+
+// -------------------- Archive Playback --------------------
+// --playback で開いたアーカイブの時刻列を gTimes にして再生する。
+// タイムラインのドラッグ中は低ズーム (MIN_JMA_ZOOM) のタイルだけで描き、止まってから表示ズームを重ねる。
+// 先読みスレッドが進行方向の時刻のタイルをデコードしておき、メインスレッドは D2D 化だけを行う。
+static const float kTimelineHeight = 28.0f;
+static const int kCoarseAhead = 16;
+static const int kMaxFullAhead = 8;
+
+static bool OpenArchive(const std::wstring& file)
+{
+	gArchive = std::make_unique<TileArchive>();
+	if (!gArchive->Open(file)) { gArchive.reset(); return false; }
+	gDeltaReader = std::make_unique<DeltaPlaneReader>(*gArchive);
+	return true;
+}
+
+static bool OpenPlayback(const std::wstring& file)
+{
+	if (!OpenArchive(file)) return false;
+	gPlayback.active = true;
+	return true;
+}
+
+// 観測 (basetime == validtime) の時刻を新しい順に並べる。観測がなければ全時刻を使う
+static bool LoadPlaybackTimes()
+{
+	auto times = gArchive->Times(kLayerJmaHrpns);
+	if (times.empty()) times = gArchive->Times(kLayerJmaDelta);
+	bool anyObs = std::any_of(times.begin(), times.end(), [](auto& t) { return t.first == t.second; });
+	gTimes.clear();
+	for (auto it = times.rbegin(); it != times.rend(); ++it) {
+		if (anyObs && it->first != it->second) continue;
+		gTimes.push_back({ TimeString(it->second), TimeString(it->first) });
+	}
+	gTimeIndex = 0;
+	gAnimPlaying = false;
+	return !gTimes.empty();
+}
+
+static double MsSince(std::chrono::steady_clock::time_point t0)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+static bool PlaybackScrubbing()
+{
+	return gPlayback.dragging || MsSince(gPlayback.lastSeek) < kScrubSettleMs;
+}
+
+static void RecordSeekLatency(std::deque<double>& q, double ms)
+{
+	q.push_back(ms);
+	if (q.size() > kSeekStatCount) q.pop_front();
+}
+
+class PlaybackReadahead {
+public:
+	~PlaybackReadahead() { Stop(); }
+	void Start() {
+		stop = false;
+		th = std::thread([this]() { Loop(); });
+	}
+	void Stop() {
+		{
+			std::lock_guard<std::mutex> lk(mtx);
+			stop = true;
+		}
+		cv.notify_all();
+		if (th.joinable()) th.join();
+	}
+	// メインスレッドから現在位置・進行方向・ビューを伝える (変化がなければ何もしない)
+	void Hint(int index, int dir, const MapView& v) {
+		std::lock_guard<std::mutex> lk(mtx);
+		if (index == hIndex && dir == hDir && v.w == hView.w && v.h == hView.h &&
+			v.zoom == hView.zoom && v.originWX == hView.originWX && v.originWY == hView.originWY) return;
+		hIndex = index; hDir = dir; hView = v;
+		++gen;
+		cv.notify_all();
+	}
+
+private:
+	void Loop() {
+		uint64_t seen = 0;
+		for (;;) {
+			int index, dir;
+			MapView v;
+			{
+				std::unique_lock<std::mutex> lk(mtx);
+				cv.wait(lk, [&]() { return stop || gen != seen; });
+				if (stop) return;
+				seen = gen; index = hIndex; dir = hDir; v = hView;
+			}
+			// 優先順: 現在〜近い時刻の低ズーム → 現在の表示ズーム → 先の時刻の表示ズーム
+			// (gTimes は再生中は変更されないので読み取りのみ)
+			std::vector<std::pair<std::wstring, bool>> paths;
+			auto add = [&](int ti, int z) {
+				if (ti < 0 || ti >= (int)gTimes.size()) return;
+				ForEachJmaTile(v, gTimes[ti], [&](const std::wstring& p, const D2D1_RECT_F&) { paths.emplace_back(p, ti == index); }, z);
+				};
+			for (int k = 0; k <= kCoarseAhead; ++k) add(index + dir * k, MIN_JMA_ZOOM);
+			size_t before = paths.size();
+			add(index, -1);
+			size_t perFrame = std::max<size_t>(1, paths.size() - before);
+			int ahead = (int)std::clamp<size_t>(kTileLayers[kTileRain].cacheTiles / 2 / perFrame, 1, kMaxFullAhead);
+			for (int k = 1; k <= ahead; ++k) add(index + dir * k, -1);
+
+			for (const auto& p : paths) {
+				if (stop || gen != seen) break;
+				{
+					std::lock_guard<std::mutex> lk(gCacheMtx);
+					if (gCache.count(p.first)) continue;
+				}
+				IWICBitmap* bmp = DecodeArchiveTile(p.first);
+				if (!bmp) continue;
+				std::vector<BYTE> classes(kTilePixels);
+				if (!ClassifyWicBitmap(bmp, classes.data())) classes.clear();
+				{
+					std::lock_guard<std::mutex> lk(gCacheMtx);
+					auto r = gCache.emplace(p.first, Img());
+					if (r.second) {
+						r.first->second.decoded = bmp;
+						r.first->second.classes = std::move(classes);
+						r.first->second.lastUsed = std::chrono::steady_clock::now();
+					}
+					else {
+						SAFE_RELEASE(bmp);
+					}
+				}
+				// 表示中の時刻のタイルだけ再描画を促す
+				if (p.second && g.hwnd) PostMessage(g.hwnd, WM_TILE_READY, 0, 0);
+			}
+		}
+	}
+
+	std::thread th;
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::atomic<bool> stop{ false };
+	std::atomic<uint64_t> gen{ 0 };
+	int hIndex{ -1 }, hDir{ -1 };
+	MapView hView{};
+};
+static PlaybackReadahead gReadahead;
+
+static void PlaybackSeek(int index)
+{
+	if (gTimes.empty()) return;
+	index = std::clamp(index, 0, (int)gTimes.size() - 1);
+	if (index == gTimeIndex && !gAnimPlaying) return;
+	gPlayback.lastDir = index < gTimeIndex ? -1 : +1;
+	gAnimPlaying = false;
+	gTimeIndex = index;
+	gPlayback.lastSeek = gPlayback.seekStart = std::chrono::steady_clock::now();
+	gPlayback.pendingIndex = index;
+	gPlayback.coarseDone = false;
+	// スクラブが止まったら表示ズームで描き直す
+	SetTimer(g.hwnd, kSettleTimerId, kScrubSettleMs + 10, nullptr);
+	InvalidateRect(g.hwnd, nullptr, FALSE);
+	UpdateTitle();
+}
+
+// タイムライン: 左端が最古 (gTimes の末尾)、右端が最新 (gTimes[0])
+static D2D1_RECT_F TimelineRect()
+{
+	return D2D1::RectF(10.0f, g.clientH - 10.0f - kTimelineHeight, g.clientW - 10.0f, g.clientH - 10.0f);
+}
+
+static bool TimelineHit(int x, int y)
+{
+	D2D1_RECT_F r = TimelineRect();
+	return gPlayback.active && x >= r.left && x <= r.right && y >= r.top && y <= r.bottom;
+}
+
+static int TimelineIndexAt(int x)
+{
+	D2D1_RECT_F r = TimelineRect();
+	int n = (int)gTimes.size();
+	double f = Clamp((x - r.left) / std::max(1.0f, r.right - r.left), 0.0, 1.0);
+	return (n - 1) - (int)std::lround(f * (n - 1));
+}
+
+static void DrawTimeline(ID2D1RenderTarget* rt)
+{
+	if (gTimes.empty()) return;
+	ID2D1SolidColorBrush* bg = nullptr; ID2D1SolidColorBrush* fg = nullptr;
+	rt->CreateSolidColorBrush(D2D1::ColorF(D2D1::ColorF::White, 0.7f), &bg);
+	rt->CreateSolidColorBrush(D2D1::ColorF(D2D1::ColorF::DimGray), &fg);
+	if (bg && fg) {
+		D2D1_RECT_F r = TimelineRect();
+		D2D1_ROUNDED_RECT rr = D2D1::RoundedRect(r, 6.0f, 6.0f);
+		rt->FillRoundedRectangle(&rr, bg);
+		float cy = (r.top + r.bottom) * 0.5f;
+		rt->DrawLine(D2D1::Point2F(r.left + 8.0f, cy), D2D1::Point2F(r.right - 8.0f, cy), fg, 2.0f);
+		int n = (int)gTimes.size();
+		float f = n > 1 ? (float)(n - 1 - gTimeIndex) / (n - 1) : 1.0f;
+		float x = r.left + 8.0f + f * (r.right - r.left - 16.0f);
+		if (gPlayback.dragging) fg->SetColor(D2D1::ColorF(D2D1::ColorF::Red));
+		rt->FillRectangle(D2D1::RectF(x - 3.0f, r.top + 4.0f, x + 3.0f, r.bottom - 4.0f), fg);
+	}
+	SAFE_RELEASE(fg); SAFE_RELEASE(bg);
+}
+
+// 再生時の重ね描き。スクラブ中は低ズームのみ、止まったら表示ズームが揃うまで低ズームを下敷きにする
+static void DrawPlaybackOverlay(ID2D1RenderTarget* rt, const MapView& view, const TileBitmapFn& getBmp)
+{
+	if (gTimes.empty() || gTimeIndex < 0 || gTimeIndex >= (int)gTimes.size()) return;
+	const bool scrubbing = PlaybackScrubbing();
+	const int zFull = JmaZoomFor(view.zoom);
+	const bool wantFull = !scrubbing && zFull != MIN_JMA_ZOOM;
+
+	int fullMissing = 0, coarseMissing = 0;
+	if (wantFull) {
+		ForEachJmaTile(view, gTimes[gTimeIndex], [&](const std::wstring& p, const D2D1_RECT_F&) {
+			if (!getBmp(p, kTileRain)) ++fullMissing;
+			});
+	}
+	const bool drawCoarse = !wantFull || fullMissing > 0;
+	if (drawCoarse) coarseMissing = DrawJmaLayer(rt, view, getBmp, gTimeIndex, kOverlayAlpha, MIN_JMA_ZOOM);
+	if (wantFull) DrawJmaLayer(rt, view, getBmp, gTimeIndex, kOverlayAlpha, zFull);
+
+	// シーク遅延の記録
+	if (gPlayback.pendingIndex == gTimeIndex) {
+		double ms = MsSince(gPlayback.seekStart);
+		bool coarseReady = drawCoarse ? coarseMissing == 0 : true;
+		bool fullReady = wantFull ? fullMissing == 0 : (!scrubbing && coarseMissing == 0);
+		if (!gPlayback.coarseDone && coarseReady) { RecordSeekLatency(gPlayback.coarseMs, ms); gPlayback.coarseDone = true; }
+		if (fullReady) { RecordSeekLatency(gPlayback.fullMs, ms); gPlayback.pendingIndex = -1; }
+	}
+	gReadahead.Hint(gTimeIndex, gPlayback.lastDir, view);
+}
+
+// -------------------- Boundary Overlay --------------------
+// 都道府県界・市区町村界。GeoJSON (行政区域のポリゴンなど) から --boundary-build で専用のファイルを作っておき、
+// ビューアはそれをマップして、表示範囲のセルだけを Direct2D のパスジオメトリにする。
+// ファイルは LOD (ズーム) ごとに単純化した線を kBoundaryCellPx 四方のセルに切り、セル表を (cy, cx) 順に並べる (これが空間索引)。
+// 点は LOD のズームの 1/kBoundaryQuant 画素単位で、直前の点 (線片の先頭はセル原点) からの差分を zigzag + LEB128 で詰める
+//   file   = [BoundaryHeader][BoundaryLodEntry x lodCount][LOD ごとの BoundaryCellEntry 表][点列]
+//   点列   = セルごとに線片を並べたもの。線片 = 種別, 点数, (dx, dy) x 点数
+static const char kBoundaryMagic[8] = { 'A', 'M', 'E', 'B', 'N', 'D', 'R', '1' };
+static const uint32_t kBoundaryVersion = 1;
+static const int kBoundaryCellPx = 512;			// セルの大きさ (LOD のズームの画素)
+static const int kBoundaryQuant = 8;
+static const int kBoundaryMuniMinZoom = 8;		// 市区町村界はこのズーム以上の LOD にだけ入れる
+static const size_t kBoundaryGeomCache = 384;	// ビューアが保持するセルのジオメトリ数
+
+// LOD のズームと単純化の許容幅 (そのズームの画素)。表示ズーム以上で最も粗い LOD を使うので、画面上のずれも許容幅以下。
+// 最後の LOD は単純化しない (高ズーム用)
+struct BoundaryLodSpec { int zoom; double tolPx; };
+static const BoundaryLodSpec kBoundaryLods[] = { { 5, 0.6 }, { 7, 0.6 }, { 9, 0.6 }, { 11, 0.6 }, { 13, 0.6 }, { 16, 0.0 } };
+
+enum BoundaryKind : uint8_t { kBoundaryPref = 0, kBoundaryMuni = 1, kBoundaryKindCount };
+
+#pragma pack(push, 4)
+struct BoundaryHeader {
+	char magic[8];
+	uint32_t version, lodCount;
+	uint64_t fileSize;
+};
+struct BoundaryLodEntry {
+	int32_t zoom;
+	uint32_t reach;			// 線片が自分のセルからはみ出す最大のセル数 (探す範囲をこれだけ広げる)
+	uint64_t cellOffset, cellCount;
+};
+struct BoundaryCellEntry {
+	int32_t cx, cy;
+	uint32_t pieces, points;
+	uint64_t offset;
+	uint32_t size;
+	uint32_t kinds;					// 含む種別のビット
+	float minX, minY, maxX, maxY;	// 線片の範囲 (セル原点からの LOD の画素)
+};
+#pragma pack(pop)
+static_assert(sizeof(BoundaryHeader) == 24, "boundary header layout");
+static_assert(sizeof(BoundaryLodEntry) == 24, "boundary lod layout");
+static_assert(sizeof(BoundaryCellEntry) == 48, "boundary cell layout");
+
+static void PutVarint(std::vector<BYTE>& out, uint64_t v)
+{
+	for (; v >= 0x80; v >>= 7) out.push_back((BYTE)(0x80 | (v & 0x7F)));
+	out.push_back((BYTE)v);
+}
+static bool GetVarint(const BYTE*& p, const BYTE* end, uint64_t& v)
+{
+	v = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (p >= end) return false;
+		BYTE b = *p++;
+		v |= (uint64_t)(b & 0x7F) << shift;
+		if (!(b & 0x80)) return true;
+	}
+	return false;
+}
+static inline uint64_t ZigZag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+static inline int64_t UnZigZag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+static inline int64_t FloorDiv(int64_t a, int64_t b) { return a >= 0 ? a / b : -((-a + b - 1) / b); }
+
+struct BoundaryLine {
+	BoundaryKind kind;
+	std::vector<std::pair<double, double>> lonlat;
+};
+
+// 隣り合うポリゴンの輪は境界を 1 本ずつ持つので、そのままでは同じ線を二度描き、単純化も別々に行われて
+// 粗い LOD で食い違う。3 本以上の線が出会う点 (と開いた線の端) で線を切り、同じ点列の弧 (向きは問わない) を 1 本にする
+static void MergeSharedArcs(std::vector<BoundaryLine>& lines, size_t first)
+{
+	struct PtHash { size_t operator()(const std::pair<double, double>& p) const { return std::hash<double>()(p.first) * 31 + std::hash<double>()(p.second); } };
+	std::unordered_map<std::pair<double, double>, uint32_t, PtHash> ids;
+	std::vector<std::pair<double, double>> pts;
+	std::vector<std::vector<uint32_t>> rings;
+	for (size_t i = first; i < lines.size(); ++i) {
+		std::vector<uint32_t> r;
+		for (auto& ll : lines[i].lonlat) {
+			auto it = ids.try_emplace(ll, (uint32_t)pts.size()).first;
+			if (it->second == pts.size()) pts.push_back(ll);
+			if (r.empty() || r.back() != it->second) r.push_back(it->second);
+		}
+		if (r.size() >= 2) rings.push_back(std::move(r));
+	}
+	// 異なる隣の点が 3 つ以上ある点を分岐点にする
+	const uint32_t kNone = UINT32_MAX;
+	std::vector<std::pair<uint32_t, uint32_t>> nb(pts.size(), { kNone, kNone });
+	std::vector<char> junction(pts.size(), 0);
+	auto link = [&](uint32_t a, uint32_t b) {
+		auto& n = nb[a];
+		if (n.first == b || n.second == b) return;
+		if (n.first == kNone) n.first = b;
+		else if (n.second == kNone) n.second = b;
+		else junction[a] = 1;
+		};
+	for (auto& r : rings) {
+		for (size_t k = 0; k + 1 < r.size(); ++k) { link(r[k], r[k + 1]); link(r[k + 1], r[k]); }
+		if (r.front() != r.back()) junction[r.front()] = junction[r.back()] = 1;
+	}
+
+	std::vector<std::vector<uint32_t>> arcs;
+	auto emit = [&](std::vector<uint32_t> a) {
+		if (a.size() < 2) return;
+		// 向きをそろえる (端が同じ輪は 2 点目と最後から 2 点目で決める)
+		if (a.front() > a.back() || (a.front() == a.back() && a.size() > 2 && a[1] > a[a.size() - 2])) std::reverse(a.begin(), a.end());
+		arcs.push_back(std::move(a));
+		};
+	for (auto& r : rings) {
+		const bool closed = r.front() == r.back() && r.size() > 2;
+		size_t start = 0;
+		if (closed) {
+			// 分岐点から始まるように回す。分岐点のない輪 (島や飛び地) は最小の点から始める
+			r.pop_back();
+			size_t j = std::find_if(r.begin(), r.end(), [&](uint32_t id) { return junction[id] != 0; }) - r.begin();
+			if (j == r.size()) j = std::min_element(r.begin(), r.end()) - r.begin();
+			std::rotate(r.begin(), r.begin() + j, r.end());
+			r.push_back(r.front());
+		}
+		for (size_t k = 1; k < r.size(); ++k)
+			if (junction[r[k]] || k + 1 == r.size()) { emit(std::vector<uint32_t>(r.begin() + start, r.begin() + k + 1)); start = k; }
+	}
+	std::sort(arcs.begin(), arcs.end());
+	arcs.erase(std::unique(arcs.begin(), arcs.end()), arcs.end());
+
+	const BoundaryKind kind = lines[first].kind;
+	lines.resize(first);
+	for (auto& a : arcs) {
+		BoundaryLine line{ kind, {} };
+		line.lonlat.reserve(a.size());
+		for (uint32_t id : a) line.lonlat.push_back(pts[id]);
+		lines.push_back(std::move(line));
+	}
+}
+
+// GeoJSON の "coordinates" の入れ子の配列から、位置 [lon, lat(, 高さ)] の並びをそれぞれ 1 本の線として取り出す。
+// Polygon / MultiPolygon の輪も LineString も同じに扱い (properties は見ない)、隣り合う輪の共有する境界は MergeSharedArcs で 1 本にする
+static bool LoadGeoJsonLines(const std::wstring& file, BoundaryKind kind, std::vector<BoundaryLine>& out)
+{
+	std::string s;
+	if (!ReadInputFile(file, s)) return false;
+
+	const size_t before = out.size();
+	const char* end = s.c_str() + s.size();
+	for (const char* p = s.c_str(); (p = strstr(p, "\"coordinates\"")) != nullptr;) {
+		if ((p = strchr(p, '[')) == nullptr) break;
+		BoundaryLine line{ kind, {} };
+		for (int depth = 0; p < end; ++p) {
+			if (*p == '[') {
+				const char* q = p + 1;
+				while (q < end && (*q == ' ' || *q == '\t' || *q == '\r' || *q == '\n')) ++q;
+				if (q < end && (*q == '-' || (*q >= '0' && *q <= '9'))) {
+					char* e = nullptr;
+					const double lon = strtod(q, &e);
+					const char* c = strchr(e, ',');
+					if (!c) return false;
+					const double lat = strtod(c + 1, &e);
+					line.lonlat.emplace_back(lon, lat);
+					if ((p = strchr(e, ']')) == nullptr) return false;
+					continue;
+				}
+				++depth;
+			}
+			else if (*p == ']') {
+				if (line.lonlat.size() >= 2) out.push_back(line);
+				line.lonlat.clear();
+				if (--depth == 0) break;
+			}
+		}
+	}
+	if (out.size() == before) return false;
+	MergeSharedArcs(out, before);
+	return true;
+}
+
+// Douglas-Peucker (開いた線。閉じた輪は始点と終点が同じ点のまま通せる)
+struct BoundaryPt { double x, y; };
+static void SimplifyPolyline(std::vector<BoundaryPt>& pts, double tol)
+{
+	const size_t n = pts.size();
+	if (n < 3 || tol <= 0) return;
+	std::vector<char> keep(n, 0);
+	keep[0] = keep[n - 1] = 1;
+	std::vector<std::pair<size_t, size_t>> stack = { { 0, n - 1 } };
+	while (!stack.empty()) {
+		auto [a, b] = stack.back();
+		stack.pop_back();
+		const double vx = pts[b].x - pts[a].x, vy = pts[b].y - pts[a].y, len = std::sqrt(vx * vx + vy * vy);
+		size_t idx = 0;
+		double dmax = tol;
+		for (size_t i = a + 1; i < b; ++i) {
+			double wx = pts[i].x - pts[a].x, wy = pts[i].y - pts[a].y;
+			double d = len > 0 ? std::fabs(vx * wy - vy * wx) / len : std::sqrt(wx * wx + wy * wy);
+			if (d > dmax) { dmax = d; idx = i; }
+		}
+		if (idx) { keep[idx] = 1; stack.push_back({ a, idx }); stack.push_back({ idx, b }); }
+	}
+	size_t w = 0;
+	for (size_t i = 0; i < n; ++i) if (keep[i]) pts[w++] = pts[i];
+	pts.resize(w);
+}
+
+struct BoundaryBuildStats {
+	size_t lines{}, inputPoints{};
+	std::vector<size_t> lodPoints, lodCells;
+	std::vector<uint64_t> lodBytes;
+	uint64_t fileBytes{};
+};
+
+static bool BuildBoundaryFile(const std::vector<BoundaryLine>& lines, const std::wstring& file, BoundaryBuildStats& st)
+{
+	struct Cell {
+		BoundaryCellEntry e{};
+		std::vector<BYTE> data;
+	};
+	const uint32_t lodCount = (uint32_t)_countof(kBoundaryLods);
+	const int64_t cellQ = (int64_t)kBoundaryCellPx * kBoundaryQuant;
+	std::vector<BoundaryLodEntry> lods(lodCount);
+	std::vector<std::vector<Cell>> cells(lodCount);
+	st = BoundaryBuildStats();
+	st.lines = lines.size();
+	for (auto& l : lines) st.inputPoints += l.lonlat.size();
+	st.lodPoints.assign(lodCount, 0); st.lodCells.assign(lodCount, 0); st.lodBytes.assign(lodCount, 0);
+
+	std::vector<BoundaryPt> pts;
+	std::vector<std::pair<int64_t, int64_t>> q;
+	for (uint32_t li = 0; li < lodCount; ++li) {
+		const int z = kBoundaryLods[li].zoom;
+		std::unordered_map<uint64_t, Cell> byKey;
+		for (const BoundaryLine& line : lines) {
+			if (line.kind == kBoundaryMuni && z < kBoundaryMuniMinZoom) continue;
+			pts.clear();
+			for (auto& ll : line.lonlat) pts.push_back({ LonLatToWorldX(ll.first, z), LonLatToWorldY(ll.second, z) });
+			SimplifyPolyline(pts, kBoundaryLods[li].tolPx);
+			// 単純化で潰れた輪 (小さな島など) はこの LOD では描かない
+			const bool closed = line.lonlat.front() == line.lonlat.back();
+			q.clear();
+			for (auto& p : pts) {
+				std::pair<int64_t, int64_t> v((int64_t)std::llround(p.x * kBoundaryQuant), (int64_t)std::llround(p.y * kBoundaryQuant));
+				if (q.empty() || q.back() != v) q.push_back(v);
+			}
+			if (q.size() < 2 || (closed && q.size() < 4)) continue;
+
+			// セルをまたぐ所で線片に切る。またいだ線分は元のセルの線片に入れ、次の線片はまたいだ先の点から始める
+			for (size_t i = 0; i + 1 < q.size();) {
+				const int64_t cx = FloorDiv(q[i].first, cellQ), cy = FloorDiv(q[i].second, cellQ);
+				size_t j = i + 1;
+				while (j + 1 < q.size() && FloorDiv(q[j].first, cellQ) == cx && FloorDiv(q[j].second, cellQ) == cy) ++j;
+				Cell& c = byKey[((uint64_t)(uint32_t)cy << 32) | (uint32_t)cx];
+				if (c.e.pieces == 0) {
+					c.e.cx = (int32_t)cx; c.e.cy = (int32_t)cy;
+					c.e.minX = c.e.minY = FLT_MAX; c.e.maxX = c.e.maxY = -FLT_MAX;
+				}
+				PutVarint(c.data, line.kind);
+				PutVarint(c.data, j - i + 1);
+				int64_t px = cx * cellQ, py = cy * cellQ;
+				for (size_t k = i; k <= j; ++k) {
+					PutVarint(c.data, ZigZag(q[k].first - px));
+					PutVarint(c.data, ZigZag(q[k].second - py));
+					px = q[k].first; py = q[k].second;
+					const float lx = (float)(q[k].first - cx * cellQ) / kBoundaryQuant, ly = (float)(q[k].second - cy * cellQ) / kBoundaryQuant;
+					c.e.minX = std::min(c.e.minX, lx); c.e.maxX = std::max(c.e.maxX, lx);
+					c.e.minY = std::min(c.e.minY, ly); c.e.maxY = std::max(c.e.maxY, ly);
+				}
+				++c.e.pieces;
+				c.e.points += (uint32_t)(j - i + 1);
+				c.e.kinds |= 1u << line.kind;
+				st.lodPoints[li] += j - i + 1;
+				i = j;
+			}
+		}
+
+		uint32_t reach = 0;
+		for (auto& kv : byKey) {
+			const BoundaryCellEntry& e = kv.second.e;
+			const double over = std::max({ -(double)e.minX, -(double)e.minY, e.maxX - (double)kBoundaryCellPx, e.maxY - (double)kBoundaryCellPx, 0.0 });
+			reach = std::max(reach, (uint32_t)std::ceil(over / kBoundaryCellPx));
+			st.lodBytes[li] += kv.second.data.size() + sizeof(BoundaryCellEntry);
+			cells[li].push_back(std::move(kv.second));
+		}
+		std::sort(cells[li].begin(), cells[li].end(), [](const Cell& a, const Cell& b) { return a.e.cy != b.e.cy ? a.e.cy < b.e.cy : a.e.cx < b.e.cx; });
+		lods[li].zoom = z;
+		lods[li].reach = reach;
+		lods[li].cellCount = cells[li].size();
+		st.lodCells[li] = cells[li].size();
+	}
+
+	uint64_t off = sizeof(BoundaryHeader) + lodCount * sizeof(BoundaryLodEntry);
+	for (uint32_t li = 0; li < lodCount; ++li) { lods[li].cellOffset = off; off += lods[li].cellCount * sizeof(BoundaryCellEntry); }
+	for (auto& lc : cells)
+		for (auto& c : lc) {
+			if (c.data.size() > 0xFFFFFFFFu) return false;
+			c.e.offset = off; c.e.size = (uint32_t)c.data.size(); off += c.data.size();
+		}
+	BoundaryHeader h{};
+	memcpy(h.magic, kBoundaryMagic, 8);
+	h.version = kBoundaryVersion;
+	h.lodCount = lodCount;
+	h.fileSize = off;
+
+	FILE* f = nullptr;
+	if (_wfopen_s(&f, file.c_str(), L"wb") != 0 || !f) return false;
+	bool ok = fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(lods.data(), sizeof(BoundaryLodEntry), lodCount, f) == lodCount;
+	for (auto& lc : cells) for (auto& c : lc) ok = ok && fwrite(&c.e, sizeof(c.e), 1, f) == 1;
+	for (auto& lc : cells) for (auto& c : lc) ok = ok && (c.data.empty() || fwrite(c.data.data(), 1, c.data.size(), f) == c.data.size());
+	ok = fclose(f) == 0 && ok;
+	st.fileBytes = off;
+	return ok;
+}
+
+// 読み出し側。ファイル全体を読み取り専用でマップし、セル表を二分探索する
+using BoundaryCellFn = std::function<void(const BoundaryCellEntry& c)>;
+using BoundaryPieceFn = std::function<void(BoundaryKind kind, const D2D1_POINT_2F* pts, size_t n)>;
+class BoundaryFile {
+public:
+	~BoundaryFile() { Close(); }
+
+	bool Open(const std::wstring& file) {
+		Close();
+		hFile = CreateFileW(file.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+		if (hFile == INVALID_HANDLE_VALUE) { hFile = nullptr; return false; }
+		LARGE_INTEGER sz{};
+		if (!GetFileSizeEx(hFile, &sz) || sz.QuadPart < (LONGLONG)sizeof(BoundaryHeader)) { Close(); return false; }
+		size = (uint64_t)sz.QuadPart;
+		hMap = CreateFileMappingW(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!hMap) { Close(); return false; }
+		base = (const BYTE*)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+		if (!base) { Close(); return false; }
+
+		const BoundaryHeader* h = (const BoundaryHeader*)base;
+		bool ok = memcmp(h->magic, kBoundaryMagic, 8) == 0 && h->version == kBoundaryVersion && h->fileSize == size &&
+			h->lodCount > 0 && sizeof(BoundaryHeader) + (uint64_t)h->lodCount * sizeof(BoundaryLodEntry) <= size;
+		for (uint32_t i = 0; ok && i < h->lodCount; ++i) {
+			const BoundaryLodEntry& L = lod(i);
+			ok = L.cellOffset <= size && L.cellCount <= (size - L.cellOffset) / sizeof(BoundaryCellEntry);
+		}
+		if (!ok) { Close(); return false; }
+		return true;
+	}
+
+	void Close() {
+		if (base) UnmapViewOfFile(base);
+		if (hMap) CloseHandle(hMap);
+		if (hFile) CloseHandle(hFile);
+		base = nullptr; hMap = nullptr; hFile = nullptr; size = 0;
+	}
+
+	bool isOpen() const { return base != nullptr; }
+	uint64_t fileSize() const { return size; }
+	uint32_t lodCount() const { return ((const BoundaryHeader*)base)->lodCount; }
+	const BoundaryLodEntry& lod(uint32_t i) const { return ((const BoundaryLodEntry*)(base + sizeof(BoundaryHeader)))[i]; }
+	const BoundaryCellEntry* cells(uint32_t i) const { return (const BoundaryCellEntry*)(base + lod(i).cellOffset); }
+
+	// 表示ズーム z に使う LOD (z 以上で最も粗いもの。なければ最も細かいもの)
+	uint32_t LodFor(int z) const {
+		for (uint32_t i = 0; i < lodCount(); ++i) if (lod(i).zoom >= z) return i;
+		return lodCount() - 1;
+	}
+
+	// LOD の画素範囲 [x0, x1] x [y0, y1] に掛かるセル。セル位置で絞ってから線片の範囲で判定する
+	void ForEachCell(uint32_t li, double x0, double y0, double x1, double y1, const BoundaryCellFn& fn) const {
+		const BoundaryLodEntry& L = lod(li);
+		if (L.cellCount == 0) return;
+		const BoundaryCellEntry* b = cells(li);
+		const BoundaryCellEntry* e = b + L.cellCount;
+		const int r = (int)L.reach;
+		const int cx0 = (int)std::floor(x0 / kBoundaryCellPx) - r, cx1 = (int)std::floor(x1 / kBoundaryCellPx) + r;
+		const int cy0 = std::max((int)std::floor(y0 / kBoundaryCellPx) - r, b->cy);
+		const int cy1 = std::min((int)std::floor(y1 / kBoundaryCellPx) + r, (e - 1)->cy);
+		for (int cy = cy0; cy <= cy1; ++cy) {
+			const BoundaryCellEntry* it = std::lower_bound(b, e, std::make_pair(cy, cx0),
+				[](const BoundaryCellEntry& c, const std::pair<int, int>& k) { return c.cy != k.first ? c.cy < k.first : c.cx < k.second; });
+			for (; it != e && it->cy == cy && it->cx <= cx1; ++it) {
+				const double ox = (double)it->cx * kBoundaryCellPx, oy = (double)it->cy * kBoundaryCellPx;
+				if (ox + it->maxX < x0 || ox + it->minX > x1 || oy + it->maxY < y0 || oy + it->minY > y1) continue;
+				fn(*it);
+			}
+		}
+	}
+
+	// セルの線片を展開する。点はセル原点からの LOD の画素 (原点が近いので float でも精度が落ちない)
+	bool DecodeCell(const BoundaryCellEntry& c, const BoundaryPieceFn& fn) const {
+		if (c.offset > size || c.size > size - c.offset) return false;
+		const BYTE* p = base + c.offset;
+		const BYTE* end = p + c.size;
+		std::vector<D2D1_POINT_2F> pts;
+		for (uint32_t i = 0; i < c.pieces; ++i) {
+			uint64_t kind, n, dx, dy;
+			if (!GetVarint(p, end, kind) || !GetVarint(p, end, n) || kind >= kBoundaryKindCount || n < 2 || n > c.points) return false;
+			pts.resize((size_t)n);
+			int64_t x = 0, y = 0;
+			for (auto& pt : pts) {
+				if (!GetVarint(p, end, dx) || !GetVarint(p, end, dy)) return false;
+				x += UnZigZag(dx); y += UnZigZag(dy);
+				pt = D2D1::Point2F((float)x / kBoundaryQuant, (float)y / kBoundaryQuant);
+			}
+			fn((BoundaryKind)kind, pts.data(), pts.size());
+		}
+		return true;
+	}
+
+private:
+	HANDLE hFile{}, hMap{};
+	const BYTE* base{};
+	uint64_t size{};
+};
+static BoundaryFile gBoundaryFile;
+
+// ビューア用。表示範囲のセルだけ種別ごとのパスジオメトリ (セル原点からの座標) を作って持ち、
+// 描画はセルごとの変換で行う。使われなくなったセルは古いものから捨てる (メインスレッドのみ)
+static bool gShowBoundaries = true;	// 'B' で切り替え (ファイルが開けたときのみ描く)
+
+class BoundaryLayer {
+public:
+	struct Stats {
+		size_t cells{}, built{}, cached{};
+		int lodZoom{ -1 };
+		double drawMs{};
+	};
+	~BoundaryLayer() { Clear(); }
+
+	void Clear() {
+		for (auto& kv : geoms) for (auto*& p : kv.second.geo) SAFE_RELEASE(p);
+		geoms.clear();
+	}
+
+	void Draw(ID2D1RenderTarget* rt, const MapView& v, const BoundaryFile& f) {
+		auto t0 = std::chrono::steady_clock::now();
+		st = Stats();
+		if (!f.isOpen() || !g.factory) return;
+		const int zDL = std::clamp((int)std::floor(v.zoom), MIN_MAP_ZOOM, MAX_MAP_ZOOM);
+		const double sc = std::pow(2.0, v.zoom - zDL);
+		const uint32_t li = f.LodFor(zDL);
+		st.lodZoom = f.lod(li).zoom;
+		const double k = std::ldexp(1.0, st.lodZoom - zDL);	// 表示ズームの世界座標 → LOD の画素
+		const double x0 = v.originWX * k, y0 = v.originWY * k;
+		const double x1 = (v.originWX + v.w / sc) * k, y1 = (v.originWY + v.h / sc) * k;
+		const float s = (float)(sc / k);						// LOD の画素 → 画面
+
+		static const float kWidth[kBoundaryKindCount] = { 1.6f, 0.8f };
+		ID2D1SolidColorBrush* br[kBoundaryKindCount] = {};
+		rt->CreateSolidColorBrush(D2D1::ColorF(0.20f, 0.20f, 0.25f, 0.85f), &br[kBoundaryPref]);
+		rt->CreateSolidColorBrush(D2D1::ColorF(0.30f, 0.30f, 0.35f, 0.55f), &br[kBoundaryMuni]);
+		D2D1_MATRIX_3X2_F old;
+		rt->GetTransform(&old);
+		++frame;
+		f.ForEachCell(li, x0, y0, x1, y1, [&](const BoundaryCellEntry& c) {
+			const Entry& e = Geometry(f, li, c);
+			const float tx = (float)(((double)c.cx * kBoundaryCellPx - x0) * s), ty = (float)(((double)c.cy * kBoundaryCellPx - y0) * s);
+			rt->SetTransform(D2D1::Matrix3x2F::Scale(s, s) * D2D1::Matrix3x2F::Translation(tx, ty));
+			for (int kd = 0; kd < kBoundaryKindCount; ++kd)
+				if (e.geo[kd] && br[kd]) rt->DrawGeometry(e.geo[kd], br[kd], kWidth[kd] / s);
+			++st.cells;
+			});
+		rt->SetTransform(old);
+		for (auto*& b : br) SAFE_RELEASE(b);
+		Trim();
+		st.cached = geoms.size();
+		st.drawMs = MsSince(t0);
+	}
+
+	const Stats& stats() const { return st; }
+
+private:
+	struct Entry {
+		ID2D1PathGeometry* geo[kBoundaryKindCount]{};
+		uint64_t lastFrame{};
+	};
+
+	const Entry& Geometry(const BoundaryFile& f, uint32_t li, const BoundaryCellEntry& c) {
+		const uint64_t key = ((uint64_t)li << 48) | ((uint64_t)(uint32_t)c.cy << 24) | (uint32_t)c.cx;
+		auto r = geoms.try_emplace(key);
+		Entry& e = r.first->second;
+		e.lastFrame = frame;
+		if (!r.second) return e;
+
+		++st.built;
+		ID2D1GeometrySink* sink[kBoundaryKindCount] = {};
+		for (int kd = 0; kd < kBoundaryKindCount; ++kd) {
+			if (!(c.kinds & (1u << kd)) || FAILED(g.factory->CreatePathGeometry(&e.geo[kd]))) continue;
+			if (FAILED(e.geo[kd]->Open(&sink[kd]))) SAFE_RELEASE(e.geo[kd]);
+		}
+		f.DecodeCell(c, [&](BoundaryKind kind, const D2D1_POINT_2F* pts, size_t n) {
+			ID2D1GeometrySink* s = sink[kind];
+			if (!s) return;
+			s->BeginFigure(pts[0], D2D1_FIGURE_BEGIN_HOLLOW);
+			s->AddLines(pts + 1, (UINT32)n - 1);
+			s->EndFigure(D2D1_FIGURE_END_OPEN);
+			});
+		for (auto*& s : sink) if (s) { s->Close(); SAFE_RELEASE(s); }
+		return e;
+	}
+
+	void Trim() {
+		if (geoms.size() <= kBoundaryGeomCache) return;
+		std::vector<std::pair<uint64_t, uint64_t>> v;	// (lastFrame, key)。この描画で使ったものは残す
+		for (auto& kv : geoms) if (kv.second.lastFrame != frame) v.emplace_back(kv.second.lastFrame, kv.first);
+		std::sort(v.begin(), v.end());
+		for (size_t i = 0; i < v.size() && geoms.size() > kBoundaryGeomCache; ++i) {
+			auto it = geoms.find(v[i].second);
+			for (auto*& p : it->second.geo) SAFE_RELEASE(p);
+			geoms.erase(it);
+		}
+	}
+
+	std::unordered_map<uint64_t, Entry> geoms;
+	uint64_t frame{};
+	Stats st;
+};
+static BoundaryLayer gBoundaryLayer;
+
+// -------------------- Draw --------------------
+static void EnsureRT() {
+	if (!g.rt) {
+		RECT rc; GetClientRect(g.hwnd, &rc);
+		D2D1_SIZE_U sz = D2D1::SizeU(rc.right, rc.bottom);
+		HRESULT hr = g.factory->CreateHwndRenderTarget(D2D1::RenderTargetProperties(),
+			D2D1::HwndRenderTargetProperties(g.hwnd, sz), &g.rt);
+		if (FAILED(hr)) g.rt = nullptr;
+	}
+}
+
+// 情報表示に追加する行 (各行の先頭で改行する)
+static void AppendHudLines(std::wstringstream& ss) {
+	if (gCursor.inside) {
+		UpdateCursorIntensity();
+		ss << L"\nカーソル: ";
+		if (gCursor.valid) ss << FormatIntensity(gCursor.sample) << L" (z" << gCursor.sample.z << L", "
+			<< std::fixed << std::setprecision(1) << gCursor.queryUs << L" µs)" << std::defaultfloat;
+		else ss << L"タイル未取得";
+	}
+	AreaStats vs;
+	if (ViewportStats(vs) && vs.dataKm2() > 0) {
+		ss << std::fixed << std::setprecision(1) << L"\n表示範囲: 最大 " << FormatIntensity({ vs.maxClass, kJmaScale[vs.maxClass].lo, kJmaScale[vs.maxClass].hi })
+			<< L" / 平均 " << vs.MeanMmh() << L" mm/h / 10 mm/h 以上 " << std::setprecision(0) << vs.AboveKm2(10.0f) << L" km²" << std::defaultfloat;
+	}
+	if (gShowLayerStats) {
+		// 層 (地図はスタイルごと) の要求数・通信数とキャッシュ内の枚数 (取得中を含む)・容量。使っていない層は省く
+		TileLayerUsage u[kTileLayerCount];
+		CountTileLayerUsage(u);
+		for (int l = 0; l < kTileLayerCount; ++l) {
+			const bool shown = IsGsiLayer((TileLayer)l) ? l == gGsiStyle : gTileLayerOn[l];
+			if (!shown && u[l].tiles == 0) continue;
+			const TileLayerCounters& c = gTileLayerCounters[l];
+			ss << std::fixed << std::setprecision(1) << L"\n" << kTileLayers[l].name << L": 要求 " << c.requests.load()
+				<< L" / 通信 " << c.httpFetches.load() << L" (失敗 " << c.failures.load() << L", " << c.fetchedBytes.load() / 1048576.0
+				<< L" MB) / キャッシュ " << u[l].tiles << L"/" << kTileLayers[l].cacheTiles << L" 枚 " << u[l].bytes / 1048576.0
+				<< L" MB" << std::defaultfloat;
+		}
+		const BoundaryLayer::Stats& b = gBoundaryLayer.stats();
+		if (gShowBoundaries && b.lodZoom >= 0)
+			ss << std::fixed << std::setprecision(2) << L"\n境界: LOD z" << b.lodZoom << L" / セル " << b.cells << L" (作成 " << b.built
+				<< L", 保持 " << b.cached << L") / " << b.drawMs << L" ms" << std::defaultfloat;
+	}
+	if (gPlayback.active && !gPlayback.fullMs.empty()) {
+		std::vector<double> c(gPlayback.coarseMs.begin(), gPlayback.coarseMs.end());
+		std::vector<double> f(gPlayback.fullMs.begin(), gPlayback.fullMs.end());
+		ss << std::fixed << std::setprecision(0)
+			<< L"\nシーク: 低ズーム " << Percentile(c, 50) << L" ms / 表示 " << Percentile(f, 50)
+			<< L" ms (p95 " << Percentile(f, 95) << L" ms)";
+	}
+}
+
+static void DrawScene() {
+	EnsureRT();
+	if (!g.rt) return;
+
+	g.rt->BeginDraw();
+	g.rt->Clear(D2D1::ColorF(1.0f, 1.0f, 1.0f));
+
+	const MapView view = CurrentView();
+	auto getBmp = [](const std::wstring& path, TileLayer layer) -> ID2D1Bitmap* {
+		ID2D1Bitmap* bmp = nullptr;
+		return (GetOrFetchBitmap(path, &bmp, layer) && bmp) ? bmp : nullptr;
+		};
+
+	// 1. GSI Base Mapを描画 (スタイルの切り替え直後は、要求が全部終わるまで前のスタイルのキャッシュ済みタイルを下に敷く。
+	//    白地図の範囲外や海域のように 404 のタイルがあるスタイルでは、そろうのを待つといつまでも切り替わらない)
+	if (gGsiUnderlay != gGsiStyle)
+		DrawGsiLayer(g.rt, view, [](const std::wstring& path, TileLayer) { return PeekCachedBitmap(path); }, gGsiUnderlay);
+	if (DrawGsiLayer(g.rt, view, getBmp) == 0 || (gGsiUnderlay != gGsiStyle && CountPendingGsiTiles(view, gGsiStyle) == 0)) gGsiUnderlay = gGsiStyle;
+
+	// 2. JMA Overlayを描画
+	if (gAccumFrames > 0) {
+		// 積算表示ではクロスフェードせず、移動先の時刻を描く
+		if (gAnimPlaying) { gAnimPlaying = false; gTimeIndex = gAnimTo; UpdateTitle(); }
+		gAccumShort = DrawAccumLayer(g.rt, view, gTimeIndex, gAccumFrames, kOverlayAlpha) < 0;
+	}
+	else if (gAnimPlaying) {
+		float t = std::chrono::duration<float>(std::chrono::steady_clock::now() - gAnimStart).count() / kAnimDurationSec;
+		gAnimT = (float)Clamp(t, 0.0, 1.0);
+		// 隣り合う時刻の間は途中フレームで動かす (折り返しなどはクロスフェード)
+		if (gMotionInterp && std::abs(gAnimFrom - gAnimTo) == 1)
+			DrawMotionLayer(g.rt, view, getBmp, gAnimFrom, gAnimTo, gAnimT, kOverlayAlpha);
+		else {
+			DrawJmaLayer(g.rt, view, getBmp, gAnimFrom, (1.0f - gAnimT) * kOverlayAlpha);
+			DrawJmaLayer(g.rt, view, getBmp, gAnimTo, gAnimT * kOverlayAlpha);
+		}
+		if (t >= 1.0f) { gAnimPlaying = false; gTimeIndex = gAnimTo; UpdateTitle(); }
+		InvalidateRect(g.hwnd, nullptr, FALSE);
+	}
+	else if (gPlayback.active) {
+		DrawPlaybackOverlay(g.rt, view, getBmp);
+	}
+	else {
+		DrawJmaLayer(g.rt, view, getBmp, gTimeIndex, kOverlayAlpha);
+	}
+	DrawExtraJmaLayers(g.rt, view, getBmp, gAnimPlaying ? gAnimTo : gTimeIndex);
+
+	// 次に送る組の途中フレームを先に作っておく
+	if (gMotionInterp && gAccumFrames == 0 && !gPlayback.active && !gTimes.empty()) {
+		const int cur = gAnimPlaying ? gAnimTo : gTimeIndex;
+		std::vector<std::pair<int, int>> pairs;
+		if (gAnimPlaying) pairs.push_back({ gAnimFrom, gAnimTo });
+		pairs.push_back({ cur, cur - 1 });
+		pairs.push_back({ cur, cur + 1 });
+		gMotionLayer.Request(view, pairs);
+	}
+
+	if (gShowBoundaries) gBoundaryLayer.Draw(g.rt, view, gBoundaryFile);
+	if (gShowContours) gContourLayer.Draw(g.rt, view, gTimeIndex);
+	if (gShowStorms) gStormLayer.Draw(g.rt, view, gTimeIndex);
+
+	// 3. 情報表示オーバーレイ
+	if (!gTimes.empty()) {
+		ID2D1SolidColorBrush* bgBrush = nullptr;
+		g.rt->CreateSolidColorBrush(D2D1::ColorF(D2D1::ColorF::White, 0.7f), &bgBrush);
+
+		ID2D1SolidColorBrush* textBrush = nullptr;
+		g.rt->CreateSolidColorBrush(D2D1::ColorF(D2D1::ColorF::Black), &textBrush);
+
+
+		IDWriteFactory* writeFactory = nullptr;
+		IDWriteTextFormat* textFormat = nullptr;
+
+		HRESULT hr = DWriteCreateFactory(DWRITE_FACTORY_TYPE_SHARED, __uuidof(IDWriteFactory),
+			reinterpret_cast<IUnknown**>(&writeFactory));
+
+		if (SUCCEEDED(hr) && writeFactory) {
+			hr = writeFactory->CreateTextFormat(L"Arial", nullptr, DWRITE_FONT_WEIGHT_NORMAL, DWRITE_FONT_STYLE_NORMAL,
+				DWRITE_FONT_STRETCH_NORMAL, 24.0f, L"ja-jp", &textFormat);
+		}
+
+		if (bgBrush && textBrush && textFormat) {
+			std::wstringstream ss;
+			if (gPlayback.active) ss << L"アーカイブ再生 (" << (gTimes.size() - gTimeIndex) << L"/" << gTimes.size() << L")\n";
+			else ss << (gUseForecast ? L"予測 (N2)" : L"観測 (N1)") << L"\n";
+			if (gAccumFrames > 0) ss << L"積算雨量 " << gAccumFrames * 5 / 60 << L" 時間" << (gAccumShort ? L" (観測が足りないため表示なし)" : L"") << L"\n";
+
+			if (gTimeIndex >= 0 && gTimeIndex < gTimes.size()) {
+				const auto& t = gTimes[gTimeIndex].validtime;
+
+				int year = std::stoi(t.substr(0, 4));
+				int month = std::stoi(t.substr(4, 2));
+				int day = std::stoi(t.substr(6, 2));
+				int hour = std::stoi(t.substr(8, 2));
+				int minute = std::stoi(t.substr(10, 2));
+
+				hour += 9;
+
+				if (hour >= 24) {
+					hour -= 24;
+					day += 1;
+
+					// 簡易的な日付繰り上げ処理
+					if (day > 31) { /* 処理省略 */ }
+				}
+
+				std::wstringstream time_ss;
+				time_ss << std::setw(2) << std::setfill(L'0') << month << L"/"
+					<< std::setw(2) << std::setfill(L'0') << day << L" "
+					<< std::setw(2) << std::setfill(L'0') << hour << L":"
+					<< std::setw(2) << std::setfill(L'0') << minute;
+
+				ss << L"表示時刻: " << time_ss.str() << L" JST";
+			}
+			else {
+				ss << L"表示時刻: データなし";
+			}
+			AppendHudLines(ss);
+
+			std::wstring text = ss.str();
+
+			IDWriteTextLayout* textLayout = nullptr;
+			hr = writeFactory->CreateTextLayout(text.c_str(), (UINT32)text.length(), textFormat, (float)g.clientW - 20.0f, (float)g.clientH - 20.0f, &textLayout);
+
+			if (SUCCEEDED(hr) && textLayout) {
+				DWRITE_TEXT_METRICS metrics;
+				textLayout->GetMetrics(&metrics);
+
+				float padding = 10.0f;
+				D2D1_RECT_F bgRect = D2D1::RectF(
+					10.0f, 10.0f,
+					10.0f + metrics.width + padding * 2.0f,
+					10.0f + metrics.height + padding * 2.0f
+				);
+
+				D2D1_ROUNDED_RECT roundedRect = D2D1::RoundedRect(bgRect, 8.0f, 8.0f);
+
+				g.rt->FillRoundedRectangle(&roundedRect, bgBrush);
+
+				D2D1_RECT_F textRect = D2D1::RectF(
+					10.0f + padding,
+					10.0f + padding,
+					bgRect.right,
+					bgRect.bottom
+				);
+				g.rt->DrawTextLayout(D2D1::Point2F(textRect.left, textRect.top), textLayout, textBrush);
+
+				SAFE_RELEASE(textLayout);
+			}
+		}
+
+		SAFE_RELEASE(textFormat);
+		SAFE_RELEASE(writeFactory);
+		SAFE_RELEASE(textBrush);
+		SAFE_RELEASE(bgBrush);
+	}
+
+	// 4. 再生タイムライン
+	if (gPlayback.active) DrawTimeline(g.rt);
+
+	g.rt->EndDraw();
+}
+
+// -------------------- Headless Render --------------------
+// ウィンドウを使わず WIC ビットマップ上に GSI + JMA を合成する (サーバーでのスナップショット生成用)
+static bool SaveBitmapPng(IWICImagingFactory* wic, IWICBitmapSource* src, const std::wstring& file)
+{
+	IWICStream* s = nullptr; IWICBitmapEncoder* enc = nullptr; IWICBitmapFrameEncode* fr = nullptr;
+	bool ok = false;
+	if (FAILED(wic->CreateStream(&s))) goto done;
+	if (FAILED(s->InitializeFromFilename(file.c_str(), GENERIC_WRITE))) goto done;
+	if (FAILED(wic->CreateEncoder(GUID_ContainerFormatPng, nullptr, &enc))) goto done;
+	if (FAILED(enc->Initialize(s, WICBitmapEncoderNoCache))) goto done;
+	if (FAILED(enc->CreateNewFrame(&fr, nullptr))) goto done;
+	if (FAILED(fr->Initialize(nullptr))) goto done;
+	if (FAILED(fr->WriteSource(src, nullptr))) goto done;
+	if (FAILED(fr->Commit())) goto done;
+	ok = SUCCEEDED(enc->Commit());
+done:
+	SAFE_RELEASE(fr); SAFE_RELEASE(enc); SAFE_RELEASE(s);
+	return ok;
+}
+
+static bool EncodePngToMemory(IWICImagingFactory* wic, IWICBitmapSource* src, std::vector<BYTE>& out)
+{
+	IStream* s = nullptr; IWICBitmapEncoder* enc = nullptr; IWICBitmapFrameEncode* fr = nullptr;
+	bool ok = false;
+	LARGE_INTEGER zero{}; ULARGE_INTEGER end{}; ULONG got = 0;
+	if (FAILED(CreateStreamOnHGlobal(nullptr, TRUE, &s))) goto done;
+	if (FAILED(wic->CreateEncoder(GUID_ContainerFormatPng, nullptr, &enc))) goto done;
+	if (FAILED(enc->Initialize(s, WICBitmapEncoderNoCache))) goto done;
+	if (FAILED(enc->CreateNewFrame(&fr, nullptr))) goto done;
+	if (FAILED(fr->Initialize(nullptr))) goto done;
+	if (FAILED(fr->WriteSource(src, nullptr))) goto done;
+	if (FAILED(fr->Commit())) goto done;
+	if (FAILED(enc->Commit())) goto done;
+	if (FAILED(s->Seek(zero, STREAM_SEEK_END, &end))) goto done;
+	if (FAILED(s->Seek(zero, STREAM_SEEK_SET, nullptr))) goto done;
+	out.resize((size_t)end.QuadPart);
+	ok = SUCCEEDED(s->Read(out.data(), (ULONG)out.size(), &got)) && got == out.size();
+done:
+	SAFE_RELEASE(fr); SAFE_RELEASE(enc); SAFE_RELEASE(s);
+	return ok;
+}
+
+// 一度だけデコードしたタイル群。読み取り専用で複数の描画スレッドから参照する
+class SharedTileSet {
+public:
+	~SharedTileSet() { for (auto& kv : tiles) SAFE_RELEASE(kv.second); }
+
+	// ビューと時刻に必要なタイルを並列に取得・デコードする。追加した枚数を返す
+	size_t Collect(const MapView& v, const std::vector<int>& timeIndices) {
+		std::vector<std::pair<std::wstring, TileLayer>> want;
+		ForEachGsiTile(v, gGsiStyle, [&](const std::wstring& path, const D2D1_RECT_F&) { want.emplace_back(path, gGsiStyle); });
+		for (int ti : timeIndices) {
+			if (ti < 0 || ti >= (int)gTimes.size()) continue;
+			ForEachJmaTile(v, gTimes[ti], [&](const std::wstring& path, const D2D1_RECT_F&) { want.emplace_back(path, kTileRain); });
+		}
+		std::sort(want.begin(), want.end());
+		want.erase(std::unique(want.begin(), want.end()), want.end());
+		want.erase(std::remove_if(want.begin(), want.end(), [&](auto& p) { return tiles.count(p.first) != 0; }), want.end());
+
+		std::vector<IWICBitmap*> decoded(want.size(), nullptr);
+		ParallelFor(want.size(), WORKER_THREADS * 2, [&](size_t i) {
+			std::vector<BYTE> buf;
+			decoded[i] = DecodeArchiveTile(want[i].first);
+			if (!decoded[i] && FetchTileBytes(want[i].first, want[i].second, buf))
+				decoded[i] = DecodePngToWic(ThreadWic(), buf.data(), buf.size());
+			});
+		for (size_t i = 0; i < want.size(); ++i) tiles[want[i].first] = decoded[i];
+		return want.size();
+	}
+	IWICBitmap* Find(const std::wstring& path) const {
+		auto it = tiles.find(path);
+		return it != tiles.end() ? it->second : nullptr;
+	}
+	size_t size() const { return tiles.size(); }
+
+private:
+	std::unordered_map<std::wstring, IWICBitmap*> tiles;
+};
+
+class HeadlessRenderer {
+public:
+	HeadlessRenderer(ID2D1Factory* factory, IWICImagingFactory* wic, int w, int h) : wic(wic) {
+		if (FAILED(wic->CreateBitmap(w, h, GUID_WICPixelFormat32bppPBGRA, WICBitmapCacheOnLoad, &target))) return;
+		D2D1_RENDER_TARGET_PROPERTIES props = D2D1::RenderTargetProperties(D2D1_RENDER_TARGET_TYPE_DEFAULT,
+			D2D1::PixelFormat(DXGI_FORMAT_B8G8R8A8_UNORM, D2D1_ALPHA_MODE_PREMULTIPLIED));
+		if (FAILED(factory->CreateWicBitmapRenderTarget(target, props, &rt))) rt = nullptr;
+	}
+	~HeadlessRenderer() {
+		for (auto& kv : bitmaps) SAFE_RELEASE(kv.second);
+		for (auto* lk : locks) SAFE_RELEASE(lk);
+		SAFE_RELEASE(rt);
+		SAFE_RELEASE(target);
+	}
+	bool ok() const { return rt != nullptr; }
+	IWICBitmap* bitmap() const { return target; }
+	void Attach(const SharedTileSet* set) { tiles = set; }
+
+	// fromIndex → toIndex のクロスフェード (t = 0..1) を含めて DrawScene と同じ順で合成する
+	void Render(const MapView& v, int fromIndex, int toIndex, float t) {
+		auto getBmp = [this](const std::wstring& path, TileLayer) { return Bitmap(path); };
+		rt->BeginDraw();
+		rt->Clear(D2D1::ColorF(1.0f, 1.0f, 1.0f));
+		DrawGsiLayer(rt, v, getBmp);
+		if (fromIndex == toIndex || t <= 0.0f) {
+			DrawJmaLayer(rt, v, getBmp, fromIndex, kOverlayAlpha);
+		}
+		else {
+			DrawJmaLayer(rt, v, getBmp, fromIndex, (1.0f - t) * kOverlayAlpha);
+			DrawJmaLayer(rt, v, getBmp, toIndex, t * kOverlayAlpha);
+		}
+		rt->EndDraw();
+	}
+
+	bool SavePng(const std::wstring& file) { return SaveBitmapPng(wic, target, file); }
+
+private:
+	// 共有タイルの画素を読み取りロック越しに参照する (WIC 描画先ならコピー不要)
+	ID2D1Bitmap* Bitmap(const std::wstring& path) {
+		auto it = bitmaps.find(path);
+		if (it != bitmaps.end()) return it->second;
+		ID2D1Bitmap* bmp = nullptr;
+		IWICBitmap* src = tiles ? tiles->Find(path) : nullptr;
+		if (src) {
+			UINT w = 0, h = 0;
+			src->GetSize(&w, &h);
+			WICRect rc{ 0, 0, (INT)w, (INT)h };
+			IWICBitmapLock* lk = nullptr;
+			D2D1_BITMAP_PROPERTIES props = D2D1::BitmapProperties(D2D1::PixelFormat(DXGI_FORMAT_B8G8R8A8_UNORM, D2D1_ALPHA_MODE_PREMULTIPLIED));
+			if (SUCCEEDED(src->Lock(&rc, WICBitmapLockRead, &lk)) &&
+				SUCCEEDED(rt->CreateSharedBitmap(__uuidof(IWICBitmapLock), lk, &props, &bmp))) {
+				locks.push_back(lk);
+			}
+			else {
+				SAFE_RELEASE(lk);
+				if (FAILED(rt->CreateBitmapFromWicBitmap(src, nullptr, &bmp))) bmp = nullptr;
+			}
+		}
+		bitmaps[path] = bmp;
+		return bmp;
+	}
+
+	IWICImagingFactory* wic{};
+	IWICBitmap* target{};
+	ID2D1RenderTarget* rt{};
+	const SharedTileSet* tiles{};
+	std::unordered_map<std::wstring, ID2D1Bitmap*> bitmaps;
+	std::vector<IWICBitmapLock*> locks;
+};
+
+// -------------------- Animation Export --------------------
+// gTimes を古い順 (StepTime(+1) と同じ向き) に辿り、kAnimDurationSec のクロスフェードを挟んだフレーム列を作る
+struct ExportFrame { int from, to; float t; int delayMs; };
+struct EncodedFrame { std::vector<BYTE> data; std::vector<WICColor> palette; };
+enum class ExportFormat { Apng, Gif, PngSequence };
+
+static std::vector<ExportFrame> PlanExportFrames(int fps)
+{
+	std::vector<ExportFrame> plan;
+	if (gTimes.empty()) return plan;
+	const int frameMs = 1000 / std::max(1, fps);
+	const int fadeFrames = std::max(1, (int)std::lround(kAnimDurationSec * fps));
+	const int holdMs = std::max(frameMs, (int)std::lround((kAnimStepInterval - kAnimDurationSec) * 1000.0f));
+
+	int cur = (int)gTimes.size() - 1;
+	plan.push_back({ cur, cur, 0.0f, holdMs });
+	while (cur > 0) {
+		int next = cur - 1;
+		for (int k = 1; k <= fadeFrames; ++k)
+			plan.push_back({ cur, next, (float)k / fadeFrames, k == fadeFrames ? frameMs + holdMs : frameMs });
+		cur = next;
+	}
+	return plan;
+}
+
+// WIC は APNG を書けないため、フレームごとの PNG の IDAT を fdAT に詰め替えて組み立てる
+class ApngWriter {
+public:
+	bool Open(const std::wstring& file, uint32_t frameCount) {
+		frames = frameCount;
+		return _wfopen_s(&f, file.c_str(), L"wb") == 0 && f;
+	}
+	~ApngWriter() { if (f) fclose(f); }
+
+	bool AddFrame(const std::vector<BYTE>& png, int delayMs) {
+		static const BYTE kSig[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+		if (png.size() < 8 || memcmp(png.data(), kSig, 8) != 0) return false;
+		bool first = (seq == 0);
+		uint32_t w = 0, h = 0;
+		for (size_t pos = 8; pos + 12 <= png.size();) {
+			uint32_t len = ReadBE(&png[pos]);
+			if (pos + 12 + len > png.size()) return false;
+			const BYTE* type = &png[pos + 4];
+			const BYTE* data = &png[pos + 8];
+			if (!memcmp(type, "IHDR", 4)) {
+				w = ReadBE(data); h = ReadBE(data + 4);
+				if (first) {
+					fwrite(kSig, 1, 8, f);
+					WriteChunk("IHDR", data, len);
+					BYTE actl[8]; WriteBE(actl, frames); WriteBE(actl + 4, 0);
+					WriteChunk("acTL", actl, 8);
+				}
+			}
+			else if (!memcmp(type, "IDAT", 4)) {
+				if (w == 0) return false;
+				if (!fctlWritten) { WriteFctl(w, h, delayMs); fctlWritten = true; }
+				if (first) {
+					WriteChunk("IDAT", data, len);
+				}
+				else {
+					std::vector<BYTE> fd(4 + len);
+					WriteBE(fd.data(), seq++);
+					memcpy(fd.data() + 4, data, len);
+					WriteChunk("fdAT", fd.data(), (uint32_t)fd.size());
+				}
+			}
+			else if (!memcmp(type, "IEND", 4)) {
+				break;
+			}
+			else if (first && type[0] >= 'a' && type[0] <= 'z') {
+				// 補助チャンク (sRGB, pHYs 等) は先頭フレームのものだけ IDAT 前に残す
+				if (!fctlWritten) WriteChunk((const char*)type, data, len);
+			}
+			pos += 12 + len;
+		}
+		fctlWritten = false;
+		return !ferror(f);
+	}
+
+	bool Close() {
+		WriteChunk("IEND", nullptr, 0);
+		bool ok = !ferror(f);
+		ok = (fclose(f) == 0) && ok;
+		f = nullptr;
+		return ok;
+	}
+
+private:
+	static uint32_t ReadBE(const BYTE* p) { return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]; }
+	static void WriteBE(BYTE* p, uint32_t v) { p[0] = (BYTE)(v >> 24); p[1] = (BYTE)(v >> 16); p[2] = (BYTE)(v >> 8); p[3] = (BYTE)v; }
+	void WriteChunk(const char* type, const BYTE* data, uint32_t len) {
+		BYTE hdr[8]; WriteBE(hdr, len); memcpy(hdr + 4, type, 4);
+		uint32_t crc = Crc32(hdr + 4, 4);
+		if (len) crc = Crc32(data, len, crc);
+		BYTE tail[4]; WriteBE(tail, crc);
+		fwrite(hdr, 1, 8, f);
+		if (len) fwrite(data, 1, len, f);
+		fwrite(tail, 1, 4, f);
+	}
+	void WriteFctl(uint32_t w, uint32_t h, int delayMs) {
+		BYTE d[26] = {};
+		WriteBE(d, seq++); WriteBE(d + 4, w); WriteBE(d + 8, h);
+		d[20] = (BYTE)(delayMs >> 8); d[21] = (BYTE)delayMs;	// delay_num (ms)
+		d[22] = (BYTE)(1000 >> 8); d[23] = (BYTE)(1000 & 0xFF);	// delay_den
+		WriteChunk("fcTL", d, 26);
+	}
+	FILE* f{};
+	uint32_t frames{}, seq{};
+	bool fctlWritten{};
+};
+
+// WIC の GIF エンコーダにフレーム毎のパレットと遅延を与えて書き出す
+class GifWriter {
+public:
+	bool Open(IWICImagingFactory* wicFactory, const std::wstring& file, UINT width, UINT height) {
+		wic = wicFactory; w = width; h = height;
+		if (FAILED(wic->CreateStream(&s))) return false;
+		if (FAILED(s->InitializeFromFilename(file.c_str(), GENERIC_WRITE))) return false;
+		if (FAILED(wic->CreateEncoder(GUID_ContainerFormatGif, nullptr, &enc))) return false;
+		if (FAILED(enc->Initialize(s, WICBitmapEncoderNoCache))) return false;
+		// 無限ループ (NETSCAPE2.0 拡張)
+		IWICMetadataQueryWriter* mw = nullptr;
+		if (SUCCEEDED(enc->GetMetadataQueryWriter(&mw))) {
+			BYTE app[] = { 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0' };
+			BYTE loop[] = { 3, 1, 0, 0, 0 };
+			PROPVARIANT pv{};
+			pv.vt = VT_UI1 | VT_VECTOR; pv.caub.cElems = sizeof(app); pv.caub.pElems = app;
+			mw->SetMetadataByName(L"/appext/Application", &pv);
+			pv.caub.cElems = sizeof(loop); pv.caub.pElems = loop;
+			mw->SetMetadataByName(L"/appext/Data", &pv);
+			SAFE_RELEASE(mw);
+		}
+		return true;
+	}
+	~GifWriter() { SAFE_RELEASE(enc); SAFE_RELEASE(s); }
+
+	bool AddFrame(EncodedFrame& fr, int delayMs) {
+		IWICBitmapFrameEncode* fe = nullptr; IWICPalette* pal = nullptr; IWICMetadataQueryWriter* mw = nullptr;
+		WICPixelFormatGUID fmt = GUID_WICPixelFormat8bppIndexed;
+		bool ok = false;
+		if (FAILED(wic->CreatePalette(&pal))) goto done;
+		if (FAILED(pal->InitializeCustom(fr.palette.data(), (UINT)fr.palette.size()))) goto done;
+		if (FAILED(enc->CreateNewFrame(&fe, nullptr))) goto done;
+		if (FAILED(fe->Initialize(nullptr))) goto done;
+		if (FAILED(fe->SetSize(w, h))) goto done;
+		if (FAILED(fe->SetPixelFormat(&fmt)) || fmt != GUID_WICPixelFormat8bppIndexed) goto done;
+		if (FAILED(fe->SetPalette(pal))) goto done;
+		if (SUCCEEDED(fe->GetMetadataQueryWriter(&mw))) {
+			PROPVARIANT pv{};
+			pv.vt = VT_UI2; pv.uiVal = (USHORT)std::max(1, delayMs / 10);	// 1/100 秒単位
+			mw->SetMetadataByName(L"/grctlext/Delay", &pv);
+		}
+		if (FAILED(fe->WritePixels(h, w, (UINT)fr.data.size(), fr.data.data()))) goto done;
+		ok = SUCCEEDED(fe->Commit());
+	done:
+		SAFE_RELEASE(mw); SAFE_RELEASE(fe); SAFE_RELEASE(pal);
+		return ok;
+	}
+
+	bool Close() { return enc && SUCCEEDED(enc->Commit()); }
+
+private:
+	IWICImagingFactory* wic{};
+	IWICStream* s{};
+	IWICBitmapEncoder* enc{};
+	UINT w{}, h{};
+};
+
+// PNG 連番のファイル名。雛形は %d / %0Nd をちょうど 1 つだけ含むか、含まなければ拡張子の前に _%05d を挿む
+// (雛形をそのまま書式文字列に渡さない)
+class SequenceName {
+public:
+	bool Parse(const std::wstring& pattern) {
+		size_t pct = pattern.find(L'%');
+		if (pct == std::wstring::npos) {
+			size_t slash = pattern.find_last_of(L"\\/");
+			size_t dot = pattern.find_last_of(L'.');
+			if (dot == std::wstring::npos || (slash != std::wstring::npos && dot < slash)) dot = pattern.size();
+			prefix = pattern.substr(0, dot) + L"_";
+			suffix = dot < pattern.size() ? pattern.substr(dot) : L".png";
+			width = 5;
+			return true;
+		}
+		size_t i = pct + 1;
+		width = 0;
+		while (i < pattern.size() && iswdigit(pattern[i])) width = width * 10 + (pattern[i++] - L'0');
+		if (i >= pattern.size() || pattern[i] != L'd' || width > 16) return false;
+		if (pattern.find(L'%', i + 1) != std::wstring::npos) return false;
+		prefix = pattern.substr(0, pct);
+		suffix = pattern.substr(i + 1);
+		return true;
+	}
+	std::wstring At(size_t i) const {
+		wchar_t num[32];
+		swprintf_s(num, L"%0*d", width, (int)i);
+		return prefix + num + suffix;
+	}
+private:
+	std::wstring prefix, suffix;
+	int width = 5;
+};
+
+// 描画済みフレームを出力形式の中間データにする (ワーカースレッドで実行)
+static bool EncodeExportFrame(IWICImagingFactory* wic, IWICBitmap* frame, ExportFormat fmt, EncodedFrame& out)
+{
+	if (fmt != ExportFormat::Gif) return EncodePngToMemory(wic, frame, out.data);
+
+	// GIF はフレーム毎に 256 色へ減色する
+	IWICPalette* pal = nullptr; IWICFormatConverter* cvt = nullptr;
+	UINT w = 0, h = 0, n = 0;
+	bool ok = false;
+	if (FAILED(frame->GetSize(&w, &h))) goto done;
+	if (FAILED(wic->CreatePalette(&pal))) goto done;
+	if (FAILED(pal->InitializeFromBitmap(frame, 256, FALSE))) goto done;
+	if (FAILED(wic->CreateFormatConverter(&cvt))) goto done;
+	if (FAILED(cvt->Initialize(frame, GUID_WICPixelFormat8bppIndexed, WICBitmapDitherTypeErrorDiffusion, pal, 0.0, WICBitmapPaletteTypeCustom))) goto done;
+	out.data.resize((size_t)w * h);
+	if (FAILED(cvt->CopyPixels(nullptr, w, (UINT)out.data.size(), out.data.data()))) goto done;
+	if (FAILED(pal->GetColorCount(&n))) goto done;
+	out.palette.resize(n);
+	ok = SUCCEEDED(pal->GetColors(n, out.palette.data(), &n));
+done:
+	SAFE_RELEASE(cvt); SAFE_RELEASE(pal);
+	return ok;
+}
+
+// フレームを複数スレッドで描画・エンコードし、sink へは番号順に渡す。
+// 各スレッドは自前の D2D ファクトリと描画先を持ち、タイルは SharedTileSet を共有する。
+// 出力待ちのフレームは threads * 2 枚までに抑える。
+static bool ExportFrames(const MapView& v, const SharedTileSet& set, const std::vector<ExportFrame>& plan, ExportFormat fmt,
+	size_t threads, const std::function<bool(size_t, EncodedFrame&)>& sink)
+{
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::unordered_map<size_t, EncodedFrame> ready;
+	std::atomic<size_t> next(0);
+	size_t consumed = 0;
+	bool failed = false;
+	const size_t window = std::max<size_t>(2, threads * 2);
+
+	auto worker = [&]() {
+		ID2D1Factory* factory = nullptr;
+		IWICImagingFactory* wic = ThreadWic();
+		D2D1CreateFactory(D2D1_FACTORY_TYPE_SINGLE_THREADED, &factory);
+		if (factory && wic) {
+			HeadlessRenderer r(factory, wic, v.w, v.h);
+			r.Attach(&set);
+			while (r.ok()) {
+				size_t i = next.fetch_add(1);
+				if (i >= plan.size()) break;
+				{
+					std::unique_lock<std::mutex> lk(mtx);
+					cv.wait(lk, [&]() { return failed || i < consumed + window; });
+					if (failed) break;
+				}
+				EncodedFrame ef;
+				r.Render(v, plan[i].from, plan[i].to, plan[i].t);
+				bool ok = EncodeExportFrame(wic, r.bitmap(), fmt, ef);
+				{
+					std::lock_guard<std::mutex> lk(mtx);
+					if (ok) ready.emplace(i, std::move(ef));
+					else failed = true;
+				}
+				cv.notify_all();
+			}
+			if (!r.ok()) { std::lock_guard<std::mutex> lk(mtx); failed = true; }
+		}
+		else {
+			std::lock_guard<std::mutex> lk(mtx); failed = true;
+		}
+		SAFE_RELEASE(factory);
+		cv.notify_all();
+	};
+
+	std::vector<std::thread> ts;
+	for (size_t t = 0; t < std::max<size_t>(1, threads); ++t) ts.emplace_back(worker);
+
+	bool ok = true;
+	for (size_t i = 0; i < plan.size(); ++i) {
+		EncodedFrame ef;
+		{
+			std::unique_lock<std::mutex> lk(mtx);
+			cv.wait(lk, [&]() { return failed || ready.count(i) != 0; });
+			if (!ready.count(i)) { ok = false; break; }
+			ef = std::move(ready[i]);
+			ready.erase(i);
+		}
+		ok = sink(i, ef);
+		{
+			std::lock_guard<std::mutex> lk(mtx);
+			++consumed;
+			if (!ok) failed = true;
+		}
+		cv.notify_all();
+		if (!ok) break;
+	}
+	if (!ok) { std::lock_guard<std::mutex> lk(mtx); failed = true; }
+	cv.notify_all();
+	for (auto& t : ts) t.join();
+	return ok;
+}
+
+// -------------------- Region Prefetch --------------------
+// 緯度経度範囲・ズーム範囲・時刻範囲に掛かる GSI/JMA タイルを列挙し、ディスクキャッシュへ事前取得する
+struct TileJob { const wchar_t* host; std::wstring path; };
+
+// 地図ズーム zMin..zMax を表示するのに必要なタイル (JMA はビューアと同じ JmaZoomFor の対応で選ぶ)
+// 地図は表示中のスタイル (gGsiStyle) のもので、タイルのないズームは端のズームにまとめる
+static std::vector<TileJob> EnumeratePrefetchTiles(const GeoBox& box, int zMin, int zMax, const std::vector<NowcTime>& times)
+{
+	std::vector<TileJob> jobs;
+	std::vector<int> jmaZooms;
+	const TileLayerDef& style = kTileLayers[gGsiStyle];
+	int zPrev = -1;
+	wchar_t buf[512];
+	for (int z = zMin; z <= zMax; ++z) {
+		int zg = std::clamp(z, style.minZoom, style.maxZoom);
+		if (zg != zPrev) {
+			zPrev = zg;
+			int tx0, ty0, tx1, ty1;
+			TileRangeForBox(box, zg, tx0, ty0, tx1, ty1);
+			for (int ty = ty0; ty <= ty1; ++ty)
+				for (int tx = tx0; tx <= tx1; ++tx) {
+					swprintf_s(buf, style.tileFmt, zg, tx, ty);
+					jobs.push_back({ style.host, buf });
+				}
+		}
+		int zj = JmaZoomFor(z);
+		if (std::find(jmaZooms.begin(), jmaZooms.end(), zj) == jmaZooms.end()) jmaZooms.push_back(zj);
+	}
+	for (const auto& T : times) {
+		for (int z : jmaZooms) {
+			int tx0, ty0, tx1, ty1;
+			TileRangeForBox(box, z, tx0, ty0, tx1, ty1);
+			for (int ty = ty0; ty <= ty1; ++ty)
+				for (int tx = tx0; tx <= tx1; ++tx) {
+					swprintf_s(buf, K_JMA_TILE_FMT, T.basetime.c_str(), T.validtime.c_str(), z, tx, ty);
+					jobs.push_back({ K_JMA_HOST, buf });
+				}
+		}
+	}
+	return jobs;
+}
+
+enum class PrefetchStatus : uint8_t { Pending, Cached, Fetched, Failed };
+
+struct PrefetchProgress {
+	std::atomic<size_t> done{ 0 }, cached{ 0 }, fetched{ 0 }, failed{ 0 };
+	std::atomic<uint64_t> bytes{ 0 };
+};
+
+// concurrency 本の同時接続で取得する。キャッシュ済みは飛ばすので、中断後に同じ指定で再実行すれば続きから再開できる
+static void RunPrefetchJobs(const std::vector<TileJob>& jobs, size_t concurrency, std::vector<PrefetchStatus>& status,
+	std::vector<uint32_t>& sizes, PrefetchProgress& prog)
+{
+	status.assign(jobs.size(), PrefetchStatus::Pending);
+	sizes.assign(jobs.size(), 0);
+	ParallelFor(jobs.size(), concurrency, [&](size_t i) {
+		const TileJob& j = jobs[i];
+		std::wstring file = DiskCachePath(j.host, j.path);
+		uint64_t existing = 0;
+		if (DiskCacheHas(file, &existing)) {
+			status[i] = PrefetchStatus::Cached;
+			sizes[i] = (uint32_t)existing;
+			++prog.cached;
+		}
+		else {
+			std::vector<BYTE> buf;
+			bool ok = false;
+			for (int attempt = 0; attempt < 3 && !ok; ++attempt) {
+				if (attempt) Sleep(500u * attempt);
+				buf.clear();
+				ok = UpstreamGet(j.host, j.path, buf);
+			}
+			ok = ok && DiskCacheWrite(file, buf);
+			status[i] = ok ? PrefetchStatus::Fetched : PrefetchStatus::Failed;
+			sizes[i] = ok ? (uint32_t)buf.size() : 0;
+			if (ok) { ++prog.fetched; prog.bytes += buf.size(); }
+			else ++prog.failed;
+		}
+		++prog.done;
+		});
+}
+
+static bool WritePrefetchManifest(const std::wstring& file, const GeoBox& box, int zMin, int zMax,
+	const std::vector<NowcTime>& times, const std::vector<TileJob>& jobs, const std::vector<PrefetchStatus>& status, const std::vector<uint32_t>& sizes)
+{
+	FILE* f = nullptr;
+	if (_wfopen_s(&f, file.c_str(), L"w") != 0 || !f) return false;
+	static const wchar_t* kStatus[] = { L"pending", L"cached", L"fetched", L"failed" };
+	fwprintf(f, L"# bbox\t%.6f,%.6f,%.6f,%.6f\n# zoom\t%d-%d\n", box.minLon, box.minLat, box.maxLon, box.maxLat, zMin, zMax);
+	for (const auto& T : times) fwprintf(f, L"# time\t%ls\t%ls\n", T.basetime.c_str(), T.validtime.c_str());
+	fwprintf(f, L"status\tbytes\thost\tpath\n");
+	for (size_t i = 0; i < jobs.size(); ++i)
+		fwprintf(f, L"%ls\t%u\t%ls\t%ls\n", kStatus[(int)status[i]], sizes[i], jobs[i].host, jobs[i].path.c_str());
+	return fclose(f) == 0;
+}
+
+// -------------------- HTTP Server --------------------
+// 社内ツール向けの小さな HTTP/1.1 サーバー (keep-alive 対応、本文は Content-Length のみ)。
+// 受け付けた接続はスレッドプールのワーカーが 1 本ずつ受け持つ
+struct HttpRequest {
+	std::string method, path, query, body;
+	bool keepAlive{ true };
+
+	// クエリ文字列の値 (URL デコード済み)
+	std::string Param(const char* name, const std::string& def = "") const;
+};
+
+struct HttpResponse {
+	int status{ 200 };
+	std::string contentType{ "application/json" };
+	std::string body;
+};
+
+using HttpHandler = std::function<void(const HttpRequest&, HttpResponse&)>;
+
+static std::string UrlDecode(const std::string& s)
+{
+	std::string out;
+	for (size_t i = 0; i < s.size(); ++i) {
+		if (s[i] == '+') out += ' ';
+		else if (s[i] == '%' && i + 2 < s.size() && isxdigit((unsigned char)s[i + 1]) && isxdigit((unsigned char)s[i + 2])) {
+			out += (char)strtol(s.substr(i + 1, 2).c_str(), nullptr, 16);
+			i += 2;
+		}
+		else out += s[i];
+	}
+	return out;
+}
+
+std::string HttpRequest::Param(const char* name, const std::string& def) const
+{
+	const size_t n = strlen(name);
+	for (size_t pos = 0; pos < query.size(); ) {
+		size_t amp = query.find('&', pos);
+		if (amp == std::string::npos) amp = query.size();
+		if (query.compare(pos, n, name) == 0 && pos + n < amp && query[pos + n] == '=')
+			return UrlDecode(query.substr(pos + n + 1, amp - pos - n - 1));
+		pos = amp + 1;
+	}
+	return def;
+}
+
+static const char* HttpStatusText(int status)
+{
+	switch (status) {
+	case 200: return "OK";
+	case 400: return "Bad Request";
+	case 404: return "Not Found";
+	case 405: return "Method Not Allowed";
+	case 502: return "Bad Gateway";
+	default: return "Error";
+	}
+}
+
+static bool SendAll(SOCKET s, const char* p, size_t n)
+{
+	while (n > 0) {
+		int k = send(s, p, (int)std::min<size_t>(n, 1 << 20), 0);
+		if (k <= 0) return false;
+		p += k; n -= (size_t)k;
+	}
+	return true;
+}
+
+// ヘッダと本文を 1 つ読む。buf には同じ接続の次のメッセージの先頭が残る
+static bool ReadHttpMessage(SOCKET s, std::string& buf, std::string& head, std::string& body)
+{
+	static const size_t kMaxHeader = 64 * 1024, kMaxBody = 64 << 20;
+	char tmp[16384];
+	size_t end;
+	while ((end = buf.find("\r\n\r\n")) == std::string::npos) {
+		if (buf.size() > kMaxHeader) return false;
+		int k = recv(s, tmp, sizeof(tmp), 0);
+		if (k <= 0) return false;
+		buf.append(tmp, k);
+	}
+	head = buf.substr(0, end);
+	buf.erase(0, end + 4);
+	size_t length = 0;
+	std::string lower = head;
+	std::transform(lower.begin(), lower.end(), lower.begin(), [](char c) { return (char)tolower((unsigned char)c); });
+	size_t cl = lower.find("\r\ncontent-length:");
+	if (cl != std::string::npos) length = strtoull(head.c_str() + cl + 17, nullptr, 10);
+	if (length > kMaxBody) return false;
+	while (buf.size() < length) {
+		int k = recv(s, tmp, sizeof(tmp), 0);
+		if (k <= 0) return false;
+		buf.append(tmp, k);
+	}
+	body = buf.substr(0, length);
+	buf.erase(0, length);
+	return true;
+}
+
+static bool HeaderHas(const std::string& head, const char* nameColonValue)
+{
+	std::string lower = head;
+	std::transform(lower.begin(), lower.end(), lower.begin(), [](char c) { return (char)tolower((unsigned char)c); });
+	return lower.find(nameColonValue) != std::string::npos;
+}
+
+class HttpServer {
+public:
+	~HttpServer() { Stop(); }
+
+	// port 0 なら空いているポートを使う (port() で確認)
+	bool Start(const char* bindAddr, int port, size_t threads, HttpHandler h) {
+		WSADATA wsa;
+		if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) return false;
+		wsaStarted = true;
+		handler = std::move(h);
+		listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (listener == INVALID_SOCKET) return false;
+		BOOL yes = TRUE;
+		setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+		sockaddr_in a{};
+		a.sin_family = AF_INET;
+		a.sin_port = htons((unsigned short)port);
+		if (inet_pton(AF_INET, bindAddr, &a.sin_addr) != 1) return false;
+		if (bind(listener, (const sockaddr*)&a, sizeof(a)) != 0 || listen(listener, SOMAXCONN) != 0) return false;
+		int len = sizeof(a);
+		getsockname(listener, (sockaddr*)&a, &len);
+		boundPort = ntohs(a.sin_port);
+		pool = std::make_unique<ThreadPool>(threads);
+		acceptThread = std::thread([this]() { AcceptLoop(); });
+		return true;
+	}
+
+	void Stop() {
+		if (stopping.exchange(true)) return;
+		if (listener != INVALID_SOCKET) { closesocket(listener); listener = INVALID_SOCKET; }
+		if (acceptThread.joinable()) acceptThread.join();
+		{
+			// keep-alive で待っている接続を起こす
+			std::lock_guard<std::mutex> lk(connMtx);
+			for (SOCKET c : conns) shutdown(c, SD_BOTH);
+		}
+		pool.reset();
+		if (wsaStarted) { WSACleanup(); wsaStarted = false; }
+	}
+
+	int port() const { return boundPort; }
+	size_t requestCount() const { return requests; }
+
+private:
+	void AcceptLoop() {
+		const SOCKET ls = listener;
+		while (!stopping) {
+			SOCKET c = accept(ls, nullptr, nullptr);
+			if (c == INVALID_SOCKET) {
+				// Stop で listener を閉じたときはここで抜ける。ハンドル切れ (WSAEMFILE/WSAENOBUFS) などは少し待ってから受け直す
+				if (stopping) break;
+				const int err = WSAGetLastError();
+				std::this_thread::sleep_for(std::chrono::milliseconds(err == WSAECONNRESET ? 1 : 100));
+				continue;
+			}
+			BOOL nodelay = TRUE;
+			setsockopt(c, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+			DWORD timeout = 30000;
+			setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+			{
+				std::lock_guard<std::mutex> lk(connMtx);
+				conns.push_back(c);
+			}
+			pool->enqueue([this, c]() { Serve(c); });
+		}
+	}
+
+	void Serve(SOCKET c) {
+		std::string buf, head, body;
+		while (!stopping && ReadHttpMessage(c, buf, head, body)) {
+			HttpRequest req;
+			size_t sp1 = head.find(' '), sp2 = head.find(' ', sp1 + 1), eol = head.find("\r\n");
+			if (sp1 == std::string::npos || sp2 == std::string::npos || sp2 > eol) break;
+			req.method = head.substr(0, sp1);
+			std::string target = head.substr(sp1 + 1, sp2 - sp1 - 1);
+			size_t q = target.find('?');
+			req.path = target.substr(0, q);
+			if (q != std::string::npos) req.query = target.substr(q + 1);
+			req.body = std::move(body);
+			req.keepAlive = !HeaderHas(head, "\r\nconnection: close") && head.compare(sp2 + 1, 8, "HTTP/1.0") != 0;
+
+			HttpResponse res;
+			handler(req, res);
+			++requests;
+			char hdr[256];
+			int n = sprintf_s(hdr, "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: %s\r\n\r\n",
+				res.status, HttpStatusText(res.status), res.contentType.c_str(), res.body.size(), req.keepAlive ? "keep-alive" : "close");
+			if (!SendAll(c, hdr, n) || !SendAll(c, res.body.data(), res.body.size()) || !req.keepAlive) break;
+		}
+		{
+			std::lock_guard<std::mutex> lk(connMtx);
+			conns.erase(std::remove(conns.begin(), conns.end(), c), conns.end());
+		}
+		closesocket(c);
+	}
+
+	SOCKET listener{ INVALID_SOCKET };
+	bool wsaStarted{};
+	int boundPort{};
+	HttpHandler handler;
+	std::unique_ptr<ThreadPool> pool;
+	std::thread acceptThread;
+	std::atomic<bool> stopping{ false };
+	std::atomic<size_t> requests{ 0 };
+	std::mutex connMtx;
+	std::vector<SOCKET> conns;
+};
+
+// 負荷試験用の keep-alive クライアント (呼び出し側で WSAStartup 済みであること)
+class HttpClient {
+public:
+	~HttpClient() { Close(); }
+	bool Connect(const char* host, int port) {
+		Close();
+		s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (s == INVALID_SOCKET) return false;
+		BOOL nodelay = TRUE;
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+		sockaddr_in a{};
+		a.sin_family = AF_INET;
+		a.sin_port = htons((unsigned short)port);
+		if (inet_pton(AF_INET, host, &a.sin_addr) != 1 || connect(s, (const sockaddr*)&a, sizeof(a)) != 0) { Close(); return false; }
+		return true;
+	}
+	bool Request(const char* method, const std::string& target, const std::string& body, int& status, std::string& resp) {
+		if (s == INVALID_SOCKET) return false;
+		char hdr[1024];
+		int n = sprintf_s(hdr, "%s %s HTTP/1.1\r\nHost: localhost\r\nContent-Length: %zu\r\n\r\n", method, target.c_str(), body.size());
+		std::string head;
+		if (n <= 0 || !SendAll(s, hdr, n) || !SendAll(s, body.data(), body.size()) || !ReadHttpMessage(s, buf, head, resp)) { Close(); return false; }
+		status = atoi(head.c_str() + std::min<size_t>(9, head.size()));
+		return true;
+	}
+	void Close() {
+		if (s != INVALID_SOCKET) { closesocket(s); s = INVALID_SOCKET; }
+		buf.clear();
+	}
+
+private:
+	SOCKET s{ INVALID_SOCKET };
+	std::string buf;
+};
+
+// -------------------- Query Service --------------------
+// /intensity?lat=&lon=[&time=][&zoom=]   1 地点の強度 (time は添字 (0 = 最新) または validtime)
+// POST /intensity                        本文 1 行 1 地点 "lat,lon[,time]"、結果は JSON 配列
+// /times                                 時刻一覧
+// タイルのパレット面は LRU で保持し、同じタイルへの同時の取得は 1 回にまとめる
+class IntensityService {
+public:
+	explicit IntensityService(size_t cacheTiles) : planes(cacheTiles) {}
+
+	void SetTimes(std::vector<NowcTime> t) {
+		auto p = std::make_shared<const std::vector<NowcTime>>(std::move(t));
+		std::lock_guard<std::mutex> lk(mtx);
+		times = p;
+	}
+	std::shared_ptr<const std::vector<NowcTime>> Times() const {
+		std::lock_guard<std::mutex> lk(mtx);
+		return times;
+	}
+
+	void Handle(const HttpRequest& req, HttpResponse& res) {
+		auto ts = Times();
+		if (req.path == "/times") {
+			res.body = "[";
+			for (size_t i = 0; ts && i < ts->size(); ++i)
+				res.body += (i ? ",{" : "{") + Json("basetime", (*ts)[i].basetime) + "," + Json("validtime", (*ts)[i].validtime) + "}";
+			res.body += "]";
+			return;
+		}
+		if (req.path != "/intensity") { res.status = 404; res.body = "{\"error\":\"not found\"}"; return; }
+		if (!ts || ts->empty()) { res.status = 502; res.body = "{\"error\":\"no frames\"}"; return; }
+		int z = std::clamp(atoi(req.Param("zoom", std::to_string(MAX_JMA_ZOOM)).c_str()), MIN_JMA_ZOOM, MAX_JMA_ZOOM);
+		if (req.method == "GET") {
+			double lat, lon;
+			if (!ParseCoord(req.Param("lat"), 90.0, lat) || !ParseCoord(req.Param("lon"), 180.0, lon)) {
+				res.status = 400; res.body = "{\"error\":\"lat (-90..90) and lon (-180..180) are required\"}"; return;
+			}
+			res.body = QueryJson(*ts, lon, lat, req.Param("time", "0"), z);
+		}
+		else if (req.method == "POST") {
+			std::string defTime = req.Param("time", "0");
+			res.body = "[";
+			size_t pos = 0, count = 0, lineNo = 0;
+			while (pos < req.body.size()) {
+				size_t eol = req.body.find('\n', pos);
+				if (eol == std::string::npos) eol = req.body.size();
+				std::string line = req.body.substr(pos, eol - pos);
+				pos = eol + 1;
+				++lineNo;
+				double lat, lon;
+				char tbuf[32] = {};
+				int n = sscanf_s(line.c_str(), "%lf,%lf,%31s", &lat, &lon, tbuf, (unsigned)sizeof(tbuf));
+				if (n < 2) continue;
+				if (!(std::fabs(lat) <= 90.0 && std::fabs(lon) <= 180.0)) {
+					res.status = 400;
+					res.body = "{\"error\":\"line " + std::to_string(lineNo) + ": lat must be -90..90 and lon -180..180\"}";
+					return;
+				}
+				res.body += (count++ ? "," : "") + QueryJson(*ts, lon, lat, n >= 3 ? std::string(tbuf) : defTime, z);
+			}
+			res.body += "]";
+		}
+		else {
+			res.status = 405; res.body = "{\"error\":\"method not allowed\"}";
+		}
+	}
+
+	size_t tileLoads() const { return planes.statistics().loads; }
+
+private:
+	using Plane = SingleFlightCache<std::vector<BYTE>>::Ptr;
+
+	// 数値として全体を読めて |v| <= limit のときだけ true (NaN も弾く)
+	static bool ParseCoord(const std::string& s, double limit, double& v) {
+		if (s.empty()) return false;
+		char* end = nullptr;
+		v = strtod(s.c_str(), &end);
+		return end && *end == '\0' && std::fabs(v) <= limit;
+	}
+
+	static std::string Json(const char* k, const std::wstring& v) {
+		return std::string("\"") + k + "\":\"" + std::string(v.begin(), v.end()) + "\"";
+	}
+
+	// time: 添字 (0 = 最新) または 14 桁の validtime
+	static int ResolveTime(const std::vector<NowcTime>& ts, const std::string& t) {
+		if (t.size() == 14) {
+			std::wstring w(t.begin(), t.end());
+			for (size_t i = 0; i < ts.size(); ++i) if (ts[i].validtime == w) return (int)i;
+			return -1;
+		}
+		int i = atoi(t.c_str());
+		return i >= 0 && i < (int)ts.size() ? i : -1;
+	}
+
+	std::string QueryJson(const std::vector<NowcTime>& ts, double lon, double lat, const std::string& time, int z) {
+		char buf[320];
+		int ti = ResolveTime(ts, time);
+		if (ti < 0) {
+			sprintf_s(buf, "{\"lat\":%.6f,\"lon\":%.6f,\"error\":\"unknown time\"}", lat, lon);
+			return buf;
+		}
+		double wx = LonLatToWorldX(lon, z), wy = LonLatToWorldY(lat, z);
+		int tx = (int)std::floor(wx / TILE_SIZE), ty = (int)std::floor(wy / TILE_SIZE);
+		Plane p;
+		if (tx >= 0 && ty >= 0 && tx < (1 << z) && ty < (1 << z)) p = Get(JmaTilePath(ts[ti], z, tx, ty));
+		std::string vt(ts[ti].validtime.begin(), ts[ti].validtime.end());
+		if (!p) {
+			sprintf_s(buf, "{\"lat\":%.6f,\"lon\":%.6f,\"validtime\":\"%s\",\"error\":\"tile unavailable\"}", lat, lon, vt.c_str());
+			return buf;
+		}
+		int px = std::clamp((int)(wx - tx * TILE_SIZE), 0, TILE_SIZE - 1), py = std::clamp((int)(wy - ty * TILE_SIZE), 0, TILE_SIZE - 1);
+		int c = (*p)[(size_t)py * TILE_SIZE + px];
+		if (c >= kJmaClassCount) c = 0;
+		sprintf_s(buf, "{\"lat\":%.6f,\"lon\":%.6f,\"validtime\":\"%s\",\"class\":%d,\"mmh_lo\":%g,\"mmh_hi\":%g}",
+			lat, lon, vt.c_str(), c, kJmaScale[c].lo, kJmaScale[c].hi);
+		return buf;
+	}
+
+	Plane Get(const std::wstring& path) {
+		return planes.Get(path, [&](std::vector<BYTE>& v) {
+			v.resize(kTilePixels);
+			return LoadTileClasses(path, v.data());
+			});
+	}
+
+	mutable std::mutex mtx;
+	std::shared_ptr<const std::vector<NowcTime>> times;
+	SingleFlightCache<std::vector<BYTE>> planes;
+};
+
+// 負荷試験用の模擬タイルサーバー。時刻一覧と、どのパスにも同じ雨域の PNG を返す (応答前に latencyMs 待つ)
+static bool MakeMockTile(std::string& png)
+{
+	std::vector<BYTE> plane(kTilePixels, 0);
+	for (int y = 0; y < TILE_SIZE; ++y)
+		for (int x = 0; x < TILE_SIZE; ++x) {
+			double d = std::hypot(x - 128.0, y - 128.0);
+			plane[(size_t)y * TILE_SIZE + x] = (BYTE)(d < 120 ? std::min(8, 1 + (int)((120 - d) / 15)) : 0);
+		}
+	IWICBitmap* bmp = ClassPlaneToWic(ThreadWic(), plane.data());
+	std::vector<BYTE> out;
+	bool ok = bmp && EncodePngToMemory(ThreadWic(), bmp, out);
+	SAFE_RELEASE(bmp);
+	png.assign(out.begin(), out.end());
+	return ok;
+}
+
+static std::string MockTimesJson(int frames)
+{
+	// 2024-07-01 12:00 から 5 分ずつ遡る (最大 12 時間)
+	frames = std::clamp(frames, 1, 144);
+	std::string js = "[";
+	for (int i = 0; i < frames; ++i) {
+		int m = 12 * 60 - i * 5;
+		char buf[96];
+		sprintf_s(buf, "%s{\"basetime\":\"20240701%02d%02d00\",\"validtime\":\"20240701%02d%02d00\"}", i ? "," : "", m / 60, m % 60, m / 60, m % 60);
+		js += buf;
+	}
+	return js + "]";
+}
+
+struct MockUpstream {
+	HttpServer server;
+	std::string png, times;
+	int latencyMs{};
+	std::atomic<size_t> tileRequests{ 0 };
+
+	bool Start(int frames, int latency, size_t threads) {
+		if (!MakeMockTile(png)) return false;
+		times = MockTimesJson(frames);
+		latencyMs = latency;
+		return server.Start("127.0.0.1", 0, threads, [this](const HttpRequest& req, HttpResponse& res) {
+			if (latencyMs > 0) std::this_thread::sleep_for(std::chrono::milliseconds(latencyMs));
+			if (req.path.find("/targetTimes_N") != std::string::npos) { res.body = times; return; }
+			if (req.path.size() > 4 && req.path.compare(req.path.size() - 4, 4, ".png") == 0) {
+				++tileRequests;
+				res.contentType = "image/png";
+				res.body = png;
+				return;
+			}
+			res.status = 404;
+			});
+	}
+};
+
+// -------------------- Tile Proxy --------------------
+// LAN 内の他のビューアー (--upstream このマシン:port) へ GSI/JMA のタイルを中継する。
+// メモリの LRU → ディスクキャッシュ → 本来のサーバーの順に探し、同じタイルの同時の取りこぼしは 1 回の取得にまとめる
+class TileProxy {
+public:
+	explicit TileProxy(size_t memTiles) : tiles(memTiles) {}
+
+	void Handle(const HttpRequest& req, HttpResponse& res) {
+		++requests;
+		if (req.method != "GET") { res.status = 405; return; }
+		std::wstring path(req.path.begin(), req.path.end());
+
+		// 時刻一覧は更新されるので短時間だけ使い回す
+		if (path == K_TIMES_URL_N1 || path == K_TIMES_URL_N2) {
+			auto t = Times(path);
+			if (!t) { res.status = 502; return; }
+			res.body = *t;
+			return;
+		}
+		// 既知の層のタイルだけを中継する (任意のパスをディスクキャッシュに書かせない)
+		TileLayer layer;
+		if (!ParseTileLayerPath(path, layer)) { res.status = 404; return; }
+		auto p = tiles.Get(path, [&](std::string& v) {
+			std::vector<BYTE> buf;
+			if (!FetchTileBytes(path, layer, buf)) return false;
+			v.assign(buf.begin(), buf.end());
+			return true;
+			});
+		if (!p) { res.status = 502; return; }
+		auto endsWith = [&](const wchar_t* ext) { size_t n = wcslen(ext); return path.size() > n && path.compare(path.size() - n, n, ext) == 0; };
+		res.contentType = endsWith(L".png") ? "image/png" : endsWith(L".jpg") ? "image/jpeg" : "application/octet-stream";
+		res.body = *p;
+	}
+
+	size_t requestCount() const { return requests; }
+	SingleFlightCache<std::string>::Stats statistics() const { return tiles.statistics(); }
+
+private:
+	std::shared_ptr<const std::string> Times(const std::wstring& path) {
+		static const double kTimesTtl = 30.0;
+		{
+			std::lock_guard<std::mutex> lk(timesMtx);
+			auto it = times.find(path);
+			if (it != times.end() && SecondsSince(it->second.second) < kTimesTtl) return it->second.first;
+		}
+		std::vector<BYTE> buf;
+		if (!UpstreamGet(K_JMA_HOST, path, buf)) return nullptr;
+		auto p = std::make_shared<const std::string>(buf.begin(), buf.end());
+		std::lock_guard<std::mutex> lk(timesMtx);
+		times[path] = { p, std::chrono::steady_clock::now() };
+		return p;
+	}
+
+	SingleFlightCache<std::string> tiles;
+	std::mutex timesMtx;
+	std::unordered_map<std::wstring, std::pair<std::shared_ptr<const std::string>, std::chrono::steady_clock::time_point>> times;
+	std::atomic<size_t> requests{ 0 };
+};
+
+// -------------------- Geofence Stream --------------------
+// 車両位置の行 ("id,lon,lat[,...]") を流し込み、最新の観測フレームの強度を末尾に足して返す ("...,validtime,mm/h")。
+// 行は 1024 件ずつまとめ、経度緯度 → ワールド画素を SSE2 で変換 (メルカトルの緯度は 0.01 度刻みの表を線形補間、
+// z10 でも誤差は 1/1000 画素程度) してから、直前に使ったタイルを覚えておく小さな表で引く
+static const size_t kGeoBatch = 1024;
+
+// 緯度 → ワールド Y (0..1)。表の端はメルカトルの有効範囲
+struct MercatorTable {
+	double minLat, step;
+	std::vector<double> y;
+};
+static const MercatorTable& MercatorLut()
+{
+	static const MercatorTable t = []() {
+		MercatorTable m{ -85.0, 0.01, {} };
+		const int n = (int)std::lround(170.0 / m.step) + 2;
+		m.y.resize(n);
+		for (int i = 0; i < n; ++i) m.y[i] = LonLatToWorldY(m.minLat + i * m.step, 0) / TILE_SIZE;
+		return m;
+		}();
+	return t;
+}
+
+static void ProjectToWorldPixelsScalar(const double* lon, const double* lat, size_t n, int z, int32_t* wx, int32_t* wy)
+{
+	const double maxPx = (double)TILE_SIZE * (1 << z) - 1;
+	for (size_t i = 0; i < n; ++i) {
+		wx[i] = (int32_t)std::clamp(std::floor(LonLatToWorldX(lon[i], z)), 0.0, maxPx);
+		wy[i] = (int32_t)std::clamp(std::floor(LonLatToWorldY(std::clamp(lat[i], -85.0, 85.0), z)), 0.0, maxPx);
+	}
+}
+
+// SSE2 で 2 件ずつ。表の値の取り出しだけはスカラー (SSE2 に gather はない)
+static void ProjectToWorldPixels(const double* lon, const double* lat, size_t n, int z, int32_t* wx, int32_t* wy)
+{
+	const MercatorTable& t = MercatorLut();
+	const double S = (double)TILE_SIZE * (1 << z);
+	const __m128d kx = _mm_set1_pd(S / 360.0), ox = _mm_set1_pd(180.0), ks = _mm_set1_pd(S), inv = _mm_set1_pd(1.0 / t.step);
+	const __m128d lo = _mm_set1_pd(t.minLat), hi = _mm_set1_pd(-t.minLat), zero = _mm_setzero_pd(), maxPx = _mm_set1_pd(S - 1);
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2) {
+		__m128d x = _mm_mul_pd(_mm_add_pd(_mm_loadu_pd(lon + i), ox), kx);
+		const __m128d f = _mm_mul_pd(_mm_sub_pd(_mm_min_pd(_mm_max_pd(_mm_loadu_pd(lat + i), lo), hi), lo), inv);	// NaN は lo に寄る
+		const __m128i k = _mm_cvttpd_epi32(f);
+		const __m128d fr = _mm_sub_pd(f, _mm_cvtepi32_pd(k));
+		const int k0 = _mm_cvtsi128_si32(k), k1 = _mm_cvtsi128_si32(_mm_srli_si128(k, 4));
+		const __m128d a = _mm_set_pd(t.y[k1], t.y[k0]), b = _mm_set_pd(t.y[k1 + 1], t.y[k0 + 1]);
+		__m128d y = _mm_mul_pd(_mm_add_pd(a, _mm_mul_pd(_mm_sub_pd(b, a), fr)), ks);
+		x = _mm_min_pd(_mm_max_pd(x, zero), maxPx);
+		y = _mm_min_pd(_mm_max_pd(y, zero), maxPx);
+		_mm_storel_epi64((__m128i*)(wx + i), _mm_cvttpd_epi32(x));
+		_mm_storel_epi64((__m128i*)(wy + i), _mm_cvttpd_epi32(y));
+	}
+	if (i < n) ProjectToWorldPixelsScalar(lon + i, lat + i, n - i, z, wx + i, wy + i);
+}
+
+// 接続をまたいで共有する部分: 現在のフレームとパレット面のキャッシュ
+class GeofenceService {
+public:
+	using Plane = SingleFlightCache<std::vector<BYTE>>::Ptr;
+	GeofenceService(int z, size_t cacheTiles) : zoom(z), planes(cacheTiles) {}
+
+	void SetFrame(const NowcTime& T) {
+		std::lock_guard<std::mutex> lk(mtx);
+		frame = T;
+		++generation;
+	}
+	NowcTime Frame(uint64_t& gen) const {
+		std::lock_guard<std::mutex> lk(mtx);
+		gen = generation;
+		return frame;
+	}
+	uint64_t Generation() const { return generation; }
+
+	Plane Tile(const NowcTime& T, int tx, int ty) {
+		const std::wstring path = JmaTilePath(T, zoom, tx, ty);
+		return planes.Get(path, [&](std::vector<BYTE>& v) { v.resize(kTilePixels); return LoadTileClasses(path, v.data()); });
+	}
+	size_t tileLoads() const { return planes.statistics().loads; }
+
+	const int zoom;
+
+private:
+	SingleFlightCache<std::vector<BYTE>> planes;
+	mutable std::mutex mtx;
+	NowcTime frame;
+	std::atomic<uint64_t> generation{ 0 };
+};
+
+// 1 本の入力 (標準入力や 1 接続) ごと。スレッドをまたいで使わない
+class GeofenceStream {
+public:
+	struct Stats {
+		size_t records{}, noData{}, malformed{};
+		double parseSec{}, projectSec{}, annotateSec{};
+	};
+
+	explicit GeofenceStream(GeofenceService& svc) : svc(svc) {
+		for (int c = 0; c < kJmaClassCount; ++c) {
+			char buf[16];
+			sprintf_s(buf, "%.1f", JmaClassMmh(c));
+			mmhText[c] = buf;
+		}
+	}
+
+	// 完全な行だけを処理し、改行のない末尾は次の Feed まで持ち越す
+	void Feed(const char* p, size_t n, std::string& out) {
+		auto t0 = std::chrono::steady_clock::now();
+		const double flushed = stats.projectSec + stats.annotateSec;
+		pending.append(p, n);
+		size_t pos = 0;
+		for (size_t eol; (eol = pending.find('\n', pos)) != std::string::npos; pos = eol + 1) {
+			AddLine(pos, eol);
+			if (count == kGeoBatch) Flush(out);
+		}
+		Flush(out);
+		pending.erase(0, pos);
+		stats.parseSec += SecondsSince(t0) - (stats.projectSec + stats.annotateSec - flushed);
+	}
+
+	// 入力の終わり。改行で終わっていない最後の行も処理する
+	void Finish(std::string& out) {
+		if (!pending.empty()) { AddLine(0, pending.size()); Flush(out); }
+		pending.clear();
+	}
+
+	const Stats& statistics() const { return stats; }
+
+private:
+	void AddLine(size_t b, size_t e) {
+		if (e > b && pending[e - 1] == '\r') --e;
+		begin[count] = b; end[count] = e;
+		ok[count] = false;
+		// 2 番目と 3 番目の項目が経度・緯度
+		const char* s = pending.data() + b, * const last = pending.data() + e;
+		auto field = [&](const char* from, double& v) {
+			const char* comma = std::find(from, last, ',');
+			while (from < comma && *from == ' ') ++from;
+			return std::from_chars(from, comma, v).ec == std::errc() ? comma : nullptr;
+			};
+		const char* c1 = std::find(s, last, ',');
+		const char* c2 = c1 != last ? field(c1 + 1, lon[count]) : nullptr;
+		ok[count] = c2 && c2 != last && field(c2 + 1, lat[count]) && std::abs(lat[count]) <= 90.0 && std::abs(lon[count]) <= 180.0;
+		if (!ok[count]) { lon[count] = lat[count] = 0.0; ++stats.malformed; }
+		++count;
+	}
+
+	void Flush(std::string& out) {
+		if (count == 0) return;
+		auto t0 = std::chrono::steady_clock::now();
+		ProjectToWorldPixels(lon, lat, count, svc.zoom, wx, wy);
+		auto t1 = std::chrono::steady_clock::now();
+		stats.projectSec += std::chrono::duration<double>(t1 - t0).count();
+
+		if (svc.Generation() != gen) {
+			frame = svc.Frame(gen);
+			frameText = frame.validtime.size() >= 12 ? std::string(frame.validtime.begin(), frame.validtime.begin() + 12) : "";
+			for (auto& m : memo) m = Memo();
+		}
+		for (size_t i = 0; i < count; ++i) {
+			out.append(pending, begin[i], end[i] - begin[i]);
+			out += ',';
+			const BYTE* plane = ok[i] && !frameText.empty() ? Plane(wx[i] >> 8, wy[i] >> 8) : nullptr;
+			if (!plane) { ++stats.noData; out += ",\n"; continue; }
+			const BYTE c = plane[(wy[i] & (TILE_SIZE - 1)) * TILE_SIZE + (wx[i] & (TILE_SIZE - 1))];
+			out += frameText;
+			out += ',';
+			out += mmhText[c < kJmaClassCount ? c : 0];
+			out += '\n';
+		}
+		stats.records += count;
+		count = 0;
+		stats.annotateSec += SecondsSince(t1);
+	}
+
+	// 直接写像の小さな表。車両は同じタイルに続けて現れることが多い
+	const BYTE* Plane(int tx, int ty) {
+		const uint64_t key = ((uint64_t)(uint32_t)ty << 32) | (uint32_t)tx;
+		Memo& m = memo[(tx & 31) | (ty & 31) << 5];
+		if (m.key != key || !m.loaded) {
+			m.key = key;
+			m.loaded = true;
+			m.plane = svc.Tile(frame, tx, ty);		// 取れなかったタイルも入れ替わるまで覚えておく
+		}
+		return m.plane ? m.plane->data() : nullptr;
+	}
+
+	static const int kMemoSize = 1024;	// 32x32 タイルの窓
+	struct Memo {
+		uint64_t key{};
+		bool loaded{};
+		GeofenceService::Plane plane;
+	};
+
+	GeofenceService& svc;
+	std::string pending;
+	size_t count{};
+	size_t begin[kGeoBatch], end[kGeoBatch];
+	bool ok[kGeoBatch];
+	double lon[kGeoBatch], lat[kGeoBatch];
+	int32_t wx[kGeoBatch], wy[kGeoBatch];
+	uint64_t gen{ UINT64_MAX };
+	NowcTime frame;
+	std::string frameText;
+	std::string mmhText[kJmaClassCount];
+	Memo memo[kMemoSize];
+	Stats stats;
+};
+
+// -------------------- Win32 --------------------
 static LRESULT CALLBACK WndProc(HWND h, UINT m, WPARAM w, LPARAM l) {
 	switch (m) {
 	case WM_CREATE:
 		gPool = std::make_unique<ThreadPool>(WORKER_THREADS);
-		SwitchTimes(gUseForecast);
+		if (gPlayback.active) { LoadPlaybackTimes(); gReadahead.Start(); }
+		else { SwitchTimes(gUseForecast); ApplyExtrapolation(); }
+		gAccumLayer.Start();
+		gContourLayer.Start();
+		gStormLayer.Start();
+		gMotionLayer.Start();
 		SetTimer(h, 1, (UINT)(kAnimStepInterval * 1000), nullptr);
+		SetTimer(h, kTimesTimerId, 60 * 1000, nullptr);
+		return 0;
+	case WM_SIZE: {
+		RECT rc; GetClientRect(h, &rc);
+		g.clientW = rc.right; g.clientH = rc.bottom;
+		if (g.rt) g.rt->Resize(D2D1::SizeU(g.clientW, g.clientH));
+		ClampViewToJapan();
+		InvalidateRect(h, nullptr, FALSE); return 0;
+	}
+	case WM_LBUTTONDOWN:
+		if (TimelineHit(GET_X_LPARAM(l), GET_Y_LPARAM(l))) {
+			gPlayback.dragging = true; SetCapture(h);
+			PlaybackSeek(TimelineIndexAt(GET_X_LPARAM(l))); return 0;
+		}
+		g.dragging = true; SetCapture(h);
+		g.dragStart.x = GET_X_LPARAM(l); g.dragStart.y = GET_Y_LPARAM(l);
+		g.dragStartWX = g.originWX; g.dragStartWY = g.originWY; return 0;
+	case WM_MOUSEMOVE:
+		if (!gCursor.inside) {
+			// ウィンドウ外へ出たときに WM_MOUSELEAVE を受け取る (1 回ごとに登録し直す)
+			TRACKMOUSEEVENT tme{ sizeof(tme), TME_LEAVE, h, 0 };
+			TrackMouseEvent(&tme);
+		}
+		gCursor.inside = true; gCursor.sx = GET_X_LPARAM(l); gCursor.sy = GET_Y_LPARAM(l);
+		if (!g.dragging && !gPlayback.dragging && UpdateCursorIntensity()) InvalidateRect(h, nullptr, FALSE);
+		if (gPlayback.dragging) PlaybackSeek(TimelineIndexAt(GET_X_LPARAM(l)));
+		else if (g.dragging) {
+			int sx = GET_X_LPARAM(l), sy = GET_Y_LPARAM(l);
+			int z = (int)std::floor(g.zoom);
+			double sc = std::pow(2.0, g.zoom - z);
+			g.originWX = g.dragStartWX - (sx - g.dragStart.x) / sc;
+			g.originWY = g.dragStartWY - (sy - g.dragStart.y) / sc;
+			ClampViewToJapan();
+			InvalidateRect(h, nullptr, FALSE);
+			UpdateTitle();
+		}return 0;
+	case WM_MOUSELEAVE:
+		gCursor.inside = false; gCursor.valid = false;
+		InvalidateRect(h, nullptr, FALSE); return 0;
+	case WM_LBUTTONUP:
+		if (gPlayback.dragging) { gPlayback.dragging = false; InvalidateRect(h, nullptr, FALSE); }
+		g.dragging = false; ReleaseCapture(); return 0;
+	case WM_MOUSEWHEEL: {
+		int delta = GET_WHEEL_DELTA_WPARAM(w);
+		ZoomAtCenter((delta > 0) ? 0.25 : -0.25); return 0;
+	}
+	case WM_KEYDOWN:
+		if (w == '1' && !gPlayback.active) { SwitchTimes(false); ApplyExtrapolation(); }
+		else if (w == '2' && !gPlayback.active) { SwitchTimes(true); ApplyExtrapolation(); }
+		else if (w == 'A') {
+			// 積算表示の切り替え: なし → 1 時間 → 3 時間
+			gAccumFrames = gAccumFrames == 0 ? 12 : gAccumFrames == 12 ? 36 : 0;
+			InvalidateRect(h, nullptr, FALSE);
+		}
+		else if (w == 'C') { gShowContours = !gShowContours; InvalidateRect(h, nullptr, FALSE); }
+		else if (w == 'S') { gShowStorms = !gShowStorms; InvalidateRect(h, nullptr, FALSE); }
+		else if (w == 'M') gMotionInterp = !gMotionInterp;
+		else if (w == 'G') {
+			// 地図のスタイルを順に切り替える。キャッシュはスタイルごとなので、戻したときは取得し直さない
+			// 下敷き (gGsiUnderlay) は新しいスタイルの要求が全部終わるまで前のスタイルのまま
+			gGsiStyle = (TileLayer)((gGsiStyle + 1) % kTileRain);
+			InvalidateRect(h, nullptr, FALSE);
+		}
+		else if (w == 'B') { gShowBoundaries = !gShowBoundaries; InvalidateRect(h, nullptr, FALSE); }
+		else if (w == 'L') { gShowLayerStats = !gShowLayerStats; InvalidateRect(h, nullptr, FALSE); }
+		else if (w == 'T' || w == 'O') {
+			bool& on = gTileLayerOn[w == 'T' ? kTileThunder : kTileTornado];
+			on = !on;
+			InvalidateRect(h, nullptr, FALSE);
+		}
+		else if (w == 'E') { gExtrapEnabled = !gExtrapEnabled; ApplyExtrapolation(); InvalidateRect(h, nullptr, FALSE); UpdateTitle(); }
+		else if (gPlayback.active && w == VK_HOME) PlaybackSeek((int)gTimes.size() - 1);
+		else if (gPlayback.active && w == VK_END) PlaybackSeek(0);
+		else if (gPlayback.active && w == VK_PRIOR) PlaybackSeek(gTimeIndex + 12);	// 1 時間前
+		else if (gPlayback.active && w == VK_NEXT) PlaybackSeek(gTimeIndex - 12);
+		else if (w == VK_LEFT) StepTime(-1);
+		else if (w == VK_RIGHT) StepTime(+1);
+		else if (w == 'R') { CenterOnLonLat(139.767125, 35.681236); ZoomAtCenter(0); InvalidateRect(h, nullptr, FALSE); UpdateTitle(); }
 		return 0;
-	case WM_SIZE: {
-		RECT rc; GetClientRect(h, &rc);
-		g.clientW = rc.right; g.clientH = rc.bottom;
-		if (g.rt) g.rt->Resize(D2D1::SizeU(g.clientW, g.clientH));
-		ClampViewToJapan();
+	case WM_TIMER:
+		// 再生中はシーク直後の自動送りを止める
+		if (w == 1 && !gAnimPlaying && !(gPlayback.active && (gPlayback.dragging || MsSince(gPlayback.lastSeek) < 2000))) StepTime(+1);
+		else if (w == kSettleTimerId) { KillTimer(h, kSettleTimerId); InvalidateRect(h, nullptr, FALSE); }
+		else if (w == kTimesTimerId) RefreshObservations();
+		return 0;
+	case WM_PAINT: {
+		PAINTSTRUCT ps; BeginPaint(h, &ps); DrawScene(); EndPaint(h, &ps); return 0;
+	}
+	case WM_TILE_READY:
+		{
+			// 先読み分はここで上限まで間引く (D2D リソースの解放はメインスレッドで行う)
+			std::lock_guard<std::mutex> lk(gCacheMtx);
+			PurgeOldTiles();
+		}
 		InvalidateRect(h, nullptr, FALSE); return 0;
+	case WM_DESTROY:
+		// タイマーを停止
+		KillTimer(h, 1);
+		KillTimer(h, kSettleTimerId);
+		KillTimer(h, kTimesTimerId);
+
+		// 先読み・積算・等値線・セル追跡・途中フレームのスレッドを停止
+		gReadahead.Stop();
+		gAccumLayer.Stop();
+		gContourLayer.Stop();
+		gStormLayer.Stop();
+		gMotionLayer.Stop();
+
+		// キャッシュと関連リソースの解放
+		{
+			std::scoped_lock lk(gCacheMtx);
+			for (auto& kv : gCache) { SAFE_RELEASE(kv.second.bmp); SAFE_RELEASE(kv.second.decoded); }
+			gCache.clear();
+		}
+
+		// 修正: スレッドプール停止前にHWNDをクリア。これがワーカースレッドへの終了信号となる。
+		g.hwnd = nullptr;
+
+		// スレッドプール停止
+		gPool.reset();
+
+		// D2Dリソースの解放
+		gBoundaryLayer.Clear();
+		SAFE_RELEASE(g.rt);
+		SAFE_RELEASE(g.wic);
+		SAFE_RELEASE(g.factory);
+
+		PostQuitMessage(0); return 0;
+	}
+	return DefWindowProc(h, m, w, l);
+}
+
+static void UpdateClientSize() {
+	RECT rc; GetClientRect(g.hwnd, &rc);
+	g.clientW = rc.right - rc.left;
+	g.clientH = rc.bottom - rc.top;
+	if (g.rt) {
+		g.rt->Resize(D2D1::SizeU(g.clientW, g.clientH));
+	}
+}
+
+// -------------------- Command Line --------------------
+// "--key value" 形式の簡易パーサ。値を取らないキーは Has() で判定する
+struct CmdLine {
+	std::vector<std::wstring> args;
+
+	int Find(const wchar_t* key) const {
+		for (size_t i = 0; i < args.size(); ++i) if (args[i] == key) return (int)i;
+		return -1;
+	}
+	bool Has(const wchar_t* key) const { return Find(key) >= 0; }
+	std::wstring Str(const wchar_t* key, const wchar_t* def = L"") const {
+		int i = Find(key);
+		bool hasValue = i >= 0 && i + 1 < (int)args.size() && args[i + 1].compare(0, 2, L"--") != 0;
+		return hasValue ? args[i + 1] : std::wstring(def);
+	}
+	double Num(const wchar_t* key, double def) const {
+		std::wstring s = Str(key);
+		return s.empty() ? def : _wtof(s.c_str());
+	}
+	// "4-10" または "6" 形式
+	bool Range(const wchar_t* key, int& lo, int& hi) const {
+		std::wstring s = Str(key);
+		if (s.empty()) return false;
+		if (swscanf_s(s.c_str(), L"%d-%d", &lo, &hi) == 2) return lo <= hi;
+		lo = hi = _wtoi(s.c_str());
+		return true;
+	}
+	// "1920x1080" 形式
+	bool Size(const wchar_t* key, int& w, int& h) const {
+		std::wstring s = Str(key);
+		return !s.empty() && swscanf_s(s.c_str(), L"%dx%d", &w, &h) == 2 && w > 0 && h > 0;
+	}
+};
+
+static CmdLine ParseCmdLine()
+{
+	CmdLine cl;
+	int n = 0;
+	LPWSTR* argv = CommandLineToArgvW(GetCommandLineW(), &n);
+	if (argv) {
+		for (int i = 1; i < n; ++i) cl.args.emplace_back(argv[i]);
+		LocalFree(argv);
+	}
+	return cl;
+}
+
+// サブシステムが Windows のため、起動元コンソールに標準出力をつなぎ直す
+static void AttachCliConsole()
+{
+	if (!AttachConsole(ATTACH_PARENT_PROCESS)) AllocConsole();
+	FILE* f = nullptr;
+	freopen_s(&f, "CONOUT$", "w", stdout);
+	freopen_s(&f, "CONOUT$", "w", stderr);
+}
+
+// 共通オプション: --lat --lon --zoom --size WxH --time N --forecast
+static MapView CliView(const CmdLine& cl, int defW, int defH)
+{
+	int w = defW, h = defH;
+	cl.Size(L"--size", w, h);
+	return MakeView(cl.Num(L"--lon", 139.767125), cl.Num(L"--lat", 35.681236), cl.Num(L"--zoom", DEFAULT_ZOOM), w, h);
+}
+
+static bool CliLoadTimes(const CmdLine& cl)
+{
+	// --archive file.ame ならアーカイブの時刻とタイルを使う (通信しない)
+	if (cl.Has(L"--archive")) {
+		std::wstring file = cl.Str(L"--archive");
+		if (!OpenArchive(file) || !LoadPlaybackTimes()) {
+			fwprintf(stderr, L"warning: cannot read JMA frames from %ls\n", file.c_str());
+			return false;
+		}
+		gTimeIndex = std::clamp((int)cl.Num(L"--time", 0), 0, (int)gTimes.size() - 1);
+		return true;
+	}
+	gUseForecast = cl.Has(L"--forecast");
+	if (!FetchTimes(gUseForecast, gTimes)) {
+		fwprintf(stderr, L"warning: failed to fetch %ls times; rendering base map only\n", gUseForecast ? L"N2" : L"N1");
+		return false;
+	}
+	if (gUseForecast) FetchTimes(false, gObsTimes);
+	gTimeIndex = std::clamp((int)cl.Num(L"--time", 0), 0, (int)gTimes.size() - 1);
+	return true;
+}
+
+// ame.exe --snapshot out.png [--lat --lon --zoom --size --time --forecast]
+static int RunSnapshot(const CmdLine& cl)
+{
+	CliLoadTimes(cl);
+	MapView v = CliView(cl, 1280, 800);
+	HeadlessRenderer r(g.factory, g.wic, v.w, v.h);
+	if (!r.ok()) { fwprintf(stderr, L"error: failed to create WIC render target\n"); return 1; }
+
+	SharedTileSet tiles;
+	auto t0 = std::chrono::steady_clock::now();
+	size_t n = tiles.Collect(v, { gTimeIndex });
+	r.Attach(&tiles);
+	double tFetch = SecondsSince(t0);
+	t0 = std::chrono::steady_clock::now();
+	r.Render(v, gTimeIndex, gTimeIndex, 0.0f);
+	double tRender = SecondsSince(t0);
+
+	std::wstring out = cl.Str(L"--snapshot", L"snapshot.png");
+	if (!r.SavePng(out)) { fwprintf(stderr, L"error: failed to write %ls\n", out.c_str()); return 1; }
+	wprintf(L"snapshot: %ls (%dx%d, zoom %.2f, %zu tiles, fetch %.0f ms, render %.1f ms)\n",
+		out.c_str(), v.w, v.h, v.zoom, n, tFetch * 1000.0, tRender * 1000.0);
+	return 0;
+}
+
+// ame.exe --bench-render [--frames N] : タイル取得後の合成のみを計測 (既定 1080p)
+static int RunBenchRender(const CmdLine& cl)
+{
+	CliLoadTimes(cl);
+	MapView v = CliView(cl, 1920, 1080);
+	if (!cl.Has(L"--zoom")) v = MakeView(cl.Num(L"--lon", 139.767125), cl.Num(L"--lat", 35.681236), 6.5, v.w, v.h);
+	int frames = std::max(1, (int)cl.Num(L"--frames", 120));
+	HeadlessRenderer r(g.factory, g.wic, v.w, v.h);
+	if (!r.ok()) { fwprintf(stderr, L"error: failed to create WIC render target\n"); return 1; }
+
+	int next = gTimeIndex > 0 ? gTimeIndex - 1 : std::min(1, (int)gTimes.size() - 1);
+	SharedTileSet tiles;
+	size_t n = tiles.Collect(v, { gTimeIndex, next });
+	r.Attach(&tiles);
+	r.Render(v, gTimeIndex, gTimeIndex, 0.0f);
+
+	auto t0 = std::chrono::steady_clock::now();
+	for (int i = 0; i < frames; ++i) r.Render(v, gTimeIndex, gTimeIndex, 0.0f);
+	double tStill = SecondsSince(t0);
+
+	t0 = std::chrono::steady_clock::now();
+	for (int i = 0; i < frames; ++i) r.Render(v, gTimeIndex, next, (float)(i % 16) / 16.0f);
+	double tFade = SecondsSince(t0);
+
+	t0 = std::chrono::steady_clock::now();
+	r.SavePng(cl.Str(L"--out", L"bench_render.png"));
+	double tPng = SecondsSince(t0);
+
+	wprintf(L"bench-render: %dx%d zoom %.2f, %zu tiles, %d frames\n", v.w, v.h, v.zoom, n, frames);
+	wprintf(L"  single overlay : %8.2f fps (%.2f ms/frame)\n", frames / tStill, tStill * 1000.0 / frames);
+	wprintf(L"  cross-fade     : %8.2f fps (%.2f ms/frame)\n", frames / tFade, tFade * 1000.0 / frames);
+	wprintf(L"  png encode     : %8.2f ms\n", tPng * 1000.0);
+	return 0;
+}
+
+static ExportFormat CliExportFormat(const CmdLine& cl, const std::wstring& out)
+{
+	std::wstring f = cl.Str(L"--format");
+	if (f.empty()) {
+		size_t dot = out.find_last_of(L'.');
+		std::wstring ext = dot == std::wstring::npos ? L"" : out.substr(dot + 1);
+		f = (ext == L"gif" || ext == L"GIF") ? L"gif" : (out.find(L'%') != std::wstring::npos) ? L"png" : L"apng";
+	}
+	if (f == L"gif") return ExportFormat::Gif;
+	if (f == L"png") return ExportFormat::PngSequence;
+	return ExportFormat::Apng;
+}
+
+// ame.exe --export out.apng|out.gif|frame_%04d.png [--format apng|gif|png] [--fps N] [--threads N] [--lat --lon --zoom --size --forecast]
+static int RunExport(const CmdLine& cl)
+{
+	if (!CliLoadTimes(cl)) return 1;
+	MapView v = CliView(cl, 1280, 800);
+	std::wstring out = cl.Str(L"--export", L"nowcast.apng");
+	ExportFormat fmt = CliExportFormat(cl, out);
+	size_t threads = (size_t)cl.Num(L"--threads", std::max(1u, std::thread::hardware_concurrency()));
+	std::vector<ExportFrame> plan = PlanExportFrames((int)cl.Num(L"--fps", 12));
+
+	std::vector<int> all(gTimes.size());
+	for (size_t i = 0; i < all.size(); ++i) all[i] = (int)i;
+	SharedTileSet tiles;
+	auto t0 = std::chrono::steady_clock::now();
+	tiles.Collect(v, all);
+	double tFetch = SecondsSince(t0);
+
+	ApngWriter apng;
+	GifWriter gif;
+	if (fmt == ExportFormat::Apng && !apng.Open(out, (uint32_t)plan.size())) { fwprintf(stderr, L"error: cannot open %ls\n", out.c_str()); return 1; }
+	if (fmt == ExportFormat::Gif && !gif.Open(g.wic, out, v.w, v.h)) { fwprintf(stderr, L"error: cannot open %ls\n", out.c_str()); return 1; }
+	SequenceName seq;
+	if (fmt == ExportFormat::PngSequence && !seq.Parse(out)) {
+		fwprintf(stderr, L"error: %ls: file name must contain exactly one %%d (or %%0Nd) and no other %%\n", out.c_str());
+		return 1;
+	}
+
+	size_t bytes = 0;
+	auto sink = [&](size_t i, EncodedFrame& ef) {
+		bytes += ef.data.size();
+		if (fmt == ExportFormat::Apng) return apng.AddFrame(ef.data, plan[i].delayMs);
+		if (fmt == ExportFormat::Gif) return gif.AddFrame(ef, plan[i].delayMs);
+		FILE* f = nullptr;
+		if (_wfopen_s(&f, seq.At(i).c_str(), L"wb") != 0 || !f) return false;
+		bool ok = fwrite(ef.data.data(), 1, ef.data.size(), f) == ef.data.size();
+		return (fclose(f) == 0) && ok;
+		};
+
+	t0 = std::chrono::steady_clock::now();
+	bool ok = ExportFrames(v, tiles, plan, fmt, threads, sink);
+	if (fmt == ExportFormat::Apng) ok = apng.Close() && ok;
+	if (fmt == ExportFormat::Gif) ok = gif.Close() && ok;
+	double tExport = SecondsSince(t0);
+	if (!ok) { fwprintf(stderr, L"error: export to %ls failed\n", out.c_str()); return 1; }
+
+	wprintf(L"export: %ls (%zu frames from %zu times, %dx%d, %zu tiles, %zu threads)\n",
+		out.c_str(), plan.size(), gTimes.size(), v.w, v.h, tiles.size(), threads);
+	wprintf(L"  fetch+decode %.2f s, render+encode %.2f s (%.1f frames/s), %.1f MB\n",
+		tFetch, tExport, plan.size() / tExport, bytes / 1048576.0);
+	return 0;
+}
+
+// ame.exe --bench-export [--format ...] [--max-threads 16] : 同じタイル集合でスレッド数を変えて壁時計時間を比較
+static int RunBenchExport(const CmdLine& cl)
+{
+	if (!CliLoadTimes(cl)) return 1;
+	MapView v = CliView(cl, 1280, 800);
+	ExportFormat fmt = cl.Has(L"--format") ? CliExportFormat(cl, L"") : ExportFormat::PngSequence;
+	std::vector<ExportFrame> plan = PlanExportFrames((int)cl.Num(L"--fps", 12));
+	int maxThreads = std::max(1, (int)cl.Num(L"--max-threads", 16));
+
+	std::vector<int> all(gTimes.size());
+	for (size_t i = 0; i < all.size(); ++i) all[i] = (int)i;
+	SharedTileSet tiles;
+	tiles.Collect(v, all);
+
+	wprintf(L"bench-export: %zu frames, %dx%d, %zu tiles\n", plan.size(), v.w, v.h, tiles.size());
+	wprintf(L"  threads   wall(s)  frames/s  speedup\n");
+	double base = 0.0;
+	for (int threads = 1; threads <= maxThreads; threads *= 2) {
+		auto t0 = std::chrono::steady_clock::now();
+		bool ok = ExportFrames(v, tiles, plan, fmt, threads, [](size_t, EncodedFrame&) { return true; });
+		double t = SecondsSince(t0);
+		if (!ok) { fwprintf(stderr, L"error: export failed with %d threads\n", threads); return 1; }
+		if (threads == 1) base = t;
+		wprintf(L"  %7d  %8.2f  %8.1f  %7.2fx\n", threads, t, plan.size() / t, base / t);
+	}
+	return 0;
+}
+
+static bool ParseBox(const std::wstring& s, GeoBox& b)
+{
+	return swscanf_s(s.c_str(), L"%lf,%lf,%lf,%lf", &b.minLon, &b.minLat, &b.maxLon, &b.maxLat) == 4 &&
+		b.minLon < b.maxLon && b.minLat < b.maxLat;
+}
+
+// 時刻一覧を --times a-b (添字) / --from --to (validtime, UTC の yyyymmddhhmmss) で絞り込む
+static std::vector<NowcTime> CliSelectTimes(const CmdLine& cl, const std::vector<NowcTime>& all)
+{
+	int lo = 0, hi = (int)all.size() - 1;
+	cl.Range(L"--times", lo, hi);
+	std::wstring from = cl.Str(L"--from"), to = cl.Str(L"--to");
+	std::vector<NowcTime> out;
+	for (int i = std::max(0, lo); i <= std::min(hi, (int)all.size() - 1); ++i) {
+		const auto& v = all[i].validtime;
+		if (!from.empty() && v.compare(0, from.size(), from) < 0) continue;
+		if (!to.empty() && v.compare(0, to.size(), to) > 0) continue;
+		out.push_back(all[i]);
+	}
+	return out;
+}
+
+// ame.exe --prefetch [minLon,minLat,maxLon,maxLat] [--zooms a-b] [--times a-b | --from T --to T] [--forecast | --both]
+//         [--concurrency N] [--manifest file]
+static int RunPrefetch(const CmdLine& cl)
+{
+	GeoBox box = kJapanBox;
+	std::wstring bs = cl.Str(L"--prefetch");
+	if (!bs.empty() && !ParseBox(bs, box)) { fwprintf(stderr, L"error: bad bbox '%ls' (minLon,minLat,maxLon,maxLat)\n", bs.c_str()); return 1; }
+	int zMin = DEFAULT_ZOOM, zMax = DEFAULT_ZOOM;
+	cl.Range(L"--zooms", zMin, zMax);
+	zMin = std::clamp(zMin, MIN_MAP_ZOOM, MAX_MAP_ZOOM);
+	zMax = std::clamp(zMax, zMin, MAX_MAP_ZOOM);
+	size_t concurrency = (size_t)std::clamp((int)cl.Num(L"--concurrency", 8), 1, 64);
+
+	std::vector<NowcTime> times;
+	for (int pass = 0; pass < 2; ++pass) {
+		bool forecast = (pass == 1);
+		if (!cl.Has(L"--both") && forecast != cl.Has(L"--forecast")) continue;
+		std::vector<NowcTime> t;
+		if (!FetchTimes(forecast, t)) { fwprintf(stderr, L"warning: failed to fetch %ls times\n", forecast ? L"N2" : L"N1"); continue; }
+		for (auto& x : CliSelectTimes(cl, t)) times.push_back(std::move(x));
+	}
+
+	std::vector<TileJob> jobs = EnumeratePrefetchTiles(box, zMin, zMax, times);
+	wprintf(L"prefetch: bbox %.3f,%.3f,%.3f,%.3f zoom %d-%d, %zu times, %zu tiles, %zu connections\n",
+		box.minLon, box.minLat, box.maxLon, box.maxLat, zMin, zMax, times.size(), jobs.size(), concurrency);
+	wprintf(L"  cache: %ls\n", DiskCacheRoot().c_str());
+
+	PrefetchProgress prog;
+	std::vector<PrefetchStatus> status;
+	std::vector<uint32_t> sizes;
+	std::atomic<bool> finished(false);
+	auto t0 = std::chrono::steady_clock::now();
+	std::thread reporter([&]() {
+		while (!finished) {
+			for (int i = 0; i < 10 && !finished; ++i) Sleep(100);
+			double t = SecondsSince(t0);
+			size_t done = prog.done, fetched = prog.fetched;
+			double rate = fetched / std::max(t, 1e-3);
+			double eta = done ? (jobs.size() - done) * t / done : 0.0;
+			wprintf(L"\r  [%zu/%zu] %5.1f%%  fetched %zu  cached %zu  failed %zu  %.2f MB/s  %.1f tiles/s  ETA %.0f s   ",
+				done, jobs.size(), jobs.empty() ? 100.0 : 100.0 * done / jobs.size(), fetched, (size_t)prog.cached, (size_t)prog.failed,
+				prog.bytes / 1048576.0 / std::max(t, 1e-3), rate, eta);
+			fflush(stdout);
+		}
+		});
+	RunPrefetchJobs(jobs, concurrency, status, sizes, prog);
+	finished = true;
+	reporter.join();
+	double t = SecondsSince(t0);
+
+	std::wstring manifest = cl.Str(L"--manifest", (DiskCacheRoot() + L"\\prefetch-manifest.tsv").c_str());
+	bool mok = WritePrefetchManifest(manifest, box, zMin, zMax, times, jobs, status, sizes);
+	wprintf(L"\n  done in %.1f s: fetched %zu (%.1f MB, %.2f MB/s), cached %zu, failed %zu\n",
+		t, (size_t)prog.fetched, prog.bytes / 1048576.0, prog.bytes / 1048576.0 / std::max(t, 1e-3), (size_t)prog.cached, (size_t)prog.failed);
+	wprintf(L"  manifest: %ls%ls\n", manifest.c_str(), mok ? L"" : L" (write failed)");
+	return prog.failed ? 2 : 0;
+}
+
+// ame.exe --archive-build out.ame [--layer all|jma|gsi] [--delta] : ディスクキャッシュのタイルを 1 ファイルにまとめる
+// jma は降水・雷・竜巻、gsi は地図の全スタイル。--delta は降水のタイルをパレット面のキーフレーム + 差分で格納する
+static int RunArchiveBuild(const CmdLine& cl)
+{
+	std::wstring out = cl.Str(L"--archive-build", L"nowcast.ame");
+	std::wstring layer = cl.Str(L"--layer", L"all");
+	const bool delta = cl.Has(L"--delta");
+	if (layer != L"all" && layer != L"jma" && layer != L"gsi") { fwprintf(stderr, L"error: --layer expects all, jma or gsi\n"); return 1; }
+	std::vector<std::pair<ArchiveKey, std::wstring>> items;
+	size_t perLayer[kTileLayerCount] = {};
+	ForEachCachedTile([&](const wchar_t*, const std::wstring& file, const std::wstring& url) {
+		ArchiveKey k;
+		TileLayer tl;
+		if (!ArchiveKeyFromPath(url, k) || !TileLayerOfArchive(k.layer, tl)) return;
+		if (layer == L"jma" && IsGsiLayer(tl)) return;
+		if (layer == L"gsi" && !IsGsiLayer(tl)) return;
+		++perLayer[tl];
+		items.emplace_back(k, file);
+		});
+	// キー順に書くと時系列の blob がファイル上でも連続する
+	std::sort(items.begin(), items.end(), [](auto& a, auto& b) { return ArchiveKeyLess(a.first, b.first); });
+
+	auto t0 = std::chrono::steady_clock::now();
+	ArchiveWriter w;
+	if (!w.Open(out)) { fwprintf(stderr, L"error: cannot create %ls\n", out.c_str()); return 1; }
+	size_t unreadable = 0, keyframes = 0, deltas = 0;
+	std::vector<BYTE> buf, blob, plane(kTilePixels);
+	std::vector<std::pair<ArchiveKey, std::wstring>> jma;
+	for (auto& it : items) {
+		if (delta && it.first.layer == kLayerJmaHrpns) { jma.push_back(it); continue; }
+		if (!DiskCacheRead(it.second, buf)) { ++unreadable; continue; }
+		if (!w.Add(it.first, buf.data(), buf.size())) { fwprintf(stderr, L"error: write failed\n"); return 1; }
+	}
+	// 差分はタイル位置・系列ごとに時刻順に作る
+	std::stable_sort(jma.begin(), jma.end(), [](auto& a, auto& b) {
+		return std::make_tuple(a.first.z, a.first.x, a.first.y, DeltaStream(a.first)) < std::make_tuple(b.first.z, b.first.x, b.first.y, DeltaStream(b.first));
+		});
+	DeltaSeriesEncoder enc;
+	for (size_t i = 0; i < jma.size(); ++i) {
+		const ArchiveKey& k = jma[i].first;
+		if (i == 0 || k.z != jma[i - 1].first.z || k.x != jma[i - 1].first.x || k.y != jma[i - 1].first.y ||
+			DeltaStream(k) != DeltaStream(jma[i - 1].first)) enc.Reset();
+		if (!DiskCacheRead(jma[i].second, buf)) { ++unreadable; continue; }
+		bool ok;
+		if (DecodeJmaClasses(ThreadWic(), buf.data(), buf.size(), plane.data())) {
+			++(enc.Encode(k, plane.data(), blob) ? keyframes : deltas);
+			ArchiveKey dk = k;
+			dk.layer = kLayerJmaDelta;
+			ok = w.Add(dk, blob.data(), blob.size());
+		}
+		else {
+			ok = w.Add(k, buf.data(), buf.size());	// 256x256 でないものは PNG のまま
+		}
+		if (!ok) { fwprintf(stderr, L"error: write failed\n"); return 1; }
+	}
+	if (!w.Finish()) { fwprintf(stderr, L"error: failed to finalize %ls\n", out.c_str()); return 1; }
+	double t = SecondsSince(t0);
+	wprintf(L"archive-build: %ls\n  %zu entries, %zu unique blobs (%zu deduplicated), %zu unreadable\n",
+		out.c_str(), w.entryCount(), w.blobCount(), w.dedupCount(), unreadable);
+	for (int l = 0; l < kTileLayerCount; ++l)
+		if (perLayer[l]) wprintf(L"  %-14ls %zu tiles\n", kTileLayers[l].key, perLayer[l]);
+	if (delta) wprintf(L"  JMA as palette deltas: %zu keyframes, %zu deltas\n", keyframes, deltas);
+	wprintf(L"  input %.1f MB -> blobs %.1f MB in %.2f s\n", w.inputBytes() / 1048576.0, w.blobBytes() / 1048576.0, t);
+	return 0;
+}
+
+// ame.exe --archive-verify file.ame
+static int RunArchiveVerify(const CmdLine& cl)
+{
+	std::wstring file = cl.Str(L"--archive-verify");
+	TileArchive a;
+	if (!a.Open(file)) { fwprintf(stderr, L"error: %ls is not a valid archive (header/layout check failed)\n", file.c_str()); return 1; }
+	auto t0 = std::chrono::steady_clock::now();
+	size_t badBlobs = 0, badEntries = 0;
+	std::wstring msg;
+	bool ok = a.Verify(badBlobs, badEntries, msg);
+	wprintf(L"archive-verify: %ls\n  %zu entries, %llu blobs, %.1f MB, checked in %.2f s\n", file.c_str(), a.entryCount(),
+		(unsigned long long)a.header()->blobCount, a.fileSize() / 1048576.0, SecondsSince(t0));
+	if (!msg.empty()) wprintf(L"  %ls", msg.c_str());
+	wprintf(L"  bad blobs %zu, bad entries %zu -> %ls\n", badBlobs, badEntries, ok ? L"OK" : L"CORRUPT");
+	return ok ? 0 : 2;
+}
+
+// 読んだ blob を確実にメモリから引くための軽いチェックサム (64 バイトおき)
+static inline uint32_t TouchBytes(const BYTE* p, size_t n)
+{
+	uint32_t s = 0;
+	for (size_t i = 0; i < n; i += 64) s += p[i];
+	return s + (n ? p[n - 1] : 0);
+}
+
+// ame.exe --bench-archive file.ame [--reads N] [--decodes N]
+static int RunBenchArchive(const CmdLine& cl)
+{
+	std::wstring file = cl.Str(L"--bench-archive");
+	TileArchive a;
+	if (!a.Open(file) || a.entryCount() == 0) { fwprintf(stderr, L"error: cannot open %ls or archive is empty\n", file.c_str()); return 1; }
+	const size_t n = a.entryCount();
+	const size_t reads = (size_t)cl.Num(L"--reads", 100000);
+	const size_t decodes = (size_t)cl.Num(L"--decodes", 500);
+	std::mt19937_64 rng(12345);
+	volatile uint32_t sink = 0;
+
+	// 1. ランダムアクセス (キー検索 + blob 参照)
+	std::vector<ArchiveKey> keys(reads);
+	for (auto& k : keys) k = a.entries()[rng() % n].key;
+	auto t0 = std::chrono::steady_clock::now();
+	for (const auto& k : keys) {
+		const BYTE* p; size_t len;
+		if (a.Find(k, &p, &len)) sink = sink + TouchBytes(p, len);
+	}
+	double tRandom = SecondsSince(t0);
+
+	// 2. ランダムアクセス + マップ領域からのゼロコピーデコード
+	t0 = std::chrono::steady_clock::now();
+	size_t decoded = 0;
+	for (size_t i = 0; i < decodes; ++i) {
+		const BYTE* p; size_t len;
+		if (!a.Blob(a.entries()[rng() % n], &p, &len)) continue;
+		if (IWICBitmap* bmp = DecodePngToWic(ThreadWic(), p, len)) { ++decoded; bmp->Release(); }
+	}
+	double tDecode = SecondsSince(t0);
+
+	// 3. 時系列の順次走査 (JMA 層を索引順に全件)
+	auto range = a.LayerRange(kLayerJmaHrpns);
+	size_t frames = a.Times(kLayerJmaHrpns).size(), scanned = 0;
+	uint64_t scanBytes = 0;
+	t0 = std::chrono::steady_clock::now();
+	for (auto* e = range.first; e != range.second; ++e) {
+		const BYTE* p; size_t len;
+		if (!a.Blob(*e, &p, &len)) continue;
+		sink = sink + TouchBytes(p, len);
+		scanBytes += len; ++scanned;
+	}
+	double tScan = SecondsSince(t0);
+
+	// 4. 1 タイル位置の全時刻を検索
+	size_t seriesHits = 0, seriesLookups = 0;
+	double tSeries = 0.0;
+	if (range.first != range.second) {
+		ArchiveKey k = range.first[rng() % (range.second - range.first)].key;
+		auto times = a.Times(kLayerJmaHrpns);
+		t0 = std::chrono::steady_clock::now();
+		for (int rep = 0; rep < 100; ++rep) {
+			for (auto& tb : times) {
+				k.time = tb.first; k.base = tb.second;
+				const BYTE* p; size_t len;
+				if (a.Find(k, &p, &len)) { ++seriesHits; sink = sink + p[0]; }
+				++seriesLookups;
+			}
+		}
+		tSeries = SecondsSince(t0);
+	}
+
+	wprintf(L"bench-archive: %ls (%zu entries, %.1f MB)\n", file.c_str(), n, a.fileSize() / 1048576.0);
+	wprintf(L"  random lookup+read : %10.0f tiles/s (%.2f us/tile, %zu reads)\n", reads / tRandom, tRandom * 1e6 / std::max<size_t>(1, reads), reads);
+	wprintf(L"  random + decode    : %10.0f tiles/s (%zu decoded, zero-copy from mapping)\n", decoded / std::max(tDecode, 1e-9), decoded);
+	wprintf(L"  sequential scan    : %10.1f MB/s (%zu tiles, %zu frames, %.1f frames/s)\n",
+		scanBytes / 1048576.0 / std::max(tScan, 1e-9), scanned, frames, frames / std::max(tScan, 1e-9));
+	wprintf(L"  tile time series   : %10.0f lookups/s (%zu/%zu found)\n", seriesLookups / std::max(tSeries, 1e-9), seriesHits, seriesLookups);
+	return 0;
+}
+
+// ame.exe --bench-delta file.ame
+// アーカイブの JMA (PNG) を差分形式に変換し、容量とデコード速度を PNG と比べる
+static int RunBenchDelta(const CmdLine& cl)
+{
+	std::wstring file = cl.Str(L"--bench-delta");
+	TileArchive a;
+	if (!a.Open(file)) { fwprintf(stderr, L"error: cannot open %ls\n", file.c_str()); return 1; }
+	auto range = a.LayerRange(kLayerJmaHrpns);
+	std::vector<const ArchiveEntry*> items;
+	for (auto* e = range.first; e != range.second; ++e) items.push_back(e);
+	if (items.empty()) { fwprintf(stderr, L"error: %ls has no JMA PNG tiles\n", file.c_str()); return 1; }
+	// タイル位置 → 系列 (実況 / 予報の basetime) → 時刻の順
+	std::sort(items.begin(), items.end(), [](const ArchiveEntry* x, const ArchiveEntry* y) {
+		if (x->key.z != y->key.z) return x->key.z < y->key.z;
+		if (x->key.x != y->key.x) return x->key.x < y->key.x;
+		if (x->key.y != y->key.y) return x->key.y < y->key.y;
+		if (DeltaStream(x->key) != DeltaStream(y->key)) return DeltaStream(x->key) < DeltaStream(y->key);
+		return x->key.time < y->key.time;
+		});
+
+	IWICImagingFactory* wic = ThreadWic();
+	uint64_t pngBytes = 0, keyBytes = 0, deltaBytes = 0;
+	size_t tiles = 0, keys = 0, deltas = 0, skipped = 0, mismatched = 0, inexact = 0, chains = 0;
+	double tPng = 0.0, tEncode = 0.0, tApply = 0.0, tExpand = 0.0;
+	std::vector<std::vector<BYTE>> planes, blobs;
+	std::vector<BYTE> plane(kTilePixels);
+	std::vector<uint32_t> bgra(kTilePixels);
+	DeltaSeriesEncoder enc;
+
+	for (size_t i = 0; i < items.size(); ) {
+		size_t j = i;
+		while (j < items.size() && items[j]->key.z == items[i]->key.z && items[j]->key.x == items[i]->key.x && items[j]->key.y == items[i]->key.y &&
+			DeltaStream(items[j]->key) == DeltaStream(items[i]->key)) ++j;
+		++chains;
+		// 1. PNG デコード + 階級化 (従来の読み出しに相当)
+		planes.clear(); blobs.clear();
+		auto t0 = std::chrono::steady_clock::now();
+		std::vector<const ArchiveEntry*> series;
+		for (size_t k = i; k < j; ++k) {
+			const BYTE* p; size_t n;
+			if (!a.Blob(*items[k], &p, &n)) { ++skipped; continue; }
+			std::vector<BYTE> pl(kTilePixels);
+			size_t bad = 0;
+			if (!DecodeJmaClasses(wic, p, n, pl.data(), &bad)) { ++skipped; continue; }
+			inexact += bad;
+			pngBytes += n;
+			planes.push_back(std::move(pl));
+			series.push_back(items[k]);
+		}
+		tPng += SecondsSince(t0);
+
+		// 2. 差分化
+		t0 = std::chrono::steady_clock::now();
+		enc.Reset();
+		for (size_t k = 0; k < planes.size(); ++k) {
+			blobs.emplace_back();
+			bool isKey = enc.Encode(series[k]->key, planes[k].data(), blobs.back());
+			(isKey ? keyBytes : deltaBytes) += blobs.back().size();
+			++(isKey ? keys : deltas);
+		}
+		tEncode += SecondsSince(t0);
+
+		// 3. 順方向の復元 (差分適用) と PBGRA への展開
+		t0 = std::chrono::steady_clock::now();
+		for (size_t k = 0; k < blobs.size(); ++k) {
+			if (!ApplyDeltaBlob(blobs[k].data(), blobs[k].size(), plane.data()) || memcmp(plane.data(), planes[k].data(), kTilePixels) != 0) ++mismatched;
+		}
+		tApply += SecondsSince(t0);
+		t0 = std::chrono::steady_clock::now();
+		for (size_t k = 0; k < planes.size(); ++k) ExpandClassPlane(planes[k].data(), bgra.data());
+		tExpand += SecondsSince(t0);
+		tiles += planes.size();
+		i = j;
+	}
+
+	auto perSec = [](size_t n, double t) { return t > 0.0 ? n / t : 0.0; };
+	wprintf(L"bench-delta: %ls\n  %zu tiles in %zu chains (%zu undecodable)\n", file.c_str(), tiles, chains, skipped);
+	wprintf(L"  size   : PNG %.2f MB -> delta %.2f MB (%.1f%%)  key %zu (%.2f MB) / delta %zu (%.2f MB, avg %.0f B)\n",
+		pngBytes / 1048576.0, (keyBytes + deltaBytes) / 1048576.0, pngBytes ? 100.0 * (keyBytes + deltaBytes) / pngBytes : 0.0,
+		keys, keyBytes / 1048576.0, deltas, deltaBytes / 1048576.0, deltas ? (double)deltaBytes / deltas : 0.0);
+	wprintf(L"  decode : PNG+classify %.0f tiles/s | delta apply %.0f tiles/s | +expand to PBGRA %.0f tiles/s\n",
+		perSec(tiles, tPng), perSec(tiles, tApply), perSec(tiles, tApply + tExpand));
+	wprintf(L"  encode : %.0f tiles/s\n", perSec(tiles, tEncode));
+	wprintf(L"  check  : %zu mismatched reconstructions, %zu off-palette pixels\n", mismatched, inexact);
+	return mismatched ? 2 : 0;
+}
+
+// ランダムシークで 1 画面分のタイルを低ズーム/表示ズームでデコードする時間を測る
+static int RunBenchSeek(const CmdLine& cl)
+{
+	std::wstring file = cl.Str(L"--bench-seek");
+	if (!OpenPlayback(file) || !LoadPlaybackTimes()) { fwprintf(stderr, L"error: cannot open %ls or archive has no JMA frames\n", file.c_str()); return 1; }
+	MapView v = CliView(cl, 1280, 800);
+	const int seeks = std::max(1, (int)cl.Num(L"--seeks", 200));
+	std::mt19937 rng(12345);
+	std::vector<double> coarse, full;
+	size_t missing = 0;
+	auto decodeFrame = [&](int ti, int z) {
+		auto t0 = std::chrono::steady_clock::now();
+		ForEachJmaTile(v, gTimes[ti], [&](const std::wstring& p, const D2D1_RECT_F&) {
+			if (IWICBitmap* bmp = DecodeArchiveTile(p)) bmp->Release();
+			else ++missing;
+			}, z);
+		return SecondsSince(t0) * 1000.0;
+		};
+	for (int i = 0; i < seeks; ++i) {
+		int ti = (int)(rng() % gTimes.size());
+		coarse.push_back(decodeFrame(ti, MIN_JMA_ZOOM));
+		full.push_back(decodeFrame(ti, JmaZoomFor(v.zoom)));
+	}
+	wprintf(L"seeks: %d over %zu frames (%dx%d, zoom %.2f, JMA z%d / z%d)\n",
+		seeks, gTimes.size(), v.w, v.h, v.zoom, MIN_JMA_ZOOM, JmaZoomFor(v.zoom));
+	wprintf(L"coarse: p50 %.2f ms  p95 %.2f ms  max %.2f ms\n", Percentile(coarse, 50), Percentile(coarse, 95), Percentile(coarse, 100));
+	wprintf(L"full  : p50 %.2f ms  p95 %.2f ms  max %.2f ms\n", Percentile(full, 50), Percentile(full, 95), Percentile(full, 100));
+	if (missing) wprintf(L"missing tiles: %zu\n", missing);
+	return 0;
+}
+
+// 地点 CSV: 1 行 1 地点 "name,lon,lat" または "lon,lat" (数値でない行は見出しとして読み飛ばす)
+static bool LoadPointsCsv(const std::wstring& file, std::vector<GeoPoint>& pts, std::vector<std::string>& names)
+{
+	std::string text;
+	if (!ReadInputFile(file, text)) return false;
+	size_t pos = 0;
+	while (pos < text.size()) {
+		size_t eol = text.find('\n', pos);
+		if (eol == std::string::npos) eol = text.size();
+		std::string line = text.substr(pos, eol - pos);
+		pos = eol + 1;
+		if (!line.empty() && line.back() == '\r') line.pop_back();
+		std::vector<std::string> f;
+		for (size_t s = 0; ; ) {
+			size_t c = line.find(',', s);
+			f.push_back(line.substr(s, c == std::string::npos ? std::string::npos : c - s));
+			if (c == std::string::npos) break;
+			s = c + 1;
+		}
+		if (f.size() < 2) continue;
+		size_t o = f.size() >= 3 ? f.size() - 2 : 0;
+		char* e1 = nullptr; char* e2 = nullptr;
+		double lon = strtod(f[o].c_str(), &e1), lat = strtod(f[o + 1].c_str(), &e2);
+		if (e1 == f[o].c_str() || e2 == f[o + 1].c_str()) continue;
+		pts.push_back({ lon, lat });
+		names.push_back(o ? f[0] : std::to_string(pts.size()));
+	}
+	return true;
+}
+
+// 古い時刻から順に並べた gTimes の添字
+static std::vector<int> ChronologicalFrames()
+{
+	std::vector<int> frames;
+	for (int i = (int)gTimes.size() - 1; i >= 0; --i) frames.push_back(i);
+	return frames;
+}
+
+// ame.exe --timeseries points.csv [--out series.csv] [--zoom z] [--threads N] [--archive f | --forecast]
+static int RunTimeseries(const CmdLine& cl)
+{
+	std::wstring in = cl.Str(L"--timeseries"), out = cl.Str(L"--out", L"timeseries.csv");
+	std::vector<GeoPoint> pts;
+	std::vector<std::string> names;
+	if (!LoadPointsCsv(in, pts, names) || pts.empty()) { fwprintf(stderr, L"error: no points in %ls\n", in.c_str()); return 1; }
+	if (!CliLoadTimes(cl)) return 1;
+	const int z = std::clamp((int)cl.Num(L"--zoom", MAX_JMA_ZOOM), MIN_JMA_ZOOM, MAX_JMA_ZOOM);
+	const size_t threads = (size_t)std::max(1.0, cl.Num(L"--threads", WORKER_THREADS * 2));
+
+	PointSeriesQuery q(pts, z);
+	std::vector<int> frames = ChronologicalFrames();
+	std::vector<BYTE> classes;
+	q.Run(gTimes, frames, threads, classes);
+
+	FILE* f = nullptr;
+	if (_wfopen_s(&f, out.c_str(), L"wb") != 0 || !f) { fwprintf(stderr, L"error: cannot create %ls\n", out.c_str()); return 1; }
+	fprintf(f, "name,lon,lat");
+	for (int ti : frames) fprintf(f, ",%ls", gTimes[ti].validtime.c_str());
+	fprintf(f, "\n");
+	for (size_t i = 0; i < pts.size(); ++i) {
+		fprintf(f, "%s,%.6f,%.6f", names[i].c_str(), pts[i].lon, pts[i].lat);
+		for (size_t fi = 0; fi < frames.size(); ++fi) {
+			BYTE c = classes[fi * pts.size() + i];
+			if (c == kNoSample) fprintf(f, ",");
+			else fprintf(f, ",%.1f", JmaClassMmh(c));
+		}
+		fprintf(f, "\n");
+	}
+	fclose(f);
+	const auto& st = q.statistics();
+	wprintf(L"timeseries: %zu points (%zu inside tile range) x %zu frames -> %ls\n", pts.size(), q.mappedCount(), frames.size(), out.c_str());
+	wprintf(L"  %zu tiles at z%d, %zu loads (%zu failed), %.2f s\n", st.tiles, z, st.tileLoads, st.failedLoads, st.mapSec + st.fetchSec);
+	return 0;
+}
+
+// ame.exe --bench-timeseries [--points 100000] [--zoom 8] [--threads N] [--archive f]
+static int RunBenchTimeseries(const CmdLine& cl)
+{
+	if (!CliLoadTimes(cl)) return 1;
+	const size_t n = (size_t)std::max(1.0, cl.Num(L"--points", 100000));
+	const int z = std::clamp((int)cl.Num(L"--zoom", 8), MIN_JMA_ZOOM, MAX_JMA_ZOOM);
+	const size_t threads = (size_t)std::max(1.0, cl.Num(L"--threads", WORKER_THREADS * 2));
+	std::mt19937 rng(12345);
+	std::uniform_real_distribution<double> lon(kJapanBox.minLon, kJapanBox.maxLon), lat(kJapanBox.minLat, kJapanBox.maxLat);
+	std::vector<GeoPoint> pts(n);
+	for (auto& p : pts) p = { lon(rng), lat(rng) };
+
+	std::vector<int> frames = ChronologicalFrames();
+	std::vector<BYTE> classes;
+	wprintf(L"bench-timeseries: %zu points x %zu frames, z%d, %zu threads\n", n, frames.size(), z, threads);
+	// 1 回目はディスクキャッシュへの取得を含む。2 回目はキャッシュ (またはアーカイブ) から
+	for (int pass = 0; pass < 2; ++pass) {
+		auto t0 = std::chrono::steady_clock::now();
+		PointSeriesQuery q(pts, z);
+		q.Run(gTimes, frames, threads, classes);
+		double t = SecondsSince(t0);
+		const auto& st = q.statistics();
+		size_t hits = std::count_if(classes.begin(), classes.end(), [](BYTE c) { return c != kNoSample; });
+		wprintf(L"  pass %d: map %.1f ms, %zu tiles x %zu frames = %zu loads (%zu failed), fetch+gather %.2f s\n",
+			pass + 1, st.mapSec * 1000.0, st.tiles, frames.size(), st.tileLoads, st.failedLoads, st.fetchSec);
+		wprintf(L"          %.0f rows/s (%zu rows, %zu with data)\n", (double)n * frames.size() / t, n * frames.size(), hits);
+	}
+	return 0;
+}
+
+// 多角形ファイル: "# 名前" の行で多角形を始め、"lon,lat" を 1 行ずつ並べる。空行で次の輪 (穴) に移る
+static bool LoadPolygons(const std::wstring& file, std::vector<GeoPolygon>& polys)
+{
+	std::string text;
+	if (!ReadInputFile(file, text)) return false;
+	size_t pos = 0;
+	bool newRing = true;
+	while (pos < text.size()) {
+		size_t eol = text.find('\n', pos);
+		if (eol == std::string::npos) eol = text.size();
+		std::string line = text.substr(pos, eol - pos);
+		pos = eol + 1;
+		if (!line.empty() && line.back() == '\r') line.pop_back();
+		if (!line.empty() && line[0] == '#') {
+			size_t s = line.find_first_not_of(" \t", 1);
+			polys.push_back({ s == std::string::npos ? std::to_string(polys.size() + 1) : line.substr(s), {} });
+			newRing = true;
+			continue;
+		}
+		double lon, lat;
+		if (sscanf_s(line.c_str(), "%lf,%lf", &lon, &lat) != 2) { newRing = true; continue; }
+		if (polys.empty()) polys.push_back({ "1", {} });
+		if (newRing) { polys.back().rings.emplace_back(); newRing = false; }
+		polys.back().rings.back().push_back({ lon, lat });
+	}
+	return true;
+}
+
+// ame.exe --region-stats polygons.txt [--out stats.csv] [--zoom z] [--threshold mm/h] [--threads N] [--archive f | --forecast]
+static int RunRegionStats(const CmdLine& cl)
+{
+	std::wstring in = cl.Str(L"--region-stats"), out = cl.Str(L"--out", L"region_stats.csv");
+	std::vector<GeoPolygon> polys;
+	if (!LoadPolygons(in, polys) || polys.empty()) { fwprintf(stderr, L"error: no polygons in %ls\n", in.c_str()); return 1; }
+	if (!CliLoadTimes(cl)) return 1;
+	const int z = std::clamp((int)cl.Num(L"--zoom", 8), MIN_JMA_ZOOM, MAX_JMA_ZOOM);
+	const float threshold = (float)cl.Num(L"--threshold", 10.0);
+	const size_t threads = (size_t)std::max(1.0, cl.Num(L"--threads", WORKER_THREADS * 2));
+
+	auto t0 = std::chrono::steady_clock::now();
+	RegionStatsEngine eng(z);
+	for (auto& p : polys) eng.Add(p);
+	double tRaster = SecondsSince(t0);
+	std::vector<int> frames = ChronologicalFrames();
+	std::vector<std::vector<AreaStats>> res;
+	t0 = std::chrono::steady_clock::now();
+	eng.Run(gTimes, frames, threads, LoadTileClasses, res);
+	double tRun = SecondsSince(t0);
+
+	FILE* f = nullptr;
+	if (_wfopen_s(&f, out.c_str(), L"wb") != 0 || !f) { fwprintf(stderr, L"error: cannot create %ls\n", out.c_str()); return 1; }
+	fprintf(f, "name,validtime,max_mmh,mean_mmh,area_km2,data_km2,above_%g_km2\n", threshold);
+	for (size_t p = 0; p < polys.size(); ++p)
+		for (size_t fi = 0; fi < frames.size(); ++fi) {
+			const AreaStats& st = res[fi][p];
+			fprintf(f, "%s,%ls,%.1f,%.2f,%.1f,%.1f,%.1f\n", polys[p].name.c_str(), gTimes[frames[fi]].validtime.c_str(),
+				JmaClassMmh(st.maxClass), st.MeanMmh(), st.maskKm2, st.dataKm2(), st.AboveKm2(threshold));
+		}
+	fclose(f);
+	wprintf(L"region-stats: %zu polygons x %zu frames -> %ls\n", polys.size(), frames.size(), out.c_str());
+	wprintf(L"  rasterize %.1f ms (%zu tiles at z%d), stats %.2f s\n", tRaster * 1000.0, eng.tileCount(), z, tRun);
+	return 0;
+}
+
+// 日本全域を覆う格子状の多角形群 (各 64 頂点の星形) を作る
+static std::vector<GeoPolygon> SyntheticPolygons(int count, uint32_t seed)
+{
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<double> jitter(0.55, 1.0);
+	int cols = (int)std::ceil(std::sqrt((double)count)), rows = (count + cols - 1) / cols;
+	double cw = (kJapanBox.maxLon - kJapanBox.minLon) / cols, ch = (kJapanBox.maxLat - kJapanBox.minLat) / rows;
+	std::vector<GeoPolygon> polys;
+	for (int i = 0; i < count; ++i) {
+		double cx = kJapanBox.minLon + (i % cols + 0.5) * cw, cy = kJapanBox.minLat + (i / cols + 0.5) * ch;
+		GeoPolygon p{ "poly" + std::to_string(i + 1), { {} } };
+		for (int k = 0; k < 64; ++k) {
+			double a = 2.0 * M_PI * k / 64, r = jitter(rng) * 0.5;
+			p.rings[0].push_back({ cx + r * cw * std::cos(a), cy + r * ch * std::sin(a) });
+		}
+		polys.push_back(std::move(p));
+	}
+	return polys;
+}
+
+// ame.exe --bench-region [--polygons 47] [--zoom 8] [--max-threads 16] [--archive f]
+static int RunBenchRegion(const CmdLine& cl)
+{
+	if (!CliLoadTimes(cl)) return 1;
+	const int count = std::max(1, (int)cl.Num(L"--polygons", 47));
+	const int z = std::clamp((int)cl.Num(L"--zoom", 8), MIN_JMA_ZOOM, MAX_JMA_ZOOM);
+	const int maxThreads = std::max(1, (int)cl.Num(L"--max-threads", 16));
+	auto polys = SyntheticPolygons(count, 12345);
+
+	auto t0 = std::chrono::steady_clock::now();
+	RegionStatsEngine eng(z);
+	for (auto& p : polys) eng.Add(p);
+	double tRaster = SecondsSince(t0);
+	std::vector<int> frames = ChronologicalFrames();
+
+	// タイルの取得/デコードを除いた集計カーネルだけの速度を見るため、先に全パレット面を読み込んでおく
+	std::unordered_map<std::wstring, std::vector<BYTE>> planes;
+	std::mutex planesMtx;
+	std::vector<std::vector<AreaStats>> res;
+	t0 = std::chrono::steady_clock::now();
+	eng.Run(gTimes, frames, WORKER_THREADS * 2, [&](const std::wstring& path, BYTE* plane) {
+		if (!LoadTileClasses(path, plane)) return false;
+		std::lock_guard<std::mutex> lk(planesMtx);
+		planes[path].assign(plane, plane + kTilePixels);
+		return true;
+		}, res);
+	double tLoad = SecondsSince(t0);
+	auto fromMemory = [&](const std::wstring& path, BYTE* plane) {
+		auto it = planes.find(path);
+		if (it == planes.end()) return false;
+		memcpy(plane, it->second.data(), kTilePixels);
+		return true;
+		};
+
+	wprintf(L"bench-region: %d polygons, %zu frames, z%d, %zu tiles per frame\n", count, frames.size(), z, eng.tileCount());
+	wprintf(L"  rasterize %.1f ms, load+stats (cold) %.2f s, %zu tiles loaded\n", tRaster * 1000.0, tLoad, planes.size());
+	for (int th = 1; th <= maxThreads; th *= 2) {
+		t0 = std::chrono::steady_clock::now();
+		eng.Run(gTimes, frames, th, fromMemory, res);
+		double t = SecondsSince(t0);
+		double mpx = (double)eng.tileCount() * frames.size() * kTilePixels / 1e6;
+		wprintf(L"  %2d threads: %8.2f ms, %.0f frames/s, %.0f Mpx/s\n", th, t * 1000.0, frames.size() / t, mpx / t);
+	}
+	return 0;
+}
+
+// ame.exe --bench-accum [--window 12] [--zoom 8] [--threads N] [--archive f]
+// 日本全域のタイルで積算の窓を古い時刻から 1 フレームずつ進め、1 フレームあたりの更新時間を測る
+static int RunBenchAccum(const CmdLine& cl)
+{
+	if (!CliLoadTimes(cl)) return 1;
+	const int window = std::clamp((int)cl.Num(L"--window", 12), 1, 36);
+	const int z = std::clamp((int)cl.Num(L"--zoom", kAccumMaxZoom), MIN_JMA_ZOOM, MAX_JMA_ZOOM);
+	const size_t threads = (size_t)std::max(1.0, cl.Num(L"--threads", WORKER_THREADS * 2));
+	if ((int)gTimes.size() <= window) { fwprintf(stderr, L"error: need more than %d frames (have %zu)\n", window, gTimes.size()); return 1; }
+
+	int tx0, ty0, tx1, ty1;
+	TileRangeForBox(kJapanBox, z, tx0, ty0, tx1, ty1);
+	std::vector<std::pair<int, int>> xy;
+	for (int y = ty0; y <= ty1; ++y) for (int x = tx0; x <= tx1; ++x) xy.emplace_back(x, y);
+	std::vector<TileAccumulator> acc(xy.size());
+
+	auto step = [&](int timeIndex, AccumUpdateStats& total) {
+		std::vector<NowcTime> w;
+		if (!AccumWindow(gTimes, timeIndex, window, w)) return 0.0;
+		std::vector<std::wstring> times;
+		std::unordered_map<std::wstring, const NowcTime*> byValid;
+		for (auto& t : w) { times.push_back(t.validtime); byValid[t.validtime] = &t; }
+		std::vector<AccumUpdateStats> st(xy.size());
+		auto t0 = std::chrono::steady_clock::now();
+		ParallelFor(xy.size(), threads, [&](size_t i) {
+			acc[i].Slide(times, [&](const std::wstring& t, BYTE* plane) {
+				return LoadTileClasses(JmaTilePath(*byValid[t], z, xy[i].first, xy[i].second), plane);
+				}, st[i]);
+			});
+		double wall = SecondsSince(t0);
+		for (auto& s : st) total.Merge(s);
+		return wall;
+		};
+
+	wprintf(L"bench-accum: %zu tiles at z%d, window %d frames (%d min), %zu threads\n", xy.size(), z, window, window * 5, threads);
+	int start = (int)gTimes.size() - window;
+	AccumUpdateStats fill;
+	double tFill = step(start, fill);
+	wprintf(L"  initial fill : %.2f s (%zu frames loaded, %zu missing)\n", tFill, fill.added, fill.missing);
+	AccumUpdateStats slide;
+	double tSlide = 0.0;
+	int steps = 0;
+	for (int t = start - 1; t >= 0; --t, ++steps) tSlide += step(t, slide);
+	if (steps == 0) return 0;
+	wprintf(L"  slide        : %d steps, %.1f ms/frame wall (+%zu/-%zu tile frames, %zu rebuilds)\n",
+		steps, tSlide * 1000.0 / steps, slide.added, slide.removed, slide.rebuilds);
+	wprintf(L"  per frame CPU: load+classify %.1f ms, add/subtract %.2f ms\n", slide.loadSec * 1000.0 / steps, slide.applySec * 1000.0 / steps);
+
+	// 窓を進めたときの結果が一から積算し直したものと一致するか
+	TileAccumulator fresh;
+	AccumUpdateStats dummy;
+	std::vector<NowcTime> w;
+	AccumWindow(gTimes, 0, window, w);
+	std::vector<std::wstring> times;
+	for (auto& t : w) times.push_back(t.validtime);
+	size_t probe = xy.size() / 2;
+	fresh.Slide(times, [&](const std::wstring& t, BYTE* plane) {
+		auto it = std::find_if(w.begin(), w.end(), [&](const NowcTime& n) { return n.validtime == t; });
+		return LoadTileClasses(JmaTilePath(*it, z, xy[probe].first, xy[probe].second), plane);
+		}, dummy);
+	bool same = fresh.isComplete() && acc[probe].isComplete() && memcmp(fresh.units(), acc[probe].units(), kTilePixels * sizeof(uint16_t)) == 0;
+	wprintf(L"  incremental vs full recompute (tile %d/%d): %ls\n", xy[probe].first, xy[probe].second, same ? L"identical" : L"DIFFERENT or incomplete");
+	return 0;
+}
+
+static std::atomic<bool> gCliStop{ false };
+static BOOL WINAPI CliCtrlHandler(DWORD)
+{
+	gCliStop = true;
+	return TRUE;
+}
+
+// ame.exe --watch watchlist.txt [--threshold 30] [--alerts alerts.jsonl] [--alert-udp host:port]
+//         [--interval 60] [--cycles N] [--zoom 10] [--threads N]
+// 監視リストは --region-stats と同じ形式 ("# 名前" + "lon,lat" 行)。座標が 1 行だけなら地点として扱う
+static int RunWatch(const CmdLine& cl)
+{
+	std::wstring listFile = cl.Str(L"--watch");
+	std::vector<GeoPolygon> polys;
+	if (!LoadPolygons(listFile, polys) || polys.empty()) { fwprintf(stderr, L"error: no watch entries in %ls\n", listFile.c_str()); return 1; }
+	std::vector<WatchItem> items;
+	for (auto& p : polys) items.push_back({ p.name, p });
+
+	const float threshold = (float)cl.Num(L"--threshold", 30.0);
+	const int z = std::clamp((int)cl.Num(L"--zoom", MAX_JMA_ZOOM), MIN_JMA_ZOOM, MAX_JMA_ZOOM);
+	const int interval = std::max(5, (int)cl.Num(L"--interval", 60));
+	const int cycles = (int)cl.Num(L"--cycles", 0);
+	const size_t threads = (size_t)std::max(1.0, cl.Num(L"--threads", WORKER_THREADS));
+
+	AlertSink sink;
+	if (cl.Has(L"--alerts") && !sink.OpenFile(cl.Str(L"--alerts"))) { fwprintf(stderr, L"error: cannot open %ls\n", cl.Str(L"--alerts").c_str()); return 1; }
+	if (cl.Has(L"--alert-udp") && !sink.OpenUdp(cl.Str(L"--alert-udp"))) { fwprintf(stderr, L"error: bad UDP target %ls\n", cl.Str(L"--alert-udp").c_str()); return 1; }
+	if (!sink.isOpen() && !sink.OpenFile(L"alerts.jsonl")) { fwprintf(stderr, L"error: cannot open alerts.jsonl\n"); return 1; }
+
+	WatchEvaluator eval(items, z, threshold, threads);
+	SetConsoleCtrlHandler(CliCtrlHandler, TRUE);
+	wprintf(L"watch: %zu entries, threshold %.0f mm/h, z%d, every %d s (Ctrl+C to stop)\n", items.size(), threshold, z, interval);
+
+	std::wstring lastObs, lastFcBase;
+	for (int cycle = 1; !gCliStop && (cycles <= 0 || cycle <= cycles); ++cycle) {
+		auto t0 = std::chrono::steady_clock::now();
+		size_t disk0 = gTileDiskHits, http0 = gTileHttpFetches;
+		std::vector<NowcTime> n1, n2;
+		bool ok1 = FetchTimes(false, n1), ok2 = FetchTimes(true, n2);
+		std::vector<AlertEvent> events;
+		WatchEvaluator::Stats st;
+		// 観測は最新の 1 フレーム、予測は basetime が変わったときに全フレーム
+		if (ok1 && n1[0].validtime != lastObs) {
+			eval.Evaluate({ n1[0] }, false, events, st);
+			lastObs = n1[0].validtime;
+		}
+		if (ok2 && n2[0].basetime != lastFcBase) {
+			eval.Evaluate(n2, true, events, st);
+			lastFcBase = n2[0].basetime;
+		}
+		for (auto& e : events) sink.Emit(e);
+		std::string now = UtcNowIso();
+		wprintf(L"[%hs] cycle %d: times N1 %ls / N2 %ls, %zu frames, %zu tile loads (http %zu, disk %zu, failed %zu), eval %.1f ms, %zu alerts, %.2f s\n",
+			now.c_str(), cycle, ok1 ? L"ok" : L"FAIL", ok2 ? L"ok" : L"FAIL", st.frames, st.tileLoads,
+			gTileHttpFetches - http0, gTileDiskHits - disk0, st.failedLoads, st.evalMs, events.size(), SecondsSince(t0));
+		for (auto& e : events)
+			wprintf(L"  %ls %hs: %hs %ls (%g-%g mm/h)\n", e.raised ? L"ALERT" : L"clear", e.forecast ? "forecast" : "observation",
+				e.item.c_str(), e.validtime.c_str(), kJmaScale[e.cls].lo, kJmaScale[e.cls].hi);
+		fflush(stdout);
+		if (cycles > 0 && cycle >= cycles) break;
+		for (int s = 0; s < interval && !gCliStop; ++s) std::this_thread::sleep_for(std::chrono::seconds(1));
+	}
+	return 0;
+}
+
+// ame.exe --serve [port] [--bind 127.0.0.1] [--threads 64] [--cache-tiles 2048] [--forecast | --archive f]
+// 接続 1 本がワーカー 1 本を占有するため、--threads は同時接続数の上限になる
+static int RunServe(const CmdLine& cl)
+{
+	const int port = (int)cl.Num(L"--serve", 8080);
+	const std::wstring wbind = cl.Str(L"--bind", L"127.0.0.1");
+	const std::string bindAddr(wbind.begin(), wbind.end());
+	const size_t threads = (size_t)std::max(1.0, cl.Num(L"--threads", 64));
+	const bool archive = cl.Has(L"--archive");
+	if (!CliLoadTimes(cl)) return 1;
+
+	IntensityService svc((size_t)std::max(16.0, cl.Num(L"--cache-tiles", 2048)));
+	svc.SetTimes(gTimes);
+	HttpServer server;
+	if (!server.Start(bindAddr.c_str(), port, threads, [&](const HttpRequest& q, HttpResponse& r) { svc.Handle(q, r); })) {
+		fwprintf(stderr, L"error: cannot listen on %ls:%d\n", wbind.c_str(), port);
+		return 1;
+	}
+	SetConsoleCtrlHandler(CliCtrlHandler, TRUE);
+	wprintf(L"serve: http://%ls:%d/intensity?lat=35.68&lon=139.77 (%zu frames, Ctrl+C to stop)\n", wbind.c_str(), server.port(), gTimes.size());
+	fflush(stdout);
+	// 時刻一覧は 1 分ごとに取り直す (アーカイブは固定)
+	for (int s = 1; !gCliStop; ++s) {
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+		std::vector<NowcTime> t;
+		if (!archive && s % 60 == 0 && FetchTimes(gUseForecast, t)) svc.SetTimes(std::move(t));
+	}
+	server.Stop();
+	wprintf(L"serve: %zu requests, %zu tile loads\n", server.requestCount(), svc.tileLoads());
+	return 0;
+}
+
+// ame.exe --bench-serve [--clients 32] [--requests 20000] [--zoom 10] [--frames 12] [--mock-latency 20] [--cache-tiles 2048]
+// ローカルの模擬タイルサーバーを上流にしてサービスを立て、keep-alive の並列クライアントで qps と遅延を測る
+static int RunBenchServe(const CmdLine& cl)
+{
+	const int clients = std::max(1, (int)cl.Num(L"--clients", 32));
+	const int requests = std::max(clients, (int)cl.Num(L"--requests", 20000));
+	const int z = std::clamp((int)cl.Num(L"--zoom", MAX_JMA_ZOOM), MIN_JMA_ZOOM, MAX_JMA_ZOOM);
+	const int frames = std::clamp((int)cl.Num(L"--frames", 12), 1, 144);
+
+	MockUpstream mock;
+	if (!mock.Start(frames, (int)cl.Num(L"--mock-latency", 20), 32)) { fwprintf(stderr, L"error: cannot start mock upstream\n"); return 1; }
+	const Upstream savedUpstream = gUpstream;
+	const bool savedDisk = gDiskCacheEnabled;
+	gUpstream = { L"127.0.0.1", (INTERNET_PORT)mock.server.port() };
+	gDiskCacheEnabled = false;
+
+	std::vector<NowcTime> times;
+	IntensityService svc((size_t)std::max(16.0, cl.Num(L"--cache-tiles", 2048)));
+	HttpServer server;
+	if (!FetchTimes(false, times)) { fwprintf(stderr, L"error: mock upstream did not answer\n"); gUpstream = savedUpstream; gDiskCacheEnabled = savedDisk; return 1; }
+	svc.SetTimes(times);
+	if (!server.Start("127.0.0.1", 0, (size_t)clients + 4, [&](const HttpRequest& q, HttpResponse& r) { svc.Handle(q, r); })) {
+		fwprintf(stderr, L"error: cannot start service\n");
+		gUpstream = savedUpstream; gDiskCacheEnabled = savedDisk;
+		return 1;
 	}
-	case WM_LBUTTONDOWN:
-		g.dragging = true; SetCapture(h);
-		g.dragStart.x = GET_X_LPARAM(l); g.dragStart.y = GET_Y_LPARAM(l);
-		g.dragStartWX = g.originWX; g.dragStartWY = g.originWY; return 0;
-	case WM_MOUSEMOVE:
-		if (g.dragging) {
-			int sx = GET_X_LPARAM(l), sy = GET_Y_LPARAM(l);
-			int z = (int)std::floor(g.zoom);
-			double sc = std::pow(2.0, g.zoom - z);
-			g.originWX = g.dragStartWX - (sx - g.dragStart.x) / sc;
-			g.originWY = g.dragStartWY - (sy - g.dragStart.y) / sc;
-			ClampViewToJapan();
-			InvalidateRect(h, nullptr, FALSE);
-			UpdateTitle();
-		}return 0;
-	case WM_LBUTTONUP:g.dragging = false; ReleaseCapture(); return 0;
-	case WM_MOUSEWHEEL: {
-		int delta = GET_WHEEL_DELTA_WPARAM(w);
-		ZoomAtCenter((delta > 0) ? 0.25 : -0.25); return 0;
+	wprintf(L"bench-serve: %d clients, %d requests, z%d, %zu frames, upstream latency %d ms\n",
+		clients, requests, z, times.size(), mock.latencyMs);
+
+	// 単発の GET を並列に投げる
+	std::vector<std::vector<double>> lat(clients);
+	std::atomic<int> next{ 0 }, errors{ 0 };
+	auto t0 = std::chrono::steady_clock::now();
+	std::vector<std::thread> th;
+	for (int c = 0; c < clients; ++c) th.emplace_back([&, c]() {
+		std::mt19937 rng(1000 + c);
+		std::uniform_real_distribution<double> lon(kJapanBox.minLon, kJapanBox.maxLon), la(kJapanBox.minLat, kJapanBox.maxLat);
+		std::uniform_int_distribution<int> ti(0, (int)times.size() - 1);
+		HttpClient hc;
+		if (!hc.Connect("127.0.0.1", server.port())) { errors += 1; return; }
+		while (next++ < requests) {
+			char target[160];
+			sprintf_s(target, "/intensity?lat=%.5f&lon=%.5f&time=%d&zoom=%d", la(rng), lon(rng), ti(rng), z);
+			int status = 0;
+			std::string body;
+			auto r0 = std::chrono::steady_clock::now();
+			if (!hc.Request("GET", target, "", status, body) || status != 200) {
+				++errors;
+				if (!hc.Connect("127.0.0.1", server.port())) return;
+				continue;
+			}
+			lat[c].push_back(SecondsSince(r0) * 1000.0);
+		}
+		});
+	for (auto& t : th) t.join();
+	double wall = SecondsSince(t0);
+	std::vector<double> all;
+	for (auto& v : lat) all.insert(all.end(), v.begin(), v.end());
+	wprintf(L"  GET   : %zu ok, %d errors in %.2f s = %.0f qps, p50 %.2f ms, p99 %.2f ms\n",
+		all.size(), (int)errors, wall, all.size() / wall, Percentile(all, 50), Percentile(all, 99));
+	wprintf(L"          %zu tile loads, %zu upstream tile requests\n", svc.tileLoads(), (size_t)mock.tileRequests);
+
+	// 一括問い合わせ。同じ地点の組を 2 回送り、1 回目 (タイルの取得を含む) と 2 回目 (キャッシュが温まった状態) を比べる
+	{
+		std::mt19937 rng(7);
+		std::uniform_real_distribution<double> lon(kJapanBox.minLon, kJapanBox.maxLon), la(kJapanBox.minLat, kJapanBox.maxLat);
+		std::string body;
+		const int n = 10000;
+		for (int i = 0; i < n; ++i) {
+			char line[64];
+			sprintf_s(line, "%.5f,%.5f\n", la(rng), lon(rng));
+			body += line;
+		}
+		HttpClient hc;
+		bool connected = hc.Connect("127.0.0.1", server.port());
+		for (const wchar_t* pass : { L"cold", L"warm" }) {
+			int status = 0;
+			std::string resp;
+			size_t loads0 = svc.tileLoads();
+			auto b0 = std::chrono::steady_clock::now();
+			bool ok = connected && hc.Request("POST", "/intensity?time=0&zoom=" + std::to_string(z), body, status, resp);
+			double t = SecondsSince(b0);
+			wprintf(L"  POST  : %ls, %d points %ls (status %d, %zu bytes, %zu tile loads) in %.1f ms = %.0f points/s\n",
+				pass, n, ok ? L"ok" : L"FAILED", status, resp.size(), svc.tileLoads() - loads0, t * 1000.0, n / t);
+			if (!ok || status != 200) ++errors;
+		}
 	}
-	case WM_KEYDOWN:
-		if (w == '1') SwitchTimes(false);
-		else if (w == '2') SwitchTimes(true);
-		else if (w == VK_LEFT) StepTime(-1);
-		else if (w == VK_RIGHT) StepTime(+1);
-		else if (w == 'R') { CenterOnLonLat(139.767125, 35.681236); ZoomAtCenter(0); InvalidateRect(h, nullptr, FALSE); UpdateTitle(); }
-		return 0;
-	case WM_TIMER:
-		if (w == 1 && !gAnimPlaying) StepTime(+1);
-		return 0;
-	case WM_PAINT: {
-		PAINTSTRUCT ps; BeginPaint(h, &ps); DrawScene(); EndPaint(h, &ps); return 0;
+
+	server.Stop();
+	mock.server.Stop();
+	gUpstream = savedUpstream;
+	gDiskCacheEnabled = savedDisk;
+	return errors > 0 ? 1 : 0;
+}
+
+// ame.exe --proxy [port] [--bind 127.0.0.1] [--threads 64] [--mem-tiles 8192]
+// 他のマシンからは ame.exe --upstream このマシン:port で使う (LAN に公開するときは --bind 0.0.0.0 などを明示する)
+static int RunProxy(const CmdLine& cl)
+{
+	const int port = (int)cl.Num(L"--proxy", 8081);
+	const std::wstring wbind = cl.Str(L"--bind", L"127.0.0.1");
+	const std::string bindAddr(wbind.begin(), wbind.end());
+	const size_t threads = (size_t)std::max(1.0, cl.Num(L"--threads", 64));
+
+	TileProxy proxy((size_t)std::max(16.0, cl.Num(L"--mem-tiles", 8192)));
+	HttpServer server;
+	if (!server.Start(bindAddr.c_str(), port, threads, [&](const HttpRequest& q, HttpResponse& r) { proxy.Handle(q, r); })) {
+		fwprintf(stderr, L"error: cannot listen on %ls:%d\n", wbind.c_str(), port);
+		return 1;
 	}
-	case WM_TILE_READY:
-		InvalidateRect(h, nullptr, FALSE); return 0;
-	case WM_DESTROY:
-		// タイマーを停止
-		KillTimer(h, 1);
+	SetConsoleCtrlHandler(CliCtrlHandler, TRUE);
+	wprintf(L"proxy: listening on %ls:%d (Ctrl+C to stop)\n", wbind.c_str(), server.port());
+	fflush(stdout);
+	size_t lastRequests = 0;
+	for (int s = 1; !gCliStop; ++s) {
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+		if (s % 60 != 0 || proxy.requestCount() == lastRequests) continue;
+		lastRequests = proxy.requestCount();
+		auto st = proxy.statistics();
+		wprintf(L"proxy: %zu requests, memory %zu, coalesced %zu, loads %zu (disk %zu, upstream %zu)\n",
+			lastRequests, st.hits, st.coalesced, st.loads, (size_t)gTileDiskHits, (size_t)gTileHttpFetches);
+		fflush(stdout);
+	}
+	server.Stop();
+	return 0;
+}
 
-		// キャッシュと関連リソースの解放
+// ame.exe --bench-proxy [--clients 16] [--lat --lon --zoom --size] [--mock-latency 20]
+// 同じ画面を開いた N 台のビューアーを模し、一斉に同じタイル群を要求したときの上流への取得回数を数える
+static int RunBenchProxy(const CmdLine& cl)
+{
+	const int clients = std::max(1, (int)cl.Num(L"--clients", 16));
+	MockUpstream mock;
+	if (!mock.Start(12, (int)cl.Num(L"--mock-latency", 20), 32)) { fwprintf(stderr, L"error: cannot start mock upstream\n"); return 1; }
+	const Upstream savedUpstream = gUpstream;
+	const bool savedDisk = gDiskCacheEnabled;
+	gUpstream = { L"127.0.0.1", (INTERNET_PORT)mock.server.port() };
+	gDiskCacheEnabled = false;
+
+	// 1 台分の要求: 時刻一覧、地図タイル、表示中の全フレームの JMA タイル
+	std::vector<NowcTime> times;
+	FetchTimes(false, times);
+	MapView v = CliView(cl, 1280, 800);
+	std::vector<std::string> paths = { std::string(K_TIMES_URL_N1, K_TIMES_URL_N1 + wcslen(K_TIMES_URL_N1)) };
+	auto add = [&](const std::wstring& p, const D2D1_RECT_F&) { paths.emplace_back(p.begin(), p.end()); };
+	ForEachGsiTile(v, gGsiStyle, add);
+	for (auto& t : times) ForEachJmaTile(v, t, add);
+	const size_t mock0 = mock.tileRequests;
+
+	TileProxy proxy(8192);
+	HttpServer server;
+	if (!server.Start("127.0.0.1", 0, (size_t)clients + 4, [&](const HttpRequest& q, HttpResponse& r) { proxy.Handle(q, r); })) {
+		fwprintf(stderr, L"error: cannot start proxy\n");
+		gUpstream = savedUpstream; gDiskCacheEnabled = savedDisk;
+		return 1;
+	}
+	wprintf(L"bench-proxy: %d clients x %zu requests, upstream latency %d ms\n", clients, paths.size(), mock.latencyMs);
+
+	std::atomic<int> errors{ 0 };
+	auto t0 = std::chrono::steady_clock::now();
+	std::vector<std::thread> th;
+	for (int c = 0; c < clients; ++c) th.emplace_back([&, c]() {
+		// 要求順は台ごとにずらす (表示の差し替えタイミングの違い)
+		std::vector<std::string> order = paths;
+		std::shuffle(order.begin() + 1, order.end(), std::mt19937(c));
+		HttpClient hc;
+		if (!hc.Connect("127.0.0.1", server.port())) { errors += (int)order.size(); return; }
+		for (auto& p : order) {
+			int status = 0;
+			std::string body;
+			if (!hc.Request("GET", p, "", status, body) || status != 200) {
+				++errors;
+				hc.Connect("127.0.0.1", server.port());
+			}
+		}
+		});
+	for (auto& t : th) t.join();
+	double wall = SecondsSince(t0);
+	auto st = proxy.statistics();
+	const size_t upstream = mock.tileRequests - mock0, direct = (size_t)clients * (paths.size() - 1);
+	wprintf(L"  %zu requests in %.2f s (%d errors): memory %zu, coalesced %zu, loads %zu\n",
+		proxy.requestCount(), wall, (int)errors, st.hits, st.coalesced, st.loads);
+	wprintf(L"  upstream tile requests: %zu via proxy vs %zu direct (%.1f%% saved)\n",
+		upstream, direct, direct ? 100.0 * (1.0 - (double)upstream / direct) : 0.0);
+
+	server.Stop();
+	mock.server.Stop();
+	gUpstream = savedUpstream;
+	gDiskCacheEnabled = savedDisk;
+	return errors > 0 ? 1 : 0;
+}
+
+// "10,30,50" 形式の閾値
+static std::vector<float> CliMmhLevels(const CmdLine& cl, const wchar_t* def)
+{
+	std::vector<float> levels;
+	std::wstring s = cl.Str(L"--levels", def);
+	for (size_t pos = 0; pos < s.size();) {
+		size_t comma = s.find(L',', pos);
+		if (comma == std::wstring::npos) comma = s.size();
+		float v = (float)_wtof(s.substr(pos, comma - pos).c_str());
+		if (v > 0) levels.push_back(v);
+		pos = comma + 1;
+	}
+	return levels;
+}
+
+// ame.exe --contours out.geojson [--levels 10,30,50] [--zoom 8] [--simplify 0.75] [--time N] [--threads N] [--archive f | --forecast]
+// 日本全域の等値線を GeoJSON に書き出す。--simplify はズーム z の画素単位
+static int RunContours(const CmdLine& cl)
+{
+	std::wstring outFile = cl.Str(L"--contours");
+	if (outFile.empty()) { fwprintf(stderr, L"error: --contours needs an output file\n"); return 1; }
+	if (!CliLoadTimes(cl)) return 1;
+	const int z = std::clamp((int)cl.Num(L"--zoom", 8), MIN_JMA_ZOOM, MAX_JMA_ZOOM);
+	const size_t threads = (size_t)std::max(1.0, cl.Num(L"--threads", WORKER_THREADS * 2));
+	const std::vector<float> levels = CliMmhLevels(cl, L"10,30,50");
+
+	int tx0, ty0, tx1, ty1;
+	TileRangeForBox(kJapanBox, z, tx0, ty0, tx1, ty1);
+	ClassMosaic m;
+	size_t failed = LoadClassMosaic(gTimes[gTimeIndex], z, tx0, ty0, tx1, ty1, threads, m);
+	std::vector<ContourRing> rings;
+	ContourStats st;
+	ExtractContours(m, levels, cl.Num(L"--simplify", 0.75), threads, rings, st);
+	if (!WriteContoursGeoJson(outFile, rings, z)) { fwprintf(stderr, L"error: cannot write %ls\n", outFile.c_str()); return 1; }
+	wprintf(L"contours: %ls z%d, %zu tiles (%zu missing), %zu rings, %zu points -> %ls\n",
+		gTimes[gTimeIndex].validtime.c_str(), z, m.planes.size(), failed, st.rings, st.points, outFile.c_str());
+	return 0;
+}
+
+// ame.exe --bench-contours [--zoom 8] [--levels 10,30,50] [--simplify 0.75] [--threads N] [--time N] [--archive f]
+// 日本全域のモザイクで 2 値化・線分生成・連結・単純化の時間を 1 スレッドと N スレッドで測る
+static int RunBenchContours(const CmdLine& cl)
+{
+	if (!CliLoadTimes(cl)) return 1;
+	const int z = std::clamp((int)cl.Num(L"--zoom", 8), MIN_JMA_ZOOM, MAX_JMA_ZOOM);
+	const size_t threads = (size_t)std::max(1.0, cl.Num(L"--threads", WORKER_THREADS * 2));
+	const std::vector<float> levels = CliMmhLevels(cl, L"10,30,50");
+	const double tol = cl.Num(L"--simplify", 0.75);
+
+	int tx0, ty0, tx1, ty1;
+	TileRangeForBox(kJapanBox, z, tx0, ty0, tx1, ty1);
+	auto t0 = std::chrono::steady_clock::now();
+	ClassMosaic m;
+	size_t failed = LoadClassMosaic(gTimes[gTimeIndex], z, tx0, ty0, tx1, ty1, threads, m);
+	wprintf(L"bench-contours: %ls z%d, %dx%d tiles (%zu missing), %zu levels, load %.2f s\n",
+		gTimes[gTimeIndex].validtime.c_str(), z, m.nx, m.ny, failed, levels.size(), SecondsSince(t0));
+
+	for (size_t n : { (size_t)1, threads }) {
+		const int reps = 5;
+		ContourStats st;
+		std::vector<ContourRing> rings;
+		t0 = std::chrono::steady_clock::now();
+		for (int r = 0; r < reps; ++r) {
+			rings.clear();
+			st = ContourStats();
+			ExtractContours(m, levels, tol, n, rings, st);
+		}
+		wprintf(L"  %2zu threads: %.1f ms/run (classify %.1f, march %.1f, join %.1f, simplify %.1f)\n",
+			n, SecondsSince(t0) * 1000.0 / reps, st.classifySec * 1000.0, st.marchSec * 1000.0, st.joinSec * 1000.0, st.simplifySec * 1000.0);
+		wprintf(L"              %zu segments -> %zu rings, %zu -> %zu points\n", st.segments, st.rings, st.rawPoints, st.points);
+	}
+	return 0;
+}
+
+// ame.exe --storms cells.csv [--threshold 20] [--min-area 10] [--zoom 8] [--threads N] [--archive f | --forecast]
+//         [--follow [--interval 60]]
+// 全フレームを古い順に追跡して CSV に書く。--follow では一覧を取り直し、新しいフレームだけを追加で処理する
+static int RunStorms(const CmdLine& cl)
+{
+	std::wstring outFile = cl.Str(L"--storms", L"storms.csv");
+	if (!CliLoadTimes(cl)) return 1;
+	const float threshold = (float)cl.Num(L"--threshold", kStormThresholdMmh);
+	const double minKm2 = cl.Num(L"--min-area", kStormMinKm2);
+	const int z = std::clamp((int)cl.Num(L"--zoom", 8), MIN_JMA_ZOOM, MAX_JMA_ZOOM);
+	const size_t threads = (size_t)std::max(1.0, cl.Num(L"--threads", WORKER_THREADS * 2));
+	const bool follow = cl.Has(L"--follow") && !cl.Has(L"--archive");
+	const int interval = std::max(5, (int)cl.Num(L"--interval", 60));
+
+	FILE* f = nullptr;
+	if (_wfopen_s(&f, outFile.c_str(), L"wb") != 0 || !f) { fwprintf(stderr, L"error: cannot write %ls\n", outFile.c_str()); return 1; }
+	fputs("validtime,track,lon,lat,area_km2,mean_mmh,max_mmh,speed_kmh,heading_deg\n", f);
+	int tx0, ty0, tx1, ty1;
+	TileRangeForBox(kJapanBox, z, tx0, ty0, tx1, ty1);
+	StormTracker tracker;
+	SetConsoleCtrlHandler(CliCtrlHandler, TRUE);
+	for (;;) {
+		for (int i : ChronologicalFrames()) {
+			if (gCliStop) break;
+			const NowcTime& T = gTimes[i];
+			if (T.validtime <= tracker.lastTime()) continue;
+			ClassMosaic m;
+			size_t failed = LoadClassMosaic(T, z, tx0, ty0, tx1, ty1, threads, m);
+			// タイルが 1 枚も読めなかったフレームでは追跡を進めない (全セルを見失ったことにしない。StormLayer と同じ)
+			if (failed == m.planes.size()) {
+				wprintf(L"%ls: skipped (no tiles)\n", T.validtime.c_str());
+				continue;
+			}
+			std::vector<StormCell> cells;
+			StormLabelStats st;
+			LabelStormCells(m, threshold, minKm2, threads, cells, st);
+			tracker.Advance(T.validtime, std::move(cells));
+			for (const StormCell& c : tracker.frames().back().cells) {
+				const double speed = std::hypot(c.vxKmh, c.vyKmh);
+				const double heading = speed > 0 ? std::fmod(std::atan2(c.vxKmh, c.vyKmh) * 180.0 / M_PI + 360.0, 360.0) : 0.0;
+				fprintf(f, "%ls,%d,%.5f,%.5f,%.1f,%.1f,%.1f,%.1f,%.0f\n", T.validtime.c_str(), c.track, c.lon, c.lat,
+					c.areaKm2, c.meanMmh, c.maxMmh, speed, heading);
+			}
+			fflush(f);
+			wprintf(L"%ls: %zu components, %zu cells, %zu tracks (%zu tiles missing)\n",
+				T.validtime.c_str(), st.components, st.cells, tracker.trackCount(), failed);
+		}
+		if (!follow || gCliStop) break;
+		for (int s = 0; s < interval && !gCliStop; ++s) std::this_thread::sleep_for(std::chrono::seconds(1));
+		std::vector<NowcTime> t;
+		if (!gCliStop && FetchTimes(gUseForecast, t)) gTimes.swap(t);
+	}
+	fclose(f);
+	return 0;
+}
+
+// ame.exe --bench-storms [--zoom 8] [--threshold 20] [--threads N] [--archive f]
+// 日本全域のモザイクを全フレーム分読み込み、ラベル付け (1 スレッド / N スレッド) と追跡の時間を測る
+static int RunBenchStorms(const CmdLine& cl)
+{
+	if (!CliLoadTimes(cl)) return 1;
+	const int z = std::clamp((int)cl.Num(L"--zoom", 8), MIN_JMA_ZOOM, MAX_JMA_ZOOM);
+	const float threshold = (float)cl.Num(L"--threshold", kStormThresholdMmh);
+	const size_t threads = (size_t)std::max(1.0, cl.Num(L"--threads", WORKER_THREADS * 2));
+	int tx0, ty0, tx1, ty1;
+	TileRangeForBox(kJapanBox, z, tx0, ty0, tx1, ty1);
+
+	auto t0 = std::chrono::steady_clock::now();
+	std::vector<int> frames = ChronologicalFrames();
+	std::vector<ClassMosaic> mosaics(frames.size());
+	for (size_t i = 0; i < frames.size(); ++i) LoadClassMosaic(gTimes[frames[i]], z, tx0, ty0, tx1, ty1, threads, mosaics[i]);
+	wprintf(L"bench-storms: z%d, %dx%d tiles x %zu frames, threshold %.0f mm/h, load %.2f s\n",
+		z, tx1 - tx0 + 1, ty1 - ty0 + 1, frames.size(), threshold, SecondsSince(t0));
+
+	for (size_t n : { (size_t)1, threads }) {
+		StormTracker tracker;
+		StormLabelStats st;
+		double trackSec = 0;
+		for (size_t i = 0; i < frames.size(); ++i) {
+			std::vector<StormCell> cells;
+			LabelStormCells(mosaics[i], threshold, kStormMinKm2, n, cells, st);
+			auto t1 = std::chrono::steady_clock::now();
+			tracker.Advance(gTimes[frames[i]].validtime, std::move(cells));
+			trackSec += SecondsSince(t1);
+		}
+		const double per = 1000.0 / std::max<size_t>(1, frames.size());
+		wprintf(L"  %2zu threads: label %.2f ms/frame, merge %.2f ms/frame, track %.3f ms/frame\n",
+			n, st.labelSec * per, st.mergeSec * per, trackSec * per);
+		wprintf(L"              %zu labelled tiles, %zu components, %zu cells, %zu tracks\n",
+			st.labelledTiles, st.components, st.cells, tracker.trackCount());
+	}
+	return 0;
+}
+
+// ame.exe --bench-flow [--zoom 8] [--pairs 6] [--threads N] [--archive f]
+// 日本全域のうち雨のあるタイルについて、連続する時刻の組ごとに動きの推定 (SSE2 / スカラー) と途中フレームの生成を測る
+static int RunBenchFlow(const CmdLine& cl)
+{
+	if (!CliLoadTimes(cl)) return 1;
+	const int z = std::clamp((int)cl.Num(L"--zoom", 8), MIN_JMA_ZOOM, MAX_JMA_ZOOM);
+	const int pairs = std::clamp((int)cl.Num(L"--pairs", 6), 1, (int)gTimes.size() - 1);
+	const size_t threads = (size_t)std::max(1.0, cl.Num(L"--threads", WORKER_THREADS * 2));
+	if (gTimes.size() < 2) { fwprintf(stderr, L"error: need at least 2 frames\n"); return 1; }
+	int tx0, ty0, tx1, ty1;
+	TileRangeForBox(kJapanBox, z, tx0, ty0, tx1, ty1);
+
+	// 古い方 → 新しい方の組で、両方そろっていて A に雨のあるタイル。周りの 8 タイルから縁付きの面も作る
+	struct Pair { std::vector<BYTE> a, ea, eb; };
+	std::vector<Pair> work;
+	std::mutex mtx;
+	auto t0 = std::chrono::steady_clock::now();
+	for (int p = 0; p < pairs; ++p) {
+		const NowcTime& A = gTimes[p + 1], & B = gTimes[p];
+		ParallelFor((size_t)(tx1 - tx0 + 1) * (ty1 - ty0 + 1), threads, [&](size_t k) {
+			const int x = tx0 + (int)(k % (tx1 - tx0 + 1)), y = ty0 + (int)(k / (tx1 - tx0 + 1));
+			auto apron = [&](const NowcTime& T, std::vector<BYTE>& center, std::vector<BYTE>& out) {
+				std::vector<BYTE> nb[9];
+				const BYTE* src[9];
+				for (int i = 0; i < 9; ++i) {
+					const int nx = x + i % 3 - 1, ny = y + i / 3 - 1;
+					nb[i].resize(kTilePixels);
+					src[i] = nx >= 0 && ny >= 0 && nx < (1 << z) && ny < (1 << z) && LoadTileClasses(JmaTilePath(T, z, nx, ny), nb[i].data()) ? nb[i].data() : nullptr;
+				}
+				if (!src[4]) return false;
+				out.resize(kApronSize * kApronSize);
+				BuildApronPlane(src, out.data());
+				center = std::move(nb[4]);
+				return true;
+			};
+			Pair w;
+			std::vector<BYTE> b;
+			if (!apron(A, w.a, w.ea) || !apron(B, b, w.eb)) return;
+			if (std::all_of(w.a.begin(), w.a.end(), [](BYTE c) { return c == 0; })) return;
+			std::lock_guard<std::mutex> lk(mtx);
+			work.push_back(std::move(w));
+			});
+	}
+	wprintf(L"bench-flow: z%d, %d pairs, %zu tile pairs with rain (load %.2f s)\n", z, pairs, work.size(), SecondsSince(t0));
+	if (work.empty()) return 0;
+
+	std::vector<FlowField> flows(work.size());
+	t0 = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < work.size(); ++i) EstimateFlowT<BlockSadScalar>(work[i].a.data(), work[i].eb.data(), flows[i]);
+	const double scalar = SecondsSince(t0);
+	t0 = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < work.size(); ++i) EstimateFlow(work[i].a.data(), work[i].eb.data(), flows[i]);
+	const double simd = SecondsSince(t0);
+	t0 = std::chrono::steady_clock::now();
+	ParallelFor(work.size(), threads, [&](size_t i) { EstimateFlow(work[i].a.data(), work[i].eb.data(), flows[i]); });
+	const double par = SecondsSince(t0);
+
+	std::vector<BYTE> out(kTilePixels);
+	t0 = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < work.size(); ++i)
+		for (int s = 1; s <= kMotionSteps; ++s) InterpolateClasses(work[i].ea.data(), work[i].eb.data(), flows[i], (float)s / (kMotionSteps + 1), out.data());
+	const double warp = SecondsSince(t0);
+
+	double speed = 0;
+	size_t blocks = 0;
+	for (auto& f : flows) {
+		for (int k = 0; k < kFlowGrid * kFlowGrid; ++k) speed += std::hypot(f.vx[k], f.vy[k]);
+		blocks += f.validBlocks;
+	}
+	const double n = (double)work.size();
+	wprintf(L"  flow   : scalar %.3f ms/tile, SSE2 %.3f ms/tile (x%.1f), %zu threads %.3f ms/tile\n",
+		scalar * 1000.0 / n, simd * 1000.0 / n, scalar / std::max(simd, 1e-9), threads, par * 1000.0 / n);
+	wprintf(L"  warp   : %.3f ms/tile for %d in-between frames\n", warp * 1000.0 / n, kMotionSteps);
+	wprintf(L"  motion : %zu blocks with rain, mean |v| %.2f px/frame\n", blocks, speed / (n * kFlowGrid * kFlowGrid));
+	return 0;
+}
+
+// ame.exe --bench-extrap [--zoom 8] [--steps 12] [--threads N] [--archive f]
+// 2 つ前までの観測を読み込んだ状態から最新の観測が届いたとして、
+// 新しいフレームの読み込み、動きの推定、最初の外挿フレームと全ステップがそろうまでの時間を測る
+static int RunBenchExtrap(const CmdLine& cl)
+{
+	if (!CliLoadTimes(cl)) return 1;
+	if (gTimes.size() < 3) { fwprintf(stderr, L"error: need at least 3 frames\n"); return 1; }
+	const int z = std::clamp((int)cl.Num(L"--zoom", kExtrapZoom), MIN_JMA_ZOOM, kExtrapZoom);
+	const int steps = std::clamp((int)cl.Num(L"--steps", kExtrapSteps), 1, 36);
+	const size_t threads = (size_t)std::max(1.0, cl.Num(L"--threads", WORKER_THREADS * 2));
+	int tx0, ty0, tx1, ty1;
+	TileRangeForBox(kJapanBox, z, tx0, ty0, tx1, ty1);
+	const size_t nx = tx1 - tx0 + 1, tiles = nx * (ty1 - ty0 + 1);
+	auto tileXY = [&](size_t k, int& x, int& y) { x = tx0 + (int)(k % nx); y = ty0 + (int)(k / nx); };
+
+	// 最新の 1 つ前までを受信済みにする
+	Extrapolator ex(tiles * (steps + 4) + 64);
+	std::vector<NowcTime> history(gTimes.begin() + 1, gTimes.end());
+	auto t0 = std::chrono::steady_clock::now();
+	ex.SetObservations(history, steps);
+	for (int i = 0; i < 2; ++i)
+		ParallelFor(tiles, threads, [&](size_t k) { int x, y; tileXY(k, x, y); ex.ObservedTile(history[i], z, x, y); });
+	wprintf(L"bench-extrap: z%d, %zu tiles, %d steps, history %.2f s\n", z, tiles, steps, SecondsSince(t0));
+
+	// 最新の観測が届く
+	t0 = std::chrono::steady_clock::now();
+	std::vector<NowcTime> frames = ex.SetObservations(gTimes, steps);
+	std::vector<NowcTime> obs = ex.Recent();
+	ParallelFor(tiles, threads, [&](size_t k) { int x, y; tileXY(k, x, y); ex.ObservedTile(obs[0], z, x, y); });
+	const double load = SecondsSince(t0);
+	std::atomic<size_t> moving{ 0 };
+	auto t1 = std::chrono::steady_clock::now();
+	ParallelFor(tiles, threads, [&](size_t k) {
+		int x, y; tileXY(k, x, y);
+		FlowField f;
+		if (ex.Motion(obs, z, x, y, f) && f.validBlocks > 0) ++moving;
+		});
+	const double motion = SecondsSince(t1);
+	// frames は新しい順なので末尾が最初のステップ
+	std::atomic<size_t> ready{ 0 };
+	auto runStep = [&](const NowcTime& T) {
+		ParallelFor(tiles, threads, [&](size_t k) {
+			int x, y; tileXY(k, x, y);
+			std::vector<BYTE> out(kTilePixels);
+			if (ex.Tile(T, z, x, y, out.data())) ++ready;
+			});
+		};
+	t1 = std::chrono::steady_clock::now();
+	runStep(frames.back());
+	const double first = SecondsSince(t0), firstAdvect = SecondsSince(t1);
+	for (int s = (int)frames.size() - 2; s >= 0; --s) runStep(frames[s]);
+	const double all = SecondsSince(t0), allAdvect = SecondsSince(t1);
+
+	wprintf(L"  new frame %ls: load %.1f ms, motion %.1f ms (%zu tiles with rain)\n",
+		obs[0].validtime.c_str(), load * 1000.0, motion * 1000.0, moving.load());
+	wprintf(L"  first step (+5 min)  ready %.1f ms after arrival (advect %.3f ms/tile)\n", first * 1000.0, firstAdvect * 1000.0 / tiles);
+	wprintf(L"  all %2d steps (+%d min) ready %.1f ms after arrival (advect %.3f ms/tile), %zu tiles produced\n",
+		steps, steps * 5, all * 1000.0, allAdvect * 1000.0 / ((double)tiles * steps), ready.load());
+	return 0;
+}
+
+// ame.exe --verify tiles.csv --archive f.ame [--hours 24] [--levels 1,5,20,50] [--zoom 6] [--threads N]
+// アーカイブ内の予報を後から届いた観測で採点する。タイルごとの分割表を CSV に、全体と予報時間ごとの値を標準出力に出す
+static int RunVerify(const CmdLine& cl)
+{
+	std::wstring outFile = cl.Str(L"--verify", L"verify.csv");
+	if (!cl.Has(L"--archive") || !OpenArchive(cl.Str(L"--archive"))) { fwprintf(stderr, L"error: --verify needs --archive with N1 and N2 frames\n"); return 1; }
+	const int z = std::clamp((int)cl.Num(L"--zoom", 6), MIN_JMA_ZOOM, MAX_JMA_ZOOM);
+	const size_t threads = (size_t)std::max(1.0, cl.Num(L"--threads", WORKER_THREADS * 2));
+	std::vector<float> levels = CliMmhLevels(cl, L"1,5,20,50");
+	std::vector<VerifyPair> pairs = ArchiveVerifyPairs(cl.Num(L"--hours", 24));
+	if (pairs.empty() || levels.empty()) { fwprintf(stderr, L"error: no forecast frames with a matching observation\n"); return 1; }
+
+	VerificationJob job(z, levels);
+	auto t0 = std::chrono::steady_clock::now();
+	job.Run(pairs, threads);
+	const double sec = SecondsSince(t0);
+
+	FILE* f = nullptr;
+	if (_wfopen_s(&f, outFile.c_str(), L"wb") != 0 || !f) { fwprintf(stderr, L"error: cannot create %ls\n", outFile.c_str()); return 1; }
+	fprintf(f, "z,x,y,threshold_mmh,hits,misses,false_alarms,pod,far,csi\n");
+	for (size_t t = 0; t < job.tileCount(); ++t)
+		for (size_t k = 0; k < levels.size(); ++k) {
+			const Contingency& c = job.Tile(t, k);
+			if (c.hits + c.misses + c.falseAlarms == 0) continue;
+			fprintf(f, "%d,%d,%d,%g,%llu,%llu,%llu,%.4f,%.4f,%.4f\n", z, job.tx0 + (int)(t % (job.tx1 - job.tx0 + 1)), job.ty0 + (int)(t / (job.tx1 - job.tx0 + 1)),
+				levels[k], (unsigned long long)c.hits, (unsigned long long)c.misses, (unsigned long long)c.falseAlarms, c.POD(), c.FAR(), c.CSI());
+		}
+	fclose(f);
+
+	wprintf(L"verify: %zu forecast/observation frame pairs, z%d, %zu tiles -> %ls\n", pairs.size(), z, job.tileCount(), outFile.c_str());
+	wprintf(L"  %.2f s, %.1f frame-pairs/s (%zu tile pairs scored, %zu missing) with %zu threads\n",
+		sec, pairs.size() / std::max(sec, 1e-9), job.compared, job.skipped, threads);
+	for (size_t k = 0; k < levels.size(); ++k) {
+		const Contingency c = job.Overall(k);
+		wprintf(L"  >= %4g mm/h: POD %.3f  FAR %.3f  CSI %.3f   CSI by lead:", levels[k], c.POD(), c.FAR(), c.CSI());
+		for (int l = 1; l <= job.maxLead; ++l) wprintf(L" %d'=%.2f", l * 5, job.Lead(l, k).CSI());
+		wprintf(L"\n");
+	}
+	return 0;
+}
+
+// ame.exe --bench-verify --archive f.ame [--pairs 48] [--levels 1,5,20,50] [--zoom 6] [--threads N]
+// 読み込み済みの面で分割表の集計だけを測る (スカラー / SSE2 / N スレッド)
+static int RunBenchVerify(const CmdLine& cl)
+{
+	if (!cl.Has(L"--archive") || !OpenArchive(cl.Str(L"--archive"))) { fwprintf(stderr, L"error: --bench-verify needs --archive\n"); return 1; }
+	const int z = std::clamp((int)cl.Num(L"--zoom", 6), MIN_JMA_ZOOM, MAX_JMA_ZOOM);
+	const size_t threads = (size_t)std::max(1.0, cl.Num(L"--threads", WORKER_THREADS * 2));
+	std::vector<float> levels = CliMmhLevels(cl, L"1,5,20,50");
+	std::vector<VerifyPair> pairs = ArchiveVerifyPairs(24 * 365);
+	if (pairs.empty() || levels.empty()) { fwprintf(stderr, L"error: no forecast frames with a matching observation\n"); return 1; }
+	pairs.resize(std::min<size_t>(pairs.size(), (size_t)std::max(1.0, cl.Num(L"--pairs", 48))));
+
+	VerificationJob job(z, levels);
+	struct Planes { std::vector<BYTE> fc, ob; };
+	std::vector<Planes> work;
+	std::mutex mtx;
+	auto t0 = std::chrono::steady_clock::now();
+	ParallelFor(pairs.size() * job.tileCount(), threads, [&](size_t i) {
+		const VerifyPair& p = pairs[i / job.tileCount()];
+		const size_t t = i % job.tileCount();
+		const int x = job.tx0 + (int)(t % (job.tx1 - job.tx0 + 1)), y = job.ty0 + (int)(t / (job.tx1 - job.tx0 + 1));
+		Planes w{ std::vector<BYTE>(kTilePixels), std::vector<BYTE>(kTilePixels) };
+		if (!LoadTileClasses(JmaTilePath(p.forecast, z, x, y), w.fc.data()) || !LoadTileClasses(JmaTilePath(p.observed, z, x, y), w.ob.data())) return;
+		std::lock_guard<std::mutex> lk(mtx);
+		work.push_back(std::move(w));
+		});
+	wprintf(L"bench-verify: z%d, %zu frame pairs, %zu tile pairs, %zu levels (load %.2f s)\n",
+		z, pairs.size(), work.size(), levels.size(), SecondsSince(t0));
+	if (work.empty()) return 0;
+
+	const int nl = (int)levels.size();
+	auto run = [&](size_t n, bool simd) {
+		std::vector<Contingency> total(nl);
+		std::mutex m;
+		auto t1 = std::chrono::steady_clock::now();
+		ParallelFor(n, n, [&](size_t part) {
+			std::vector<Contingency> c(nl);
+			for (size_t i = part; i < work.size(); i += n)
+				(simd ? CountContingency : CountContingencyScalar)(work[i].fc.data(), work[i].ob.data(), job.cls.data(), nl, c.data());
+			std::lock_guard<std::mutex> lk(m);
+			for (int k = 0; k < nl; ++k) total[k] += c[k];
+			});
+		const double sec = SecondsSince(t1);
+		wprintf(L"  %-6ls %2zu threads: %.3f ms/tile pair, %.1f frame-pairs/s, CSI(>=%g) %.3f\n", simd ? L"SSE2" : L"scalar", n,
+			sec * 1000.0 / work.size(), pairs.size() / std::max(sec, 1e-9), levels[0], total[0].CSI());
+		};
+	run(1, false);
+	run(1, true);
+	run(threads, true);
+	return 0;
+}
+
+// ame.exe --mosaic outdir [--zoom 8] [--frames 1] [--equirect [--grid deg]] [--time N] [--threads N] [--archive f | --forecast]
+// 日本全域を 1 時刻 1 ファイル (<validtime>_z8.ras / _ll.ras) に書く。形式は MosaicHeader + 階級の行優先ラスタ
+static int RunMosaic(const CmdLine& cl)
+{
+	std::wstring dir = cl.Str(L"--mosaic", L"mosaic");
+	if (!CliLoadTimes(cl)) return 1;
+	const int z = std::clamp((int)cl.Num(L"--zoom", 8), MIN_JMA_ZOOM, MAX_JMA_ZOOM);
+	const int frames = std::clamp((int)cl.Num(L"--frames", 1), 1, (int)gTimes.size() - gTimeIndex);
+	const size_t threads = (size_t)std::max(1.0, cl.Num(L"--threads", WORKER_THREADS * 2));
+	const bool equirect = cl.Has(L"--equirect");
+	MosaicGrid g = MakeMosaicGrid(kJapanBox, z, equirect, cl.Num(L"--grid", 0));
+	wprintf(L"mosaic: %ls z%d, %dx%d tiles -> %dx%d px (%.1f MP) per frame\n",
+		equirect ? L"equirectangular from" : L"mercator", z, g.nx, g.ny, g.width, g.height, g.pixels() / 1e6);
+
+	double total = 0;
+	for (int f = 0; f < frames; ++f) {
+		const NowcTime& T = gTimes[gTimeIndex + f];
+		wchar_t name[64];
+		swprintf_s(name, L"\\%s_%s.ras", T.validtime.c_str(), equirect ? L"ll" : (L"z" + std::to_wstring(z)).c_str());
+		MosaicBuildStats st;
+		if (!BuildMosaicFile(T, g, dir + name, threads, st)) { fwprintf(stderr, L"error: cannot create %ls%ls\n", dir.c_str(), name); return 1; }
+		total += st.seconds;
+		wprintf(L"  %ls: %.2f s, %.1f MP/s (%zu/%zu tiles missing)\n", name + 1, st.seconds, g.pixels() / 1e6 / std::max(st.seconds, 1e-9), st.missing, st.tiles);
+	}
+	wprintf(L"  %d frames in %.2f s, %.1f MP/s overall\n", frames, total, frames * g.pixels() / 1e6 / std::max(total, 1e-9));
+	return 0;
+}
+
+// ame.exe --bench-mosaic [--zoom 8] [--grid deg] [--threads N] [--time N] [--archive f]
+// 読み込み済みのタイルから組み立てる部分だけを、メルカトルと正距円筒で 1 スレッドと N スレッドで測る
+static int RunBenchMosaic(const CmdLine& cl)
+{
+	if (!CliLoadTimes(cl)) return 1;
+	const int z = std::clamp((int)cl.Num(L"--zoom", 8), MIN_JMA_ZOOM, MAX_JMA_ZOOM);
+	const size_t threads = (size_t)std::max(1.0, cl.Num(L"--threads", WORKER_THREADS * 2));
+	int tx0, ty0, tx1, ty1;
+	TileRangeForBox(kJapanBox, z, tx0, ty0, tx1, ty1);
+	auto t0 = std::chrono::steady_clock::now();
+	ClassMosaic m;
+	size_t failed = LoadClassMosaic(gTimes[gTimeIndex], z, tx0, ty0, tx1, ty1, threads, m);
+	wprintf(L"bench-mosaic: %ls z%d, %dx%d tiles (%zu missing), load %.2f s\n",
+		gTimes[gTimeIndex].validtime.c_str(), z, m.nx, m.ny, failed, SecondsSince(t0));
+
+	for (bool equirect : { false, true }) {
+		t0 = std::chrono::steady_clock::now();
+		MosaicGrid g = MakeMosaicGrid(kJapanBox, z, equirect, cl.Num(L"--grid", 0));
+		const double gridMs = SecondsSince(t0) * 1000.0;
+		std::vector<BYTE> raster(g.pixels());
+		wprintf(L"  %ls: %dx%d px (grid %.2f ms)\n", equirect ? L"equirect" : L"mercator", g.width, g.height, gridMs);
+		for (size_t n : { (size_t)1, threads }) {
+			const int reps = 3;
+			t0 = std::chrono::steady_clock::now();
+			for (int r = 0; r < reps; ++r)
+				ParallelFor(m.planes.size(), n, [&](size_t k) {
+					const std::vector<BYTE>& p = m.planes[k];
+					BlitMosaicTile(g, (int)(k % m.nx), (int)(k / m.nx), p.empty() ? nullptr : p.data(), raster.data());
+					});
+			const double sec = SecondsSince(t0) / reps;
+			wprintf(L"    %2zu threads: %.2f ms/frame, %.0f MP/s\n", n, sec * 1000.0, g.pixels() / 1e6 / std::max(sec, 1e-9));
+		}
+	}
+	return 0;
+}
+
+// --export-grid / --bench-grid 共通: 形式は --format tiff|raw か拡張子 (.flt / .bin は raw) で決める
+static GridFormat CliGridFormat(const CmdLine& cl, const std::wstring& file)
+{
+	std::wstring fmt = cl.Str(L"--format");
+	if (fmt.empty()) {
+		const size_t dot = file.find_last_of(L'.');
+		const std::wstring ext = dot == std::wstring::npos ? L"" : file.substr(dot);
+		return _wcsicmp(ext.c_str(), L".flt") == 0 || _wcsicmp(ext.c_str(), L".bin") == 0 ? GridFormat::RawFloat : GridFormat::GeoTiff;
+	}
+	return fmt == L"raw" ? GridFormat::RawFloat : GridFormat::GeoTiff;
+}
+
+// ame.exe --export-grid out.tif [--bbox minLon,minLat,maxLon,maxLat] [--format tiff|raw] [--zoom 8] [--equirect [--grid deg]]
+//         [--times a-b | --from T --to T] [--threads N] [--archive f | --forecast]
+// 選んだ各時刻を降水強度 (mm/h) の格子で書く。複数時刻なら out_<validtime>.tif のように時刻を付ける
+static int RunExportGrid(const CmdLine& cl)
+{
+	std::wstring out = cl.Str(L"--export-grid", L"nowcast.tif");
+	GeoBox box = kJapanBox;
+	std::wstring bs = cl.Str(L"--bbox");
+	if (!bs.empty() && !ParseBox(bs, box)) { fwprintf(stderr, L"error: bad bbox '%ls' (minLon,minLat,maxLon,maxLat)\n", bs.c_str()); return 1; }
+	if (!CliLoadTimes(cl)) return 1;
+	const int z = std::clamp((int)cl.Num(L"--zoom", 8), MIN_JMA_ZOOM, MAX_JMA_ZOOM);
+	const size_t threads = (size_t)std::max(1.0, cl.Num(L"--threads", WORKER_THREADS * 2));
+	const GridFormat format = CliGridFormat(cl, out);
+	std::vector<NowcTime> times = cl.Has(L"--times") || cl.Has(L"--from") || cl.Has(L"--to")
+		? CliSelectTimes(cl, gTimes) : std::vector<NowcTime>{ gTimes[gTimeIndex] };
+	if (times.empty()) { fwprintf(stderr, L"error: no frames selected\n"); return 1; }
+	MosaicGrid g = MakeMosaicGrid(box, z, cl.Has(L"--equirect"), cl.Num(L"--grid", 0));
+	wprintf(L"export-grid: %ls, %ls z%d, %dx%d px, %zu frames\n", format == GridFormat::GeoTiff ? L"GeoTIFF" : L"raw float32",
+		g.projection == kMosaicEquirect ? L"EPSG:4326 from" : L"EPSG:3857", z, g.width, g.height, times.size());
+
+	const size_t dot = out.find_last_of(L'.');
+	const std::wstring stem = dot == std::wstring::npos ? out : out.substr(0, dot), ext = dot == std::wstring::npos ? L"" : out.substr(dot);
+	for (auto& T : times) {
+		const std::wstring file = times.size() == 1 ? out : stem + L"_" + T.validtime + ext;
+		GridExportStats st;
+		auto t0 = std::chrono::steady_clock::now();
+		if (!ExportIntensityGrid(T, g, file, format, threads, st)) {
+			fwprintf(stderr, L"error: cannot write %ls%ls\n", file.c_str(), format == GridFormat::GeoTiff ? L" (over 4 GB? use --format raw or a lower zoom)" : L"");
+			return 1;
+		}
+		const double sec = SecondsSince(t0);
+		wprintf(L"  %ls: %.2f s (load %.2f, write %.2f), %.1f MP/s, %zu/%zu tiles missing\n",
+			file.c_str(), sec, st.loadSec, st.writeSec, g.pixels() / 1e6 / std::max(sec, 1e-9), st.missing, st.tiles);
+	}
+	return 0;
+}
+
+// ame.exe --bench-grid [--zoom 10] [--format tiff|raw] [--out file] [--threads N] [--time N] [--archive f]
+// 日本全域の 1 時刻をそのまま書き出して、読み込みと書き込みの内訳と MP/s を測る
+static int RunBenchGrid(const CmdLine& cl)
+{
+	if (!CliLoadTimes(cl)) return 1;
+	const int z = std::clamp((int)cl.Num(L"--zoom", MAX_JMA_ZOOM), MIN_JMA_ZOOM, MAX_JMA_ZOOM);
+	const size_t threads = (size_t)std::max(1.0, cl.Num(L"--threads", WORKER_THREADS * 2));
+	std::wstring out = cl.Str(L"--out");
+	if (out.empty()) {
+		wchar_t tmp[MAX_PATH];
+		GetTempPathW(MAX_PATH, tmp);
+		out = std::wstring(tmp) + L"ame_bench_grid" + (cl.Str(L"--format") == L"raw" ? L".flt" : L".tif");
+	}
+	const GridFormat format = CliGridFormat(cl, out);
+	MosaicGrid g = MakeMosaicGrid(kJapanBox, z, false, 0);
+	const uint64_t bytes = (uint64_t)g.pixels() * sizeof(float);
+	wprintf(L"bench-grid: %ls z%d, %dx%d tiles, %dx%d px (%.1f MP, %.1f MB), peak buffer %.1f MB\n",
+		gTimes[gTimeIndex].validtime.c_str(), z, g.nx, g.ny, g.width, g.height, g.pixels() / 1e6, bytes / 1048576.0,
+		((double)TILE_SIZE * g.width + g.width * sizeof(float)) / 1048576.0);
+
+	GridExportStats st;
+	auto t0 = std::chrono::steady_clock::now();
+	if (!ExportIntensityGrid(gTimes[gTimeIndex], g, out, format, threads, st)) { fwprintf(stderr, L"error: cannot write %ls\n", out.c_str()); return 1; }
+	const double sec = SecondsSince(t0);
+	wprintf(L"  %ls -> %ls\n", format == GridFormat::GeoTiff ? L"GeoTIFF" : L"raw float32", out.c_str());
+	wprintf(L"  total %.2f s, %.1f MP/s, %.1f MB/s (load %.2f s, convert+write %.2f s), %zu/%zu tiles missing\n",
+		sec, g.pixels() / 1e6 / std::max(sec, 1e-9), bytes / 1048576.0 / std::max(sec, 1e-9), st.loadSec, st.writeSec, st.missing, st.tiles);
+	return 0;
+}
+
+// 経路ファイル: "# 名前 [出発 yyyymmddhhmm (UTC)]" の行で経路を始め、"lon,lat[,km/h]" を 1 行ずつ並べる。
+// 速度はその頂点から次の頂点までに使い、省略すれば直前の値 (最初は defaultKmh)。出発を省略すれば最新の観測時刻
+static bool LoadRoutes(const std::wstring& file, float defaultKmh, int64_t defaultDepart, std::vector<Route>& routes)
+{
+	std::string text;
+	if (!ReadInputFile(file, text)) return false;
+	float kmh = defaultKmh;
+	for (size_t pos = 0; pos < text.size();) {
+		size_t eol = text.find('\n', pos);
+		if (eol == std::string::npos) eol = text.size();
+		std::string line = text.substr(pos, eol - pos);
+		pos = eol + 1;
+		if (!line.empty() && line.back() == '\r') line.pop_back();
+		if (!line.empty() && line[0] == '#') {
+			std::istringstream ss(line.substr(1));
+			Route r;
+			std::string depart;
+			ss >> r.name >> depart;
+			if (r.name.empty()) r.name = std::to_string(routes.size() + 1);
+			r.departMin = depart.size() >= 12 ? ValidTimeMinutes(std::wstring(depart.begin(), depart.end())) : defaultDepart;
+			routes.push_back(std::move(r));
+			kmh = defaultKmh;
+			continue;
+		}
+		double lon, lat, v = 0;
+		const int n = sscanf_s(line.c_str(), "%lf,%lf,%lf", &lon, &lat, &v);
+		if (n < 2) continue;
+		if (n == 3 && v > 0) kmh = (float)v;
+		if (routes.empty()) routes.push_back({ "1", defaultDepart, {} });
+		routes.back().pts.push_back({ lon, lat, kmh });
+	}
+	return true;
+}
+
+// 経路用の時刻一覧。--archive ならその観測だけ、それ以外は N1 と N2 を両方取る
+static bool CliLoadTimeline(const CmdLine& cl, FrameTimeline& tl)
+{
+	std::vector<NowcTime> obs, fc;
+	if (cl.Has(L"--archive")) {
+		if (!CliLoadTimes(cl)) return false;
+		obs = gTimes;
+	}
+	else {
+		if (!FetchTimes(false, obs)) { fwprintf(stderr, L"error: failed to fetch N1 times\n"); return false; }
+		if (!FetchTimes(true, fc)) fwprintf(stderr, L"warning: failed to fetch N2 times; past frames only\n");
+	}
+	tl.Build(obs, fc);
+	return !tl.frames.empty();
+}
+
+// ame.exe --route-exposure routes.txt [--out exposure.csv] [--speed 60] [--step 1] [--threshold 1] [--zoom 8] [--threads N] [--archive f]
+// 区間ごとの平均・最大強度、閾値以上の距離、走行中に浴びる雨量 (mm) を CSV に書く
+static int RunRouteExposure(const CmdLine& cl)
+{
+	std::wstring in = cl.Str(L"--route-exposure"), out = cl.Str(L"--out", L"route_exposure.csv");
+	FrameTimeline tl;
+	if (!CliLoadTimeline(cl, tl)) return 1;
+	std::vector<Route> routes;
+	if (!LoadRoutes(in, (float)cl.Num(L"--speed", 60), tl.latestObs, routes) || routes.empty()) { fwprintf(stderr, L"error: no routes in %ls\n", in.c_str()); return 1; }
+	const int z = std::clamp((int)cl.Num(L"--zoom", 8), MIN_JMA_ZOOM, MAX_JMA_ZOOM);
+	const float threshold = (float)cl.Num(L"--threshold", 1.0);
+	const size_t threads = (size_t)std::max(1.0, cl.Num(L"--threads", WORKER_THREADS * 2));
+
+	RouteExposureQuery q(routes, tl, z, std::max(0.05, cl.Num(L"--step", 1.0)));
+	std::vector<std::vector<RouteSegmentExposure>> res;
+	q.Run(threads, threshold, res);
+	const auto& st = q.statistics();
+
+	FILE* f = nullptr;
+	if (_wfopen_s(&f, out.c_str(), L"wb") != 0 || !f) { fwprintf(stderr, L"error: cannot create %ls\n", out.c_str()); return 1; }
+	fprintf(f, "route,segment,enter_utc,km,minutes,mean_mmh,max_mmh,above_%g_km,exposure_mm,missing_samples\n", threshold);
+	for (size_t r = 0; r < routes.size(); ++r)
+		for (size_t s = 0; s < res[r].size(); ++s) {
+			const RouteSegmentExposure& e = res[r][s];
+			fprintf(f, "%s,%zu,%ls,%.2f,%.1f,%.2f,%.1f,%.2f,%.3f,%d\n", routes[r].name.c_str(), s + 1,
+				MinutesToValidTime((int64_t)std::floor(e.startMin)).substr(0, 12).c_str(), e.km, e.minutes, e.meanMmh, e.maxMmh, e.rainKm, e.exposureMm, e.missing);
+		}
+	fclose(f);
+	wprintf(L"route-exposure: %zu routes, %zu samples (%zu outside the %ls-%ls frames) -> %ls\n", routes.size(), st.samples, st.outOfTime,
+		MinutesToValidTime(tl.first).substr(8, 4).c_str(), MinutesToValidTime(tl.last).substr(8, 4).c_str(), out.c_str());
+	wprintf(L"  plan %.1f ms, %zu frame/tile loads (%zu failed) %.2f s, reduce %.1f ms\n",
+		st.planSec * 1000.0, st.groups, st.failedLoads, st.fetchSec, st.reduceSec * 1000.0);
+	return 0;
+}
+
+// ame.exe --bench-routes [--routes 5000] [--legs 8] [--step 1] [--zoom 8] [--threads N] [--archive f]
+// 日本全域にばらまいた配送経路 (出発は最新の観測の 60 分前から 30 分後まで) を一括で評価し、経路/秒を測る
+static int RunBenchRoutes(const CmdLine& cl)
+{
+	FrameTimeline tl;
+	if (!CliLoadTimeline(cl, tl)) return 1;
+	const size_t n = (size_t)std::max(1.0, cl.Num(L"--routes", 5000));
+	const int legs = std::clamp((int)cl.Num(L"--legs", 8), 1, 1000);
+	const int z = std::clamp((int)cl.Num(L"--zoom", 8), MIN_JMA_ZOOM, MAX_JMA_ZOOM);
+	const double step = std::max(0.05, cl.Num(L"--step", 1.0));
+	const size_t threads = (size_t)std::max(1.0, cl.Num(L"--threads", WORKER_THREADS * 2));
+
+	std::mt19937 rng(4242);
+	std::uniform_real_distribution<double> lon(129.5, 145.5), lat(31.0, 43.5), turn(-0.6, 0.6);
+	std::uniform_real_distribution<float> speed(30.0f, 90.0f);
+	std::uniform_int_distribution<int> depart(-60, 30);
+	std::vector<Route> routes(n);
+	for (size_t i = 0; i < n; ++i) {
+		Route& r = routes[i];
+		r.name = "r" + std::to_string(i + 1);
+		r.departMin = tl.latestObs + depart(rng);
+		double x = lon(rng), y = lat(rng), dir = std::uniform_real_distribution<double>(0, 2 * M_PI)(rng);
+		for (int k = 0; k <= legs; ++k) {
+			r.pts.push_back({ x, y, speed(rng) });
+			dir += turn(rng);
+			x += 0.25 * std::cos(dir); y += 0.2 * std::sin(dir);	// 1 区間 20 km 前後
+		}
+	}
+	wprintf(L"bench-routes: %zu routes x %d legs, step %.2f km, z%d, %zu frames, %zu threads\n", n, legs, step, z, tl.frames.size(), threads);
+	// 1 回目はディスクキャッシュへの取得を含む。2 回目はキャッシュ (またはアーカイブ) から
+	for (int pass = 0; pass < 2; ++pass) {
+		auto t0 = std::chrono::steady_clock::now();
+		RouteExposureQuery q(routes, tl, z, step);
+		std::vector<std::vector<RouteSegmentExposure>> res;
+		q.Run(threads, 1.0f, res);
+		const double t = SecondsSince(t0);
+		const auto& st = q.statistics();
+		double mm = 0;
+		for (auto& r : res) for (auto& e : r) mm += e.exposureMm;
+		wprintf(L"  pass %d: plan %.1f ms, %zu samples -> %zu frame/tile loads (%zu failed) %.2f s, reduce %.1f ms\n",
+			pass + 1, st.planSec * 1000.0, st.samples, st.groups, st.failedLoads, st.fetchSec, st.reduceSec * 1000.0);
+		wprintf(L"          %.0f routes/s, mean exposure %.3f mm/route, %zu samples outside the frames\n", n / t, mm / n, st.outOfTime);
+	}
+	return 0;
+}
+
+// ame.exe --geofence [--listen port [--bind 127.0.0.1] [--threads 16]] [--out file] [--zoom 8] [--cache-tiles 4096] [--archive f]
+// 位置の行 "id,lon,lat[,...]" を標準入力 (パイプ) か TCP 接続から読み、",validtime,mm/h" を足した行を
+// 標準出力 (--out ならファイル) または同じ接続へ返す。最新の観測は 1 分ごとに確認し、新しいフレームへ切り替える。
+// 接続は 1 つを 1 ワーカーが閉じるまで受け持つので、同時接続は --threads までで、超えた分はすぐ閉じる
+static int RunGeofence(const CmdLine& cl, HANDLE stdIn, HANDLE stdOut)
+{
+	const int z = std::clamp((int)cl.Num(L"--zoom", 8), MIN_JMA_ZOOM, MAX_JMA_ZOOM);
+	const bool archive = cl.Has(L"--archive"), listening = cl.Has(L"--listen");
+	if (!CliLoadTimes(cl)) return 1;
+	GeofenceService svc(z, (size_t)std::max(16.0, cl.Num(L"--cache-tiles", 4096)));
+	svc.SetFrame(gTimes[gTimeIndex]);
+	fwprintf(stderr, L"geofence: z%d, frame %ls, reading %ls\n", z, gTimes[gTimeIndex].validtime.c_str(), listening ? L"TCP connections" : L"stdin");
+
+	std::atomic<bool> done{ false };
+	std::atomic<size_t> records{ 0 }, noData{ 0 }, malformed{ 0 };
+	size_t rejected = 0;	// 同時接続の上限で断った接続
+	std::thread refresher([&]() {
+		std::wstring current = gTimes[gTimeIndex].validtime;
+		size_t lastRecords = 0;
+		for (int s = 1; !done && !gCliStop; ++s) {
+			std::this_thread::sleep_for(std::chrono::seconds(1));
+			std::vector<NowcTime> t;
+			if (!archive && s % 60 == 0 && FetchTimes(false, t) && t[0].validtime != current) {
+				current = t[0].validtime;
+				svc.SetFrame(t[0]);
+				fwprintf(stderr, L"geofence: frame %ls\n", current.c_str());
+			}
+			if (s % 10 == 0) {
+				const size_t n = records;
+				fwprintf(stderr, L"geofence: %.0f positions/s, %zu total\n", (n - lastRecords) / 10.0, n);
+				lastRecords = n;
+			}
+		}
+		});
+	// 前回からの増分を全体の件数に足す (途中経過の表示用)
+	auto account = [&](const GeofenceStream& s, GeofenceStream::Stats& last) {
+		const auto& st = s.statistics();
+		records += st.records - last.records; noData += st.noData - last.noData; malformed += st.malformed - last.malformed;
+		last = st;
+		};
+
+	auto t0 = std::chrono::steady_clock::now();
+	if (!listening) {
+		FILE* f = nullptr;
+		std::wstring outFile = cl.Str(L"--out");
+		if (!outFile.empty() && (_wfopen_s(&f, outFile.c_str(), L"wb") != 0 || !f)) { fwprintf(stderr, L"error: cannot create %ls\n", outFile.c_str()); done = true; refresher.join(); return 1; }
+		auto stream = std::make_unique<GeofenceStream>(svc);
+		GeofenceStream::Stats last;
+		std::vector<char> buf(1 << 16);
+		std::string out;
+		auto write = [&]() {
+			DWORD wrote = 0;
+			bool ok = f ? fwrite(out.data(), 1, out.size(), f) == out.size() : WriteFile(stdOut, out.data(), (DWORD)out.size(), &wrote, nullptr) != 0;
+			out.clear();
+			return ok;
+			};
+		for (DWORD got = 0; ReadFile(stdIn, buf.data(), (DWORD)buf.size(), &got, nullptr) && got > 0;) {
+			stream->Feed(buf.data(), got, out);
+			account(*stream, last);
+			if (!write()) break;
+		}
+		stream->Finish(out);
+		write();
+		if (f) fclose(f);
+		account(*stream, last);
+	}
+	else {
+		const std::wstring wbind = cl.Str(L"--bind", L"127.0.0.1");
+		const std::string bindAddr(wbind.begin(), wbind.end());
+		WSADATA wsa;
+		SOCKET ls = WSAStartup(MAKEWORD(2, 2), &wsa) == 0 ? socket(AF_INET, SOCK_STREAM, IPPROTO_TCP) : INVALID_SOCKET;
+		sockaddr_in a{};
+		a.sin_family = AF_INET;
+		a.sin_port = htons((unsigned short)cl.Num(L"--listen", 7070));
+		if (ls == INVALID_SOCKET || inet_pton(AF_INET, bindAddr.c_str(), &a.sin_addr) != 1 ||
+			bind(ls, (const sockaddr*)&a, sizeof(a)) != 0 || listen(ls, SOMAXCONN) != 0) {
+			fwprintf(stderr, L"error: cannot listen on %ls:%d\n", wbind.c_str(), (int)ntohs(a.sin_port));
+			if (ls != INVALID_SOCKET) closesocket(ls);
+			done = true; refresher.join();
+			return 1;
+		}
+		SetConsoleCtrlHandler(CliCtrlHandler, TRUE);
+		fwprintf(stderr, L"geofence: listening on %ls:%d (Ctrl+C to stop)\n", wbind.c_str(), (int)ntohs(a.sin_port));
+		std::mutex connMtx;
+		std::vector<SOCKET> conns;
 		{
-			std::scoped_lock lk(gCacheMtx);
-			for (auto& kv : gCache) SAFE_RELEASE(kv.second.bmp);
-			gCache.clear();
+			// 1 接続を 1 ワーカーが受け持つ。空きがないのに受け付けるとキューで待ったまま応答しないので断る
+			const size_t workers = (size_t)std::max(1.0, cl.Num(L"--threads", 16));
+			ThreadPool pool(workers);
+			while (!gCliStop) {
+				fd_set rd;
+				FD_ZERO(&rd);
+				FD_SET(ls, &rd);
+				timeval tv{ 1, 0 };
+				if (select(0, &rd, nullptr, nullptr, &tv) <= 0) continue;
+				SOCKET c = accept(ls, nullptr, nullptr);
+				if (c == INVALID_SOCKET) continue;
+				{
+					std::lock_guard<std::mutex> lk(connMtx);
+					if (conns.size() >= workers) {
+						closesocket(c);
+						fwprintf(stderr, L"geofence: refused a connection (%zu connections open, --threads %zu)\n", conns.size(), workers);
+						++rejected;
+						continue;
+					}
+					conns.push_back(c);
+				}
+				pool.enqueue([&, c]() {
+					auto stream = std::make_unique<GeofenceStream>(svc);
+					GeofenceStream::Stats last;
+					std::vector<char> buf(1 << 16);
+					std::string out;
+					for (int k; (k = recv(c, buf.data(), (int)buf.size(), 0)) > 0; out.clear()) {
+						stream->Feed(buf.data(), (size_t)k, out);
+						account(*stream, last);
+						if (!SendAll(c, out.data(), out.size())) break;
+					}
+					stream->Finish(out);
+					SendAll(c, out.data(), out.size());
+					account(*stream, last);
+					std::lock_guard<std::mutex> lk(connMtx);
+					conns.erase(std::remove(conns.begin(), conns.end(), c), conns.end());
+					closesocket(c);
+					});
+			}
+			closesocket(ls);
+			std::lock_guard<std::mutex> lk(connMtx);
+			for (SOCKET c : conns) shutdown(c, SD_BOTH);
 		}
+		WSACleanup();
+	}
+	done = true;
+	refresher.join();
+	const double sec = SecondsSince(t0);
+	fwprintf(stderr, L"geofence: %zu positions (%zu without data, %zu malformed) in %.1f s, %.0f positions/s, %zu tile loads\n",
+		records.load(), noData.load(), malformed.load(), sec, records / std::max(sec, 1e-9), svc.tileLoads());
+	if (rejected) fwprintf(stderr, L"geofence: %zu connections refused\n", rejected);
+	return 0;
+}
 
-		// 修正: スレッドプール停止前にHWNDをクリア。これがワーカースレッドへの終了信号となる。
-		g.hwnd = nullptr;
+// ame.exe --bench-geofence [--positions 1000000] [--vehicles 20000] [--zoom 8] [--archive f]
+// 車両が少しずつ動く位置の列を作り、1 スレッドで取り込み (解析・変換・注釈) の位置/秒を測る。
+// 変換だけはスカラーと SSE2 を比べ、画素が食い違った件数も出す
+static int RunBenchGeofence(const CmdLine& cl)
+{
+	if (!CliLoadTimes(cl)) return 1;
+	const size_t n = (size_t)std::max(1.0, cl.Num(L"--positions", 1000000));
+	const size_t vehicles = (size_t)std::clamp(cl.Num(L"--vehicles", 20000), 1.0, (double)n);
+	const int z = std::clamp((int)cl.Num(L"--zoom", 8), MIN_JMA_ZOOM, MAX_JMA_ZOOM);
 
-		// スレッドプール停止
-		gPool.reset();
+	std::mt19937 rng(777);
+	std::uniform_real_distribution<double> lon(129.5, 145.5), lat(31.0, 43.5), step(-0.005, 0.005);
+	std::vector<GeoPoint> at(vehicles);
+	for (auto& p : at) p = { lon(rng), lat(rng) };
+	std::vector<double> lons(n), lats(n);
+	std::string feed;
+	feed.reserve(n * 32);
+	char line[64];
+	for (size_t i = 0; i < n; ++i) {
+		GeoPoint& p = at[i % vehicles];
+		p.lon += step(rng); p.lat += step(rng);
+		lons[i] = p.lon; lats[i] = p.lat;
+		feed.append(line, sprintf_s(line, "v%zu,%.5f,%.5f\n", i % vehicles, p.lon, p.lat));
+	}
+	wprintf(L"bench-geofence: %zu positions from %zu vehicles (%.1f MB), z%d, frame %ls\n",
+		n, vehicles, feed.size() / 1048576.0, z, gTimes[gTimeIndex].validtime.c_str());
 
-		// D2Dリソースの解放
-		SAFE_RELEASE(g.rt);
-		SAFE_RELEASE(g.wic);
-		SAFE_RELEASE(g.factory);
+	std::vector<int32_t> ax(n), ay(n), bx(n), by(n);
+	auto t0 = std::chrono::steady_clock::now();
+	ProjectToWorldPixelsScalar(lons.data(), lats.data(), n, z, ax.data(), ay.data());
+	const double scalar = SecondsSince(t0);
+	t0 = std::chrono::steady_clock::now();
+	ProjectToWorldPixels(lons.data(), lats.data(), n, z, bx.data(), by.data());
+	const double simd = SecondsSince(t0);
+	size_t differ = 0;
+	for (size_t i = 0; i < n; ++i) differ += ax[i] != bx[i] || ay[i] != by[i];
+	wprintf(L"  project: scalar %.1f M/s, SSE2 %.1f M/s (x%.1f), %zu positions off by a pixel\n",
+		n / scalar / 1e6, n / simd / 1e6, scalar / std::max(simd, 1e-9), differ);
 
-		PostQuitMessage(0); return 0;
+	GeofenceService svc(z, 4096);
+	svc.SetFrame(gTimes[gTimeIndex]);
+	// 1 回目はタイルの取得を含む。2 回目は共有キャッシュから
+	for (int pass = 0; pass < 2; ++pass) {
+		auto stream = std::make_unique<GeofenceStream>(svc);
+		std::string out;
+		out.reserve(feed.size() * 2);
+		t0 = std::chrono::steady_clock::now();
+		for (size_t p = 0; p < feed.size(); p += 1 << 16) {
+			stream->Feed(feed.data() + p, std::min<size_t>(1 << 16, feed.size() - p), out);
+			out.clear();
+		}
+		stream->Finish(out);
+		const double sec = SecondsSince(t0);
+		const auto& st = stream->statistics();
+		wprintf(L"  pass %d: %.0f positions/s on 1 thread (parse %.0f ms, project %.0f ms, annotate %.0f ms), %zu without data, %zu tile loads\n",
+			pass + 1, st.records / std::max(sec, 1e-9), st.parseSec * 1000.0, st.projectSec * 1000.0, st.annotateSec * 1000.0, st.noData, svc.tileLoads());
 	}
-	return DefWindowProc(h, m, w, l);
+	return 0;
 }
 
-static void UpdateClientSize() {
-	RECT rc; GetClientRect(g.hwnd, &rc);
-	g.clientW = rc.right - rc.left;
-	g.clientH = rc.bottom - rc.top;
-	if (g.rt) {
-		g.rt->Resize(D2D1::SizeU(g.clientW, g.clientH));
+// ame.exe --boundary-build out.amb --pref prefectures.geojson [--muni municipalities.geojson]
+// 行政区域の GeoJSON (ポリゴンでも線でもよい) から境界線のファイルを作る。ビューアは --boundaries で指定する
+static int RunBoundaryBuild(const CmdLine& cl)
+{
+	std::wstring out = cl.Str(L"--boundary-build", L"boundaries.amb");
+	std::vector<BoundaryLine> lines;
+	auto t0 = std::chrono::steady_clock::now();
+	if (!cl.Has(L"--pref") && !cl.Has(L"--muni")) { fwprintf(stderr, L"error: --pref and/or --muni GeoJSON required\n"); return 1; }
+	for (auto [opt, kind] : { std::make_pair(L"--pref", kBoundaryPref), std::make_pair(L"--muni", kBoundaryMuni) }) {
+		if (!cl.Has(opt)) continue;
+		std::wstring in = cl.Str(opt);
+		if (!LoadGeoJsonLines(in, kind, lines)) { fwprintf(stderr, L"error: no coordinates read from %ls\n", in.c_str()); return 1; }
+	}
+	const double loadSec = SecondsSince(t0);
+	BoundaryBuildStats st;
+	t0 = std::chrono::steady_clock::now();
+	if (!BuildBoundaryFile(lines, out, st)) { fwprintf(stderr, L"error: cannot write %ls\n", out.c_str()); return 1; }
+	wprintf(L"boundary-build: %zu lines, %zu points (read %.2f s, build %.2f s) -> %ls (%.1f MB)\n",
+		st.lines, st.inputPoints, loadSec, SecondsSince(t0), out.c_str(), st.fileBytes / 1048576.0);
+	for (size_t i = 0; i < st.lodPoints.size(); ++i)
+		wprintf(L"  LOD z%-2d tol %.1f px: %9zu points, %7zu cells, %8.1f KB\n",
+			kBoundaryLods[i].zoom, kBoundaryLods[i].tolPx, st.lodPoints[i], st.lodCells[i], st.lodBytes[i] / 1024.0);
+	return 0;
+}
+
+// ベンチ用の境界線。格子状に並べた区画の辺を乱歩でぎざぎざにする (都道府県 8x6、市区町村 48x36)
+static void MakeSyntheticBoundaries(std::vector<BoundaryLine>& lines)
+{
+	std::mt19937 rng(2024);
+	std::uniform_real_distribution<double> jitter(-1.0, 1.0);
+	const GeoBox b{ 129.0, 30.5, 146.0, 45.5 };
+	for (auto [kind, nx, ny, perEdge] : { std::make_tuple(kBoundaryPref, 8, 6, 4096), std::make_tuple(kBoundaryMuni, 48, 36, 256) }) {
+		const double dx = (b.maxLon - b.minLon) / nx, dy = (b.maxLat - b.minLat) / ny;
+		const double amp = std::min(dx, dy) / perEdge * 0.8;
+		// 縦横の辺を 1 本ずつ作る (隣り合う区画で共有する)
+		for (int dir = 0; dir < 2; ++dir)
+			for (int i = 0; i <= (dir ? ny : nx); ++i)
+				for (int j = 0; j < (dir ? nx : ny); ++j) {
+					BoundaryLine line{ kind, {} };
+					double off = 0;
+					for (int k = 0; k <= perEdge; ++k) {
+						off = (k == 0 || k == perEdge) ? 0 : std::clamp(off + jitter(rng) * amp, -amp * 20, amp * 20);
+						const double t = (j + (double)k / perEdge);
+						if (dir == 0) line.lonlat.emplace_back(b.minLon + i * dx + off, b.minLat + t * dy);
+						else line.lonlat.emplace_back(b.minLon + t * dx, b.minLat + i * dy + off);
+					}
+					lines.push_back(std::move(line));
+				}
+	}
+}
+
+// ame.exe --bench-boundaries [file.amb] [--frames 120] [--size WxH] [--lon --lat]
+// 表示ズームごとに横へ流しながら描き、境界線の描画 (セルの絞り込み・ジオメトリ作成・描画命令) と EndDraw のラスタ化の時間を測る。
+// 1 ms の目安と比べるのは両方を足したフレームあたりの時間。
+// ファイルを省略すると合成した境界線で bench_boundaries.amb を作って使う
+static int RunBenchBoundaries(const CmdLine& cl)
+{
+	std::wstring file = cl.Str(L"--bench-boundaries");
+	if (file.empty()) {
+		file = L"bench_boundaries.amb";
+		std::vector<BoundaryLine> lines;
+		MakeSyntheticBoundaries(lines);
+		BoundaryBuildStats st;
+		auto t0 = std::chrono::steady_clock::now();
+		if (!BuildBoundaryFile(lines, file, st)) { fwprintf(stderr, L"error: cannot write %ls\n", file.c_str()); return 1; }
+		wprintf(L"bench-boundaries: synthetic %zu lines, %zu points -> %ls (%.1f MB, %.2f s)\n",
+			st.lines, st.inputPoints, file.c_str(), st.fileBytes / 1048576.0, SecondsSince(t0));
+	}
+	BoundaryFile f;
+	if (!f.Open(file)) { fwprintf(stderr, L"error: cannot open %ls\n", file.c_str()); return 1; }
+	const int frames = std::max(1, (int)cl.Num(L"--frames", 120));
+	int w = 1280, h = 800;
+	cl.Size(L"--size", w, h);
+
+	IWICBitmap* target = nullptr;
+	ID2D1RenderTarget* rt = nullptr;
+	if (FAILED(g.wic->CreateBitmap(w, h, GUID_WICPixelFormat32bppPBGRA, WICBitmapCacheOnLoad, &target)) ||
+		FAILED(g.factory->CreateWicBitmapRenderTarget(target, D2D1::RenderTargetProperties(D2D1_RENDER_TARGET_TYPE_DEFAULT,
+			D2D1::PixelFormat(DXGI_FORMAT_B8G8R8A8_UNORM, D2D1_ALPHA_MODE_PREMULTIPLIED)), &rt))) {
+		SAFE_RELEASE(target);
+		fwprintf(stderr, L"error: failed to create WIC render target\n");
+		return 1;
 	}
+	wprintf(L"bench-boundaries: %ls (%.1f MB, %u LODs), %dx%d, %d frames per zoom panning 8 px/frame\n",
+		file.c_str(), f.fileSize() / 1048576.0, f.lodCount(), w, h, frames);
+	wprintf(L"  zoom  LOD  cells  built   p50 ms   p95 ms   max ms  raster ms  total p95\n");
+	double worst = 0;
+	BoundaryLayer layer;
+	for (int z = MIN_JMA_ZOOM; z <= MAX_MAP_ZOOM; ++z) {
+		MapView v = MakeView(cl.Num(L"--lon", 139.767125), cl.Num(L"--lat", 35.681236), z + 0.5, w, h);
+		const double step = 8.0 / std::pow(2.0, v.zoom - std::floor(v.zoom));	// 画面上で 8 px
+		std::vector<double> ms, total;
+		size_t cells = 0, built = 0;
+		double raster = 0;
+		for (int i = 0; i < frames; ++i) {
+			v.originWX += step;
+			rt->BeginDraw();
+			rt->Clear(D2D1::ColorF(1.0f, 1.0f, 1.0f));
+			layer.Draw(rt, v, f);
+			auto t0 = std::chrono::steady_clock::now();
+			rt->EndDraw();
+			const double rasterMs = SecondsSince(t0) * 1000.0;
+			raster += rasterMs;
+			ms.push_back(layer.stats().drawMs);
+			total.push_back(layer.stats().drawMs + rasterMs);
+			cells += layer.stats().cells;
+			built += layer.stats().built;
+		}
+		const double p95 = Percentile(total, 95);
+		worst = std::max(worst, p95);
+		wprintf(L"  %4.1f  z%-2d  %5zu  %5zu  %7.3f  %7.3f  %7.3f  %9.3f  %9.3f\n", v.zoom, layer.stats().lodZoom, cells / frames, built,
+			Percentile(ms, 50), Percentile(ms, 95), *std::max_element(ms.begin(), ms.end()), raster / frames, p95);
+	}
+	wprintf(L"  worst p95 %.3f ms per frame including raster (target < 1 ms)%ls\n", worst, worst < 1.0 ? L"" : L" -- over budget");
+	layer.Clear();
+	SAFE_RELEASE(rt);
+	SAFE_RELEASE(target);
+	return 0;
+}
+
+// CLI モードが指定されていれば実行して終了コードを返す。なければ -1 (通常のビューア起動)
+static int RunCli(const CmdLine& cl)
+{
+	if (cl.Has(L"--cache-dir")) gDiskCacheDir = cl.Str(L"--cache-dir");
+	if (cl.Has(L"--no-disk-cache")) gDiskCacheEnabled = false;
+	if (cl.Has(L"--style") && !GsiStyleFromKey(cl.Str(L"--style"), gGsiStyle)) {
+		AttachCliConsole();
+		fwprintf(stderr, L"error: --style expects std, pale, blank or seamlessphoto\n");
+		return 1;
+	}
+	if (cl.Has(L"--upstream") && !ParseHostPort(cl.Str(L"--upstream"), gUpstream.host, gUpstream.port)) {
+		AttachCliConsole();
+		fwprintf(stderr, L"error: --upstream expects host:port\n");
+		return 1;
+	}
+	if (cl.Has(L"--snapshot")) { AttachCliConsole(); return RunSnapshot(cl); }
+	if (cl.Has(L"--bench-render")) { AttachCliConsole(); return RunBenchRender(cl); }
+	if (cl.Has(L"--export")) { AttachCliConsole(); return RunExport(cl); }
+	if (cl.Has(L"--bench-export")) { AttachCliConsole(); return RunBenchExport(cl); }
+	if (cl.Has(L"--prefetch")) { AttachCliConsole(); return RunPrefetch(cl); }
+	if (cl.Has(L"--archive-build")) { AttachCliConsole(); return RunArchiveBuild(cl); }
+	if (cl.Has(L"--archive-verify")) { AttachCliConsole(); return RunArchiveVerify(cl); }
+	if (cl.Has(L"--bench-archive")) { AttachCliConsole(); return RunBenchArchive(cl); }
+	if (cl.Has(L"--bench-delta")) { AttachCliConsole(); return RunBenchDelta(cl); }
+	if (cl.Has(L"--bench-seek")) { AttachCliConsole(); return RunBenchSeek(cl); }
+	if (cl.Has(L"--timeseries")) { AttachCliConsole(); return RunTimeseries(cl); }
+	if (cl.Has(L"--bench-timeseries")) { AttachCliConsole(); return RunBenchTimeseries(cl); }
+	if (cl.Has(L"--region-stats")) { AttachCliConsole(); return RunRegionStats(cl); }
+	if (cl.Has(L"--bench-region")) { AttachCliConsole(); return RunBenchRegion(cl); }
+	if (cl.Has(L"--bench-accum")) { AttachCliConsole(); return RunBenchAccum(cl); }
+	if (cl.Has(L"--watch")) { AttachCliConsole(); return RunWatch(cl); }
+	if (cl.Has(L"--serve")) { AttachCliConsole(); return RunServe(cl); }
+	if (cl.Has(L"--bench-serve")) { AttachCliConsole(); return RunBenchServe(cl); }
+	if (cl.Has(L"--proxy")) { AttachCliConsole(); return RunProxy(cl); }
+	if (cl.Has(L"--bench-proxy")) { AttachCliConsole(); return RunBenchProxy(cl); }
+	if (cl.Has(L"--contours")) { AttachCliConsole(); return RunContours(cl); }
+	if (cl.Has(L"--bench-contours")) { AttachCliConsole(); return RunBenchContours(cl); }
+	if (cl.Has(L"--storms")) { AttachCliConsole(); return RunStorms(cl); }
+	if (cl.Has(L"--bench-storms")) { AttachCliConsole(); return RunBenchStorms(cl); }
+	if (cl.Has(L"--bench-flow")) { AttachCliConsole(); return RunBenchFlow(cl); }
+	if (cl.Has(L"--bench-extrap")) { AttachCliConsole(); return RunBenchExtrap(cl); }
+	if (cl.Has(L"--verify")) { AttachCliConsole(); return RunVerify(cl); }
+	if (cl.Has(L"--bench-verify")) { AttachCliConsole(); return RunBenchVerify(cl); }
+	if (cl.Has(L"--mosaic")) { AttachCliConsole(); return RunMosaic(cl); }
+	if (cl.Has(L"--bench-mosaic")) { AttachCliConsole(); return RunBenchMosaic(cl); }
+	if (cl.Has(L"--export-grid")) { AttachCliConsole(); return RunExportGrid(cl); }
+	if (cl.Has(L"--bench-grid")) { AttachCliConsole(); return RunBenchGrid(cl); }
+	if (cl.Has(L"--route-exposure")) { AttachCliConsole(); return RunRouteExposure(cl); }
+	if (cl.Has(L"--bench-routes")) { AttachCliConsole(); return RunBenchRoutes(cl); }
+	if (cl.Has(L"--geofence")) {
+		// 標準入出力はパイプのまま使うので、コンソールに付け替える前に取っておく
+		HANDLE in = GetStdHandle(STD_INPUT_HANDLE), out = GetStdHandle(STD_OUTPUT_HANDLE);
+		AttachCliConsole();
+		return RunGeofence(cl, in, out);
+	}
+	if (cl.Has(L"--bench-geofence")) { AttachCliConsole(); return RunBenchGeofence(cl); }
+	if (cl.Has(L"--boundary-build")) { AttachCliConsole(); return RunBoundaryBuild(cl); }
+	if (cl.Has(L"--bench-boundaries")) { AttachCliConsole(); return RunBenchBoundaries(cl); }
+	if (cl.Has(L"--playback")) {
+		std::wstring file = cl.Str(L"--playback");
+		if (!OpenPlayback(file)) {
+			MessageBoxW(nullptr, (L"アーカイブを開けません: " + file).c_str(), L"JMA Nowcast & GSI Map Viewer", MB_ICONERROR);
+			return 1;
+		}
+	}
+	// 境界線は --boundaries のファイル、なければ実行ファイルと同じ場所の boundaries.amb (なければ描かない)
+	std::wstring bnd = cl.Str(L"--boundaries");
+	if (bnd.empty()) {
+		wchar_t exe[MAX_PATH];
+		DWORD n = GetModuleFileNameW(nullptr, exe, MAX_PATH);
+		std::wstring dir = (n > 0 && n < MAX_PATH) ? std::wstring(exe, n) : L"";
+		bnd = dir.substr(0, dir.find_last_of(L"\\/") + 1) + L"boundaries.amb";
+	}
+	gBoundaryFile.Open(bnd);
+	return -1;
 }
 
 // -------------------- WinMain --------------------
@@ -820,6 +9379,15 @@ int APIENTRY wWinMain(HINSTANCE hI, HINSTANCE, LPWSTR, int nCmd) {
 	D2D1CreateFactory(D2D1_FACTORY_TYPE_SINGLE_THREADED, &g.factory);
 	CoCreateInstance(CLSID_WICImagingFactory, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&g.wic));
 
+	gSyntheticTileClasses = [](const std::wstring& path, BYTE* plane) { return gExtrap.TileFromPath(path, plane); };
+	int cliResult = RunCli(ParseCmdLine());
+	if (cliResult >= 0) {
+		SAFE_RELEASE(g.wic);
+		SAFE_RELEASE(g.factory);
+		CoUninitialize();
+		return cliResult;
+	}
+
 	WNDCLASSEXW wc{ sizeof(wc) }; wc.lpfnWndProc = WndProc; wc.hInstance = hI;
 	wc.hCursor = LoadCursor(nullptr, IDC_ARROW); wc.lpszClassName = L"JMAGSIMapViewerWnd"; RegisterClassExW(&wc);
 	g.hwnd = CreateWindowW(wc.lpszClassName, L"JMA Nowcast & GSI Map Viewer", WS_OVERLAPPEDWINDOW,